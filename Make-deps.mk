@@ -1,10 +1,28 @@
-build/environment.o: environment.h lua/install
+build/allocator.o: allocator.h error.h event.h executor.h libyaml/install lua/install parser.h
+build/batch.o: allocator.h batch.h budget.h emitter.h environment.h error.h event.h executor.h json.h libyaml/install lua/install parser.h pool.h timing.h writer.h
+build/budget.o: allocator.h budget.h error.h event.h executor.h libyaml/install lua/install parser.h profile.h state.h tags.h timing.h
+build/cache.o: cache.h error.h event.h executor.h libyaml/install lua/install lua_helpers.h parser.h sha256.h
+build/chunk_cache.o: chunk_cache.h lua/install
+build/compiler.o: budget.h chunk_cache.h compiler.h error.h event.h executor.h libyaml/install lua/install lua_helpers.h parser.h render.h
+build/daemon.o: allocator.h budget.h chunk_cache.h daemon.h emitter.h environment.h error.h event.h executor.h json.h libyaml/install lua/install parser.h pool.h timing.h writer.h
+build/emitter.o: emitter.h error.h libyaml/install lua/install
+build/environment.o: budget.h environment.h error.h libyaml/install lua/install lua_helpers.h profile.h state.h tags.h
 build/error.o: error.h libyaml/install lua/install
 build/event.o: error.h event.h executor.h libyaml/install lua/install parser.h render.h
-build/executor.o: error.h event.h executor.h libyaml/install lua/install lua_helpers.h parser.h render.h
-build/lua_helpers.o: error.h event.h libyaml/install lua/install lua_helpers.h
-build/main.o: environment.h error.h event.h executor.h libyaml/install lua/install parser.h render.h test.h
+build/executor.o: environment.h error.h event.h executor.h libyaml/install lua/install lua_helpers.h parser.h profile.h render.h tags.h
+build/json.o: error.h json.h libyaml/install lua/install
+build/lua_helpers.o: budget.h chunk_cache.h error.h event.h libyaml/install lua/install lua_helpers.h profile.h state.h tags.h
+build/main.o: allocator.h batch.h budget.h cache.h chunk_cache.h compiler.h daemon.h emitter.h environment.h error.h event.h executor.h json.h libyaml/install lua/install parallel.h parser.h profile.h render.h sha256.h test.h timing.h watch.h writer.h
+build/parallel.o: allocator.h budget.h environment.h error.h event.h executor.h libyaml/install lua/install parallel.h parser.h pool.h
 build/parser.o: error.h libyaml/install lua/install parser.h
+build/pool.o: pool.h
+build/profile.o: allocator.h budget.h error.h event.h executor.h libyaml/install lua/install parser.h profile.h state.h tags.h timing.h
 build/render.o: error.h event.h executor.h libyaml/install lua/install lua_helpers.h parser.h render.h
-build/test.o: error.h event.h executor.h libyaml/install lua/install parser.h render.h test.h
-build/main.out: build/environment.o build/error.o build/event.o build/executor.o build/lua_helpers.o build/main.o build/parser.o build/render.o build/test.o
+build/sha256.o: sha256.h
+build/state.o: budget.h libyaml/install lua/install profile.h state.h tags.h
+build/tags.o: budget.h environment.h error.h libyaml/install lua/install lua_helpers.h profile.h state.h tags.h
+build/test.o: allocator.h budget.h chunk_cache.h environment.h error.h event.h executor.h libyaml/install lua/install parser.h pool.h render.h test.h timing.h
+build/timing.o: error.h event.h executor.h libyaml/install lua/install parser.h timing.h
+build/watch.o: allocator.h budget.h cache.h chunk_cache.h emitter.h environment.h error.h event.h executor.h json.h libyaml/install lua/install parser.h sha256.h timing.h watch.h writer.h
+build/writer.o: error.h libyaml/install lua/install writer.h
+build/main.out: build/allocator.o build/batch.o build/budget.o build/cache.o build/chunk_cache.o build/compiler.o build/daemon.o build/emitter.o build/environment.o build/error.o build/event.o build/executor.o build/json.o build/lua_helpers.o build/main.o build/parallel.o build/parser.o build/pool.o build/profile.o build/render.o build/sha256.o build/state.o build/tags.o build/test.o build/timing.o build/watch.o build/writer.o
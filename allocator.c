@@ -0,0 +1,192 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+
+static size_t size_class(size_t size)
+{
+    return (size - 1) / YL_ALLOCATOR_CLASS_SIZE;
+}
+
+static void *acquire_small(yl_allocator_t *allocator, size_t size)
+{
+    size_t class = size_class(size);
+    void *block = allocator->free_lists[class];
+    if (block != NULL) {
+        allocator->free_lists[class] = *(void **)block;
+        return block;
+    }
+
+    size_t block_size = (class + 1) * YL_ALLOCATOR_CLASS_SIZE;
+    if ((size_t)(allocator->slab_end - allocator->slab_next) < block_size) {
+        // What's left of the old slab is too small for this class; leave it.
+        char *slab = malloc(YL_ALLOCATOR_SLAB_SIZE);
+        if (slab == NULL)
+            return NULL;
+        *(void **)slab = allocator->slabs;
+        allocator->slabs = slab;
+        allocator->slab_next = slab + YL_ALLOCATOR_CLASS_SIZE; // Keep blocks aligned past the link.
+        allocator->slab_end = slab + YL_ALLOCATOR_SLAB_SIZE;
+    }
+    block = allocator->slab_next;
+    allocator->slab_next += block_size;
+    return block;
+}
+
+static void release_small(yl_allocator_t *allocator, void *block, size_t size)
+{
+    size_t class = size_class(size);
+    *(void **)block = allocator->free_lists[class];
+    allocator->free_lists[class] = block;
+}
+
+static void *acquire(yl_allocator_t *allocator, size_t size)
+{
+    return size <= YL_ALLOCATOR_SMALL_SIZE ? acquire_small(allocator, size) : malloc(size);
+}
+
+static void release(yl_allocator_t *allocator, void *block, size_t size)
+{
+    if (size <= YL_ALLOCATOR_SMALL_SIZE)
+        release_small(allocator, block, size);
+    else
+        free(block);
+}
+
+static void *resize(yl_allocator_t *allocator, void *block, size_t osize, size_t nsize)
+{
+    bool small = osize <= YL_ALLOCATOR_SMALL_SIZE, nsmall = nsize <= YL_ALLOCATOR_SMALL_SIZE;
+    if (small && nsmall && size_class(osize) == size_class(nsize))
+        return block;
+    if (!small && !nsmall)
+        return realloc(block, nsize);
+
+    void *moved = acquire(allocator, nsize);
+    if (moved == NULL) {
+        if (small || nsize > osize)
+            return NULL;
+        // Lua relies on shrinking never failing. Trim the block to a full block
+        // of its new class in place, which the pools then adopt for good.
+        moved = realloc(block, (size_class(nsize) + 1) * YL_ALLOCATOR_CLASS_SIZE);
+        return moved != NULL ? moved : block;
+    }
+    memcpy(moved, block, osize < nsize ? osize : nsize);
+    release(allocator, block, osize);
+    return moved;
+}
+
+static void *allocate(void *ud, void *ptr, size_t osize, size_t nsize)
+{
+    yl_allocator_t *allocator = ud;
+
+    // Without a block, osize is the type of object being allocated.
+    if (ptr == NULL)
+        osize = 0;
+
+    if (nsize == 0) {
+        if (ptr != NULL)
+            release(allocator, ptr, osize);
+        allocator->stats.current -= osize;
+        return NULL;
+    }
+
+    if (nsize > osize && allocator->limit && allocator->stats.current + (nsize - osize) > allocator->limit) {
+        allocator->limit_exceeded = true;
+        return NULL;
+    }
+
+    void *block = ptr == NULL ? acquire(allocator, nsize) : resize(allocator, ptr, osize, nsize);
+    if (block == NULL)
+        return NULL;
+
+    yl_allocator_stats_t *stats = &allocator->stats;
+    stats->current += nsize - osize;
+    if (nsize > osize)
+        stats->total += nsize - osize;
+    if (stats->current > stats->peak)
+        stats->peak = stats->current;
+    ++stats->allocations;
+    return block;
+}
+
+static int panic(lua_State *L)
+{
+    const char *message = lua_tostring(L, -1);
+    fprintf(stderr, "PANIC: unprotected error in call to Lua API (%s)\n",
+            message ? message : "error object is not a string");
+    return 0; // Return to Lua to abort.
+}
+
+lua_State *yl_allocator_new_state(void)
+{
+    yl_allocator_t *allocator = calloc(1, sizeof(yl_allocator_t));
+    if (allocator == NULL)
+        return NULL;
+
+    lua_State *L = lua_newstate(allocate, allocator);
+    if (L == NULL) {
+        free(allocator);
+        return NULL;
+    }
+    lua_atpanic(L, panic);
+    return L;
+}
+
+void yl_allocator_close_state(lua_State *L)
+{
+    void *ud;
+    lua_getallocf(L, &ud);
+    lua_close(L);
+
+    yl_allocator_t *allocator = ud;
+    while (allocator->slabs != NULL) {
+        void *slab = allocator->slabs;
+        allocator->slabs = *(void **)slab;
+        free(slab);
+    }
+    free(allocator);
+}
+
+yl_allocator_t *yl_allocator(lua_State *L)
+{
+    void *ud;
+    return lua_getallocf(L, &ud) == allocate ? ud : NULL;
+}
+
+yl_allocator_stats_t yl_allocator_stats(lua_State *L)
+{
+    yl_allocator_t *allocator = yl_allocator(L);
+    return allocator != NULL ? allocator->stats : (yl_allocator_stats_t){0};
+}
+
+void yl_allocator_reset_stats(lua_State *L)
+{
+    yl_allocator_t *allocator = yl_allocator(L);
+    if (allocator == NULL)
+        return;
+    yl_allocator_stats_t *stats = &allocator->stats;
+    stats->peak = stats->current;
+    stats->total = 0;
+    stats->allocations = 0;
+}
+
+int yl_memory_reporter(yl_memory_reporter_t *reporter, yaml_event_t *event, lua_State *L, yl_error_t *err)
+{
+    if (event->type == YAML_DOCUMENT_START_EVENT)
+        yl_allocator_reset_stats(reporter->lua);
+
+    // The wrapped consumer may take ownership of the event, and zero it.
+    bool document_end = event->type == YAML_DOCUMENT_END_EVENT;
+    if (!reporter->consumer.callback(reporter->consumer.data, event, L, err))
+        return 0;
+
+    if (document_end) {
+        yl_allocator_stats_t stats = yl_allocator_stats(reporter->lua);
+        fprintf(reporter->report, "document %zu: peak %zu bytes, %zu bytes allocated in %zu allocations\n",
+                ++reporter->documents,
+                stats.peak,
+                stats.total,
+                stats.allocations);
+    }
+    return 1;
+}
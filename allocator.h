@@ -0,0 +1,91 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "lua.h"
+
+#include "executor.h"
+
+// Blocks up to YL_ALLOCATOR_CLASSES * YL_ALLOCATOR_CLASS_SIZE bytes come from pools,
+// one per multiple of YL_ALLOCATOR_CLASS_SIZE; larger ones from the system.
+#define YL_ALLOCATOR_CLASS_SIZE 16
+#define YL_ALLOCATOR_CLASSES 16
+#define YL_ALLOCATOR_SMALL_SIZE (YL_ALLOCATOR_CLASSES * YL_ALLOCATOR_CLASS_SIZE)
+
+// Size of the slabs small blocks are carved from.
+#define YL_ALLOCATOR_SLAB_SIZE (64 * 1024)
+
+typedef struct _yl_allocator_stats_s {
+    size_t current; // Bytes in use.
+    size_t peak;    // Most bytes in use at once since the last reset.
+    size_t total;   // Bytes allocated since the last reset, counting growth of resized blocks.
+    size_t allocations;
+} yl_allocator_stats_t;
+
+/**
+ * A Lua allocator. Small blocks are served from per-size-class free lists, carved
+ * out of slabs that are only returned to the system when the state closes, so the
+ * many short-lived tables and strings a template builds are recycled in place
+ * instead of going through the system allocator each time.
+ *
+ * Not thread-safe: each Lua state gets its own allocator.
+ */
+typedef struct _yl_allocator_s {
+    void *free_lists[YL_ALLOCATOR_CLASSES];
+    void *slabs;                // Linked through their first word.
+    char *slab_next, *slab_end; // Not yet carved part of the newest slab.
+    yl_allocator_stats_t stats;
+
+    // While an expression with a memory budget runs, the most bytes that may be in
+    // use (0 for no limit), and whether an allocation was refused for it. See
+    // yl_budget_pcall().
+    size_t limit;
+    bool limit_exceeded;
+} yl_allocator_t;
+
+/**
+ * Create a Lua state using a pooled allocator of its own, with the same panic
+ * handler luaL_newstate() installs.
+ *
+ * @returns The new state, or @c NULL if memory could not be allocated.
+ */
+lua_State *yl_allocator_new_state(void);
+
+/**
+ * Close a state created by yl_allocator_new_state(), then free its allocator.
+ */
+void yl_allocator_close_state(lua_State *L);
+
+/**
+ * The allocator of a state created by yl_allocator_new_state(), or NULL for a
+ * state created some other way.
+ */
+yl_allocator_t *yl_allocator(lua_State *L);
+
+/**
+ * The allocation statistics of a state created by yl_allocator_new_state(), or
+ * zeros for a state created some other way.
+ */
+yl_allocator_stats_t yl_allocator_stats(lua_State *L);
+
+/**
+ * Start new peak and total counts, e.g. at the start of a document. Does nothing
+ * on a state created some other way than by yl_allocator_new_state().
+ */
+void yl_allocator_reset_stats(lua_State *L);
+
+typedef struct _yl_memory_reporter_s {
+    yl_event_consumer_t consumer;
+    lua_State *lua; // The state to report on; consumers aren't always passed it.
+    FILE *report;
+    size_t documents;
+} yl_memory_reporter_t;
+
+/**
+ * Event consumer that forwards to a wrapped consumer, resetting the allocation
+ * statistics of the Lua state at each document start and reporting the document's
+ * peak and total allocated bytes on @c report at its end.
+ */
+int yl_memory_reporter(yl_memory_reporter_t *reporter, yaml_event_t *event, lua_State *L, yl_error_t *err);
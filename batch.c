@@ -0,0 +1,224 @@
+#include <errno.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "lua.h"
+
+#include "allocator.h"
+#include "budget.h"
+#include "batch.h"
+#include "emitter.h"
+#include "environment.h"
+#include "executor.h"
+#include "json.h"
+#include "pool.h"
+#include "timing.h"
+#include "writer.h"
+
+typedef struct _yl_batch_job_s {
+    const char *input_path;
+    char *output_path;
+    off_t size;
+    const yl_batch_options_t *options;
+
+    int status;        // Process-style exit status: 0 on success, 1 on failure.
+    double seconds;
+    char report[1024]; // The error report, when status is non-zero.
+} yl_batch_job_t;
+
+static void report_error(yl_batch_job_t *job, yl_error_t *err)
+{
+    job->status = 1;
+    snprintf(job->report, sizeof(job->report), "%zu:%zu: %s: %s: %s",
+             err->line + 1,
+             err->column + 1,
+             yl_error_name(err->type),
+             err->context,
+             err->message);
+}
+
+static void render_job(yl_batch_job_t *job, size_t worker)
+{
+    (void)worker; // Every job gets a fresh Lua state, so no per-worker state is kept.
+
+    double start = yl_time_now();
+
+    FILE *input = NULL, *output = NULL;
+    yl_execution_context_t ctx = {0};
+    yaml_parser_t parser = {0};
+    yl_parser_input_t parser_input = {0};
+    yaml_emitter_t emitter = {0};
+    yl_writer_t writer = {0};
+    yl_json_writer_t json_writer = {0};
+
+    if ((input = fopen(job->input_path, "rb")) == NULL) {
+        job->status = 1;
+        snprintf(job->report, sizeof(job->report), "error opening input file: %s", strerror(errno));
+        goto done;
+    }
+    if ((output = fopen(job->output_path, "wb")) == NULL) {
+        job->status = 1;
+        snprintf(job->report, sizeof(job->report), "error opening output file %s: %s", job->output_path, strerror(errno));
+        goto done;
+    }
+
+    if (!yaml_parser_initialize(&parser)) {
+        job->status = 1;
+        snprintf(job->report, sizeof(job->report), "error initializing parser");
+        goto done;
+    }
+    if (!yl_parser_set_input(&parser, &parser_input, input, job->options->allow_mmap, &ctx.err)) {
+        report_error(job, &ctx.err);
+        goto done;
+    }
+    ctx.producer.callback = (yl_event_producer_callback_t *)yl_parser_parse;
+    ctx.producer.data = &parser;
+
+    if (job->options->json) {
+        if (!yl_json_writer_initialize(&json_writer, output)) {
+            job->status = 1;
+            snprintf(job->report, sizeof(job->report), "error initializing JSON writer");
+            goto done;
+        }
+        ctx.consumer = (yl_event_consumer_t){(yl_event_consumer_callback_t *)yl_json_writer_write, &json_writer, true};
+    } else if (job->options->native_writer) {
+        if (!yl_writer_initialize(&writer, output)) {
+            job->status = 1;
+            snprintf(job->report, sizeof(job->report), "error initializing writer");
+            goto done;
+        }
+        ctx.consumer = (yl_event_consumer_t){(yl_event_consumer_callback_t *)yl_writer_write, &writer, true};
+    } else {
+        if (!yaml_emitter_initialize(&emitter)) {
+            job->status = 1;
+            snprintf(job->report, sizeof(job->report), "error initializing emitter");
+            goto done;
+        }
+        yaml_emitter_set_unicode(&emitter, true);
+        yaml_emitter_set_encoding(&emitter, YAML_UTF8_ENCODING);
+        yaml_emitter_set_output_file(&emitter, output);
+        ctx.consumer.callback = (yl_event_consumer_callback_t *)yl_emitter_emit;
+        ctx.consumer.data = &emitter;
+    }
+    ctx.preserve_order = job->options->preserve_order;
+
+    ctx.lua = yl_allocator_new_state();
+    if (ctx.lua == NULL) {
+        job->status = 1;
+        snprintf(job->report, sizeof(job->report), "error initializing lua");
+        goto done;
+    }
+    yl_load_safe_libraries(ctx.lua);
+    yl_budget_set(ctx.lua, &job->options->budget);
+
+    // Format the report before closing the Lua state, which may own the message.
+    if (!yl_execute_stream(&ctx))
+        report_error(job, &ctx.err);
+
+done:
+    yaml_parser_delete(&parser);
+    yl_parser_input_delete(&parser_input);
+    yaml_emitter_delete(&emitter);
+    yl_writer_delete(&writer);
+    yl_json_writer_delete(&json_writer);
+    if (ctx.lua)
+        yl_allocator_close_state(ctx.lua);
+    if (input)
+        fclose(input);
+    if (output && fclose(output) != 0 && job->status == 0) {
+        job->status = 1;
+        snprintf(job->report, sizeof(job->report), "error writing output file %s: %s", job->output_path, strerror(errno));
+    }
+
+    job->seconds = yl_time_now() - start;
+}
+
+static int compare_jobs_by_size(const void *left, const void *right)
+{
+    const yl_batch_job_t *const *l = left, *const *r = right;
+    return ((*l)->size < (*r)->size) - ((*l)->size > (*r)->size);
+}
+
+size_t yl_batch_render(char **paths, size_t count, const yl_batch_options_t *options)
+{
+    size_t failures = count;
+    yl_pool_t pool = {0};
+    yl_batch_job_t *jobs = calloc(count, sizeof(yl_batch_job_t));
+    yl_batch_job_t **order = calloc(count, sizeof(yl_batch_job_t *));
+    if (jobs == NULL || order == NULL) {
+        fprintf(stderr, "Error allocating batch jobs!\n");
+        goto done;
+    }
+
+    for (size_t i = 0; i < count; ++i) {
+        yl_batch_job_t *job = &jobs[i];
+        job->input_path = paths[i];
+        job->options = options;
+        order[i] = job;
+
+        char *path = strdup(paths[i]);
+        if (path == NULL) {
+            fprintf(stderr, "Error allocating batch jobs!\n");
+            goto done;
+        }
+        const char *name = basename(path);
+        size_t length = strlen(options->output_dir) + strlen(name) + 2;
+        job->output_path = malloc(length);
+        if (job->output_path != NULL)
+            snprintf(job->output_path, length, "%s/%s", options->output_dir, name);
+        free(path);
+        if (job->output_path == NULL) {
+            fprintf(stderr, "Error allocating batch jobs!\n");
+            goto done;
+        }
+
+        for (size_t j = 0; j < i; ++j) {
+            if (strcmp(jobs[j].output_path, job->output_path) == 0) {
+                fprintf(stderr, "Error: %s and %s would both be written to %s!\n",
+                        jobs[j].input_path, job->input_path, job->output_path);
+                goto done;
+            }
+        }
+
+        struct stat st;
+        if (stat(job->input_path, &st) == 0)
+            job->size = st.st_size;
+    }
+
+    // Start the largest templates first, so the tail of the run is small files
+    // that idle workers can steal.
+    qsort(order, count, sizeof(yl_batch_job_t *), compare_jobs_by_size);
+
+    if (!yl_pool_initialize(&pool, options->jobs ? options->jobs : yl_pool_default_size())) {
+        fprintf(stderr, "Error starting worker threads!\n");
+        goto done;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        if (!yl_pool_submit(&pool, (yl_pool_task_callback_t *)render_job, order[i])) {
+            order[i]->status = 1;
+            snprintf(order[i]->report, sizeof(order[i]->report), "error queueing job");
+        }
+    }
+    yl_pool_delete(&pool);
+
+    failures = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (jobs[i].status == 0) {
+            fprintf(stderr, "%s: ok (%.3f ms)\n", jobs[i].input_path, jobs[i].seconds * 1e3);
+        } else {
+            fprintf(stderr, "%s: exit %d: %s\n", jobs[i].input_path, jobs[i].status, jobs[i].report);
+            ++failures;
+        }
+    }
+
+done:
+    if (jobs != NULL)
+        for (size_t i = 0; i < count; ++i)
+            free(jobs[i].output_path);
+    free(jobs);
+    free(order);
+    return failures;
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "budget.h"
+
+typedef struct _yl_batch_options_s {
+    const char *output_dir;
+    size_t jobs; // Worker threads; 0 for one per processor.
+    bool allow_mmap;
+    bool preserve_order;
+    bool native_writer; // Write YAML with yl_writer_write() instead of the libyaml emitter.
+    bool json;          // Write JSON instead of YAML.
+    yl_budget_t budget; // Of each expression.
+} yl_batch_options_t;
+
+/**
+ * Render many template files concurrently, each into a file of the same name in
+ * the output directory.
+ *
+ * Every file is executed on its own Lua state, parser and writer, on a pool of
+ * work-stealing workers. Files are queued largest first so that a few big
+ * templates start early instead of holding up the end of the run. A status line
+ * is printed to stderr for each file, in argument order, once all have finished.
+ *
+ * @param[in]       paths       The input files.
+ * @param[in]       count       The number of input files.
+ * @param[in]       options     Output directory and pool settings.
+ *
+ * @returns The number of files that failed.
+ */
+size_t yl_batch_render(char **paths, size_t count, const yl_batch_options_t *options);
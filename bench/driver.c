@@ -0,0 +1,204 @@
+// Render a corpus made by bench/generate.c and report its performance as JSON.
+//
+//   build/bench_driver.out build/main.out build/corpus
+//
+// Every DIR/doc-*.yaml is rendered by a process of its own, for the latency of a
+// document: the wall time of the whole process, startup included. DIR/stream.yaml
+// is then rendered by a single process, for the throughput: the events it outputs
+// and the bytes of template it reads, per second. Only the process is timed; its
+// output goes to a temporary file, whose events are counted afterwards. Peak RSS
+// is the largest of any of the processes. Arguments after DIR are passed to
+// PROGRAM.
+
+#include <dirent.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "yaml.h"
+
+typedef struct _run_s {
+    double seconds;
+    size_t events;
+    long max_rss; // Kilobytes.
+} run_t;
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static int is_document(const struct dirent *entry)
+{
+    size_t length = strlen(entry->d_name);
+    return strncmp(entry->d_name, "doc-", 4) == 0 && length > 9 && strcmp(entry->d_name + length - 5, ".yaml") == 0;
+}
+
+/**
+ * Count the events of a YAML stream.
+ *
+ * @returns Whether the stream is well-formed.
+ */
+static bool count_events(FILE *output, const char *path, size_t *events)
+{
+    yaml_parser_t parser;
+    yaml_parser_initialize(&parser);
+    yaml_parser_set_input_file(&parser, output);
+    bool parsed = true;
+    *events = 0;
+    for (;;) {
+        yaml_event_t event;
+        if (!yaml_parser_parse(&parser, &event)) {
+            fprintf(stderr, "%s: output %zu:%zu: %s\n", path, parser.problem_mark.line + 1,
+                    parser.problem_mark.column + 1, parser.problem);
+            parsed = false;
+            break;
+        }
+        ++*events;
+        bool end = event.type == YAML_STREAM_END_EVENT;
+        yaml_event_delete(&event);
+        if (end)
+            break;
+    }
+    yaml_parser_delete(&parser);
+    return parsed;
+}
+
+/**
+ * Render a template with the program, then count the events of its output.
+ *
+ * @returns Whether the program exited successfully with well-formed output.
+ */
+static bool run(char **argv, const char *path, run_t *result)
+{
+    // A file, not a pipe, so reading the output doesn't pace the program.
+    FILE *output = tmpfile();
+    if (output == NULL) {
+        perror("tmpfile");
+        return false;
+    }
+
+    double start = now();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        fclose(output);
+        return false;
+    }
+    if (pid == 0) {
+        dup2(fileno(output), STDOUT_FILENO);
+        argv[2] = (char *)path;
+        execv(argv[0], argv);
+        perror(argv[0]);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0) {
+        perror("wait4");
+        fclose(output);
+        return false;
+    }
+    result->seconds = now() - start;
+    result->max_rss = usage.ru_maxrss;
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s: %s exited with status %d\n", path, argv[0],
+                WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status));
+        fclose(output);
+        return false;
+    }
+
+    rewind(output);
+    bool parsed = count_events(output, path, &result->events);
+    fclose(output);
+    return parsed;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 3) {
+        fprintf(stderr, "Usage: %s PROGRAM DIR [ARG]...\n", argv[0]);
+        return 2;
+    }
+    const char *dir = argv[2];
+
+    // PROGRAM -i PATH ARG...
+    char **child = calloc(argc + 1, sizeof(char *));
+    child[0] = argv[1];
+    child[1] = "-i";
+    for (int i = 3; i < argc; ++i)
+        child[i] = argv[i];
+
+    struct dirent **entries;
+    int n = scandir(dir, &entries, is_document, alphasort);
+    if (n < 0) {
+        fprintf(stderr, "%s: %s\n", dir, strerror(errno));
+        free(child);
+        return 1;
+    }
+
+    size_t length = strlen(dir) + 2 + 256;
+    char *path = malloc(length);
+    double *latencies = malloc((n ? n : 1) * sizeof(double));
+    long max_rss = 0;
+    int status = 0;
+    for (int i = 0; i < n; ++i) {
+        snprintf(path, length, "%s/%s", dir, entries[i]->d_name);
+        run_t result;
+        if (!run(child, path, &result))
+            status = 1;
+        latencies[i] = result.seconds;
+        if (result.max_rss > max_rss)
+            max_rss = result.max_rss;
+    }
+
+    snprintf(path, length, "%s/stream.yaml", dir);
+    struct stat st;
+    run_t stream = {0};
+    if (stat(path, &st)) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        status = 1;
+    } else if (!run(child, path, &stream)) {
+        status = 1;
+    }
+    if (stream.max_rss > max_rss)
+        max_rss = stream.max_rss;
+
+    if (!status) {
+        qsort(latencies, n, sizeof(double), compare_doubles);
+        // Nearest rank: the smallest latency at least p of the documents are within.
+        // It's the wall time of a whole process, so startup dominates small documents.
+        double p50 = n ? latencies[(n * 50 + 99) / 100 - 1] : 0;
+        double p99 = n ? latencies[(n * 99 + 99) / 100 - 1] : 0;
+        printf("{\"documents\": %d, \"input_bytes\": %lld, \"events\": %zu, \"seconds\": %.6f, "
+               "\"events_per_second\": %.1f, \"mb_per_second\": %.3f, "
+               "\"process_latency_ms\": {\"p50\": %.3f, \"p99\": %.3f}, \"peak_rss_kb\": %ld}\n",
+               n, (long long)st.st_size, stream.events, stream.seconds, stream.events / stream.seconds,
+               st.st_size / 1e6 / stream.seconds, p50 * 1e3, p99 * 1e3, max_rss);
+    }
+
+    for (int i = 0; i < n; ++i)
+        free(entries[i]);
+    free(entries);
+    free(latencies);
+    free(path);
+    free(child);
+    return status;
+}
@@ -0,0 +1,248 @@
+// Generate a synthetic corpus of templates, for bench/driver.c to render.
+//
+//   build/bench_generate.out --documents 100 --depth 3 --width 8 build/corpus
+//
+// Each document is a tree of block mappings, written both to DIR/doc-NNNNN.yaml
+// and, as one stream of all of them, to DIR/stream.yaml. A share of the nodes,
+// the tag density, is tagged: leaves with expressions and calls, sequences with
+// calls joining their items, and mappings with ! so they're built as Lua tables
+// and rendered from them. The corpus only depends on the options, seed included.
+
+#include <argp.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+static char doc[] = "Generate a synthetic template corpus in DIR.";
+static char args_doc[] = "DIR";
+
+enum {
+    OPT_DEPTH = 256,
+    OPT_WIDTH,
+    OPT_TAG_DENSITY,
+    OPT_SCALAR_SIZE,
+    OPT_SEED,
+};
+
+static struct argp_option options[] = {
+    {"documents", 'n', "N", 0, "Number of documents (default: 100).", 0},
+    {"depth", OPT_DEPTH, "N", 0, "Nesting depth of each document's mappings (default: 3).", 0},
+    {"width", OPT_WIDTH, "N", 0, "Number of keys in each mapping (default: 8).", 0},
+    {"tag-density", OPT_TAG_DENSITY, "P", 0, "Share of nodes that are tagged, from 0 to 1 (default: 0.25).", 0},
+    {"scalar-size", OPT_SCALAR_SIZE, "BYTES", 0, "Length of untagged scalars (default: 16).", 0},
+    {"seed", OPT_SEED, "N", 0, "Seed of the generator (default: 1).", 0},
+    {0}};
+
+struct arguments {
+    unsigned long documents;
+    unsigned long depth;
+    unsigned long width;
+    double tag_density;
+    unsigned long scalar_size;
+    uint64_t seed;
+    const char *dir;
+};
+
+static unsigned long parse_count(const char *arg, struct argp_state *state)
+{
+    char *end;
+    errno = 0;
+    unsigned long value = strtoul(arg, &end, 10);
+    if (errno || end == arg || *end != '\0' || arg[0] == '-')
+        argp_error(state, "Invalid number: %s", arg);
+    return value;
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+    struct arguments *arguments = state->input;
+    char *end;
+    switch (key) {
+    case 'n':
+        arguments->documents = parse_count(arg, state);
+        break;
+    case OPT_DEPTH:
+        arguments->depth = parse_count(arg, state);
+        if (arguments->depth == 0)
+            argp_error(state, "The depth must be at least 1.");
+        break;
+    case OPT_WIDTH:
+        arguments->width = parse_count(arg, state);
+        if (arguments->width == 0)
+            argp_error(state, "The width must be at least 1.");
+        break;
+    case OPT_TAG_DENSITY:
+        arguments->tag_density = strtod(arg, &end);
+        if (end == arg || *end != '\0' || !(arguments->tag_density >= 0 && arguments->tag_density <= 1))
+            argp_error(state, "Invalid tag density: %s", arg);
+        break;
+    case OPT_SCALAR_SIZE:
+        arguments->scalar_size = parse_count(arg, state);
+        if (arguments->scalar_size == 0)
+            argp_error(state, "The scalar size must be at least 1.");
+        break;
+    case OPT_SEED:
+        arguments->seed = parse_count(arg, state);
+        break;
+    case ARGP_KEY_ARG:
+        if (arguments->dir)
+            argp_usage(state);
+        arguments->dir = arg;
+        break;
+    case ARGP_KEY_END:
+        if (!arguments->dir)
+            argp_usage(state);
+        break;
+    default:
+        return ARGP_ERR_UNKNOWN;
+    }
+    return 0;
+}
+
+static struct argp argp = {options, parse_opt, args_doc, doc, 0, 0, 0};
+
+typedef struct _generator_s {
+    const struct arguments *arguments;
+    uint64_t state; // xorshift64*, so the corpus is the same on every libc.
+    unsigned long counter;
+} generator_t;
+
+static uint64_t next_random(generator_t *generator)
+{
+    generator->state ^= generator->state >> 12;
+    generator->state ^= generator->state << 25;
+    generator->state ^= generator->state >> 27;
+    return generator->state * 0x2545f4914f6cdd1dull;
+}
+
+static int tagged(generator_t *generator)
+{
+    return (next_random(generator) >> 11) * 0x1.0p-53 < generator->arguments->tag_density;
+}
+
+static void write_indent(FILE *file, unsigned long level)
+{
+    for (unsigned long i = 0; i < level; ++i)
+        fputs("  ", file);
+}
+
+static void write_word(generator_t *generator, FILE *file)
+{
+    static const char alphabet[] = "abcdefghijklmnopqrstuvwxyz0123456789";
+    for (unsigned long i = 0; i < generator->arguments->scalar_size; ++i)
+        fputc(alphabet[next_random(generator) % (sizeof(alphabet) - 1)], file);
+}
+
+/**
+ * Write a leaf value, after its key and a space.
+ */
+static void write_leaf(generator_t *generator, FILE *file)
+{
+    unsigned long n = ++generator->counter;
+    if (!tagged(generator)) {
+        write_word(generator, file);
+        fputc('\n', file);
+        return;
+    }
+
+    switch (next_random(generator) % 3) {
+    case 0:
+        // Parenthesized, so the plain scalar doesn't start with a quote.
+        fputs("! (\"", file);
+        write_word(generator, file);
+        fprintf(file, "\" .. %lu)\n", n);
+        break;
+    case 1:
+        fputs("!string.upper ", file);
+        write_word(generator, file);
+        fputc('\n', file);
+        break;
+    default:
+        fprintf(file, "! %lu * 3 + %lu // 7\n", n, n);
+        break;
+    }
+}
+
+/**
+ * Write the keys of a mapping at the given level, each on its own line.
+ */
+static void write_mapping(generator_t *generator, FILE *file, unsigned long level)
+{
+    const struct arguments *arguments = generator->arguments;
+    for (unsigned long i = 0; i < arguments->width; ++i) {
+        write_indent(file, level);
+        fprintf(file, "k%lu:", i);
+        if (level + 1 >= arguments->depth) {
+            fputc(' ', file);
+            write_leaf(generator, file);
+        } else if (!tagged(generator)) {
+            fputc('\n', file);
+            write_mapping(generator, file, level + 1);
+        } else if (next_random(generator) % 2) {
+            // A call on a sequence of the same width, joining its items.
+            fputs(" !table.concat\n", file);
+            for (unsigned long j = 0; j < arguments->width; ++j) {
+                write_indent(file, level + 1);
+                fputs("- ", file);
+                write_word(generator, file);
+                fputc('\n', file);
+            }
+        } else {
+            // A mapping built as a Lua table, and rendered from it.
+            fputs(" !\n", file);
+            write_mapping(generator, file, level + 1);
+        }
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct arguments arguments = {100, 3, 8, 0.25, 16, 1, NULL};
+    argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+    if (mkdir(arguments.dir, 0777) && errno != EEXIST) {
+        fprintf(stderr, "%s: %s\n", arguments.dir, strerror(errno));
+        return 1;
+    }
+
+    size_t length = strlen(arguments.dir) + sizeof("/doc-00000.yaml") + 16;
+    char *path = malloc(length);
+    snprintf(path, length, "%s/stream.yaml", arguments.dir);
+    FILE *stream = fopen(path, "wb");
+    if (stream == NULL) {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        free(path);
+        return 1;
+    }
+
+    // A zero seed would stay zero.
+    generator_t generator = {&arguments, arguments.seed * 0x9e3779b97f4a7c15ull | 1, 0};
+    int status = 0;
+    for (unsigned long i = 0; i < arguments.documents && !status; ++i) {
+        char *text;
+        size_t size;
+        FILE *document = open_memstream(&text, &size);
+        fputs("---\n", document);
+        write_mapping(&generator, document, 0);
+        fclose(document);
+
+        snprintf(path, length, "%s/doc-%05lu.yaml", arguments.dir, i);
+        FILE *file = fopen(path, "wb");
+        if (file == NULL || (fwrite(text, 1, size, file) != size) + fclose(file)) {
+            fprintf(stderr, "%s: %s\n", path, strerror(errno));
+            status = 1;
+        }
+        fwrite(text, 1, size, stream);
+        free(text);
+    }
+
+    if (fclose(stream) && !status) {
+        fprintf(stderr, "%s/stream.yaml: %s\n", arguments.dir, strerror(errno));
+        status = 1;
+    }
+    free(path);
+    return status;
+}
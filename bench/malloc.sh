@@ -0,0 +1,53 @@
+#!/usr/bin/env bash
+# Count allocations per rendered node, for a template rendering a large Lua table.
+# Two sizes are rendered, so that startup and parsing costs cancel out.
+#
+# Calls to the system allocator are counted by a preloaded shim, once for each
+# writer: the libyaml emitter takes ownership of the events it's given, so every
+# rendered scalar is still copied for it, while the native writer borrows them.
+# Lua's own allocations mostly come from its pooled allocator instead, so they're
+# counted separately, from --memory-stats.
+#
+# Exits non-zero if the native writer makes more than about zero system
+# allocations per rendered node.
+set -euo pipefail
+
+cd "$(dirname "$0")/.."
+
+mkdir -p build
+${CC:-gcc} -O2 -shared -fPIC bench/malloc_count.c -o build/malloc_count.so
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT
+
+# Prints the Lua and system allocation counts of rendering N items: the shim
+# reports at exit, after the document's statistics.
+function allocations() {
+    echo "! (function() local t = {} for i = 1, $1 do t[i] = {name = 'item' .. i, value = i, ratio = i / 3} end return t end)()" >"$tmp/template.yaml"
+    LD_PRELOAD=build/malloc_count.so build/main.out -i "$tmp/template.yaml" -o /dev/null --memory-stats "${@:2}" 2>&1 |
+        sed -nre 's/^allocations: ([0-9]+)$/\1/p; s/^document 1: .* in ([0-9]+) allocations$/\1/p' |
+        tr '\n' ' '
+}
+
+small=${1:-10000}
+large=$((small * 2))
+# Each item renders a mapping with three keys and three values.
+nodes=$(((large - small) * 7))
+
+# Prints the allocations per rendered node with a writer. Fails if there are more
+# than MAX system allocations per node, unless MAX is empty.
+function report() {
+    read -r lua_a system_a <<<"$(allocations "$small" "${@:3}")"
+    read -r lua_b system_b <<<"$(allocations "$large" "${@:3}")"
+    awk -v name="$1" -v max="$2" -v s=$((system_b - system_a)) -v l=$((lua_b - lua_a)) -v n=$nodes \
+        'BEGIN {
+            printf "%s: %.2f system, %.2f Lua allocations per rendered node\n", name, s / n, l / n
+            if (max != "" && s / n > max) {
+                printf "%s: more than %s system allocations per rendered node\n", name, max >"/dev/stderr"
+                exit 1
+            }
+        }'
+}
+
+report emitter ''
+report native-writer 0.01 --native-writer
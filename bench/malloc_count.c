@@ -0,0 +1,36 @@
+// Preloadable shim counting allocator calls, reported on stderr at exit.
+//
+//   LD_PRELOAD=build/malloc_count.so build/main.out -i template.yaml
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+static atomic_size_t allocations;
+
+void *malloc(size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+    atomic_fetch_add_explicit(&allocations, 1, memory_order_relaxed);
+    return __libc_realloc(ptr, size);
+}
+
+__attribute__((destructor)) static void report(void)
+{
+    fprintf(stderr, "allocations: %zu\n", atomic_load(&allocations));
+}
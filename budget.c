@@ -0,0 +1,114 @@
+#include "lauxlib.h"
+
+#include "allocator.h"
+#include "budget.h"
+#include "error.h"
+#include "state.h"
+#include "timing.h"
+
+static void budget_hook(lua_State *L, lua_Debug *ar)
+{
+    (void)ar; // Unused.
+
+    yl_budget_state_t *state = &yl_state(L)->budget;
+    if (state->exceeded == NULL) {
+        state->instructions += state->interval;
+        if (state->budget.max_instructions && state->instructions >= state->budget.max_instructions)
+            state->exceeded = "instruction budget exceeded";
+        else if (state->budget.max_seconds && yl_time_now() > state->deadline)
+            state->exceeded = "time budget exceeded";
+        else
+            return;
+
+        // Raise again on every instruction, so a pcall() in the template can't outlast it.
+        lua_sethook(L, budget_hook, LUA_MASKCOUNT, 1);
+    }
+    luaL_error(L, "%s", state->exceeded);
+}
+
+void yl_budget_set(lua_State *L, const yl_budget_t *budget)
+{
+    yl_state(L)->budget = (yl_budget_state_t){.budget = *budget};
+}
+
+yl_budget_t yl_budget_get(lua_State *L)
+{
+    return yl_state(L)->budget.budget;
+}
+
+int yl_budget_pcall(lua_State *L, int nargs, int nresults, int msgh)
+{
+    // Only a state with a pooled allocator can limit its memory.
+    yl_allocator_t *allocator = yl_allocator(L);
+    yl_budget_state_t *state = &yl_state(L)->budget;
+    const yl_budget_t *budget = &state->budget;
+
+    if (state->depth > 0 || (!budget->max_instructions && !budget->max_seconds && !budget->max_memory)) {
+        ++state->depth;
+        int status = lua_pcall(L, nargs, nresults, msgh);
+        --state->depth;
+        return status;
+    }
+
+    lua_Hook hook = lua_gethook(L);
+    int hook_mask = lua_gethookmask(L), hook_count = lua_gethookcount(L);
+    state->exceeded = NULL;
+    if (budget->max_instructions || budget->max_seconds) {
+        state->instructions = 0;
+        state->interval = YL_BUDGET_HOOK_INTERVAL;
+        if (budget->max_instructions && budget->max_instructions < state->interval)
+            state->interval = (int)budget->max_instructions;
+        state->deadline = yl_time_now() + budget->max_seconds;
+        lua_sethook(L, budget_hook, LUA_MASKCOUNT, state->interval);
+    }
+    if (budget->max_memory && allocator != NULL) {
+        allocator->limit = allocator->stats.current + budget->max_memory;
+        allocator->limit_exceeded = false;
+    }
+
+    int base = lua_gettop(L) - nargs - 1;
+    ++state->depth;
+    int status = lua_pcall(L, nargs, nresults, msgh);
+    --state->depth;
+
+    lua_sethook(L, hook, hook_mask, hook_count);
+    if (allocator != NULL)
+        allocator->limit = 0;
+
+    // A refused allocation only matters if the expression failed for it; Lua
+    // retries after collecting garbage, and the template may have caught it.
+    if (status == LUA_ERRMEM && allocator != NULL && allocator->limit_exceeded)
+        state->exceeded = "memory budget exceeded";
+
+    // A pcall() in the template may have caught the error, even the last one
+    // raised if nothing ran after it, as in a tail call; it still failed.
+    if (state->exceeded != NULL) {
+        lua_settop(L, base);
+        lua_pushstring(L, state->exceeded);
+        return YL_LUA_ERRBUDGET;
+    }
+    return status;
+}
+
+static long long tighter_count(long long limit, long long own)
+{
+    return own && (!limit || own < limit) ? own : limit;
+}
+
+static double tighter_seconds(double limit, double own)
+{
+    return own && (!limit || own < limit) ? own : limit;
+}
+
+int yl_budget_pcall_within(lua_State *L, const yl_budget_t *budget, int nargs, int nresults, int msgh)
+{
+    yl_budget_state_t *state = &yl_state(L)->budget;
+    yl_budget_t saved = state->budget;
+
+    state->budget.max_instructions = tighter_count(saved.max_instructions, budget->max_instructions);
+    state->budget.max_seconds = tighter_seconds(saved.max_seconds, budget->max_seconds);
+    state->budget.max_memory = (size_t)tighter_count((long long)saved.max_memory, (long long)budget->max_memory);
+    int status = yl_budget_pcall(L, nargs, nresults, msgh);
+    state->budget = saved;
+    return status;
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lua.h"
+
+// How many instructions run between checks of the instruction count and deadline.
+#define YL_BUDGET_HOOK_INTERVAL 1000
+
+/**
+ * Limits on each expression a template runs. Zero means no limit.
+ */
+typedef struct _yl_budget_s {
+    long long max_instructions; // Lua VM instructions.
+    double max_seconds;         // Wall-clock time.
+    size_t max_memory;          // Bytes in use beyond what was in use when the expression started.
+} yl_budget_t;
+
+/**
+ * What a Lua state keeps about its budget while an expression runs.
+ */
+typedef struct _yl_budget_state_s {
+    yl_budget_t budget;
+    int depth; // Nested budgeted calls; only the outermost one is limited.
+    long long instructions;
+    int interval;
+    double deadline;
+    const char *exceeded; // Which budget ran out, or NULL.
+} yl_budget_state_t;
+
+/**
+ * Set the budget of every expression later run on a state. Memory is only
+ * limited on a state created by yl_allocator_new_state().
+ */
+void yl_budget_set(lua_State *L, const yl_budget_t *budget);
+
+/**
+ * The budget set on a state.
+ */
+yl_budget_t yl_budget_get(lua_State *L);
+
+/**
+ * Call lua_pcall() within the state's budget. The instruction count is checked
+ * with a count hook, the deadline in the same hook, and memory by the state's
+ * allocator, which refuses to grow past the limit. A hook set by the caller is
+ * put back afterwards.
+ *
+ * @returns As lua_pcall(), or YL_LUA_ERRBUDGET if a budget ran out, with a
+ * message saying which one on the top of the stack. A budget that ran out fails
+ * the call even if the template caught the error.
+ */
+int yl_budget_pcall(lua_State *L, int nargs, int nresults, int msgh);
+
+/**
+ * Call yl_budget_pcall() with each limit of the state's budget tightened to the
+ * one in @p budget, if that's lower or the state has none, e.g. to try running
+ * an expression at compile time.
+ */
+int yl_budget_pcall_within(lua_State *L, const yl_budget_t *budget, int nargs, int nresults, int msgh);
@@ -0,0 +1,762 @@
+#include <errno.h>
+#include <limits.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "lauxlib.h"
+
+#include "cache.h"
+#include "lua_helpers.h"
+
+#define YL_CACHE_VERSION 2
+
+static const char yl_cache_magic[4] = {'Y', 'L', 'C', '1'};
+
+uint64_t yl_cache_hash(const unsigned char *data, size_t length)
+{
+    // 64-bit FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+yl_cache_key_t yl_cache_key(const unsigned char *data, size_t length)
+{
+    yl_cache_key_t key = {0};
+    yl_sha256(data, length, key.digest);
+    key.length = length;
+    return key;
+}
+
+char *yl_cache_path(const char *cache_dir, const yl_cache_key_t *key)
+{
+    size_t length = strlen(cache_dir) + 1 + 2 * YL_SHA256_SIZE + 4 + 1;
+    char *path = malloc(length);
+    if (path == NULL)
+        return NULL;
+
+    char *c = path + snprintf(path, length, "%s/", cache_dir);
+    for (size_t i = 0; i < YL_SHA256_SIZE; ++i)
+        c += snprintf(c, 3, "%02x", key->digest[i]);
+    strcpy(c, ".ylc");
+    return path;
+}
+
+/**
+ * Whether a file belongs to the current user, and nobody else can write to it.
+ */
+static bool is_private(const struct stat *st)
+{
+    return st->st_uid == geteuid() && (st->st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+const char *yl_cache_dir_problem(const char *cache_dir)
+{
+    struct stat st;
+    if (stat(cache_dir, &st) != 0)
+        return strerror(errno);
+    if (!S_ISDIR(st.st_mode))
+        return "not a directory";
+    if (!is_private(&st))
+        return "writable by others, or owned by another user";
+    return NULL;
+}
+
+static int grow(void **array, size_t *capacity, size_t needed, size_t size)
+{
+    if (needed <= *capacity)
+        return 1;
+
+    size_t new_capacity = *capacity << 1;
+    if (new_capacity == 0)
+        new_capacity = 16;
+    while (new_capacity < needed)
+        new_capacity <<= 1;
+
+    void *resized = realloc(*array, size * new_capacity);
+    if (resized == NULL)
+        return 0;
+
+    *array = resized;
+    *capacity = new_capacity;
+    return 1;
+}
+
+static int append_bytes(yl_cache_builder_t *builder, const void *bytes, size_t length, uint32_t *offset)
+{
+    // Offsets are 32-bit, and UINT32_MAX means "no string".
+    if (builder->strings_size + length + 1 >= YL_CACHE_NO_STRING)
+        return 0;
+
+    // The bytes may be a string already in the table, which growing would move.
+    const char *strings = builder->strings;
+    bool internal = strings != NULL && (const char *)bytes >= strings && (const char *)bytes < strings + builder->strings_size;
+    size_t internal_offset = internal ? (const char *)bytes - strings : 0;
+
+    if (!grow((void **)&builder->strings, &builder->strings_capacity, builder->strings_size + length + 1, 1))
+        return 0;
+    if (internal)
+        bytes = &builder->strings[internal_offset];
+
+    *offset = builder->strings_size;
+    memcpy(&builder->strings[builder->strings_size], bytes, length);
+    builder->strings[builder->strings_size + length] = '\0';
+    builder->strings_size += length + 1;
+    return 1;
+}
+
+static uint64_t string_hash(const unsigned char *string, size_t length)
+{
+    // A zero hash marks an empty slot, so nudge real zero hashes.
+    return yl_cache_hash(string, length) | 1;
+}
+
+/**
+ * Find the entry of an interned string, or else the empty slot it would take.
+ */
+static yl_cache_string_t *find_interned(yl_cache_builder_t *builder, const unsigned char *string, size_t length)
+{
+    uint64_t hash = string_hash(string, length);
+    size_t slot = hash & (builder->interned_capacity - 1);
+    while (builder->interned[slot].hash != 0) {
+        yl_cache_string_t *entry = &builder->interned[slot];
+        if (entry->hash == hash && entry->length == length &&
+            memcmp(&builder->strings[entry->offset], string, length) == 0)
+            break;
+        slot = (slot + 1) & (builder->interned_capacity - 1);
+    }
+    return &builder->interned[slot];
+}
+
+static int intern_string(yl_cache_builder_t *builder, const unsigned char *string, size_t length, uint32_t *offset)
+{
+    if (string == NULL) {
+        *offset = YL_CACHE_NO_STRING;
+        return 1;
+    }
+
+    if (builder->ninterned * 2 >= builder->interned_capacity) {
+        size_t new_capacity = builder->interned_capacity ? builder->interned_capacity << 1 : 256;
+        yl_cache_string_t *resized = calloc(new_capacity, sizeof(yl_cache_string_t));
+        if (resized == NULL)
+            return 0;
+        for (size_t i = 0; i < builder->interned_capacity; ++i) {
+            yl_cache_string_t *entry = &builder->interned[i];
+            if (entry->hash == 0)
+                continue;
+            size_t slot = entry->hash & (new_capacity - 1);
+            while (resized[slot].hash != 0)
+                slot = (slot + 1) & (new_capacity - 1);
+            resized[slot] = *entry;
+        }
+        free(builder->interned);
+        builder->interned = resized;
+        builder->interned_capacity = new_capacity;
+    }
+
+    yl_cache_string_t *entry = find_interned(builder, string, length);
+    if (entry->hash != 0) {
+        *offset = entry->offset;
+        return 1;
+    }
+
+    uint64_t hash = string_hash(string, length);
+    if (!append_bytes(builder, string, length, offset))
+        return 0;
+
+    *entry = (yl_cache_string_t){hash, *offset, length, false};
+    ++builder->ninterned;
+    return 1;
+}
+
+#define INTERN(builder, string, offset) \
+    intern_string(builder, string, (string) ? strlen((char *)(string)) : 0, offset)
+
+static int record_event(yl_cache_builder_t *builder, yaml_event_t *event)
+{
+    if (!grow((void **)&builder->events, &builder->events_capacity, builder->nevents + 1, sizeof(yl_cache_event_t)))
+        return 0;
+
+    yl_cache_event_t record = {
+        .type = event->type,
+        .anchor = YL_CACHE_NO_STRING,
+        .tag = YL_CACHE_NO_STRING,
+        .value = YL_CACHE_NO_STRING,
+        .start_index = event->start_mark.index,
+        .start_line = event->start_mark.line,
+        .start_column = event->start_mark.column,
+        .end_index = event->end_mark.index,
+        .end_line = event->end_mark.line,
+        .end_column = event->end_mark.column,
+    };
+
+    switch (event->type) {
+    case YAML_STREAM_START_EVENT:
+        record.style = event->data.stream_start.encoding;
+        break;
+    case YAML_DOCUMENT_START_EVENT:
+        record.implicit = event->data.document_start.implicit;
+        if (event->data.document_start.version_directive) {
+            record.version_major = event->data.document_start.version_directive->major;
+            record.version_minor = event->data.document_start.version_directive->minor;
+        }
+        record.directives_start = builder->ndirectives;
+        for (yaml_tag_directive_t *directive = event->data.document_start.tag_directives.start;
+             directive != event->data.document_start.tag_directives.end; ++directive) {
+            if (!grow((void **)&builder->directives, &builder->directives_capacity,
+                      builder->ndirectives + 1, sizeof(yl_cache_directive_t)))
+                return 0;
+            yl_cache_directive_t *cached = &builder->directives[builder->ndirectives++];
+            if (!INTERN(builder, directive->handle, &cached->handle) ||
+                !INTERN(builder, directive->prefix, &cached->prefix))
+                return 0;
+            ++record.directives_count;
+        }
+        break;
+    case YAML_DOCUMENT_END_EVENT:
+        record.implicit = event->data.document_end.implicit;
+        break;
+    case YAML_ALIAS_EVENT:
+        if (!INTERN(builder, event->data.alias.anchor, &record.value))
+            return 0;
+        break;
+    case YAML_SCALAR_EVENT:
+        record.style = event->data.scalar.style;
+        record.implicit = event->data.scalar.plain_implicit;
+        record.quoted_implicit = event->data.scalar.quoted_implicit;
+        record.length = event->data.scalar.length;
+        if (!INTERN(builder, event->data.scalar.anchor, &record.anchor) ||
+            !INTERN(builder, event->data.scalar.tag, &record.tag) ||
+            !intern_string(builder, event->data.scalar.value, event->data.scalar.length, &record.value))
+            return 0;
+        break;
+    case YAML_SEQUENCE_START_EVENT:
+        record.style = event->data.sequence_start.style;
+        record.implicit = event->data.sequence_start.implicit;
+        if (!INTERN(builder, event->data.sequence_start.anchor, &record.anchor) ||
+            !INTERN(builder, event->data.sequence_start.tag, &record.tag))
+            return 0;
+        break;
+    case YAML_MAPPING_START_EVENT:
+        record.style = event->data.mapping_start.style;
+        record.implicit = event->data.mapping_start.implicit;
+        if (!INTERN(builder, event->data.mapping_start.anchor, &record.anchor) ||
+            !INTERN(builder, event->data.mapping_start.tag, &record.tag))
+            return 0;
+        break;
+    default:
+        break;
+    }
+
+    builder->events[builder->nevents++] = record;
+    return 1;
+}
+
+int yl_cache_builder_record(yl_cache_builder_t *builder, yaml_event_t *event, yl_error_t *err)
+{
+    if (!builder->producer.callback(builder->producer.data, event, err))
+        return 0;
+
+    if (!record_event(builder, event)) {
+        err->type = YL_MEMORY_ERROR;
+        err->line = event->start_mark.line;
+        err->column = event->start_mark.column;
+        err->context = "While recording a template for the cache, got memory error";
+        err->message = "unable to grow compiled template";
+        yaml_event_delete(event);
+        return 0;
+    }
+
+    return 1;
+}
+
+static int write_bytecode(lua_State *L, const void *bytes, size_t size, yl_cache_builder_t *builder)
+{
+    (void)L;
+    uint32_t offset;
+    if (!append_bytes(builder, bytes, size, &offset))
+        return 1;
+    // Chunks are dumped piecewise; undo the separator so the pieces are contiguous.
+    --builder->strings_size;
+    return 0;
+}
+
+/**
+ * Compile an interned source exactly as yl_lua_execute_lua() would and append its
+ * bytecode, unless it was compiled (or failed to) already.
+ */
+static int compile_chunk(yl_cache_builder_t *builder, lua_State *L, uint32_t source, size_t length)
+{
+    yl_cache_string_t *entry = find_interned(builder, (const unsigned char *)&builder->strings[source], length);
+    if (entry->compiled)
+        return 1;
+    entry->compiled = true;
+
+    const char *code = &builder->strings[source];
+    const char *retline = lua_pushfstring(L, "return %s;", code);
+    int status = luaL_loadbufferx(L, retline, strlen(retline), code, "t");
+    lua_remove(L, -2); // Remove retline.
+    if (status != LUA_OK) {
+        // Leave it to the run that uses it to report the error.
+        lua_pop(L, 1);
+        return 1;
+    }
+
+    if (!grow((void **)&builder->chunks, &builder->chunks_capacity, builder->nchunks + 1, sizeof(yl_cache_chunk_t))) {
+        lua_pop(L, 1);
+        return 0;
+    }
+
+    size_t start = builder->strings_size;
+    int failed = lua_dump(L, (lua_Writer)write_bytecode, builder, false);
+    lua_pop(L, 1); // Remove the function.
+    if (failed || builder->strings_size == start)
+        return 0;
+
+    // Terminate the bytecode so the next string starts on a separator, as usual.
+    uint32_t unused;
+    if (!append_bytes(builder, "", 0, &unused))
+        return 0;
+
+    builder->chunks[builder->nchunks++] = (yl_cache_chunk_t){source, start, builder->strings_size - 1 - start};
+    return 1;
+}
+
+static int write_section(FILE *file, const void *data, size_t size, size_t count)
+{
+    return count == 0 || fwrite(data, size, count, file) == count;
+}
+
+int yl_cache_builder_write(yl_cache_builder_t *builder, lua_State *L, const char *path, const yl_cache_key_t *key, yl_error_t *err)
+{
+    char *temporary = NULL;
+    FILE *file = NULL;
+
+    if (!lua_checkstack(L, 10))
+        goto memory_error;
+
+    for (size_t i = 0; i < builder->nevents; ++i) {
+        yl_cache_event_t *event = &builder->events[i];
+        if (event->tag == YL_CACHE_NO_STRING)
+            continue;
+
+        const char *tag = &builder->strings[event->tag];
+        if (tag[0] != '!' || tag[1] == '!')
+            continue;
+
+        uint32_t source;
+        size_t source_length;
+        if (tag[1] != '\0') {
+            // The tag names a function; strip the '!' by interning the rest.
+            source_length = strlen(tag + 1);
+            if (!intern_string(builder, (const unsigned char *)tag + 1, source_length, &source))
+                goto memory_error;
+        } else if (event->type == YAML_SCALAR_EVENT &&
+                   event->style != YAML_SINGLE_QUOTED_SCALAR_STYLE &&
+                   event->style != YAML_DOUBLE_QUOTED_SCALAR_STYLE) {
+            source = event->value;
+            source_length = event->length;
+        } else {
+            continue;
+        }
+
+        if (!compile_chunk(builder, L, source, source_length))
+            goto memory_error;
+    }
+
+    size_t length = strlen(path) + 32;
+    if ((temporary = malloc(length)) == NULL)
+        goto memory_error;
+    snprintf(temporary, length, "%s.%ld.tmp", path, (long)getpid());
+
+    yl_cache_header_t header = {
+        .version = YL_CACHE_VERSION,
+        .key = *key,
+        .nevents = builder->nevents,
+        .ndirectives = builder->ndirectives,
+        .nchunks = builder->nchunks,
+        .strings_size = builder->strings_size,
+    };
+    memcpy(header.magic, yl_cache_magic, sizeof(header.magic));
+
+    // Only private artifacts are loaded, whatever the umask.
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    if (fd < 0)
+        goto io_error;
+    if ((file = fdopen(fd, "wb")) == NULL) {
+        close(fd);
+        goto io_error;
+    }
+    if (!write_section(file, &header, sizeof(header), 1) ||
+        !write_section(file, builder->events, sizeof(yl_cache_event_t), builder->nevents) ||
+        !write_section(file, builder->directives, sizeof(yl_cache_directive_t), builder->ndirectives) ||
+        !write_section(file, builder->chunks, sizeof(yl_cache_chunk_t), builder->nchunks) ||
+        !write_section(file, builder->strings, 1, builder->strings_size))
+        goto io_error;
+    if (fclose(file) != 0) {
+        file = NULL;
+        goto io_error;
+    }
+    file = NULL;
+
+    // Renaming is atomic, so concurrent runs never see a partial artifact.
+    if (rename(temporary, path) != 0)
+        goto io_error;
+
+    free(temporary);
+    return 1;
+
+memory_error:
+    err->type = YL_MEMORY_ERROR;
+    err->line = 0;
+    err->column = 0;
+    err->context = "While writing a compiled template, got memory error";
+    err->message = "unable to compile template";
+    goto error;
+
+io_error:
+    err->type = YL_WRITER_ERROR;
+    err->line = 0;
+    err->column = 0;
+    err->context = "While writing a compiled template, got error";
+    err->message = strerror(errno);
+    goto error;
+
+error:
+    if (file != NULL)
+        fclose(file);
+    if (temporary != NULL) {
+        unlink(temporary);
+        free(temporary);
+    }
+    return 0;
+}
+
+void yl_cache_builder_delete(yl_cache_builder_t *builder)
+{
+    free(builder->events);
+    free(builder->directives);
+    free(builder->chunks);
+    free(builder->strings);
+    free(builder->interned);
+
+    *builder = (yl_cache_builder_t){0};
+}
+
+static int valid_string(const yl_cache_artifact_t *artifact, uint32_t offset)
+{
+    return offset == YL_CACHE_NO_STRING || offset < artifact->header->strings_size;
+}
+
+int yl_cache_artifact_load(yl_cache_artifact_t *artifact, const char *path, const yl_cache_key_t *key)
+{
+    *artifact = (yl_cache_artifact_t){0};
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) || !is_private(&st) ||
+        (size_t)st.st_size < sizeof(yl_cache_header_t)) {
+        close(fd);
+        return 0;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+        return 0;
+
+    artifact->data = data;
+    artifact->size = st.st_size;
+    artifact->header = data;
+
+    const yl_cache_header_t *header = artifact->header;
+    if (memcmp(header->magic, yl_cache_magic, sizeof(header->magic)) != 0 ||
+        header->version != YL_CACHE_VERSION || header->key.length != key->length ||
+        memcmp(header->key.digest, key->digest, YL_SHA256_SIZE) != 0)
+        goto invalid;
+
+    size_t expected = sizeof(yl_cache_header_t) +
+                      (size_t)header->nevents * sizeof(yl_cache_event_t) +
+                      (size_t)header->ndirectives * sizeof(yl_cache_directive_t) +
+                      (size_t)header->nchunks * sizeof(yl_cache_chunk_t) +
+                      header->strings_size;
+    if (expected != artifact->size || header->strings_size == 0)
+        goto invalid;
+
+    artifact->events = (const yl_cache_event_t *)(header + 1);
+    artifact->directives = (const yl_cache_directive_t *)(artifact->events + header->nevents);
+    artifact->chunks = (const yl_cache_chunk_t *)(artifact->directives + header->ndirectives);
+    artifact->strings = (const char *)(artifact->chunks + header->nchunks);
+    if (artifact->strings[header->strings_size - 1] != '\0')
+        goto invalid;
+
+    // Check every offset once here, so replay can trust them.
+    for (size_t i = 0; i < header->nevents; ++i) {
+        const yl_cache_event_t *event = &artifact->events[i];
+        if (!valid_string(artifact, event->anchor) || !valid_string(artifact, event->tag) ||
+            !valid_string(artifact, event->value) ||
+            (event->value != YL_CACHE_NO_STRING && event->length > header->strings_size - event->value) ||
+            event->directives_start > header->ndirectives ||
+            event->directives_count > header->ndirectives - event->directives_start)
+            goto invalid;
+    }
+    for (size_t i = 0; i < header->ndirectives; ++i) {
+        if (!valid_string(artifact, artifact->directives[i].handle) ||
+            !valid_string(artifact, artifact->directives[i].prefix))
+            goto invalid;
+    }
+    for (size_t i = 0; i < header->nchunks; ++i) {
+        const yl_cache_chunk_t *chunk = &artifact->chunks[i];
+        if (!valid_string(artifact, chunk->source) || chunk->source == YL_CACHE_NO_STRING ||
+            chunk->bytecode >= header->strings_size ||
+            chunk->length > header->strings_size - chunk->bytecode)
+            goto invalid;
+    }
+
+    return 1;
+
+invalid:
+    yl_cache_artifact_delete(artifact);
+    return 0;
+}
+
+int yl_cache_artifact_register_chunks(yl_cache_artifact_t *artifact, lua_State *L, yl_error_t *err)
+{
+    if (!lua_checkstack(L, 10)) {
+        err->type = YL_MEMORY_ERROR;
+        err->line = 0;
+        err->column = 0;
+        err->context = "While loading a compiled template, got memory error";
+        err->message = "could not expand Lua stack space";
+        return 0;
+    }
+
+    // Load every chunk before registering any, so a bad artifact leaves nothing behind.
+    size_t nchunks = artifact->header->nchunks;
+    lua_createtable(L, nchunks < INT_MAX ? (int)nchunks : 0, 0);
+    for (size_t i = 0; i < nchunks; ++i) {
+        const yl_cache_chunk_t *chunk = &artifact->chunks[i];
+        const char *source = &artifact->strings[chunk->source];
+
+        int status = luaL_loadbufferx(L, &artifact->strings[chunk->bytecode], chunk->length, source, "b");
+        if (status != LUA_OK) {
+            lua_remove(L, -2); // Remove the loaded chunks, and leave the message.
+            err->type = yl_error_from_lua_error(status);
+            err->line = 0;
+            err->column = 0;
+            err->context = "While loading a compiled template, got error";
+            err->message = lua_tostring(L, -1);
+            return 0;
+        }
+        lua_rawseti(L, -2, (lua_Integer)i + 1);
+    }
+
+    for (size_t i = 0; i < nchunks; ++i) {
+        lua_rawgeti(L, -1, (lua_Integer)i + 1);
+        yl_lua_register_chunk(L, &artifact->strings[artifact->chunks[i].source]);
+    }
+    lua_pop(L, 1); // Remove the loaded chunks.
+
+    return 1;
+}
+
+#define STRING(artifact, offset) \
+    ((offset) == YL_CACHE_NO_STRING ? NULL : (yaml_char_t *)&(artifact)->strings[offset])
+
+static int end_of_stream(yl_error_t *err)
+{
+    err->type = YL_READER_ERROR;
+    err->line = 0;
+    err->column = 0;
+    err->context = "While replaying a compiled template, got error";
+    err->message = "unexpected end of event stream";
+    return 0;
+}
+
+int yl_cache_artifact_replay(yl_cache_artifact_t *artifact, yaml_event_t *event, yl_error_t *err)
+{
+    *event = (yaml_event_t){0};
+
+    if (artifact->index == artifact->header->nevents)
+        return end_of_stream(err);
+
+    const yl_cache_event_t *cached = &artifact->events[artifact->index++];
+    int status = 0;
+
+    switch (cached->type) {
+    case YAML_STREAM_START_EVENT:
+        status = yaml_stream_start_event_initialize(event, cached->style);
+        break;
+    case YAML_STREAM_END_EVENT:
+        status = yaml_stream_end_event_initialize(event);
+        break;
+    case YAML_DOCUMENT_START_EVENT: {
+        yaml_version_directive_t version = {cached->version_major, cached->version_minor};
+        yaml_tag_directive_t *directives = NULL;
+        if (cached->directives_count) {
+            directives = calloc(cached->directives_count, sizeof(yaml_tag_directive_t));
+            if (directives == NULL)
+                break;
+            for (size_t i = 0; i < cached->directives_count; ++i) {
+                directives[i].handle = STRING(artifact, artifact->directives[cached->directives_start + i].handle);
+                directives[i].prefix = STRING(artifact, artifact->directives[cached->directives_start + i].prefix);
+            }
+        }
+        status = yaml_document_start_event_initialize(event,
+                                                      cached->version_major ? &version : NULL,
+                                                      directives,
+                                                      directives + cached->directives_count,
+                                                      cached->implicit);
+        free(directives);
+    } break;
+    case YAML_DOCUMENT_END_EVENT:
+        status = yaml_document_end_event_initialize(event, cached->implicit);
+        break;
+    case YAML_ALIAS_EVENT:
+        status = yaml_alias_event_initialize(event, STRING(artifact, cached->value));
+        break;
+    case YAML_SCALAR_EVENT:
+        status = yaml_scalar_event_initialize(event,
+                                              STRING(artifact, cached->anchor),
+                                              STRING(artifact, cached->tag),
+                                              STRING(artifact, cached->value),
+                                              cached->length,
+                                              cached->implicit,
+                                              cached->quoted_implicit,
+                                              cached->style);
+        break;
+    case YAML_SEQUENCE_START_EVENT:
+        status = yaml_sequence_start_event_initialize(event,
+                                                      STRING(artifact, cached->anchor),
+                                                      STRING(artifact, cached->tag),
+                                                      cached->implicit,
+                                                      cached->style);
+        break;
+    case YAML_SEQUENCE_END_EVENT:
+        status = yaml_sequence_end_event_initialize(event);
+        break;
+    case YAML_MAPPING_START_EVENT:
+        status = yaml_mapping_start_event_initialize(event,
+                                                     STRING(artifact, cached->anchor),
+                                                     STRING(artifact, cached->tag),
+                                                     cached->implicit,
+                                                     cached->style);
+        break;
+    case YAML_MAPPING_END_EVENT:
+        status = yaml_mapping_end_event_initialize(event);
+        break;
+    default:
+        break;
+    }
+
+    if (!status) {
+        err->type = YL_READER_ERROR;
+        err->line = cached->start_line;
+        err->column = cached->start_column;
+        err->context = "While replaying a compiled template, got error";
+        err->message = "could not initialize event";
+        return 0;
+    }
+
+    event->start_mark = (yaml_mark_t){cached->start_index, cached->start_line, cached->start_column};
+    event->end_mark = (yaml_mark_t){cached->end_index, cached->end_line, cached->end_column};
+    return 1;
+}
+
+int yl_cache_artifact_lend(yl_cache_artifact_t *artifact, yaml_event_t *event, yl_error_t *err)
+{
+    *event = (yaml_event_t){0};
+
+    if (artifact->index == artifact->header->nevents)
+        return end_of_stream(err);
+
+    const yl_cache_event_t *cached = &artifact->events[artifact->index++];
+    event->type = cached->type;
+    event->start_mark = (yaml_mark_t){cached->start_index, cached->start_line, cached->start_column};
+    event->end_mark = (yaml_mark_t){cached->end_index, cached->end_line, cached->end_column};
+
+    switch (cached->type) {
+    case YAML_STREAM_START_EVENT:
+        event->data.stream_start.encoding = cached->style;
+        break;
+    case YAML_DOCUMENT_START_EVENT:
+        if (cached->version_major) {
+            artifact->version = (yaml_version_directive_t){cached->version_major, cached->version_minor};
+            event->data.document_start.version_directive = &artifact->version;
+        }
+        if (cached->directives_count) {
+            if (artifact->tag_directives == NULL) {
+                size_t ndirectives = artifact->header->ndirectives;
+                if ((artifact->tag_directives = calloc(ndirectives, sizeof(yaml_tag_directive_t))) == NULL) {
+                    *event = (yaml_event_t){0};
+                    err->type = YL_MEMORY_ERROR;
+                    err->line = cached->start_line;
+                    err->column = cached->start_column;
+                    err->context = "While replaying a compiled template, got memory error";
+                    err->message = "could not allocate tag directives";
+                    return 0;
+                }
+                for (size_t i = 0; i < ndirectives; ++i) {
+                    artifact->tag_directives[i].handle = STRING(artifact, artifact->directives[i].handle);
+                    artifact->tag_directives[i].prefix = STRING(artifact, artifact->directives[i].prefix);
+                }
+            }
+            event->data.document_start.tag_directives.start = &artifact->tag_directives[cached->directives_start];
+            event->data.document_start.tag_directives.end = event->data.document_start.tag_directives.start +
+                                                            cached->directives_count;
+        }
+        event->data.document_start.implicit = cached->implicit;
+        break;
+    case YAML_DOCUMENT_END_EVENT:
+        event->data.document_end.implicit = cached->implicit;
+        break;
+    case YAML_ALIAS_EVENT:
+        event->data.alias.anchor = STRING(artifact, cached->value);
+        break;
+    case YAML_SCALAR_EVENT:
+        event->data.scalar.anchor = STRING(artifact, cached->anchor);
+        event->data.scalar.tag = STRING(artifact, cached->tag);
+        event->data.scalar.value = STRING(artifact, cached->value);
+        event->data.scalar.length = cached->length;
+        event->data.scalar.plain_implicit = cached->implicit;
+        event->data.scalar.quoted_implicit = cached->quoted_implicit;
+        event->data.scalar.style = cached->style;
+        break;
+    case YAML_SEQUENCE_START_EVENT:
+        event->data.sequence_start.anchor = STRING(artifact, cached->anchor);
+        event->data.sequence_start.tag = STRING(artifact, cached->tag);
+        event->data.sequence_start.implicit = cached->implicit;
+        event->data.sequence_start.style = cached->style;
+        break;
+    case YAML_MAPPING_START_EVENT:
+        event->data.mapping_start.anchor = STRING(artifact, cached->anchor);
+        event->data.mapping_start.tag = STRING(artifact, cached->tag);
+        event->data.mapping_start.implicit = cached->implicit;
+        event->data.mapping_start.style = cached->style;
+        break;
+    default:
+        break;
+    }
+    return 1;
+}
+
+void yl_cache_artifact_delete(yl_cache_artifact_t *artifact)
+{
+    if (artifact->data != NULL)
+        munmap(artifact->data, artifact->size);
+    free(artifact->tag_directives);
+
+    *artifact = (yl_cache_artifact_t){0};
+}
@@ -0,0 +1,191 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lua.h"
+#include "yaml.h"
+
+#include "executor.h"
+#include "sha256.h"
+
+/**
+ * Compiled template artifacts.
+ *
+ * An artifact holds the parsed event stream of a template and the Lua bytecode of
+ * every expression and tag in it, so a later run over the same bytes can skip both
+ * the YAML parser and the Lua compiler. Artifacts are named after the SHA-256 of
+ * the template source, and checked against it and the source length on load.
+ *
+ * The bytecode is loaded as-is, and Lua doesn't verify bytecode, so whoever can
+ * write an artifact can run anything. The cache directory and its artifacts are
+ * only used if they belong to the current user and nobody else can write to them.
+ *
+ * The layout is a header, then fixed-size event and tag directive records, then
+ * chunk records, then a string table that every record points into by offset.
+ */
+
+#define YL_CACHE_NO_STRING UINT32_MAX
+
+/**
+ * What an artifact is named after and checked against.
+ */
+typedef struct _yl_cache_key_s {
+    uint8_t digest[YL_SHA256_SIZE]; // SHA-256 of the template source.
+    uint64_t length;                // Length of the template source.
+} yl_cache_key_t;
+
+typedef struct _yl_cache_header_s {
+    char magic[4];
+    uint32_t version;
+    yl_cache_key_t key;
+    uint32_t nevents;
+    uint32_t ndirectives;
+    uint32_t nchunks;
+    uint32_t strings_size;
+} yl_cache_header_t;
+
+typedef struct _yl_cache_event_s {
+    uint8_t type;
+    uint8_t style;    // Scalar/collection style, or the stream encoding.
+    uint8_t implicit; // Document/collection implicit, or scalar plain_implicit.
+    uint8_t quoted_implicit;
+    uint8_t version_major, version_minor; // Zero if the document has no %YAML directive.
+    uint16_t reserved;
+    uint32_t anchor, tag, value, length; // String table offsets; value doubles as the alias anchor.
+    uint32_t directives_start, directives_count;
+    uint64_t start_index, start_line, start_column;
+    uint64_t end_index, end_line, end_column;
+} yl_cache_event_t;
+
+typedef struct _yl_cache_directive_s {
+    uint32_t handle, prefix;
+} yl_cache_directive_t;
+
+typedef struct _yl_cache_chunk_s {
+    uint32_t source, bytecode, length;
+} yl_cache_chunk_t;
+
+typedef struct _yl_cache_string_s {
+    uint64_t hash;
+    uint32_t offset, length;
+    bool compiled; // Compiled as a chunk, or tried to be.
+} yl_cache_string_t;
+
+/**
+ * Accumulates an artifact while a template is parsed for the first time.
+ */
+typedef struct _yl_cache_builder_s {
+    yl_event_producer_t producer; // The producer being recorded.
+
+    yl_cache_event_t *events;
+    size_t nevents, events_capacity;
+    yl_cache_directive_t *directives;
+    size_t ndirectives, directives_capacity;
+    yl_cache_chunk_t *chunks;
+    size_t nchunks, chunks_capacity;
+    char *strings;
+    size_t strings_size, strings_capacity;
+
+    // Open-addressed set of interned strings, so repeated keys and tags are stored once.
+    yl_cache_string_t *interned;
+    size_t ninterned, interned_capacity;
+} yl_cache_builder_t;
+
+/**
+ * A loaded artifact, replayed in place of the parser.
+ */
+typedef struct _yl_cache_artifact_s {
+    void *data;
+    size_t size;
+    const yl_cache_header_t *header;
+    const yl_cache_event_t *events;
+    const yl_cache_directive_t *directives;
+    const yl_cache_chunk_t *chunks;
+    const char *strings;
+    size_t index;
+
+    // What lent document start events point at, built on first use.
+    yaml_version_directive_t version;
+    yaml_tag_directive_t *tag_directives;
+} yl_cache_artifact_t;
+
+/**
+ * A fast hash for hash tables (64-bit FNV-1a). It's not collision resistant, so
+ * use yl_cache_key() to identify content.
+ */
+uint64_t yl_cache_hash(const unsigned char *data, size_t length);
+
+/**
+ * The key of a template source.
+ */
+yl_cache_key_t yl_cache_key(const unsigned char *data, size_t length);
+
+/**
+ * Build the artifact path for a key inside a cache directory.
+ *
+ * @returns A newly allocated path, or @c NULL if out of memory.
+ */
+char *yl_cache_path(const char *cache_dir, const yl_cache_key_t *key);
+
+/**
+ * Check that a cache directory can be trusted with bytecode: it belongs to the
+ * current user, and nobody else can write to it.
+ *
+ * @returns @c NULL if it can be used, or else why not.
+ */
+const char *yl_cache_dir_problem(const char *cache_dir);
+
+/**
+ * Event producer that records every event from the wrapped producer into the
+ * builder on its way through.
+ */
+int yl_cache_builder_record(yl_cache_builder_t *builder, yaml_event_t *event, yl_error_t *err);
+
+/**
+ * Compile every expression and tag of the recorded stream and write the artifact.
+ *
+ * @param[in,out]   builder     A builder that recorded a complete stream.
+ * @param[in,out]   L           A Lua state to compile with; nothing is executed.
+ * @param[in]       path        Where to write the artifact. It is written to a
+ *                              temporary file first and renamed into place.
+ * @param[in]       key         The key of the template source.
+ * @param[out]      err         Error details.
+ *
+ * @returns On success, returns @c 1. On failure, returns @c 0.
+ */
+int yl_cache_builder_write(yl_cache_builder_t *builder, lua_State *L, const char *path, const yl_cache_key_t *key, yl_error_t *err);
+
+void yl_cache_builder_delete(yl_cache_builder_t *builder);
+
+/**
+ * Load an artifact.
+ *
+ * @returns @c 1 if a valid artifact for @p key was loaded. If it is missing,
+ * stale, malformed or writable by others, returns @c 0 and the template should
+ * be parsed instead.
+ */
+int yl_cache_artifact_load(yl_cache_artifact_t *artifact, const char *path, const yl_cache_key_t *key);
+
+/**
+ * Load the artifact's bytecode into a Lua state, with yl_lua_register_chunk().
+ * Either every chunk is registered, or none is.
+ *
+ * @returns On success, returns @c 1. On failure, returns @c 0 and the template
+ * should be parsed instead; the Lua stack may hold the error message.
+ */
+int yl_cache_artifact_register_chunks(yl_cache_artifact_t *artifact, lua_State *L, yl_error_t *err);
+
+/**
+ * Event producer that replays the artifact's event stream.
+ */
+int yl_cache_artifact_replay(yl_cache_artifact_t *artifact, yaml_event_t *event, yl_error_t *err);
+
+/**
+ * Event producer that replays the artifact's event stream without copying it:
+ * the events point into the artifact. See yl_event_producer_t.lends.
+ */
+int yl_cache_artifact_lend(yl_cache_artifact_t *artifact, yaml_event_t *event, yl_error_t *err);
+
+void yl_cache_artifact_delete(yl_cache_artifact_t *artifact);
@@ -0,0 +1,296 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "lauxlib.h"
+
+#include "chunk_cache.h"
+
+typedef struct _yl_chunk_cache_entry_s {
+    struct _yl_chunk_cache_entry_s *bucket_next;
+    struct _yl_chunk_cache_entry_s *lru_prev, *lru_next; // Unused when pinned.
+    uint64_t hash;
+    int ref; // Index of the function in the cache's function table.
+    bool pinned;
+    size_t length;
+    char source[];
+} yl_chunk_cache_entry_t;
+
+/**
+ * The cache lives in a full userdata in the registry, so the Lua state owns it and
+ * frees it on close. Its single user value is the table holding the functions.
+ */
+typedef struct _yl_chunk_cache_s {
+    yl_chunk_cache_entry_t **buckets;
+    size_t nbuckets;
+    size_t nentries;
+    yl_chunk_cache_entry_t *lru_head, *lru_tail; // Most and least recently used.
+    yl_chunk_cache_stats_t stats;
+} yl_chunk_cache_t;
+
+// The address of this variable keys the cache in the registry.
+static const char yl_chunk_cache_key = 0;
+
+static int chunk_cache_gc(lua_State *L)
+{
+    yl_chunk_cache_t *cache = lua_touserdata(L, 1);
+
+    for (size_t i = 0; i < cache->nbuckets; ++i) {
+        yl_chunk_cache_entry_t *entry = cache->buckets[i];
+        while (entry != NULL) {
+            yl_chunk_cache_entry_t *next = entry->bucket_next;
+            free(entry);
+            entry = next;
+        }
+    }
+    free(cache->buckets);
+    *cache = (yl_chunk_cache_t){0};
+
+    return 0;
+}
+
+/**
+ * Push the cache userdata, creating it on first use.
+ */
+static yl_chunk_cache_t *push_cache(lua_State *L)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &yl_chunk_cache_key) == LUA_TUSERDATA)
+        return lua_touserdata(L, -1);
+    lua_pop(L, 1);
+
+    yl_chunk_cache_t *cache = lua_newuserdatauv(L, sizeof(yl_chunk_cache_t), 1);
+    *cache = (yl_chunk_cache_t){0};
+    cache->stats.capacity = YL_CHUNK_CACHE_DEFAULT_CAPACITY;
+
+    lua_newtable(L);
+    lua_setiuservalue(L, -2, 1);
+
+    if (luaL_newmetatable(L, "yl.chunk_cache")) {
+        lua_pushcfunction(L, chunk_cache_gc);
+        lua_setfield(L, -2, "__gc");
+    }
+    lua_setmetatable(L, -2);
+
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &yl_chunk_cache_key);
+
+    return cache;
+}
+
+static uint64_t hash_source(const char *source, size_t length)
+{
+    // 64-bit FNV-1a.
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= (unsigned char)source[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static yl_chunk_cache_entry_t *find_entry(yl_chunk_cache_t *cache, const char *source, size_t length, uint64_t hash)
+{
+    if (cache->nbuckets == 0)
+        return NULL;
+
+    for (yl_chunk_cache_entry_t *entry = cache->buckets[hash & (cache->nbuckets - 1)];
+         entry != NULL; entry = entry->bucket_next) {
+        if (entry->hash == hash && entry->length == length && memcmp(entry->source, source, length) == 0)
+            return entry;
+    }
+    return NULL;
+}
+
+static void lru_unlink(yl_chunk_cache_t *cache, yl_chunk_cache_entry_t *entry)
+{
+    if (entry->lru_prev)
+        entry->lru_prev->lru_next = entry->lru_next;
+    else
+        cache->lru_head = entry->lru_next;
+    if (entry->lru_next)
+        entry->lru_next->lru_prev = entry->lru_prev;
+    else
+        cache->lru_tail = entry->lru_prev;
+    entry->lru_prev = entry->lru_next = NULL;
+}
+
+static void lru_push_front(yl_chunk_cache_t *cache, yl_chunk_cache_entry_t *entry)
+{
+    entry->lru_prev = NULL;
+    entry->lru_next = cache->lru_head;
+    if (cache->lru_head)
+        cache->lru_head->lru_prev = entry;
+    else
+        cache->lru_tail = entry;
+    cache->lru_head = entry;
+}
+
+static void remove_entry(yl_chunk_cache_t *cache, yl_chunk_cache_entry_t *entry)
+{
+    yl_chunk_cache_entry_t **link = &cache->buckets[entry->hash & (cache->nbuckets - 1)];
+    while (*link != entry)
+        link = &(*link)->bucket_next;
+    *link = entry->bucket_next;
+
+    if (!entry->pinned)
+        lru_unlink(cache, entry);
+    --cache->nentries;
+}
+
+static int grow_buckets(yl_chunk_cache_t *cache)
+{
+    size_t nbuckets = cache->nbuckets ? cache->nbuckets << 1 : 64;
+    yl_chunk_cache_entry_t **buckets = calloc(nbuckets, sizeof(yl_chunk_cache_entry_t *));
+    if (buckets == NULL)
+        return 0;
+
+    for (size_t i = 0; i < cache->nbuckets; ++i) {
+        yl_chunk_cache_entry_t *entry = cache->buckets[i];
+        while (entry != NULL) {
+            yl_chunk_cache_entry_t *next = entry->bucket_next;
+            entry->bucket_next = buckets[entry->hash & (nbuckets - 1)];
+            buckets[entry->hash & (nbuckets - 1)] = entry;
+            entry = next;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+    return 1;
+}
+
+/**
+ * Evict least recently used entries until at most capacity remain.
+ *
+ * @param[in]       index       Stack index of the cache userdata.
+ */
+static void evict(lua_State *L, yl_chunk_cache_t *cache, int index, size_t capacity)
+{
+    if (cache->stats.size <= capacity)
+        return;
+
+    lua_getiuservalue(L, index, 1);
+    while (cache->stats.size > capacity) {
+        yl_chunk_cache_entry_t *entry = cache->lru_tail;
+        remove_entry(cache, entry);
+        luaL_unref(L, -1, entry->ref);
+        free(entry);
+        --cache->stats.size;
+        ++cache->stats.evictions;
+    }
+    lua_pop(L, 1); // Remove the function table.
+}
+
+/**
+ * Add the function on the top of the stack, leaving it there.
+ *
+ * @param[in]       index       Stack index of the cache userdata.
+ */
+static void insert_entry(lua_State *L, yl_chunk_cache_t *cache, int index,
+                         const char *source, size_t length, uint64_t hash, bool pinned)
+{
+    if (!pinned && cache->stats.capacity == 0)
+        return;
+
+    if ((cache->nentries + 1) * 2 > cache->nbuckets && !grow_buckets(cache))
+        return; // Caching is an optimization; just don't cache.
+
+    yl_chunk_cache_entry_t *entry = malloc(sizeof(yl_chunk_cache_entry_t) + length + 1);
+    if (entry == NULL)
+        return;
+    *entry = (yl_chunk_cache_entry_t){.hash = hash, .pinned = pinned, .length = length};
+    memcpy(entry->source, source, length + 1);
+
+    lua_getiuservalue(L, index, 1);
+    lua_pushvalue(L, -2);
+    entry->ref = luaL_ref(L, -2);
+    lua_pop(L, 1); // Remove the function table.
+
+    size_t bucket = hash & (cache->nbuckets - 1);
+    entry->bucket_next = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    ++cache->nentries;
+
+    if (pinned) {
+        ++cache->stats.pinned;
+    } else {
+        lru_push_front(cache, entry);
+        ++cache->stats.size;
+        evict(L, cache, index, cache->stats.capacity);
+    }
+}
+
+int yl_chunk_cache_load(lua_State *L, const char *source)
+{
+    size_t length = strlen(source);
+    uint64_t hash = hash_source(source, length);
+    yl_chunk_cache_t *cache = push_cache(L);
+    int index = lua_gettop(L);
+
+    yl_chunk_cache_entry_t *entry = find_entry(cache, source, length, hash);
+    if (entry != NULL) {
+        ++cache->stats.hits;
+        if (!entry->pinned && entry != cache->lru_head) {
+            lru_unlink(cache, entry);
+            lru_push_front(cache, entry);
+        }
+        lua_getiuservalue(L, index, 1);
+        lua_rawgeti(L, -1, entry->ref);
+        lua_remove(L, -2); // Remove the function table.
+        lua_remove(L, index);
+        return LUA_OK;
+    }
+
+    ++cache->stats.misses;
+    const char *retline = lua_pushfstring(L, "return %s;", source);
+    int status = luaL_loadbufferx(L, retline, strlen(retline), source, "t");
+    lua_remove(L, -2); // Remove retline.
+    if (status == LUA_OK)
+        insert_entry(L, cache, index, source, length, hash, false);
+
+    lua_remove(L, index);
+    return status;
+}
+
+void yl_chunk_cache_insert(lua_State *L, const char *source, bool pinned)
+{
+    size_t length = strlen(source);
+    uint64_t hash = hash_source(source, length);
+    yl_chunk_cache_t *cache = push_cache(L);
+    int index = lua_gettop(L);
+    lua_insert(L, -2); // Move the cache below the function.
+
+    yl_chunk_cache_entry_t *entry = find_entry(cache, source, length, hash);
+    if (entry != NULL) {
+        // Replace the cached function.
+        remove_entry(cache, entry);
+        lua_getiuservalue(L, index - 1, 1);
+        luaL_unref(L, -1, entry->ref);
+        lua_pop(L, 1);
+        if (entry->pinned)
+            --cache->stats.pinned;
+        else
+            --cache->stats.size;
+        free(entry);
+    }
+
+    insert_entry(L, cache, index - 1, source, length, hash, pinned);
+    lua_pop(L, 2); // Remove the function and the cache.
+}
+
+void yl_chunk_cache_set_capacity(lua_State *L, size_t capacity)
+{
+    yl_chunk_cache_t *cache = push_cache(L);
+    cache->stats.capacity = capacity;
+    evict(L, cache, lua_gettop(L), capacity);
+    lua_pop(L, 1);
+}
+
+yl_chunk_cache_stats_t yl_chunk_cache_stats(lua_State *L)
+{
+    yl_chunk_cache_t *cache = push_cache(L);
+    yl_chunk_cache_stats_t stats = cache->stats;
+    lua_pop(L, 1);
+    return stats;
+}
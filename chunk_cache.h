@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "lua.h"
+
+#define YL_CHUNK_CACHE_DEFAULT_CAPACITY 1024
+
+typedef struct _yl_chunk_cache_stats_s {
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+    size_t size;     // Evictable entries currently cached.
+    size_t pinned;   // Entries that are never evicted.
+    size_t capacity; // The most evictable entries kept; 0 disables caching.
+} yl_chunk_cache_stats_t;
+
+/**
+ * Push the compiled function for an expression, compiling it only on a cache miss.
+ *
+ * The function is compiled from @c "return <source>;" with @p source as its chunk
+ * name, and kept in a per-state cache keyed by the source text. When the cache is
+ * full, the least recently used entry is evicted.
+ *
+ * @param[in,out]   L           A pointer to the Lua state.
+ * @param[in]       source      The expression.
+ *
+ * @returns One of LUA_OK, LUA_ERRSYNTAX or LUA_ERRMEM. On return, leaves the
+ * function or an error message on the Lua stack.
+ */
+int yl_chunk_cache_load(lua_State *L, const char *source);
+
+/**
+ * Cache an already compiled function for an expression.
+ *
+ * @param[in,out]   L           A pointer to the Lua state, with the function on
+ *                              the top of the stack. It is popped.
+ * @param[in]       source      The expression the function was compiled from.
+ * @param[in]       pinned      If true, the entry is never evicted and doesn't
+ *                              count against the capacity.
+ */
+void yl_chunk_cache_insert(lua_State *L, const char *source, bool pinned);
+
+/**
+ * Change the capacity, evicting least recently used entries to fit.
+ */
+void yl_chunk_cache_set_capacity(lua_State *L, size_t capacity);
+
+yl_chunk_cache_stats_t yl_chunk_cache_stats(lua_State *L);
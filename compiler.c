@@ -0,0 +1,243 @@
+#include <string.h>
+
+#include "lauxlib.h"
+
+#include "budget.h"
+#include "chunk_cache.h"
+#include "compiler.h"
+#include "lua_helpers.h"
+#include "render.h"
+
+// Instructions an expression may run while being folded before it's left to run time.
+#define FOLD_INSTRUCTION_LIMIT 100000
+// Longer results are left to run time, to keep the recorded stream small.
+#define FOLD_MAX_LENGTH 1024
+// Bytes an expression may allocate while being folded, so that building a long
+// string (say, with ("x"):rep(n), which doesn't go through _ENV) is left to run
+// time and its budget.
+#define FOLD_MAX_MEMORY (16 * FOLD_MAX_LENGTH)
+
+static int record_stream(yl_execution_context_t *ctx, yl_event_record_t *record)
+{
+    yaml_event_t event = {0};
+
+    bool done = false;
+    while (!done) {
+        if (!ctx->producer.callback(ctx->producer.data, &event, &ctx->err))
+            return 0;
+
+        done = event.type == YAML_STREAM_END_EVENT;
+
+        if (!yl_record_event(record, &event, NULL, &ctx->err)) {
+            yaml_event_delete(&event);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+static int fold_trap(lua_State *L)
+{
+    return luaL_error(L, "expression is not constant");
+}
+
+static int capture_event(yaml_event_t *captured, yaml_event_t *event, lua_State *L, yl_error_t *err)
+{
+    (void)L;
+    (void)err;
+
+    *captured = *event;
+    *event = (yaml_event_t){0}; // Mark the event as consumed.
+    return 1;
+}
+
+/**
+ * Check whether a scalar would turn back into the same Lua value when read back
+ * into a table, since tagged collections reparse plain scalars.
+ */
+static bool round_trips(lua_State *L, int index, yaml_event_t *scalar)
+{
+    yl_lua_value_from_scalar(L, scalar->data.scalar.style, scalar->data.scalar.length, (char *)scalar->data.scalar.value);
+
+    bool same = lua_type(L, -1) == lua_type(L, index) &&
+                lua_isinteger(L, -1) == lua_isinteger(L, index) &&
+                lua_rawequal(L, -1, index);
+    lua_pop(L, 1);
+    return same;
+}
+
+/**
+ * Try to evaluate the compiled expression on the top of the stack with no
+ * environment, and replace the event with the rendered result.
+ *
+ * @returns Non-zero if the event was folded. Either way, the stack is unchanged.
+ */
+static int fold_expression(lua_State *L, yl_event_record_t *record, size_t index)
+{
+    const yaml_event_t *event = &record->events[index];
+    int base = lua_gettop(L);
+    int folded = 0;
+    yaml_event_t scratch = {0}, captured = {0};
+
+    // Any read or write of a variable hits the trap, so only closed expressions succeed.
+    lua_pushcfunction(L, yl_lua_error_handler);
+    lua_pushvalue(L, base);
+    lua_newtable(L);
+    lua_newtable(L);
+    lua_pushcfunction(L, fold_trap);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, fold_trap);
+    lua_setfield(L, -2, "__newindex");
+    lua_setmetatable(L, -2);
+    lua_setupvalue(L, -2, 1); // Replace _ENV.
+
+    // Within the template's budget too, so folding never does more than running would.
+    yl_budget_t budget = {FOLD_INSTRUCTION_LIMIT, 0, FOLD_MAX_MEMORY};
+    int status = yl_budget_pcall_within(L, &budget, 0, 1, base + 1);
+
+    // The function is kept for run time, so give it back the real globals.
+    lua_pushglobaltable(L);
+    lua_setupvalue(L, base, 1);
+
+    if (status != LUA_OK)
+        goto done;
+
+    int type = lua_type(L, -1);
+    if (type != LUA_TNIL && type != LUA_TBOOLEAN && type != LUA_TNUMBER && type != LUA_TSTRING)
+        goto done;
+    if (type == LUA_TSTRING && lua_rawlen(L, -1) > FOLD_MAX_LENGTH)
+        goto done;
+
+    // Render a copy, so the original survives if the result doesn't round trip.
+    if (!yl_copy_event(event, &scratch))
+        goto done;
+
+    yl_error_t err = {0};
+    yl_event_consumer_t capture = {(yl_event_consumer_callback_t *)capture_event, &captured, false};
+    lua_pushvalue(L, -1); // Duplicate the result, it gets consumed by yl_render_scalar().
+    if (!yl_render_scalar(&capture, &scratch, L, &err))
+        goto done;
+
+    if (!round_trips(L, lua_gettop(L), &captured))
+        goto done;
+
+    captured.start_mark = event->start_mark;
+    captured.end_mark = event->end_mark;
+    folded = yl_event_record_replace(record, index, &captured, &err);
+
+done:
+    yaml_event_delete(&scratch);
+    yaml_event_delete(&captured);
+    lua_settop(L, base);
+    return folded;
+}
+
+static void report(FILE *diagnostics, const yaml_event_t *event, int status, const char *message)
+{
+    fprintf(diagnostics, "%zu:%zu: %s: While compiling, encountered an error: %s\n",
+            event->start_mark.line + 1,
+            event->start_mark.column + 1,
+            yl_error_name(yl_error_from_lua_error(status)),
+            message);
+}
+
+/**
+ * Compile source as yl_lua_execute_lua() would, and pin the result in the chunk cache.
+ *
+ * @returns The Lua status; the stack is unchanged.
+ */
+static int compile_event(lua_State *L, yl_event_record_t *record, size_t index, const char *source, bool foldable, FILE *diagnostics)
+{
+    const yaml_event_t *event = &record->events[index];
+    const char *retline = lua_pushfstring(L, "return %s;", source);
+    int status = luaL_loadbufferx(L, retline, strlen(retline), source, "t");
+    lua_remove(L, -2); // Remove retline.
+
+    if (status != LUA_OK) {
+        report(diagnostics, event, status, lua_tostring(L, -1));
+        lua_pop(L, 1);
+        return status;
+    }
+
+    if (foldable && fold_expression(L, record, index)) {
+        lua_pop(L, 1);
+        return LUA_OK;
+    }
+
+    yl_chunk_cache_insert(L, source, true);
+    return LUA_OK;
+}
+
+int yl_compile_stream(yl_execution_context_t *ctx, yl_event_record_t *record, FILE *diagnostics)
+{
+    size_t errors = 0;
+
+    if (!record_stream(ctx, record))
+        goto error;
+
+    if (!lua_checkstack(ctx->lua, 20)) {
+        ctx->err.type = YL_MEMORY_ERROR;
+        ctx->err.line = 0;
+        ctx->err.column = 0;
+        ctx->err.context = "While compiling a stream, encountered an error";
+        ctx->err.message = "could not expand Lua stack space";
+        goto error;
+    }
+
+    const yaml_event_t *event;
+    while ((event = yl_replay_event_borrowed(record)) != NULL) {
+        size_t index = record->index - 1;
+        char *tag = NULL;
+        bool quoted = false;
+
+        switch (event->type) {
+        case YAML_SCALAR_EVENT:
+            tag = (char *)event->data.scalar.tag;
+            quoted = event->data.scalar.style == YAML_SINGLE_QUOTED_SCALAR_STYLE ||
+                     event->data.scalar.style == YAML_DOUBLE_QUOTED_SCALAR_STYLE;
+            break;
+        case YAML_SEQUENCE_START_EVENT:
+            tag = (char *)event->data.sequence_start.tag;
+            break;
+        case YAML_MAPPING_START_EVENT:
+            tag = (char *)event->data.mapping_start.tag;
+            break;
+        default:
+            break;
+        }
+
+        if (!tag || tag[0] != '!' || tag[1] == '!')
+            continue;
+
+        int status = LUA_OK;
+        if (tag[1] != '\0') {
+            // Tag functions are looked up as globals first, and only compiled otherwise.
+            int type = lua_getglobal(ctx->lua, tag + 1);
+            lua_pop(ctx->lua, 1);
+            if (type == LUA_TNIL)
+                status = compile_event(ctx->lua, record, index, tag + 1, false, diagnostics);
+        } else if (event->type == YAML_SCALAR_EVENT && !quoted) {
+            status = compile_event(ctx->lua, record, index, (char *)event->data.scalar.value, true, diagnostics);
+        }
+
+        if (status != LUA_OK)
+            ++errors;
+    }
+
+    if (errors) {
+        ctx->err.type = YL_SYNTAX_ERROR;
+        ctx->err.line = 0;
+        ctx->err.column = 0;
+        ctx->err.context = "While compiling a stream, encountered errors";
+        ctx->err.message = lua_pushfstring(ctx->lua, "%d expression(s) failed to compile", (int)errors);
+        goto error;
+    }
+
+    record->index = 0; // Replay from the start.
+    return 1;
+
+error:
+    yl_event_record_delete(record);
+    return 0;
+}
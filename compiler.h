@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdio.h>
+
+#include "event.h"
+#include "executor.h"
+
+/**
+ * Read a whole stream and compile it ahead of execution.
+ *
+ * Every event is recorded from the producer. Then each `!` expression and each
+ * tag function name is compiled, and the function is pinned in the chunk cache,
+ * so executing the recorded stream never calls the Lua compiler. Expressions
+ * that read no variables and produce a scalar are evaluated once and folded into
+ * a literal scalar.
+ *
+ * All syntax errors are reported, each with its line and column, before the
+ * function returns, so nothing is rendered from a stream that can't compile.
+ *
+ * @param[in,out]   ctx         The execution context; its producer is read to the
+ *                              end of the stream and its Lua state compiles.
+ * @param[out]      record      Receives the compiled stream, to be replayed with
+ *                              yl_replay_event().
+ * @param[in]       diagnostics Where to report each syntax error.
+ *
+ * @returns On success, returns @c 1. On failure, returns @c 0; if any expression
+ * failed to compile, @c ctx->err summarizes how many.
+ */
+int yl_compile_stream(yl_execution_context_t *ctx, yl_event_record_t *record, FILE *diagnostics);
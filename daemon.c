@@ -0,0 +1,598 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "lua.h"
+
+#include "allocator.h"
+#include "budget.h"
+#include "chunk_cache.h"
+#include "daemon.h"
+#include "emitter.h"
+#include "environment.h"
+#include "executor.h"
+#include "json.h"
+#include "pool.h"
+#include "timing.h"
+#include "writer.h"
+
+typedef struct _yl_daemon_s {
+    const yl_daemon_options_t *options;
+    lua_State **states; // One per worker, created on its first request.
+    size_t nworkers;
+
+    int wake[2]; // Workers write to it when they hand a connection back.
+
+    pthread_mutex_t lock;
+    double latencies[YL_DAEMON_LATENCY_WINDOW]; // A ring of the latest requests' seconds.
+    size_t requests;
+} yl_daemon_t;
+
+typedef struct _yl_daemon_connection_s {
+    yl_daemon_t *daemon;
+    int fd;
+
+    yl_daemon_request_t request;
+    unsigned char *data; // The template, once the request header is read.
+    size_t received;     // Bytes of the header and template read so far.
+    double last_read;    // When bytes last arrived, for YL_DAEMON_TIMEOUT.
+    double start;        // When the request was complete.
+
+    // Guarded by the daemon's lock.
+    bool busy;    // A worker has the request; the accepting thread leaves it alone.
+    bool closing; // The connection is done with, e.g. the response couldn't be sent.
+} yl_daemon_connection_t;
+
+static volatile sig_atomic_t stopping = 0;
+
+static void stop(int signal)
+{
+    (void)signal; // Unused.
+    stopping = 1;
+}
+
+/**
+ * Read exactly @p length bytes.
+ *
+ * @returns @c 1 on success, @c 0 on end of file before any byte was read, and
+ * @c -1 on errors and truncated reads.
+ */
+static int read_full(int fd, void *buffer, size_t length)
+{
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = read(fd, (char *)buffer + done, length - done);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return n == 0 && done == 0 ? 0 : -1;
+        done += n;
+    }
+    return 1;
+}
+
+static int write_full(int fd, const void *buffer, size_t length)
+{
+    size_t done = 0;
+    while (done < length) {
+        ssize_t n = send(fd, (const char *)buffer + done, length - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return 0;
+        done += n;
+    }
+    return 1;
+}
+
+static int send_response(int fd, int status, const char *output, size_t length, const char *report)
+{
+    size_t report_length = strlen(report);
+    yl_daemon_response_t response = {(uint32_t)status, (uint32_t)report_length, length};
+    return write_full(fd, &response, sizeof(response)) &&
+           write_full(fd, output, length) &&
+           write_full(fd, report, report_length);
+}
+
+static int compare_doubles(const void *left, const void *right)
+{
+    double l = *(const double *)left, r = *(const double *)right;
+    return (l > r) - (l < r);
+}
+
+/**
+ * Format the latency percentiles of the latest requests.
+ */
+static void latency_report(yl_daemon_t *daemon, char *report, size_t size)
+{
+    double sorted[YL_DAEMON_LATENCY_WINDOW];
+
+    pthread_mutex_lock(&daemon->lock);
+    size_t requests = daemon->requests;
+    size_t n = requests < YL_DAEMON_LATENCY_WINDOW ? requests : YL_DAEMON_LATENCY_WINDOW;
+    memcpy(sorted, daemon->latencies, n * sizeof(double));
+    pthread_mutex_unlock(&daemon->lock);
+
+    if (n == 0) {
+        snprintf(report, size, "requests: 0\n");
+    } else {
+        qsort(sorted, n, sizeof(double), compare_doubles);
+        // Nearest rank: the smallest latency at least p of the requests are within.
+        double p50 = sorted[(n * 50 + 99) / 100 - 1];
+        double p90 = sorted[(n * 90 + 99) / 100 - 1];
+        double p99 = sorted[(n * 99 + 99) / 100 - 1];
+        snprintf(report, size, "requests: %zu, last %zu: p50 %.3f ms, p90 %.3f ms, p99 %.3f ms, max %.3f ms\n",
+                 requests, n, p50 * 1e3, p90 * 1e3, p99 * 1e3, sorted[n - 1] * 1e3);
+    }
+}
+
+static lua_State *new_state(yl_daemon_t *daemon)
+{
+    lua_State *L = yl_allocator_new_state();
+    if (L == NULL)
+        return NULL;
+    yl_load_safe_libraries(L);
+    yl_budget_set(L, &daemon->options->budget);
+    yl_chunk_cache_set_capacity(L, daemon->options->chunk_cache_size);
+
+    return L;
+}
+
+/**
+ * Render one template on a worker's state, into memory.
+ */
+static int render(lua_State *L, uint32_t flags, const unsigned char *data, size_t length,
+                  char **output, size_t *output_length, char *report, size_t report_size)
+{
+    yl_execution_context_t ctx = {0};
+    yaml_parser_t parser = {0};
+    yaml_emitter_t emitter = {0};
+    yl_writer_t writer = {0};
+    yl_json_writer_t json_writer = {0};
+    int status = 1;
+
+    FILE *file = open_memstream(output, output_length);
+    if (file == NULL) {
+        snprintf(report, report_size, "Error allocating output!\n");
+        return 1;
+    }
+
+    if (!yaml_parser_initialize(&parser)) {
+        snprintf(report, report_size, "Error initializing parser!\n");
+        goto done;
+    }
+    yaml_parser_set_input_string(&parser, data, length);
+    ctx.producer.callback = (yl_event_producer_callback_t *)yl_parser_parse;
+    ctx.producer.data = &parser;
+
+    if (flags & YL_DAEMON_JSON) {
+        if (!yl_json_writer_initialize(&json_writer, file)) {
+            snprintf(report, report_size, "Error initializing JSON writer!\n");
+            goto done;
+        }
+        ctx.consumer = (yl_event_consumer_t){(yl_event_consumer_callback_t *)yl_json_writer_write, &json_writer, true};
+    } else if (flags & YL_DAEMON_NATIVE_WRITER) {
+        if (!yl_writer_initialize(&writer, file)) {
+            snprintf(report, report_size, "Error initializing writer!\n");
+            goto done;
+        }
+        ctx.consumer = (yl_event_consumer_t){(yl_event_consumer_callback_t *)yl_writer_write, &writer, true};
+    } else {
+        if (!yaml_emitter_initialize(&emitter)) {
+            snprintf(report, report_size, "Error initializing emitter!\n");
+            goto done;
+        }
+        yaml_emitter_set_unicode(&emitter, true);
+        yaml_emitter_set_encoding(&emitter, YAML_UTF8_ENCODING);
+        yaml_emitter_set_output_file(&emitter, file);
+        ctx.consumer = (yl_event_consumer_t){(yl_event_consumer_callback_t *)yl_emitter_emit, &emitter, false};
+    }
+
+    ctx.lua = L;
+    ctx.preserve_order = flags & YL_DAEMON_PRESERVE_ORDER;
+
+    // Format the report before clearing the stack, which may hold the message.
+    if (!yl_execute_stream(&ctx)) {
+        snprintf(report, report_size, "Error executing stream!\n%zu:%zu: %s: %s: %s\n",
+                 ctx.err.line + 1,
+                 ctx.err.column + 1,
+                 yl_error_name(ctx.err.type),
+                 ctx.err.context,
+                 ctx.err.message);
+        goto done;
+    }
+    status = 0;
+
+done:
+    yaml_parser_delete(&parser);
+    yaml_emitter_delete(&emitter);
+    yl_writer_delete(&writer);
+    yl_json_writer_delete(&json_writer);
+    if (fclose(file) != 0 && status == 0) {
+        snprintf(report, report_size, "Error writing output!\n");
+        status = 1;
+    }
+    return status;
+}
+
+/**
+ * Read what has arrived of a connection's request, without blocking.
+ *
+ * @returns @c 1 once the request is complete, @c 0 if more is to come, and @c -1
+ * if the connection is to be closed.
+ */
+static int receive_request(yl_daemon_connection_t *connection)
+{
+    const size_t header = sizeof(yl_daemon_request_t);
+    char report[64];
+
+    for (;;) {
+        char *buffer;
+        size_t wanted;
+        if (connection->received < header) {
+            buffer = (char *)&connection->request + connection->received;
+            wanted = header - connection->received;
+        } else {
+            if (connection->data == NULL) {
+                yl_daemon_request_t *request = &connection->request;
+                if (request->magic != YL_DAEMON_MAGIC || request->length > YL_DAEMON_MAX_REQUEST) {
+                    snprintf(report, sizeof(report), "Error: malformed daemon request!\n");
+                    send_response(connection->fd, 1, NULL, 0, report);
+                    return -1;
+                }
+                if ((connection->data = malloc(request->length ? request->length : 1)) == NULL) {
+                    snprintf(report, sizeof(report), "Error allocating request!\n");
+                    send_response(connection->fd, 1, NULL, 0, report);
+                    return -1;
+                }
+            }
+            size_t done = connection->received - header;
+            if (done == connection->request.length)
+                return 1;
+            buffer = (char *)connection->data + done;
+            wanted = connection->request.length - done;
+        }
+
+        ssize_t n = recv(connection->fd, buffer, wanted, MSG_DONTWAIT);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return 0;
+        if (n <= 0)
+            return -1;
+        connection->received += n;
+        connection->last_read = yl_time_now();
+    }
+}
+
+/**
+ * Answer a complete request on a worker, then hand the connection back to the
+ * accepting thread.
+ */
+static void serve_request(yl_daemon_connection_t *connection, size_t worker)
+{
+    yl_daemon_t *daemon = connection->daemon;
+    char report[1024] = "";
+    char *output = NULL;
+    size_t output_length = 0;
+    int sent;
+
+    if (connection->request.flags & YL_DAEMON_STATS) {
+        latency_report(daemon, report, sizeof(report));
+        sent = send_response(connection->fd, 0, report, strlen(report), "");
+    } else {
+        int status = 1;
+        lua_State *L = daemon->states[worker];
+        if (L == NULL && (L = daemon->states[worker] = new_state(daemon)) == NULL) {
+            snprintf(report, sizeof(report), "Error initializing lua!\n");
+        } else {
+            status = render(L, connection->request.flags, connection->data, connection->request.length,
+                            &output, &output_length, report, sizeof(report));
+            lua_settop(L, 0);
+        }
+
+        pthread_mutex_lock(&daemon->lock);
+        daemon->latencies[daemon->requests++ % YL_DAEMON_LATENCY_WINDOW] = yl_time_now() - connection->start;
+        pthread_mutex_unlock(&daemon->lock);
+
+        sent = send_response(connection->fd, status, output, output_length, report);
+        free(output);
+    }
+
+    free(connection->data);
+    connection->data = NULL;
+    connection->received = 0;
+    connection->last_read = yl_time_now();
+
+    pthread_mutex_lock(&daemon->lock);
+    connection->busy = false;
+    connection->closing = !sent;
+    pthread_mutex_unlock(&daemon->lock);
+    // Full just means a wakeup is already pending.
+    while (write(daemon->wake[1], "", 1) < 0 && errno == EINTR)
+        ;
+}
+
+static void close_connection(yl_daemon_connection_t *connection)
+{
+    close(connection->fd);
+    free(connection->data);
+    free(connection);
+}
+
+/**
+ * Accept a client and add it to the open connections. Sending to it times out,
+ * so a client that stops reading can't hold a worker; reading from it never
+ * blocks, and is timed out by the accepting thread.
+ */
+static void accept_connection(yl_daemon_t *daemon, int fd, yl_daemon_connection_t ***connections,
+                              size_t *nconnections, size_t *capacity)
+{
+    int client = accept(fd, NULL, NULL);
+    if (client < 0)
+        return; // Interrupted, or the client already left; errors show on the next poll.
+    fcntl(client, F_SETFD, FD_CLOEXEC);
+
+    struct timeval timeout = {YL_DAEMON_TIMEOUT, 0};
+    setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+
+    if (*nconnections == *capacity) {
+        size_t grown_capacity = *capacity ? *capacity * 2 : 16;
+        yl_daemon_connection_t **grown = realloc(*connections, grown_capacity * sizeof(yl_daemon_connection_t *));
+        if (grown == NULL) {
+            close(client);
+            return;
+        }
+        *connections = grown;
+        *capacity = grown_capacity;
+    }
+    yl_daemon_connection_t *connection = calloc(1, sizeof(yl_daemon_connection_t));
+    if (connection == NULL) {
+        close(client);
+        return;
+    }
+    connection->daemon = daemon;
+    connection->fd = client;
+    connection->last_read = yl_time_now();
+    (*connections)[(*nconnections)++] = connection;
+}
+
+int yl_daemon_serve(const yl_daemon_options_t *options)
+{
+    yl_daemon_t daemon = {.wake = {-1, -1}};
+    yl_pool_t pool = {0};
+    int status = 1, fd = -1;
+    struct sockaddr_un address = {0};
+    sigset_t signals, old_signals;
+    bool bound = false;
+    yl_daemon_connection_t **connections = NULL;
+    size_t nconnections = 0, capacity = 0;
+    struct pollfd *polled = NULL;
+    yl_daemon_connection_t **polled_connections = NULL;
+
+    daemon.options = options;
+    pthread_mutex_init(&daemon.lock, NULL);
+
+    if (pipe(daemon.wake) != 0) {
+        fprintf(options->report, "Error creating a pipe: %s\n", strerror(errno));
+        goto done;
+    }
+    for (int i = 0; i < 2; ++i) {
+        fcntl(daemon.wake[i], F_SETFD, FD_CLOEXEC);
+        fcntl(daemon.wake[i], F_SETFL, O_NONBLOCK);
+    }
+
+    address.sun_family = AF_UNIX;
+    if (strlen(options->socket_path) >= sizeof(address.sun_path)) {
+        fprintf(options->report, "Error: socket path %s is too long!\n", options->socket_path);
+        goto done;
+    }
+    strcpy(address.sun_path, options->socket_path);
+
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        bind(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        fprintf(options->report, "Error binding %s: %s\n", options->socket_path, strerror(errno));
+        goto done;
+    }
+    bound = true;
+    if (listen(fd, SOMAXCONN) != 0) {
+        fprintf(options->report, "Error listening on %s: %s\n", options->socket_path, strerror(errno));
+        goto done;
+    }
+
+    // Only the accepting thread handles the signals, so they interrupt accept().
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, &old_signals);
+    daemon.nworkers = options->jobs ? options->jobs : yl_pool_default_size();
+    daemon.states = calloc(daemon.nworkers, sizeof(lua_State *));
+    bool started = daemon.states != NULL && yl_pool_initialize(&pool, daemon.nworkers);
+    pthread_sigmask(SIG_SETMASK, &old_signals, NULL);
+    if (!started) {
+        fprintf(options->report, "Error starting worker threads!\n");
+        goto done;
+    }
+
+    struct sigaction action = {0};
+    action.sa_handler = stop;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+
+    while (!stopping) {
+        // Closed and timed out connections are dropped; the rest that no worker
+        // has are polled for their next request.
+        size_t npolled = 2;
+        struct pollfd *grown_polled = realloc(polled, (nconnections + 2) * sizeof(struct pollfd));
+        yl_daemon_connection_t **grown_connections =
+            realloc(polled_connections, (nconnections + 2) * sizeof(yl_daemon_connection_t *));
+        if (grown_polled != NULL)
+            polled = grown_polled;
+        if (grown_connections != NULL)
+            polled_connections = grown_connections;
+        if (grown_polled == NULL || grown_connections == NULL) {
+            fprintf(options->report, "Error allocating connections!\n");
+            break;
+        }
+        polled[0] = (struct pollfd){fd, POLLIN, 0};
+        polled[1] = (struct pollfd){daemon.wake[0], POLLIN, 0};
+
+        double now = yl_time_now();
+        size_t kept = 0;
+        pthread_mutex_lock(&daemon.lock);
+        for (size_t i = 0; i < nconnections; ++i) {
+            yl_daemon_connection_t *connection = connections[i];
+            if (!connection->busy && (connection->closing || now - connection->last_read > YL_DAEMON_TIMEOUT)) {
+                close_connection(connection);
+                continue;
+            }
+            connections[kept++] = connection;
+            if (!connection->busy) {
+                polled_connections[npolled] = connection;
+                polled[npolled++] = (struct pollfd){connection->fd, POLLIN, 0};
+            }
+        }
+        nconnections = kept;
+        pthread_mutex_unlock(&daemon.lock);
+
+        // Wake up every second, to time out silent connections.
+        if (poll(polled, npolled, 1000) < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(options->report, "Error polling %s: %s\n", options->socket_path, strerror(errno));
+            break;
+        }
+
+        if (polled[1].revents) {
+            char buffer[64];
+            while (read(daemon.wake[0], buffer, sizeof(buffer)) > 0)
+                ;
+        }
+        for (size_t i = 2; i < npolled; ++i) {
+            if (!polled[i].revents)
+                continue;
+            yl_daemon_connection_t *connection = polled_connections[i];
+            int received = receive_request(connection);
+            if (received == 1) {
+                connection->start = yl_time_now();
+                connection->busy = true;
+                received = yl_pool_submit(&pool, (yl_pool_task_callback_t *)serve_request, connection) ? 1 : -1;
+                if (received == -1)
+                    connection->busy = false;
+            }
+            if (received == -1)
+                connection->closing = true;
+        }
+        if (polled[0].revents)
+            accept_connection(&daemon, fd, &connections, &nconnections, &capacity);
+    }
+    status = stopping ? 0 : 1;
+
+    char report[256];
+    latency_report(&daemon, report, sizeof(report));
+    fputs(report, options->report);
+
+done:
+    if (fd >= 0)
+        close(fd);
+    if (bound)
+        unlink(options->socket_path);
+    // Workers still sending to a client give up once its connection is shut down.
+    for (size_t i = 0; i < nconnections; ++i)
+        shutdown(connections[i]->fd, SHUT_RDWR);
+    // Wait for the requests being rendered before closing their states.
+    yl_pool_delete(&pool);
+    for (size_t i = 0; i < nconnections; ++i)
+        close_connection(connections[i]);
+    free(connections);
+    free(polled);
+    free(polled_connections);
+    for (int i = 0; i < 2; ++i)
+        if (daemon.wake[i] >= 0)
+            close(daemon.wake[i]);
+    if (daemon.states != NULL)
+        for (size_t i = 0; i < daemon.nworkers; ++i)
+            if (daemon.states[i] != NULL)
+                yl_allocator_close_state(daemon.states[i]);
+    free(daemon.states);
+    pthread_mutex_destroy(&daemon.lock);
+    return status;
+}
+
+int yl_daemon_request(const char *socket_path, uint32_t flags, FILE *input, FILE *output, FILE *report)
+{
+    int status = 1, fd = -1;
+    char *data = NULL, *received = NULL;
+    size_t length = 0, capacity = 0;
+    struct sockaddr_un address = {0};
+
+    if (!(flags & YL_DAEMON_STATS)) {
+        for (;;) {
+            if (length == capacity) {
+                size_t new_capacity = capacity ? capacity * 2 : 65536;
+                char *grown = realloc(data, new_capacity);
+                if (grown == NULL) {
+                    fprintf(report, "Error allocating input!\n");
+                    goto done;
+                }
+                data = grown;
+                capacity = new_capacity;
+            }
+            size_t n = fread(data + length, 1, capacity - length, input);
+            length += n;
+            if (n == 0)
+                break;
+        }
+        if (ferror(input)) {
+            fprintf(report, "Error reading input file: %s\n", strerror(errno));
+            goto done;
+        }
+    }
+
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        fprintf(report, "Error: socket path %s is too long!\n", socket_path);
+        goto done;
+    }
+    strcpy(address.sun_path, socket_path);
+    if ((fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0 ||
+        connect(fd, (struct sockaddr *)&address, sizeof(address)) != 0) {
+        fprintf(report, "Error connecting to %s: %s\n", socket_path, strerror(errno));
+        goto done;
+    }
+
+    yl_daemon_request_t request = {YL_DAEMON_MAGIC, flags, length};
+    yl_daemon_response_t response;
+    if (!write_full(fd, &request, sizeof(request)) || !write_full(fd, data, length) ||
+        read_full(fd, &response, sizeof(response)) != 1) {
+        fprintf(report, "Error talking to %s: %s\n", socket_path, errno ? strerror(errno) : "connection closed");
+        goto done;
+    }
+    if ((received = malloc(response.length + response.report_length + 1)) == NULL) {
+        fprintf(report, "Error allocating output!\n");
+        goto done;
+    }
+    if (read_full(fd, received, response.length + response.report_length) == -1) {
+        fprintf(report, "Error talking to %s: connection closed\n", socket_path);
+        goto done;
+    }
+
+    fwrite(received, 1, response.length, output);
+    fwrite(received + response.length, 1, response.report_length, report);
+    status = fflush(output) == 0 ? (int)response.status : 1;
+
+done:
+    if (fd >= 0)
+        close(fd);
+    free(data);
+    free(received);
+    return status;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "budget.h"
+
+#define YL_DAEMON_MAGIC 0x796c6401 // "yld" and the protocol version.
+
+// The largest template a daemon accepts in one request.
+#define YL_DAEMON_MAX_REQUEST ((uint64_t)256 << 20)
+
+// Seconds a client may stay silent, between requests or partway through one,
+// before its connection is closed; also how long sending a response may block.
+#define YL_DAEMON_TIMEOUT 10
+
+// How many of the latest requests latency percentiles are computed over.
+#define YL_DAEMON_LATENCY_WINDOW 4096
+
+// Request flags, mirroring the command line options of the same names.
+#define YL_DAEMON_JSON 0x1
+#define YL_DAEMON_NATIVE_WRITER 0x2
+#define YL_DAEMON_PRESERVE_ORDER 0x4
+// Ask for the latency report instead of rendering; the request has no template.
+#define YL_DAEMON_STATS 0x8
+
+/**
+ * A request, followed by @c length bytes of template. Both ends run on the same
+ * host, so integers are in native byte order.
+ */
+typedef struct _yl_daemon_request_s {
+    uint32_t magic;
+    uint32_t flags;
+    uint64_t length;
+} yl_daemon_request_t;
+
+/**
+ * A response, followed by @c length bytes of output and @c report_length bytes
+ * for stderr.
+ */
+typedef struct _yl_daemon_response_s {
+    uint32_t status; // Process-style exit status.
+    uint32_t report_length;
+    uint64_t length;
+} yl_daemon_response_t;
+
+typedef struct _yl_daemon_options_s {
+    const char *socket_path;
+    size_t jobs; // Worker threads, each with its own Lua state; 0 for one per processor.
+    long chunk_cache_size;
+    yl_budget_t budget; // Of each expression, whatever the client asks for.
+    FILE *report;       // Receives startup errors and the final latency report.
+} yl_daemon_options_t;
+
+/**
+ * Serve render requests on a Unix domain socket until SIGINT or SIGTERM.
+ *
+ * Requests are read by the accepting thread, which polls every open connection,
+ * and only rendering them is handed to a pool of workers, so idle clients don't
+ * hold a worker. Each worker keeps one sandboxed Lua state for its whole life, so
+ * requests skip creating a state, loading the libraries and compiling expressions
+ * they have in common with earlier requests.
+ * The template is parsed from, and the output written to, memory. As in any
+ * render, the globals a document sets are dropped when it ends.
+ *
+ * @param[in]       options     The socket path and render settings.
+ *
+ * @returns On a clean shutdown, returns @c 0. If the socket can't be set up,
+ * returns @c 1.
+ */
+int yl_daemon_serve(const yl_daemon_options_t *options);
+
+/**
+ * Render a template on a daemon, as if it had been rendered in this process:
+ * the output goes to @p output, errors to @p report, and the exit status is
+ * returned.
+ *
+ * @param[in]       socket_path The daemon's socket.
+ * @param[in]       flags       YL_DAEMON_* flags.
+ * @param[in,out]   input       The template, read to its end. Unused with
+ *                              YL_DAEMON_STATS.
+ * @param[in,out]   output      Receives the rendered stream.
+ * @param[in,out]   report      Receives errors.
+ *
+ * @returns The exit status of the render, or @c 1 if the daemon couldn't be
+ * reached.
+ */
+int yl_daemon_request(const char *socket_path, uint32_t flags, FILE *input, FILE *output, FILE *report);
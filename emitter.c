@@ -0,0 +1,23 @@
+#include "emitter.h"
+
+int yl_emitter_emit(yaml_emitter_t *emitter, yaml_event_t *event, lua_State *L, yl_error_t *err)
+{
+    (void)L;
+
+    if (!yaml_emitter_emit(emitter, event))
+        goto error;
+
+    // Mark the event as consumed to prevent double free.
+    *event = (yaml_event_t){0};
+    return 1;
+
+error:
+    // Mark the event as consumed to prevent double free.
+    *event = (yaml_event_t){0};
+    err->type = (yl_error_type_t)emitter->error;
+    err->line = emitter->line;
+    err->column = emitter->column;
+    err->context = "While emitting YAML, encountered error";
+    err->message = emitter->problem;
+    return 0;
+}
@@ -0,0 +1,11 @@
+#pragma once
+
+#include "lua.h"
+#include "yaml.h"
+
+#include "error.h"
+
+/**
+ * Event consumer that writes events through a libyaml emitter.
+ */
+int yl_emitter_emit(yaml_emitter_t *emitter, yaml_event_t *event, lua_State *L, yl_error_t *err);
@@ -4,6 +4,256 @@
 #include "lualib.h"
 
 #include "environment.h"
+#include "lua_helpers.h"
+#include "state.h"
+
+/*
+ * The registry holds the set of metatables that make a table a view of another:
+ * the globals' metatable, whose __index is the frozen base, and those of the
+ * library views, whose __index is the library.
+ */
+static const char yl_frozen_key = 0;
+
+/*
+ * The registry holds a list of the library views, whose own fields are the ones
+ * a document set, to clear them for the next document.
+ */
+static const char yl_views_key = 0;
+
+static void push_frozen(lua_State *L)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &yl_frozen_key) == LUA_TTABLE)
+        return;
+
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &yl_frozen_key);
+}
+
+/**
+ * Whether the table at the index is a view made by yl_load_safe_libraries(). If
+ * it is, pushes its target.
+ */
+static bool push_target(lua_State *L, int index)
+{
+    if (!lua_getmetatable(L, index))
+        return false;
+
+    // Look the set up without creating it, so states without views stay untouched.
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &yl_frozen_key);
+    lua_pushvalue(L, -2);
+    bool frozen = lua_type(L, -2) == LUA_TTABLE && lua_rawget(L, -2) != LUA_TNIL;
+    lua_pop(L, 2);
+    if (frozen) {
+        lua_pushliteral(L, "__index");
+        lua_rawget(L, -2);
+    }
+    lua_remove(L, frozen ? -2 : -1);
+    return frozen;
+}
+
+/**
+ * Like next(), but a view has the fields of its target that it doesn't shadow:
+ * its own fields come first, then those of the target.
+ */
+static int view_next(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 2);
+    if (!push_target(L, 1)) {
+        if (lua_next(L, 1))
+            return 2;
+        lua_pushnil(L);
+        return 1;
+    }
+
+    // A key not in the target is one of the view's own, even if it was just cleared.
+    bool own = lua_isnil(L, 2);
+    if (!own) {
+        lua_pushvalue(L, 2);
+        own = lua_rawget(L, 1) != LUA_TNIL;
+        lua_pop(L, 1);
+    }
+    if (!own) {
+        lua_pushvalue(L, 2);
+        own = lua_rawget(L, 3) == LUA_TNIL;
+        lua_pop(L, 1);
+    }
+
+    lua_pushvalue(L, 2);
+    if (own) {
+        if (lua_next(L, 1))
+            return 2;
+        lua_pushnil(L); // Start on the target.
+    }
+    while (lua_next(L, 3)) {
+        lua_pushvalue(L, -2);
+        if (lua_rawget(L, 1) == LUA_TNIL) {
+            lua_pop(L, 1);
+            return 2;
+        }
+        lua_pop(L, 2);
+    }
+    lua_pushnil(L);
+    return 1;
+}
+
+/**
+ * Iterate with view_next(), which takes the view itself, so the template never
+ * gets hold of the target.
+ */
+static int view_pairs(lua_State *L)
+{
+    lua_pushcfunction(L, view_next);
+    lua_pushvalue(L, 1);
+    lua_pushnil(L);
+    return 3;
+}
+
+static int view_rawget(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checkany(L, 2);
+    lua_settop(L, 2);
+    yl_environment_rawget(L, 1);
+    return 1;
+}
+
+/**
+ * Set a field a view doesn't have of its own. The generation is bumped, so what
+ * was found in the base is looked up again: see yl_tag_call().
+ */
+static int view_newindex(lua_State *L)
+{
+    lua_settop(L, 3);
+    lua_rawset(L, 1);
+    ++yl_state(L)->generation;
+    return 0;
+}
+
+/**
+ * Like rawset(), but bumps the generation like view_newindex(), which it goes
+ * around.
+ */
+static int view_rawset(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    luaL_checkany(L, 2);
+    luaL_checkany(L, 3);
+    lua_settop(L, 3);
+    lua_rawset(L, 1);
+    ++yl_state(L)->generation;
+    return 1;
+}
+
+/**
+ * Mark a view's metatable, on the top of the stack, as one.
+ */
+static void add_frozen(lua_State *L)
+{
+    push_frozen(L);
+    lua_pushvalue(L, -2);
+    lua_pushboolean(L, true);
+    lua_rawset(L, -3);
+    lua_pop(L, 1);
+}
+
+/**
+ * Replace the library table in the given field of the base by a view of it, where
+ * a document's own fields go.
+ */
+static void freeze_library(lua_State *L, int base, const char *name)
+{
+    lua_newtable(L);
+    lua_createtable(L, 0, 4);
+    lua_getfield(L, base, name);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, view_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, view_pairs);
+    lua_setfield(L, -2, "__pairs");
+    lua_pushboolean(L, false);
+    lua_setfield(L, -2, "__metatable");
+    add_frozen(L);
+    lua_setmetatable(L, -2);
+
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &yl_views_key) != LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_newtable(L);
+        lua_pushvalue(L, -1);
+        lua_rawsetp(L, LUA_REGISTRYINDEX, &yl_views_key);
+    }
+    lua_pushvalue(L, -2);
+    lua_rawseti(L, -2, (lua_Integer)lua_rawlen(L, -2) + 1);
+    lua_pop(L, 1);
+
+    lua_setfield(L, base, name);
+}
+
+/**
+ * Move every global into a frozen base table that the globals only fall back on,
+ * so what a document sets stays in the globals table itself.
+ */
+static void freeze_globals(lua_State *L)
+{
+    lua_pushglobaltable(L);
+    int globals = lua_gettop(L);
+    lua_newtable(L);
+    int base = lua_gettop(L);
+
+    lua_pushnil(L);
+    while (lua_next(L, globals)) {
+        lua_pushvalue(L, -2);
+        lua_insert(L, -2);
+        lua_rawset(L, base);
+    }
+    lua_pushnil(L);
+    while (lua_next(L, base)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, globals);
+    }
+
+    freeze_library(L, base, LUA_TABLIBNAME);
+    freeze_library(L, base, LUA_STRLIBNAME);
+    freeze_library(L, base, LUA_MATHLIBNAME);
+    freeze_library(L, base, LUA_UTF8LIBNAME);
+
+    // Strings index the string view instead of the library, so methods a document
+    // adds work on strings too, and the library stays hidden behind the metatable.
+    lua_pushliteral(L, "");
+    lua_getmetatable(L, -1);
+    lua_getfield(L, base, LUA_STRLIBNAME);
+    lua_setfield(L, -2, "__index");
+    lua_pushboolean(L, false);
+    lua_setfield(L, -2, "__metatable");
+    lua_pop(L, 2);
+
+    // next() and rawget() see through the views, so the globals and libraries
+    // look like plain tables to templates.
+    lua_pushcfunction(L, view_next);
+    lua_setfield(L, base, "next");
+    lua_pushcfunction(L, view_rawget);
+    lua_setfield(L, base, "rawget");
+    lua_pushcfunction(L, view_rawset);
+    lua_setfield(L, base, "rawset");
+
+    lua_createtable(L, 0, 4);
+    lua_pushvalue(L, base);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, view_newindex);
+    lua_setfield(L, -2, "__newindex");
+    lua_pushcfunction(L, view_pairs);
+    lua_setfield(L, -2, "__pairs");
+    lua_pushboolean(L, false);
+    lua_setfield(L, -2, "__metatable");
+    add_frozen(L);
+    lua_setmetatable(L, globals);
+
+    lua_settop(L, globals - 1);
+}
 
 void yl_load_safe_libraries(lua_State *L)
 {
@@ -23,5 +273,66 @@ void yl_load_safe_libraries(lua_State *L)
     lua_setfield(L, 1, "loadfile");
     lua_pushnil(L);
     lua_setfield(L, 1, "require");
+    // Helpers to mark how tables render.
+    lua_pushcfunction(L, yl_lua_sequence);
+    lua_setfield(L, 1, "sequence");
+    lua_pushcfunction(L, yl_lua_mapping);
+    lua_setfield(L, 1, "mapping");
     lua_settop(L, 0);
+
+    freeze_globals(L);
+}
+
+/**
+ * Remove every field of the table on the top of the stack, and pop it.
+ */
+static void clear_table(lua_State *L)
+{
+    // Clearing fields is allowed while traversing.
+    lua_pushnil(L);
+    while (lua_next(L, -2)) {
+        lua_pop(L, 1);
+        lua_pushvalue(L, -1);
+        lua_pushnil(L);
+        lua_rawset(L, -4);
+    }
+    lua_pop(L, 1);
+}
+
+void yl_environment_reset(lua_State *L)
+{
+    lua_pushglobaltable(L);
+    if (!push_target(L, -1)) {
+        lua_pop(L, 1);
+        return;
+    }
+    lua_pop(L, 1);
+    clear_table(L);
+
+    // The views are empty, unless a document set fields on them.
+    lua_rawgetp(L, LUA_REGISTRYINDEX, &yl_views_key);
+    lua_Integer n = (lua_Integer)lua_rawlen(L, -1);
+    for (lua_Integer i = 1; i <= n; ++i) {
+        lua_rawgeti(L, -1, i);
+        clear_table(L);
+    }
+    lua_pop(L, 1);
+}
+
+int yl_environment_rawget(lua_State *L, int index)
+{
+    index = lua_absindex(L, index);
+    lua_pushvalue(L, -1);
+    int type = lua_rawget(L, index);
+    if (type != LUA_TNIL || !push_target(L, index)) {
+        lua_remove(L, -2);
+        return type;
+    }
+
+    // key, nil, target
+    lua_replace(L, -2);
+    lua_insert(L, -2);
+    type = lua_rawget(L, -2);
+    lua_remove(L, -2);
+    return type;
 }
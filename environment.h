@@ -2,4 +2,32 @@
 
 #include "lua.h"
 
+/**
+ * Load the libraries templates may use into a new state, and freeze them as the
+ * base environment.
+ *
+ * The globals table is left empty, falling back on the base for reads, so the
+ * globals a document sets live in the globals table alone and can be dropped by
+ * yl_environment_reset(). Library tables are replaced by views of the same kind,
+ * where the fields a document sets go. pairs(), next() and rawget() see through
+ * the views, so they behave like the tables they stand for, except that a field
+ * of the base can be shadowed, but not removed. Setting a field the globals or a
+ * view doesn't have yet, or any field with rawset(), bumps the generation in
+ * yl_state().
+ */
 void yl_load_safe_libraries(lua_State *L);
+
+/**
+ * Drop every global set since the base was frozen, and any field set on a
+ * library view, for the next document. Does nothing on a state
+ * yl_load_safe_libraries() hasn't frozen.
+ */
+void yl_environment_reset(lua_State *L);
+
+/**
+ * Like lua_rawget(), but sees through the views made by yl_load_safe_libraries():
+ * a field missing from the globals or a library view is looked up in its target.
+ *
+ * @returns The type of the value pushed.
+ */
+int yl_environment_rawget(lua_State *L, int index);
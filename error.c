@@ -18,6 +18,7 @@ const char *yaml_error_names[] = {
     "TYPE_ERROR",
     "RENDER_ERROR",
     "ASSERTION_ERROR",
+    "BUDGET_ERROR",
 };
 
 const char *yl_error_name(yl_error_type_t error_type)
@@ -38,6 +39,8 @@ yl_error_type_t yl_error_from_lua_error(int status)
         return YL_MEMORY_ERROR;
     case LUA_ERRERR:
         return YL_ERROR_HANDLER_ERROR;
+    case YL_LUA_ERRBUDGET:
+        return YL_BUDGET_ERROR;
     default:
         return YL_EXECUTION_ERROR;
     }
@@ -23,8 +23,12 @@ typedef enum _yl_error_type_e {
     YL_TYPE_ERROR,
     YL_RENDER_ERROR,
     YL_ASSERTION_ERROR,
+    YL_BUDGET_ERROR,
 } yl_error_type_t;
 
+// Status returned instead of a Lua status when an expression runs out of budget.
+#define YL_LUA_ERRBUDGET (LUA_ERRERR + 16)
+
 typedef struct _yl_error_s {
     yl_error_type_t type;
 
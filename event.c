@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <string.h>
 
 #include "event.h"
@@ -17,42 +18,54 @@ const char *yl_event_names[] = {
     "MAPPING_END_EVENT",
 };
 
-int yl_copy_event(yaml_event_t *original, yaml_event_t *copy)
+int yl_copy_event(const yaml_event_t *original, yaml_event_t *copy)
 {
+    int ok;
+
     switch (original->type) {
     case YAML_DOCUMENT_START_EVENT:
-        return yaml_document_start_event_initialize(copy,
-                                                    original->data.document_start.version_directive,
-                                                    original->data.document_start.tag_directives.start,
-                                                    original->data.document_start.tag_directives.end,
-                                                    original->data.document_start.implicit);
+        ok = yaml_document_start_event_initialize(copy,
+                                                  original->data.document_start.version_directive,
+                                                  original->data.document_start.tag_directives.start,
+                                                  original->data.document_start.tag_directives.end,
+                                                  original->data.document_start.implicit);
+        break;
     case YAML_ALIAS_EVENT:
-        return yaml_alias_event_initialize(copy, original->data.alias.anchor);
+        ok = yaml_alias_event_initialize(copy, original->data.alias.anchor);
+        break;
     case YAML_SCALAR_EVENT:
-        return yaml_scalar_event_initialize(copy,
-                                            original->data.scalar.anchor,
-                                            original->data.scalar.tag,
-                                            original->data.scalar.value,
-                                            original->data.scalar.length,
-                                            original->data.scalar.plain_implicit,
-                                            original->data.scalar.quoted_implicit,
-                                            original->data.scalar.style);
+        ok = yaml_scalar_event_initialize(copy,
+                                          original->data.scalar.anchor,
+                                          original->data.scalar.tag,
+                                          original->data.scalar.value,
+                                          original->data.scalar.length,
+                                          original->data.scalar.plain_implicit,
+                                          original->data.scalar.quoted_implicit,
+                                          original->data.scalar.style);
+        break;
     case YAML_SEQUENCE_START_EVENT:
-        return yaml_sequence_start_event_initialize(copy,
-                                                    original->data.sequence_start.anchor,
-                                                    original->data.sequence_start.tag,
-                                                    original->data.sequence_start.implicit,
-                                                    original->data.sequence_start.style);
+        ok = yaml_sequence_start_event_initialize(copy,
+                                                  original->data.sequence_start.anchor,
+                                                  original->data.sequence_start.tag,
+                                                  original->data.sequence_start.implicit,
+                                                  original->data.sequence_start.style);
+        break;
     case YAML_MAPPING_START_EVENT:
-        return yaml_mapping_start_event_initialize(copy,
-                                                   original->data.mapping_start.anchor,
-                                                   original->data.mapping_start.tag,
-                                                   original->data.mapping_start.implicit,
-                                                   original->data.mapping_start.style);
+        ok = yaml_mapping_start_event_initialize(copy,
+                                                 original->data.mapping_start.anchor,
+                                                 original->data.mapping_start.tag,
+                                                 original->data.mapping_start.implicit,
+                                                 original->data.mapping_start.style);
+        break;
     default:
         *copy = *original; // No need to copy internal fields.
         return 1;
     }
+
+    // Keep the source position, so errors in replayed events point at the template.
+    copy->start_mark = original->start_mark;
+    copy->end_mark = original->end_mark;
+    return ok;
 }
 
 const char *yl_event_name(yaml_event_type_t event_type)
@@ -60,6 +73,178 @@ const char *yl_event_name(yaml_event_type_t event_type)
     return yl_event_names[event_type];
 }
 
+#define ARENA_MIN_BLOCK 4096
+#define ARENA_ALIGN sizeof(size_t)
+
+struct _yl_arena_block_s {
+    struct _yl_arena_block_s *next;
+    size_t capacity;
+    size_t used;
+    unsigned char data[];
+};
+
+static void *arena_alloc(yl_event_record_t *event_record, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+    yl_arena_block_t *block = event_record->arena;
+    if (block == NULL || block->capacity - block->used < size) {
+        size_t capacity = block ? block->capacity << 1 : ARENA_MIN_BLOCK;
+        while (capacity < size)
+            capacity <<= 1;
+
+        if ((block = malloc(sizeof(yl_arena_block_t) + capacity)) == NULL)
+            return NULL;
+        block->next = event_record->arena;
+        block->capacity = capacity;
+        block->used = 0;
+        event_record->arena = block;
+    }
+
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+static size_t hash_string(const unsigned char *string, size_t length)
+{
+    size_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; ++i) {
+        hash ^= string[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+/**
+ * Copy a string into the arena, or find the copy made earlier. Interned strings
+ * are stored after their length, and NUL terminated.
+ */
+static yaml_char_t *intern_string(yl_event_record_t *event_record, const yaml_char_t *string, size_t length)
+{
+    if (string == NULL)
+        return NULL;
+
+    // Keep the table at most half full.
+    if ((event_record->nstrings + 1) * 2 > event_record->strings_capacity) {
+        size_t capacity = event_record->strings_capacity ? event_record->strings_capacity << 1 : 64;
+        yl_interned_string_t *strings = calloc(capacity, sizeof(yl_interned_string_t));
+        if (strings == NULL)
+            return NULL;
+
+        for (size_t i = 0; i < event_record->strings_capacity; ++i) {
+            yl_interned_string_t *old = &event_record->strings[i];
+            if (old->string == NULL)
+                continue;
+            size_t j = old->hash & (capacity - 1);
+            while (strings[j].string != NULL)
+                j = (j + 1) & (capacity - 1);
+            strings[j] = *old;
+        }
+
+        free(event_record->strings);
+        event_record->strings = strings;
+        event_record->strings_capacity = capacity;
+    }
+
+    size_t hash = hash_string(string, length);
+    size_t mask = event_record->strings_capacity - 1;
+    size_t i = hash & mask;
+    for (; event_record->strings[i].string != NULL; i = (i + 1) & mask) {
+        yl_interned_string_t *candidate = &event_record->strings[i];
+        if (candidate->hash == hash &&
+            ((size_t *)candidate->string)[-1] == length &&
+            memcmp(candidate->string, string, length) == 0)
+            return candidate->string;
+    }
+
+    size_t *stored = arena_alloc(event_record, sizeof(size_t) + length + 1);
+    if (stored == NULL)
+        return NULL;
+    *stored = length;
+    yaml_char_t *copy = (yaml_char_t *)(stored + 1);
+    memcpy(copy, string, length);
+    copy[length] = '\0';
+
+    event_record->strings[i] = (yl_interned_string_t){hash, copy};
+    ++event_record->nstrings;
+    return copy;
+}
+
+#define INTERN(field) \
+    ((field) == NULL || ((field) = intern_string(event_record, (field), strlen((char *)(field)))) != NULL)
+
+/**
+ * Rewrite the strings of a copied event to point into the arena.
+ *
+ * @returns 1 on success, 0 if memory ran out.
+ */
+static int intern_event(yl_event_record_t *event_record, yaml_event_t *event)
+{
+    switch (event->type) {
+    case YAML_DOCUMENT_START_EVENT: {
+        yaml_version_directive_t *version = event->data.document_start.version_directive;
+        if (version != NULL) {
+            if ((event->data.document_start.version_directive = arena_alloc(event_record, sizeof(*version))) == NULL)
+                return 0;
+            *event->data.document_start.version_directive = *version;
+        }
+
+        yaml_tag_directive_t *start = event->data.document_start.tag_directives.start;
+        yaml_tag_directive_t *end = event->data.document_start.tag_directives.end;
+        if (start != end) {
+            yaml_tag_directive_t *directives = arena_alloc(event_record, (end - start) * sizeof(*start));
+            if (directives == NULL)
+                return 0;
+            for (yaml_tag_directive_t *directive = start; directive != end; ++directive) {
+                yaml_tag_directive_t *copy = &directives[directive - start];
+                *copy = *directive;
+                if (!INTERN(copy->handle) || !INTERN(copy->prefix))
+                    return 0;
+            }
+            event->data.document_start.tag_directives.start = directives;
+            event->data.document_start.tag_directives.end = directives + (end - start);
+        }
+        return 1;
+    }
+    case YAML_ALIAS_EVENT:
+        return INTERN(event->data.alias.anchor);
+    case YAML_SCALAR_EVENT:
+        if (!INTERN(event->data.scalar.anchor) || !INTERN(event->data.scalar.tag))
+            return 0;
+        event->data.scalar.value = intern_string(event_record, event->data.scalar.value, event->data.scalar.length);
+        return event->data.scalar.value != NULL;
+    case YAML_SEQUENCE_START_EVENT:
+        return INTERN(event->data.sequence_start.anchor) && INTERN(event->data.sequence_start.tag);
+    case YAML_MAPPING_START_EVENT:
+        return INTERN(event->data.mapping_start.anchor) && INTERN(event->data.mapping_start.tag);
+    default:
+        return 1;
+    }
+}
+
+#undef INTERN
+
+/**
+ * Store a copy of an event in a slot of the record, then free the original.
+ */
+static int store_event(yl_event_record_t *event_record, size_t index, yaml_event_t *event, yl_error_t *err)
+{
+    yaml_event_t stored = *event;
+    if (!intern_event(event_record, &stored)) {
+        err->type = YL_MEMORY_ERROR;
+        err->line = event->start_mark.line;
+        err->column = event->start_mark.column;
+        err->context = "While recording events from a stream, got memory error";
+        err->message = "unable to allocate event strings";
+        return 0;
+    }
+
+    event_record->events[index] = stored;
+    yaml_event_delete(event); // Also marks the event as consumed.
+    return 1;
+}
+
 int yl_record_event(yl_event_record_t *event_record, yaml_event_t *event, lua_State *L, yl_error_t *err)
 {
     (void)L;
@@ -83,8 +268,9 @@ int yl_record_event(yl_event_record_t *event_record, yaml_event_t *event, lua_St
         event_record->capacity = new_capacity;
     }
 
-    event_record->events[event_record->length++] = *event;
-    *event = (yaml_event_t){0}; // Mark the event as consumed to prevent its contents from being freed.
+    if (!store_event(event_record, event_record->length, event, err))
+        goto error;
+    ++event_record->length;
 
     return 1;
 
@@ -92,14 +278,23 @@ error:
     return 0;
 }
 
+int yl_event_record_replace(yl_event_record_t *event_record, size_t index, yaml_event_t *event, yl_error_t *err)
+{
+    // The strings of the replaced event stay in the arena until the record is deleted.
+    return store_event(event_record, index, event, err);
+}
+
 void yl_event_record_delete(yl_event_record_t *event_record)
 {
-    for (size_t i = 0; i < event_record->length; ++i) {
-        yaml_event_delete(&event_record->events[i]);
+    yl_arena_block_t *block = event_record->arena;
+    while (block != NULL) {
+        yl_arena_block_t *next = block->next;
+        free(block);
+        block = next;
     }
 
-    if (event_record->events != NULL)
-        free(event_record->events);
+    free(event_record->strings);
+    free(event_record->events);
 
     *event_record = (yl_event_record_t){0};
 }
@@ -125,133 +320,182 @@ error:
     return 0;
 }
 
-typedef struct _stringbuilder_s {
-    size_t capacity;
-    size_t length;
-    char *contents;
-} stringbuilder_t;
-
-static int stringbuilder_add(stringbuilder_t *builder, char *buffer, size_t size)
+const yaml_event_t *yl_replay_event_borrowed(yl_event_record_t *event_record)
 {
-    if (builder->length + size >= builder->capacity) {
-        size_t new_capacity = builder->capacity << 1;
-        if (new_capacity == 0)
-            new_capacity = 1;
-        while (new_capacity < builder->length + size)
-            new_capacity <<= 1;
-
-        char *resized_contents = realloc(builder->contents, new_capacity);
-        if (resized_contents == NULL)
-            return 0;
+    if (event_record->index == event_record->length)
+        return NULL;
 
-        builder->contents = resized_contents;
-        builder->capacity = new_capacity;
-    }
+    return &event_record->events[event_record->index++];
+}
 
-    memcpy(&builder->contents[builder->length], buffer, size);
-    builder->length += size;
+static bool is_digits(const char *c, const char *end, const char *digits)
+{
+    if (c == end)
+        return false;
+    for (; c < end; ++c)
+        if (strchr(digits, *c) == NULL || *c == '\0')
+            return false;
+    return true;
+}
 
-    return 1;
+static bool is_null(const char *value, size_t length)
+{
+    return length == 0 ||
+           (length == 1 && value[0] == '~') ||
+           (length == 4 && (!strcmp(value, "null") || !strcmp(value, "Null") || !strcmp(value, "NULL")));
 }
 
-static void stringbuilder_delete(stringbuilder_t *builder)
+/**
+ * @returns @c 1 for true, @c 0 for false, and @c -1 if the value isn't a boolean.
+ */
+static int to_bool(const char *value, size_t length)
 {
-    if (builder->contents)
-        free(builder->contents);
+    if (length == 4 && (!strcmp(value, "true") || !strcmp(value, "True") || !strcmp(value, "TRUE")))
+        return 1;
+    if (length == 5 && (!strcmp(value, "false") || !strcmp(value, "False") || !strcmp(value, "FALSE")))
+        return 0;
+    return -1;
+}
 
-    *builder = (stringbuilder_t){0};
+static bool is_int(const char *value, size_t length)
+{
+    const char *end = value + length;
+    if (length > 2 && value[0] == '0' && value[1] == 'o')
+        return is_digits(value + 2, end, "01234567");
+    if (length > 2 && value[0] == '0' && value[1] == 'x')
+        return is_digits(value + 2, end, "0123456789abcdefABCDEF");
+    if (length > 0 && (value[0] == '-' || value[0] == '+'))
+        ++value;
+    return is_digits(value, end, "0123456789");
 }
 
-char *yl_event_record_to_string(yl_event_record_t *event_record, yl_error_t *err)
+static bool is_float(const char *value, size_t length)
 {
-    yaml_emitter_t emitter = {0};
-    yaml_event_t event = {0};
-    stringbuilder_t stringbuilder = {0};
-    char *output = NULL;
-    size_t line = 0, column = 0;
-    if (event_record->length > event_record->index) {
-        line = event_record->events[event_record->index].start_mark.line;
-        column = event_record->events[event_record->index].start_mark.column;
+    const char *c = value, *end = value + length;
+    if (c < end && (*c == '-' || *c == '+'))
+        ++c;
+    if (!strcmp(c, ".inf") || !strcmp(c, ".Inf") || !strcmp(c, ".INF"))
+        return true;
+    if (!strcmp(value, ".nan") || !strcmp(value, ".NaN") || !strcmp(value, ".NAN"))
+        return true;
+
+    const char *digits = c;
+    while (c < end && *c >= '0' && *c <= '9')
+        ++c;
+    bool integral = c > digits;
+    bool fractional = false;
+    if (c < end && *c == '.') {
+        digits = ++c;
+        while (c < end && *c >= '0' && *c <= '9')
+            ++c;
+        fractional = c > digits;
     }
-
-    if (!yaml_emitter_initialize(&emitter)) {
-        err->type = YL_EMITTER_ERROR;
-        err->line = line;
-        err->column = column;
-        err->context = "Error rendering event record";
-        err->message = "failed to initialize emitter";
-        goto error;
+    if (!integral && !fractional)
+        return false;
+    if (c < end && (*c == 'e' || *c == 'E')) {
+        if (++c < end && (*c == '-' || *c == '+'))
+            ++c;
+        return is_digits(c, end, "0123456789");
     }
+    return c == end;
+}
 
-    yaml_emitter_set_unicode(&emitter, true);
-    yaml_emitter_set_encoding(&emitter, YAML_UTF8_ENCODING);
-    yaml_emitter_set_output(&emitter, (yaml_write_handler_t *)stringbuilder_add, &stringbuilder);
-
-    yaml_stream_start_event_initialize(&event, YAML_UTF8_ENCODING);
-    if (!yaml_emitter_emit(&emitter, &event))
-        goto error;
-
-    while (event_record->index < event_record->length) {
-        if (!yl_replay_event(event_record, &event, err))
-            goto error;
-
-        if (!yaml_emitter_emit(&emitter, &event)) {
-            err->type = YL_EMITTER_ERROR;
-            err->line = event.start_mark.line;
-            err->column = event.start_mark.column;
-            err->context = "While rendering event record, failed to emit event";
-            err->message = yl_event_name(event.type);
-            goto error;
-        }
+const char *yl_event_normalized_tag(const yaml_event_t *event)
+{
+    const char *tag = NULL;
+    switch (event->type) {
+    case YAML_SCALAR_EVENT: {
+        tag = (const char *)event->data.scalar.tag;
+        if (tag != NULL && strcmp(tag, "!") != 0)
+            return tag;
+        if (tag != NULL || event->data.scalar.style != YAML_PLAIN_SCALAR_STYLE)
+            return YAML_STR_TAG;
+
+        const char *value = (const char *)event->data.scalar.value;
+        size_t length = event->data.scalar.length;
+        if (is_null(value, length))
+            return YAML_NULL_TAG;
+        if (to_bool(value, length) != -1)
+            return YAML_BOOL_TAG;
+        if (is_int(value, length))
+            return YAML_INT_TAG;
+        if (is_float(value, length))
+            return YAML_FLOAT_TAG;
+        return YAML_STR_TAG;
     }
+    case YAML_SEQUENCE_START_EVENT:
+        tag = (const char *)event->data.sequence_start.tag;
+        return tag != NULL && strcmp(tag, "!") != 0 ? tag : YAML_SEQ_TAG;
+    case YAML_MAPPING_START_EVENT:
+        tag = (const char *)event->data.mapping_start.tag;
+        return tag != NULL && strcmp(tag, "!") != 0 ? tag : YAML_MAP_TAG;
+    default:
+        return NULL;
+    }
+}
 
-    yaml_stream_end_event_initialize(&event);
-    if (!yaml_emitter_emit(&emitter, &event))
-        goto error;
-
-    output = strndup(stringbuilder.contents, stringbuilder.length);
+static bool events_equal(const yaml_event_t *left, const yaml_event_t *right)
+{
+    if (left->type != right->type)
+        return false;
 
-    if (output == NULL) {
-        err->type = YL_MEMORY_ERROR;
-        err->line = line;
-        err->column = column;
-        err->context = "Error rendering event record";
-        err->message = "failed to allocate output string";
-        goto error;
+    switch (left->type) {
+    case YAML_ALIAS_EVENT:
+        return strcmp((const char *)left->data.alias.anchor, (const char *)right->data.alias.anchor) == 0;
+    case YAML_SEQUENCE_START_EVENT: // Fall through.
+    case YAML_MAPPING_START_EVENT:
+        return strcmp(yl_event_normalized_tag(left), yl_event_normalized_tag(right)) == 0;
+    case YAML_SCALAR_EVENT: {
+        const char *tag = yl_event_normalized_tag(left);
+        if (strcmp(tag, yl_event_normalized_tag(right)) != 0)
+            return false;
+
+        const char *l = (const char *)left->data.scalar.value, *r = (const char *)right->data.scalar.value;
+        size_t llength = left->data.scalar.length, rlength = right->data.scalar.length;
+        if (strcmp(tag, YAML_NULL_TAG) == 0 && is_null(l, llength) && is_null(r, rlength))
+            return true;
+        if (strcmp(tag, YAML_BOOL_TAG) == 0 && to_bool(l, llength) != -1 && to_bool(r, rlength) != -1)
+            return to_bool(l, llength) == to_bool(r, rlength);
+        return llength == rlength && memcmp(l, r, llength) == 0;
     }
+    default:
+        return true;
+    }
+}
 
-    stringbuilder_delete(&stringbuilder);
-    yaml_emitter_delete(&emitter);
-    return output;
-
-error:
-    if (output != NULL)
-        free(output);
-    stringbuilder_delete(&stringbuilder);
-    yaml_emitter_delete(&emitter);
-    return NULL;
+bool yl_event_record_equal(const yl_event_record_t *left, const yl_event_record_t *right, size_t *mismatch)
+{
+    size_t i = 0;
+    for (; i < left->length && i < right->length; ++i)
+        if (!events_equal(&left->events[i], &right->events[i]))
+            break;
+
+    if (i == left->length && i == right->length)
+        return true;
+    if (mismatch != NULL)
+        *mismatch = i;
+    return false;
 }
 
-char *yl_copy_anchor(yaml_event_t *event)
+yaml_char_t *yl_take_anchor(yaml_event_t *event)
 {
-    char *anchor = NULL;
+    yaml_char_t **anchor = NULL;
 
     switch (event->type) {
     case YAML_SCALAR_EVENT:
-        if (event->data.scalar.anchor != NULL)
-            anchor = strdup((char *)event->data.scalar.anchor);
+        anchor = &event->data.scalar.anchor;
         break;
     case YAML_SEQUENCE_START_EVENT:
-        if (event->data.sequence_start.anchor)
-            anchor = strdup((char *)event->data.sequence_start.anchor);
+        anchor = &event->data.sequence_start.anchor;
         break;
     case YAML_MAPPING_START_EVENT:
-        if (event->data.mapping_start.anchor)
-            anchor = strdup((char *)event->data.mapping_start.anchor);
+        anchor = &event->data.mapping_start.anchor;
         break;
     default:
-        break;
+        return NULL;
     }
 
-    return anchor;
+    yaml_char_t *taken = *anchor;
+    *anchor = NULL;
+    return taken;
 }
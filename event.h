@@ -9,23 +9,80 @@
 
 const char *yl_event_name(yaml_event_type_t event_type);
 
+typedef struct _yl_arena_block_s yl_arena_block_t;
+
+typedef struct _yl_interned_string_s {
+    size_t hash;
+    yaml_char_t *string;
+} yl_interned_string_t;
+
+/**
+ * A recorded sequence of events. The strings of every event live in an arena
+ * owned by the record, with duplicates stored once, so recorded events must never
+ * be passed to yaml_event_delete() or to consumers that take ownership.
+ */
 typedef struct _yl_event_record_s {
     size_t capacity;
     size_t length;
     size_t index;
     yaml_event_t *events;
+
+    yl_arena_block_t *arena;
+    yl_interned_string_t *strings; // Open addressing table of interned strings.
+    size_t strings_capacity;
+    size_t nstrings;
 } yl_event_record_t;
 
-int yl_copy_event(yaml_event_t *original, yaml_event_t *copy);
+int yl_copy_event(const yaml_event_t *original, yaml_event_t *copy);
 
 const char *yl_event_name(yaml_event_type_t event_type);
 
+/**
+ * Event consumer that copies the event into the record, and frees the original.
+ */
 int yl_record_event(yl_event_record_t *event_record, yaml_event_t *event, lua_State *L, yl_error_t *err);
 
+/**
+ * Overwrite a recorded event with a copy of @p event, and free the original.
+ */
+int yl_event_record_replace(yl_event_record_t *event_record, size_t index, yaml_event_t *event, yl_error_t *err);
+
 void yl_event_record_delete(yl_event_record_t *event_record);
 
+/**
+ * Event producer that hands out an owned copy of the next recorded event.
+ */
 int yl_replay_event(yl_event_record_t *event_record, yaml_event_t *event, yl_error_t *err);
 
-char *yl_event_record_to_string(yl_event_record_t *event_record, yl_error_t *err);
+/**
+ * Return the next recorded event without copying it, or NULL at the end of the
+ * record. The event stays owned by the record, and is valid until it's deleted.
+ */
+const yaml_event_t *yl_replay_event_borrowed(yl_event_record_t *event_record);
+
+/**
+ * The tag a node event resolves to: its own tag if it has a specific one, or else
+ * the type of the node, with plain scalars resolved by the YAML 1.2 core schema.
+ *
+ * @returns A full tag, or NULL for events that aren't nodes.
+ */
+const char *yl_event_normalized_tag(const yaml_event_t *event);
+
+/**
+ * Compare two records event by event, by type, normalized tag and scalar value.
+ * Styles, anchors and directives are ignored, and nulls and booleans are equal
+ * however they're spelled.
+ *
+ * @param[out]      mismatch    If the records differ, the index of the first
+ *                              event that differs (which may be past the end of
+ *                              the shorter record). May be NULL.
+ *
+ * @returns Whether the records are equal.
+ */
+bool yl_event_record_equal(const yl_event_record_t *left, const yl_event_record_t *right, size_t *mismatch);
 
-char *yl_copy_anchor(yaml_event_t *event);
+/**
+ * Take ownership of the anchor of an event, leaving the event without one, so it
+ * can be carried over to the rendered event without copying it.
+ */
+yaml_char_t *yl_take_anchor(yaml_event_t *event);
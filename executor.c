@@ -4,10 +4,31 @@
 
 #include "lauxlib.h"
 
+#include "environment.h"
 #include "error.h"
 #include "executor.h"
 #include "lua_helpers.h"
+#include "profile.h"
 #include "render.h"
+#include "tags.h"
+
+/**
+ * Replace a lent event with an owned copy of it.
+ */
+static int adopt_event(yl_execution_context_t *ctx, yaml_event_t *event)
+{
+    yaml_event_t lent = *event;
+    if (yl_copy_event(&lent, event))
+        return 1;
+
+    *event = (yaml_event_t){0};
+    ctx->err.type = YL_MEMORY_ERROR;
+    ctx->err.line = lent.start_mark.line;
+    ctx->err.column = lent.start_mark.column;
+    ctx->err.context = "While executing a stream, got memory error";
+    ctx->err.message = "could not copy event";
+    return 0;
+}
 
 int yl_execute_stream(yl_execution_context_t *ctx)
 {
@@ -17,6 +38,8 @@ int yl_execute_stream(yl_execution_context_t *ctx)
     while (!done) {
         if (!ctx->producer.callback(ctx->producer.data, &next_event, &ctx->err))
             goto error;
+        if (ctx->producer.lends && !adopt_event(ctx, &next_event))
+            goto error;
 
         switch (next_event.type) {
         case YAML_STREAM_START_EVENT:
@@ -51,274 +74,419 @@ error:
     return 0;
 }
 
-int yl_execute_document(yl_execution_context_t *ctx, yaml_event_t *event)
+typedef struct _yl_execution_frame_s {
+    yaml_event_t event; // The container's start event, passed on again with its Lua value.
+    bool is_mapping;
+    int tag;
+    yl_event_consumer_t saved_consumer; // The consumer to restore at the end, if tagged.
+    yl_lua_table_builder_t table_builder;
+} yl_execution_frame_t;
+
+/**
+ * The containers enclosing the current node, innermost last. Frames are allocated
+ * one at a time and reused, so a table builder never moves while consumers point
+ * at it.
+ */
+typedef struct _yl_execution_stack_s {
+    yl_execution_frame_t **frames;
+    size_t depth, allocated, capacity;
+    size_t tagged; // Frames with a table builder.
+} yl_execution_stack_t;
+
+static void execution_stack_delete(yl_execution_stack_t *stack)
 {
-    yaml_event_t next_event = {0};
+    for (size_t i = 0; i < stack->depth; ++i) {
+        yl_lua_table_builder_delete(&stack->frames[i]->table_builder);
+        yaml_event_delete(&stack->frames[i]->event);
+    }
+    for (size_t i = 0; i < stack->allocated; ++i)
+        free(stack->frames[i]);
+    free(stack->frames);
+    *stack = (yl_execution_stack_t){0};
+}
 
-    yl_event_consumer_t wrapped_consumer = ctx->consumer;
-    ctx->consumer.callback = (yl_event_consumer_callback_t *)yl_render_event;
-    ctx->consumer.data = &wrapped_consumer;
+/**
+ * Enter a container: take its start event, and if it's tagged, collect its
+ * contents with a table builder until the end.
+ */
+static int push_frame(yl_execution_context_t *ctx, yl_execution_stack_t *stack, yaml_event_t *event)
+{
+    bool is_mapping = event->type == YAML_MAPPING_START_EVENT;
+    char *tag = (char *)(is_mapping ? event->data.mapping_start.tag : event->data.sequence_start.tag);
+    const char *context = is_mapping ? "While executing a mapping, encountered an error"
+                                     : "While executing a sequence, encountered an error";
+
+    if (stack->depth == stack->allocated) {
+        if (stack->allocated == stack->capacity) {
+            size_t capacity = stack->capacity ? stack->capacity * 2 : 16;
+            yl_execution_frame_t **frames = realloc(stack->frames, capacity * sizeof(*frames));
+            if (frames == NULL)
+                goto frame_error;
+            stack->frames = frames;
+            stack->capacity = capacity;
+        }
+        if ((stack->frames[stack->allocated] = malloc(sizeof(yl_execution_frame_t))) == NULL)
+            goto frame_error;
+        ++stack->allocated;
+    }
+
+    int tag_id = yl_tag_intern(ctx->lua, tag);
+    if (tag_id == YL_TAG_ERROR) {
+        ctx->err.type = YL_MEMORY_ERROR;
+        ctx->err.line = event->start_mark.line;
+        ctx->err.column = event->start_mark.column;
+        ctx->err.context = context;
+        ctx->err.message = "could not intern the tag";
+        goto error;
+    }
+
+    // Tables being built live on the Lua stack; ensure room for them, and for
+    // executing lua functions.
+    if ((tag_id != YL_TAG_NONE || stack->tagged > 0) && !lua_checkstack(ctx->lua, 10)) {
+        ctx->err.type = YL_MEMORY_ERROR;
+        ctx->err.line = event->start_mark.line;
+        ctx->err.column = event->start_mark.column;
+        ctx->err.context = context;
+        ctx->err.message = "could not expand Lua stack space";
+        goto error;
+    }
+
+    yl_execution_frame_t *frame = stack->frames[stack->depth++];
+    *frame = (yl_execution_frame_t){0};
+    frame->event = *event;
+    *event = (yaml_event_t){0};
+    frame->is_mapping = is_mapping;
+    frame->tag = tag_id;
+    yl_profile_t *profile = yl_profile(ctx->lua);
+    if (profile != NULL)
+        yl_profile_enter(profile, &frame->event.start_mark);
+
+    if (tag_id != YL_TAG_NONE) {
+        ++stack->tagged;
+        frame->saved_consumer = ctx->consumer;
+        frame->table_builder.L = ctx->lua;
+        frame->table_builder.preserve_order = ctx->preserve_order;
+        ctx->consumer.callback = (yl_event_consumer_callback_t *)yl_lua_table_builder;
+        ctx->consumer.data = &frame->table_builder;
+    }
+
+    return ctx->consumer.callback(ctx->consumer.data, &frame->event, NULL, &ctx->err);
+
+frame_error:
+    ctx->err.type = YL_MEMORY_ERROR;
+    ctx->err.line = event->start_mark.line;
+    ctx->err.column = event->start_mark.column;
+    ctx->err.context = context;
+    ctx->err.message = "could not grow the executor stack";
+    goto error;
+
+error:
+    return 0;
+}
+
+/**
+ * Leave a container at its end event. If it's tagged, call its tag on the table
+ * built from it, and pass the start event on with the result.
+ */
+static int pop_frame(yl_execution_context_t *ctx, yl_execution_stack_t *stack, yaml_event_t *event)
+{
+    yl_execution_frame_t *frame = stack->frames[stack->depth - 1];
 
     if (!ctx->consumer.callback(ctx->consumer.data, event, NULL, &ctx->err))
         goto error;
 
-    bool done = false;
-    while (!done) {
-        if (!ctx->producer.callback(ctx->producer.data, &next_event, &ctx->err))
-            goto error;
+    yl_profile_t *profile = yl_profile(ctx->lua);
+    if (frame->tag != YL_TAG_NONE) {
+        --stack->tagged;
+        ctx->consumer = frame->saved_consumer;
+        yl_lua_table_builder_delete(&frame->table_builder);
 
-        switch (next_event.type) {
-        case YAML_SCALAR_EVENT:
-            if (!yl_execute_scalar(ctx, &next_event))
-                goto error;
-            break;
-        case YAML_SEQUENCE_START_EVENT:
-            if (!yl_execute_sequence(ctx, &next_event))
-                goto error;
-            break;
-        case YAML_MAPPING_START_EVENT:
-            if (!yl_execute_mapping(ctx, &next_event))
-                goto error;
-            break;
-        case YAML_DOCUMENT_END_EVENT:
-            if (!ctx->consumer.callback(ctx->consumer.data, &next_event, NULL, &ctx->err))
-                goto error;
-            done = true;
-            break;
-        default:
-            ctx->err.type = YL_EXECUTION_ERROR;
-            ctx->err.line = next_event.start_mark.line;
-            ctx->err.column = next_event.start_mark.column;
-            ctx->err.context = "While executing a document, got unexpected event";
-            ctx->err.message = yl_event_name(next_event.type);
+        int status = LUA_OK;
+        if (frame->tag != YL_TAG_IDENTITY)
+            status = yl_tag_call(ctx->lua, frame->tag, 1);
+
+        if (status != LUA_OK) {
+            ctx->err.type = yl_error_from_lua_error(status);
+            ctx->err.line = frame->event.start_mark.line;
+            ctx->err.column = frame->event.start_mark.column;
+            ctx->err.context = frame->is_mapping ? "While executing a mapping, encountered an error"
+                                                 : "While executing a sequence, encountered an error";
+            ctx->err.message = lua_tostring(ctx->lua, 1);
             goto error;
         }
 
-        yaml_event_delete(&next_event);
+        if (!ctx->consumer.callback(ctx->consumer.data, &frame->event, ctx->lua, &ctx->err))
+            goto error;
     }
 
-    ctx->consumer = wrapped_consumer;
+    // Leave after the tag call, which belongs to the container.
+    if (profile != NULL)
+        yl_profile_leave(profile);
+    yaml_event_delete(&frame->event);
+    --stack->depth;
     return 1;
 
 error:
-    ctx->consumer = wrapped_consumer;
-    yaml_event_delete(&next_event);
     return 0;
 }
 
-int yl_execute_sequence(yl_execution_context_t *ctx, yaml_event_t *event)
+static bool is_executed_tag(const yaml_char_t *tag)
 {
-    yaml_event_t next_event = {0};
-
-    size_t line = event->start_mark.line;
-    size_t column = event->start_mark.column;
-    yl_event_consumer_t saved_consumer = {0};
-    yl_lua_table_builder_t table_builder = {0};
-    char *tag = NULL;
-    if (event->data.sequence_start.tag)
-        if ((tag = strdup((char *)event->data.sequence_start.tag)) == NULL)
-            goto memory_error;
-
-    if (tag && tag[0] == '!' && tag[1] != '!') {
-        saved_consumer = ctx->consumer;
-        table_builder.L = ctx->lua;
-        ctx->consumer.callback = (yl_event_consumer_callback_t *)yl_lua_table_builder;
-        ctx->consumer.data = &table_builder;
-    }
-
-    // Ensure room for executing lua functions.
-    if (!lua_checkstack(ctx->lua, 10))
-        goto memory_error;
-
-    if (!ctx->consumer.callback(ctx->consumer.data, event, NULL, &ctx->err))
-        goto error;
+    return tag != NULL && tag[0] == '!' && tag[1] != '!';
+}
 
-    bool done = false;
-    while (!done) {
-        if (!ctx->producer.callback(ctx->producer.data, &next_event, &ctx->err))
+/**
+ * Record the rest of a document, and find the block collections that could be
+ * copied from the source: those without an anchor or tag, and with no executed
+ * tags inside. For each, @p ends holds the index of its end event; otherwise 0.
+ *
+ * Collections ending in a block scalar are left out, since the trailing line
+ * breaks of their source may be part of the scalar.
+ */
+static int record_document(yl_execution_context_t *ctx, yl_event_record_t *record, size_t **ends)
+{
+    typedef struct {
+        size_t start;
+        bool clean; // No executed tags so far.
+    } open_t;
+
+    yaml_event_t event = {0};
+    open_t *open = NULL;
+    size_t depth = 0;
+
+    do {
+        if (!ctx->producer.callback(ctx->producer.data, &event, &ctx->err) ||
+            (ctx->producer.lends && !adopt_event(ctx, &event)) ||
+            !yl_record_event(record, &event, NULL, &ctx->err))
             goto error;
+    } while (record->events[record->length - 1].type != YAML_DOCUMENT_END_EVENT &&
+             record->events[record->length - 1].type != YAML_STREAM_END_EVENT);
+
+    *ends = calloc(record->length, sizeof(size_t));
+    open = malloc(record->length * sizeof(open_t));
+    if (*ends == NULL || open == NULL) {
+        ctx->err.type = YL_MEMORY_ERROR;
+        ctx->err.line = record->events[0].start_mark.line;
+        ctx->err.column = record->events[0].start_mark.column;
+        ctx->err.context = "While executing a document, encountered an error";
+        ctx->err.message = "could not allocate verbatim ranges";
+        goto error;
+    }
 
-        switch (next_event.type) {
-        case YAML_SCALAR_EVENT:
-            if (!yl_execute_scalar(ctx, &next_event))
-                goto error;
-            break;
+    bool ends_in_block_scalar = false;
+    for (size_t i = 0; i < record->length; ++i) {
+        const yaml_event_t *e = &record->events[i];
+        switch (e->type) {
         case YAML_SEQUENCE_START_EVENT:
-            if (!yl_execute_sequence(ctx, &next_event))
-                goto error;
+            open[depth++] = (open_t){i, !is_executed_tag(e->data.sequence_start.tag)};
+            ends_in_block_scalar = false;
             break;
         case YAML_MAPPING_START_EVENT:
-            if (!yl_execute_mapping(ctx, &next_event))
-                goto error;
+            open[depth++] = (open_t){i, !is_executed_tag(e->data.mapping_start.tag)};
+            ends_in_block_scalar = false;
             break;
-        case YAML_SEQUENCE_END_EVENT:
-            if (!ctx->consumer.callback(ctx->consumer.data, &next_event, NULL, &ctx->err))
-                goto error;
-            done = true;
+        case YAML_SCALAR_EVENT:
+            if (depth > 0 && is_executed_tag(e->data.scalar.tag))
+                open[depth - 1].clean = false;
+            ends_in_block_scalar = e->data.scalar.style == YAML_LITERAL_SCALAR_STYLE ||
+                                   e->data.scalar.style == YAML_FOLDED_SCALAR_STYLE;
+            break;
+        case YAML_ALIAS_EVENT:
+            ends_in_block_scalar = false;
             break;
+        case YAML_SEQUENCE_END_EVENT: // Fall through.
+        case YAML_MAPPING_END_EVENT: {
+            if (depth == 0)
+                break; // Left for the executor to report.
+            open_t closed = open[--depth];
+            if (!closed.clean && depth > 0)
+                open[depth - 1].clean = false;
+
+            const yaml_event_t *start = &record->events[closed.start];
+            bool block = start->type == YAML_SEQUENCE_START_EVENT
+                             ? start->data.sequence_start.style == YAML_BLOCK_SEQUENCE_STYLE &&
+                                   !start->data.sequence_start.anchor && !start->data.sequence_start.tag
+                             : start->data.mapping_start.style == YAML_BLOCK_MAPPING_STYLE &&
+                                   !start->data.mapping_start.anchor && !start->data.mapping_start.tag;
+            if (closed.clean && block && !ends_in_block_scalar)
+                (*ends)[closed.start] = i;
+        } break;
         default:
-            ctx->err.type = YL_EXECUTION_ERROR;
-            ctx->err.line = next_event.start_mark.line;
-            ctx->err.column = next_event.start_mark.column;
-            ctx->err.context = "While executing a sequence, got unexpected event";
-            ctx->err.message = yl_event_name(next_event.type);
-            goto error;
+            break;
         }
-
-        yaml_event_delete(&next_event);
     }
 
-    if (saved_consumer.callback != NULL)
-        ctx->consumer = saved_consumer;
+    free(open);
+    return 1;
 
-    if (tag != NULL) {
-        int status = LUA_OK;
-        if (strcmp(tag, "!") != 0)
-            status = yl_lua_execute_lua_function(ctx->lua, tag + 1, 1);
+error:
+    free(open);
+    yaml_event_delete(&event);
+    return 0;
+}
 
-        free(tag);
-        tag = NULL;
+/**
+ * Copy a recorded block collection from the source, and skip its events.
+ *
+ * @returns Whether it was copied. Sources the writer can't shift safely, with
+ * line breaks other than LF, are left to the events.
+ */
+static int write_verbatim(yl_execution_context_t *ctx, yaml_event_t *start, yl_event_record_t *record, size_t end, bool *copied)
+{
+    yaml_event_t *end_event = &record->events[end];
+    size_t from, to;
 
-        if (status != LUA_OK) {
-            ctx->err.type = yl_error_from_lua_error(status);
-            ctx->err.line = line;
-            ctx->err.column = column;
-            ctx->err.context = "While executing a sequence, encountered an error";
-            ctx->err.message = lua_tostring(ctx->lua, 1);
-            goto error;
-        }
+    *copied = false;
+    if (!yl_parser_input_offset(ctx->verbatim.input, start->start_mark.index, &from) ||
+        !yl_parser_input_offset(ctx->verbatim.input, end_event->end_mark.index, &to))
+        return 1;
 
-        if (!ctx->consumer.callback(ctx->consumer.data, event, ctx->lua, &ctx->err))
-            goto error;
+    const char *source = (const char *)ctx->verbatim.input->data;
+    while (to > from && isspace((unsigned char)source[to - 1]))
+        --to;
+
+    for (size_t i = from; i < to; ++i) {
+        unsigned char c = source[i];
+        if (c == '\r' ||
+            (c == 0xC2 && i + 1 < to && (unsigned char)source[i + 1] == 0x85) ||
+            (c == 0xE2 && i + 2 < to && (unsigned char)source[i + 1] == 0x80 && ((unsigned char)source[i + 2] & 0xFE) == 0xA8))
+            return 1;
     }
 
-    return 1;
+    if (!ctx->verbatim.callback(ctx->verbatim.data, start, end_event, source + from, to - from, start->start_mark.column, &ctx->err))
+        return 0;
 
-memory_error:
-    ctx->err.type = YL_MEMORY_ERROR;
-    ctx->err.line = line;
-    ctx->err.column = column;
-    ctx->err.context = "While executing a mapping, encountered an error";
-    ctx->err.message = "could not expand Lua stack space";
-    goto error;
-
-error:
-    if (saved_consumer.callback != NULL)
-        ctx->consumer = saved_consumer;
-    if (tag != NULL) {
-        free(tag);
-        tag = NULL;
-    }
-    yaml_event_delete(&next_event);
-    yaml_event_delete(event);
-    return 0;
+    record->index = end + 1;
+    *copied = true;
+    return 1;
 }
 
-int yl_execute_mapping(yl_execution_context_t *ctx, yaml_event_t *event)
+int yl_execute_document(yl_execution_context_t *ctx, yaml_event_t *event)
 {
     yaml_event_t next_event = {0};
+    yl_execution_stack_t stack = {0};
+    yl_event_producer_t producer = ctx->producer;
+    yl_event_record_t record = {0};
+    size_t *verbatim_ends = NULL;
 
-    size_t line = event->start_mark.line;
-    size_t column = event->start_mark.column;
-    yl_event_consumer_t saved_consumer = {0};
-    yl_lua_table_builder_t table_builder = {0};
-    char *tag = NULL;
-    if (event->data.mapping_start.tag)
-        if ((tag = strdup((char *)event->data.mapping_start.tag)) == NULL)
-            goto memory_error;
-
-    if (tag && tag[0] == '!' && tag[1] != '!') {
-        saved_consumer = ctx->consumer;
-        table_builder.L = ctx->lua;
-        ctx->consumer.callback = (yl_event_consumer_callback_t *)yl_lua_table_builder;
-        ctx->consumer.data = &table_builder;
-    }
+    yl_event_consumer_t wrapped_consumer = ctx->consumer;
+    ctx->consumer.callback = (yl_event_consumer_callback_t *)yl_render_event;
+    ctx->consumer.data = &wrapped_consumer;
 
-    // Ensure room for executing lua functions.
-    if (!lua_checkstack(ctx->lua, 10))
-        goto memory_error;
+    // Nodes an earlier document failed in were never left.
+    yl_profile_t *profile = yl_profile(ctx->lua);
+    if (profile != NULL)
+        yl_profile_unwind(profile);
 
     if (!ctx->consumer.callback(ctx->consumer.data, event, NULL, &ctx->err))
         goto error;
 
+    // Look ahead over the whole document for what can be copied from the source.
+    if (ctx->verbatim.callback != NULL) {
+        if (!record_document(ctx, &record, &verbatim_ends))
+            goto error;
+        ctx->producer.callback = (yl_event_producer_callback_t *)yl_replay_event;
+        ctx->producer.data = &record;
+        ctx->producer.lends = false;
+    }
+
     bool done = false;
     while (!done) {
         if (!ctx->producer.callback(ctx->producer.data, &next_event, &ctx->err))
             goto error;
 
+        if (ctx->producer.lends) {
+            // Nothing is done with an untagged scalar outside tagged nodes but
+            // passing it on, so a borrowing consumer can have the lent event.
+            if (next_event.type == YAML_SCALAR_EVENT && stack.tagged == 0 && wrapped_consumer.borrows &&
+                !is_executed_tag(next_event.data.scalar.tag)) {
+                int consumed = wrapped_consumer.callback(wrapped_consumer.data, &next_event, NULL, &ctx->err);
+                next_event = (yaml_event_t){0};
+                if (!consumed)
+                    goto error;
+                continue;
+            }
+            if (!adopt_event(ctx, &next_event))
+                goto error;
+        }
+
+        if (verbatim_ends != NULL && verbatim_ends[record.index - 1] != 0 && stack.tagged == 0) {
+            bool copied;
+            if (!write_verbatim(ctx, &next_event, &record, verbatim_ends[record.index - 1], &copied))
+                goto error;
+            if (copied) {
+                yaml_event_delete(&next_event);
+                continue;
+            }
+        }
+
+        yl_execution_frame_t *top = stack.depth > 0 ? stack.frames[stack.depth - 1] : NULL;
         switch (next_event.type) {
         case YAML_SCALAR_EVENT:
             if (!yl_execute_scalar(ctx, &next_event))
                 goto error;
             break;
-        case YAML_SEQUENCE_START_EVENT:
-            if (!yl_execute_sequence(ctx, &next_event))
+        case YAML_SEQUENCE_START_EVENT: // Fall through.
+        case YAML_MAPPING_START_EVENT:
+            if (!push_frame(ctx, &stack, &next_event))
                 goto error;
             break;
-        case YAML_MAPPING_START_EVENT:
-            if (!yl_execute_mapping(ctx, &next_event))
+        case YAML_SEQUENCE_END_EVENT:
+            if (top == NULL || top->is_mapping)
+                goto unexpected_event;
+            if (!pop_frame(ctx, &stack, &next_event))
                 goto error;
             break;
         case YAML_MAPPING_END_EVENT:
+            if (top == NULL || !top->is_mapping)
+                goto unexpected_event;
+            if (!pop_frame(ctx, &stack, &next_event))
+                goto error;
+            break;
+        case YAML_DOCUMENT_END_EVENT:
+            if (top != NULL)
+                goto unexpected_event;
             if (!ctx->consumer.callback(ctx->consumer.data, &next_event, NULL, &ctx->err))
                 goto error;
             done = true;
             break;
         default:
-            ctx->err.type = YL_EXECUTION_ERROR;
-            ctx->err.line = next_event.start_mark.line;
-            ctx->err.column = next_event.start_mark.column;
-            ctx->err.context = "While executing a mapping, got unexpected event";
-            ctx->err.message = yl_event_name(next_event.type);
-            goto error;
+            goto unexpected_event;
         }
 
         yaml_event_delete(&next_event);
     }
 
-    if (saved_consumer.callback != NULL)
-        ctx->consumer = saved_consumer;
-
-    if (tag != NULL) {
-        int status = LUA_OK;
-        if (strcmp(tag, "!") != 0)
-            status = yl_lua_execute_lua_function(ctx->lua, tag + 1, 1);
-
-        free(tag);
-        tag = NULL;
-
-        if (status != LUA_OK) {
-            ctx->err.type = yl_error_from_lua_error(status);
-            ctx->err.line = line;
-            ctx->err.column = column;
-            ctx->err.context = "While executing a mapping, encountered an error";
-            ctx->err.message = lua_tostring(ctx->lua, 1);
-            goto error;
-        }
-
-        if (!ctx->consumer.callback(ctx->consumer.data, event, ctx->lua, &ctx->err))
-            goto error;
-    }
-
+    ctx->consumer = wrapped_consumer;
+    ctx->producer = producer;
+    execution_stack_delete(&stack);
+    yl_event_record_delete(&record);
+    free(verbatim_ends);
+    // The next document starts from the base environment again.
+    yl_environment_reset(ctx->lua);
     return 1;
 
-memory_error:
-    ctx->err.type = YL_MEMORY_ERROR;
-    ctx->err.line = line;
-    ctx->err.column = column;
-    ctx->err.context = "While executing a mapping, encountered an error";
-    ctx->err.message = "could not expand Lua stack space";
+unexpected_event:
+    ctx->err.type = YL_EXECUTION_ERROR;
+    ctx->err.line = next_event.start_mark.line;
+    ctx->err.column = next_event.start_mark.column;
+    if (stack.depth == 0)
+        ctx->err.context = "While executing a document, got unexpected event";
+    else if (stack.frames[stack.depth - 1]->is_mapping)
+        ctx->err.context = "While executing a mapping, got unexpected event";
+    else
+        ctx->err.context = "While executing a sequence, got unexpected event";
+    ctx->err.message = yl_event_name(next_event.type);
     goto error;
 
 error:
-    if (saved_consumer.callback != NULL)
-        ctx->consumer = saved_consumer;
-    if (tag != NULL) {
-        free(tag);
-        tag = NULL;
-    }
+    ctx->consumer = wrapped_consumer;
+    ctx->producer = producer;
+    execution_stack_delete(&stack);
+    yl_event_record_delete(&record);
+    free(verbatim_ends);
     yaml_event_delete(&next_event);
-    yaml_event_delete(event);
+    yl_environment_reset(ctx->lua);
     return 0;
 }
 
@@ -329,9 +497,7 @@ int yl_execute_scalar(yl_execution_context_t *ctx, yaml_event_t *event)
     size_t line = event->start_mark.line;
     size_t column = event->start_mark.column;
     yaml_scalar_style_t style = event->data.scalar.style;
-    char *tag = NULL;
-    if (event->data.scalar.tag)
-        tag = (char *)event->data.scalar.tag;
+    char *tag = (char *)event->data.scalar.tag;
 
     if (!tag || tag[0] != '!' || tag[1] == '!') {
         if (!ctx->consumer.callback(ctx->consumer.data, event, NULL, &ctx->err))
@@ -344,10 +510,24 @@ int yl_execute_scalar(yl_execution_context_t *ctx, yaml_event_t *event)
     if (!lua_checkstack(ctx->lua, 10))
         goto memory_error;
 
+    int tag_id = yl_tag_intern(ctx->lua, tag);
+    if (tag_id == YL_TAG_ERROR) {
+        ctx->err.type = YL_MEMORY_ERROR;
+        ctx->err.line = line;
+        ctx->err.column = column;
+        ctx->err.context = "While executing a scalar, encountered an error";
+        ctx->err.message = "could not intern the tag";
+        goto error;
+    }
+
+    yl_profile_t *profile = yl_profile(ctx->lua);
+    if (profile != NULL)
+        yl_profile_enter(profile, &event->start_mark);
+
     int status = LUA_OK;
     char *value = (char *)event->data.scalar.value;
     size_t length = event->data.scalar.length;
-    if (strcmp(tag, "!") == 0) {
+    if (tag_id == YL_TAG_IDENTITY) {
         if (style != YAML_DOUBLE_QUOTED_SCALAR_STYLE &&
             style != YAML_SINGLE_QUOTED_SCALAR_STYLE)
             status = yl_lua_execute_lua(ctx->lua, value);
@@ -355,9 +535,12 @@ int yl_execute_scalar(yl_execution_context_t *ctx, yaml_event_t *event)
             lua_pushlstring(ctx->lua, value, length);
     } else {
         yl_lua_value_from_scalar(ctx->lua, style, length, value);
-        status = yl_lua_execute_lua_function(ctx->lua, (char *)tag + 1, 1);
+        status = yl_tag_call(ctx->lua, tag_id, 1);
     }
 
+    if (profile != NULL)
+        yl_profile_leave(profile);
+
     if (status != LUA_OK) {
         ctx->err.type = yl_error_from_lua_error(status);
         ctx->err.line = event->start_mark.line;
@@ -386,3 +569,29 @@ error:
     yaml_event_delete(event);
     return 0;
 }
+
+int yl_replay_record(yl_event_record_t *record, yl_event_consumer_t *consumer, yl_error_t *err)
+{
+    yaml_event_t event;
+
+    if (consumer->borrows) {
+        // A shallow copy, so the consumer can't clear the recorded event.
+        const yaml_event_t *recorded;
+        while ((recorded = yl_replay_event_borrowed(record)) != NULL) {
+            event = *recorded;
+            if (!consumer->callback(consumer->data, &event, NULL, err))
+                return 0;
+        }
+        return 1;
+    }
+
+    while (record->index < record->length) {
+        if (!yl_replay_event(record, &event, err))
+            return 0;
+        int consumed = consumer->callback(consumer->data, &event, NULL, err);
+        yaml_event_delete(&event);
+        if (!consumed)
+            return 0;
+    }
+    return 1;
+}
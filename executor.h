@@ -22,6 +22,10 @@ typedef int yl_event_producer_callback_t(void *data, yaml_event_t *event, yl_err
 typedef struct _yl_event_producer_s {
     yl_event_producer_callback_t *callback;
     void *data;
+    // The events point at memory the producer keeps, valid until the next call,
+    // and must not be freed. Only yl_execute_stream() accepts such a producer: it
+    // passes untagged scalars straight to a borrowing consumer, and copies the rest.
+    bool lends;
 } yl_event_producer_t;
 
 /**
@@ -45,17 +49,42 @@ typedef int yl_event_consumer_callback_t(void *data, yaml_event_t *event, lua_St
 typedef struct _yl_event_consumer_s {
     yl_event_consumer_callback_t *callback;
     void *data;
+    // The callback only reads events, and leaves freeing them to the caller, so
+    // events may point at memory the caller doesn't own, like Lua strings.
+    bool borrows;
 } yl_event_consumer_t;
 
+/**
+ * The prototype of a verbatim writer, which writes a block collection by copying
+ * its source instead of its events. See yl_writer_write_verbatim().
+ */
+typedef int yl_verbatim_callback_t(void *data, yaml_event_t *start, yaml_event_t *end,
+                                   const char *source, size_t length, size_t column, yl_error_t *err);
+
+typedef struct _yl_verbatim_s {
+    yl_verbatim_callback_t *callback;
+    void *data;
+    yl_parser_input_t *input; // The source the producer's events were parsed from.
+} yl_verbatim_t;
+
 typedef struct _yl_execution_context_s {
     yl_event_producer_t producer;
     lua_State *lua;
     yl_event_consumer_t consumer;
     yl_error_t err;
+    bool preserve_order; // Render mappings built by tagged nodes in source order.
+    // If set, untagged block collections outside tagged nodes are copied from the
+    // source instead of being rendered event by event. The consumer must write to
+    // the same output as the verbatim writer.
+    yl_verbatim_t verbatim;
 } yl_execution_context_t;
 
 int yl_execute_stream(yl_execution_context_t *ctx);
 int yl_execute_document(yl_execution_context_t *ctx, yaml_event_t *event);
-int yl_execute_sequence(yl_execution_context_t *ctx, yaml_event_t *event);
-int yl_execute_mapping(yl_execution_context_t *ctx, yaml_event_t *event);
 int yl_execute_scalar(yl_execution_context_t *ctx, yaml_event_t *event);
+
+/**
+ * Pass the rest of a record's events to a consumer: borrowed straight from the
+ * record if the consumer only borrows, or else as owned copies.
+ */
+int yl_replay_record(yl_event_record_t *record, yl_event_consumer_t *consumer, yl_error_t *err);
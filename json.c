@@ -0,0 +1,301 @@
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+
+static bool flush(yl_json_writer_t *writer)
+{
+    if (writer->length != 0 && fwrite(writer->buffer, 1, writer->length, writer->file) != writer->length) {
+        writer->problem = "could not write output";
+        return false;
+    }
+    writer->length = 0;
+    return true;
+}
+
+static bool write_bytes(yl_json_writer_t *writer, const char *bytes, size_t length)
+{
+    while (length > 0) {
+        if (writer->length == YL_JSON_BUFFER_SIZE && !flush(writer))
+            return false;
+        size_t chunk = YL_JSON_BUFFER_SIZE - writer->length;
+        if (chunk > length)
+            chunk = length;
+        memcpy(writer->buffer + writer->length, bytes, chunk);
+        writer->length += chunk;
+        bytes += chunk;
+        length -= chunk;
+    }
+    return true;
+}
+
+static inline bool put(yl_json_writer_t *writer, char c)
+{
+    if (writer->length == YL_JSON_BUFFER_SIZE && !flush(writer))
+        return false;
+    writer->buffer[writer->length++] = c;
+    return true;
+}
+
+static bool write_string(yl_json_writer_t *writer, const char *value, size_t length)
+{
+    static const char digits[] = "0123456789abcdef";
+
+    if (!put(writer, '"'))
+        return false;
+
+    // Copy runs of characters that need no escaping in one go.
+    const char *run = value;
+    for (const char *p = value, *end = value + length; p < end; ++p) {
+        unsigned char c = *p;
+        if (c >= 0x20 && c != '"' && c != '\\')
+            continue;
+
+        if (!write_bytes(writer, run, p - run))
+            return false;
+        run = p + 1;
+
+        char escape[6] = {'\\', 0};
+        size_t escape_length = 2;
+        switch (c) {
+        case '"': escape[1] = '"'; break;
+        case '\\': escape[1] = '\\'; break;
+        case '\b': escape[1] = 'b'; break;
+        case '\f': escape[1] = 'f'; break;
+        case '\n': escape[1] = 'n'; break;
+        case '\r': escape[1] = 'r'; break;
+        case '\t': escape[1] = 't'; break;
+        default:
+            memcpy(escape + 1, "u00", 3);
+            escape[4] = digits[c >> 4];
+            escape[5] = digits[c & 0x0F];
+            escape_length = 6;
+        }
+        if (!write_bytes(writer, escape, escape_length))
+            return false;
+    }
+    if (!write_bytes(writer, run, value + length - run))
+        return false;
+
+    return put(writer, '"');
+}
+
+/**
+ * Whether @p value is a number exactly as JSON would spell it.
+ */
+static bool is_json_number(const char *value, size_t length)
+{
+    const char *p = value, *end = value + length;
+
+    if (p < end && *p == '-')
+        ++p;
+    if (p == end)
+        return false;
+    if (*p == '0') {
+        ++p;
+    } else if (*p >= '1' && *p <= '9') {
+        while (p < end && *p >= '0' && *p <= '9')
+            ++p;
+    } else {
+        return false;
+    }
+    if (p < end && *p == '.') {
+        if (++p == end || *p < '0' || *p > '9')
+            return false;
+        while (p < end && *p >= '0' && *p <= '9')
+            ++p;
+    }
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        ++p;
+        if (p < end && (*p == '+' || *p == '-'))
+            ++p;
+        if (p == end || *p < '0' || *p > '9')
+            return false;
+        while (p < end && *p >= '0' && *p <= '9')
+            ++p;
+    }
+    return p == end;
+}
+
+/**
+ * Write a plain scalar, resolving it as yl_lua_value_from_scalar() does.
+ */
+static bool write_plain(yl_json_writer_t *writer, const char *value, size_t length)
+{
+    if (length == 0 || (length == 1 && value[0] == '~') || (length == 4 && strcmp(value, "null") == 0))
+        return write_bytes(writer, "null", 4);
+    if ((length == 4 && strcmp(value, "true") == 0) || (length == 5 && strcmp(value, "false") == 0))
+        return write_bytes(writer, value, length);
+
+    char *end;
+    char buf[32];
+    long long intvalue = strtoll(value, &end, 0);
+    if (value + length == end) {
+        if (is_json_number(value, length))
+            return write_bytes(writer, value, length);
+        int len = snprintf(buf, sizeof(buf), "%lld", intvalue);
+        return write_bytes(writer, buf, len);
+    }
+    double doublevalue = strtod(value, &end);
+    if (value + length == end && isfinite(doublevalue)) {
+        if (is_json_number(value, length))
+            return write_bytes(writer, value, length);
+        int len = snprintf(buf, sizeof(buf), "%.17g", doublevalue);
+        return write_bytes(writer, buf, len);
+    }
+
+    // Anything else, including infinities and NaN, which JSON can't represent.
+    return write_string(writer, value, length);
+}
+
+/**
+ * Whether a plain scalar with the tag is resolved to a type by its value: if it's
+ * untagged, or its tag is one of the core schema's types other than strings.
+ * Anything else, like !!str, is written as a string.
+ */
+static bool is_resolved_tag(const char *tag)
+{
+    static const char *const resolved[] = {
+        YAML_NULL_TAG,
+        YAML_BOOL_TAG,
+        YAML_INT_TAG,
+        YAML_FLOAT_TAG,
+    };
+
+    if (tag == NULL || strcmp(tag, "!") == 0)
+        return true;
+    for (size_t i = 0; i < sizeof(resolved) / sizeof(resolved[0]); ++i)
+        if (strcmp(tag, resolved[i]) == 0)
+            return true;
+    return false;
+}
+
+/**
+ * Write what comes before a node: a comma between items, a colon between a key and
+ * its value. Returns whether the node is a mapping key.
+ */
+static bool begin_node(yl_json_writer_t *writer, bool *is_key)
+{
+    *is_key = false;
+    if (writer->depth == 0)
+        return true;
+
+    yl_json_frame_t *frame = &writer->frames[writer->depth - 1];
+    size_t count = frame->count++;
+    if (frame->is_mapping) {
+        *is_key = count % 2 == 0;
+        if (!*is_key)
+            return put(writer, ':');
+    }
+    return count == 0 || put(writer, ',');
+}
+
+static bool push_frame(yl_json_writer_t *writer, bool is_mapping)
+{
+    if (writer->depth == writer->frames_capacity) {
+        size_t capacity = writer->frames_capacity ? writer->frames_capacity * 2 : 16;
+        yl_json_frame_t *frames = realloc(writer->frames, capacity * sizeof(*frames));
+        if (frames == NULL) {
+            writer->problem = "could not grow collection stack";
+            return false;
+        }
+        writer->frames = frames;
+        writer->frames_capacity = capacity;
+    }
+    writer->frames[writer->depth++] = (yl_json_frame_t){is_mapping, 0};
+    return put(writer, is_mapping ? '{' : '[');
+}
+
+int yl_json_writer_initialize(yl_json_writer_t *writer, FILE *file)
+{
+    *writer = (yl_json_writer_t){0};
+    writer->file = file;
+    writer->buffer = malloc(YL_JSON_BUFFER_SIZE);
+    return writer->buffer != NULL;
+}
+
+void yl_json_writer_delete(yl_json_writer_t *writer)
+{
+    free(writer->buffer);
+    free(writer->frames);
+    *writer = (yl_json_writer_t){0};
+}
+
+int yl_json_writer_write(yl_json_writer_t *writer, yaml_event_t *event, lua_State *L, yl_error_t *err)
+{
+    (void)L;
+
+    bool is_key;
+    switch (event->type) {
+    case YAML_STREAM_START_EVENT: // Fall through.
+    case YAML_DOCUMENT_START_EVENT:
+        writer->depth = 0;
+        break;
+
+    case YAML_DOCUMENT_END_EVENT:
+        if (!put(writer, '\n') || !flush(writer))
+            goto error;
+        break;
+
+    case YAML_STREAM_END_EVENT:
+        if (!flush(writer))
+            goto error;
+        break;
+
+    case YAML_SCALAR_EVENT: {
+        if (!begin_node(writer, &is_key))
+            goto error;
+        const char *value = (const char *)event->data.scalar.value;
+        size_t length = event->data.scalar.length;
+        bool ok = is_key || event->data.scalar.style != YAML_PLAIN_SCALAR_STYLE ||
+                          !is_resolved_tag((const char *)event->data.scalar.tag)
+                      ? write_string(writer, value, length)
+                      : write_plain(writer, value, length);
+        if (!ok)
+            goto error;
+    } break;
+
+    case YAML_SEQUENCE_START_EVENT: // Fall through.
+    case YAML_MAPPING_START_EVENT:
+        if (!begin_node(writer, &is_key))
+            goto error;
+        if (is_key) {
+            writer->problem = "JSON mapping keys must be scalars";
+            goto error;
+        }
+        if (!push_frame(writer, event->type == YAML_MAPPING_START_EVENT))
+            goto error;
+        break;
+
+    case YAML_SEQUENCE_END_EVENT:
+        --writer->depth;
+        if (!put(writer, ']'))
+            goto error;
+        break;
+
+    case YAML_MAPPING_END_EVENT:
+        --writer->depth;
+        if (!put(writer, '}'))
+            goto error;
+        break;
+
+    case YAML_ALIAS_EVENT:
+        writer->problem = "aliases can't be written as JSON";
+        goto error;
+
+    default:
+        writer->problem = "unexpected event";
+        goto error;
+    }
+
+    return 1;
+
+error:
+    err->type = YL_EMITTER_ERROR;
+    err->line = event->start_mark.line;
+    err->column = event->start_mark.column;
+    err->context = "While writing JSON, encountered error";
+    err->message = writer->problem;
+    return 0;
+}
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "lua.h"
+#include "yaml.h"
+
+#include "error.h"
+
+// Size of the buffer output is collected in before it's written to the file.
+#define YL_JSON_BUFFER_SIZE (64 * 1024)
+
+typedef struct _yl_json_frame_s {
+    bool is_mapping;
+    size_t count; // Nodes written so far; in mappings, keys and values both count.
+} yl_json_frame_t;
+
+/**
+ * A JSON writer. Each document is written as one line of compact JSON, so a
+ * single document is plain JSON and a stream of documents is JSON Lines.
+ *
+ * Untagged plain scalars keep the types they would have in Lua (see
+ * yl_lua_value_from_scalar()): null, booleans and numbers are written as such,
+ * everything else as strings. So do plain scalars tagged with a core schema type
+ * other than !!str; other tagged scalars, like !!str 5, are strings. Mapping keys
+ * are always strings. Anchors and tags are dropped; aliases are an error.
+ */
+typedef struct _yl_json_writer_s {
+    FILE *file;
+    char *buffer;
+    size_t length;
+    const char *problem;
+
+    // The collections enclosing the current node, innermost last.
+    yl_json_frame_t *frames;
+    size_t depth, frames_capacity;
+} yl_json_writer_t;
+
+/**
+ * Initialize a JSON writer.
+ *
+ * @param[out]      writer      The writer to initialize.
+ * @param[in]       file        The file to write to.
+ *
+ * @returns On success, returns @c 1. If the output buffer can't be allocated,
+ * returns @c 0.
+ */
+int yl_json_writer_initialize(yl_json_writer_t *writer, FILE *file);
+
+/**
+ * Free everything a JSON writer allocated. Output that hasn't been flushed is lost.
+ */
+void yl_json_writer_delete(yl_json_writer_t *writer);
+
+/**
+ * Event consumer that writes events as JSON. Output is flushed to the file at the
+ * end of each document.
+ *
+ * The event isn't consumed; the caller still owns it.
+ */
+int yl_json_writer_write(yl_json_writer_t *writer, yaml_event_t *event, lua_State *L, yl_error_t *err);
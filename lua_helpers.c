@@ -1,10 +1,16 @@
+#include <math.h>
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "lauxlib.h"
 #include "lualib.h"
 
+#include "chunk_cache.h"
 #include "event.h"
 #include "lua_helpers.h"
+#include "profile.h"
+#include "state.h"
 
 /**
  * Compare the top two values on the Lua stack, allowing values of different types
@@ -60,6 +66,332 @@ yl_error_type_t yl_lua_sort_keys(lua_State *L, int index)
     return yl_lua_sort_array(L, -1);
 }
 
+// Keys sorted without allocating; larger mappings allocate one array of key references.
+#define INLINE_KEYS 64
+
+// Integers up to 2^53 in magnitude convert to floats exactly, as in Lua's l_intfitsf.
+#define MAXINTFITSF ((lua_Unsigned)1 << 53)
+#define INT_FITS_FLOAT(i) (MAXINTFITSF + (lua_Unsigned)(i) <= 2 * MAXINTFITSF)
+
+typedef struct _yl_lua_key_s {
+    int index; // Where the key is kept on the stack.
+    bool is_string;
+    bool is_integer;
+    lua_Integer integer;
+    lua_Number number;
+    const char *string;
+    size_t length;
+} yl_lua_key_t;
+
+/**
+ * Convert a float to an integer if it's in range, rounding with ceil or floor.
+ */
+static bool float_to_integer(lua_Number f, lua_Number (*round)(lua_Number), lua_Integer *i)
+{
+    f = round(f);
+    if (f >= -(lua_Number)LUA_MININTEGER || f < (lua_Number)LUA_MININTEGER)
+        return false;
+    *i = (lua_Integer)f;
+    return true;
+}
+
+/**
+ * Exact number comparison, as Lua's `<` operator does it.
+ */
+static bool number_less_than(const yl_lua_key_t *left, const yl_lua_key_t *right)
+{
+    lua_Integer i;
+
+    if (left->is_integer && right->is_integer)
+        return left->integer < right->integer;
+    if (!left->is_integer && !right->is_integer)
+        return left->number < right->number;
+
+    if (left->is_integer) {
+        // i < f <=> i < ceil(f)
+        if (INT_FITS_FLOAT(left->integer))
+            return (lua_Number)left->integer < right->number;
+        if (float_to_integer(right->number, ceil, &i))
+            return left->integer < i;
+        return right->number > 0;
+    }
+
+    // f < i <=> floor(f) < i
+    if (INT_FITS_FLOAT(right->integer))
+        return left->number < (lua_Number)right->integer;
+    if (float_to_integer(left->number, floor, &i))
+        return i < right->integer;
+    return left->number < 0;
+}
+
+/**
+ * String comparison, as Lua's `<` operator does it: with strcoll, one
+ * NUL-separated piece at a time.
+ */
+static int compare_strings(const char *l, size_t ll, const char *r, size_t lr)
+{
+    for (;;) {
+        int temp = strcoll(l, r);
+        if (temp != 0)
+            return temp;
+
+        size_t len = strlen(l);
+        if (len == lr)
+            return len == ll ? 0 : 1;
+        else if (len == ll)
+            return -1;
+
+        // Both strings are equal up to a NUL; compare what follows it.
+        ++len;
+        l += len;
+        ll -= len;
+        r += len;
+        lr -= len;
+    }
+}
+
+/**
+ * Order keys like yl_lua_compare(): numbers (by type tag) before strings, then
+ * by value.
+ */
+static int compare_keys(const void *a, const void *b)
+{
+    const yl_lua_key_t *left = a;
+    const yl_lua_key_t *right = b;
+
+    if (left->is_string != right->is_string)
+        return left->is_string ? 1 : -1;
+    if (left->is_string)
+        return compare_strings(left->string, left->length, right->string, right->length);
+    if (number_less_than(left, right))
+        return -1;
+    return number_less_than(right, left) ? 1 : 0;
+}
+
+bool yl_lua_push_sorted_keys(lua_State *L, int index, int *count)
+{
+    index = lua_absindex(L, index);
+    int base = lua_gettop(L);
+
+    yl_lua_key_t inline_keys[INLINE_KEYS];
+    yl_lua_key_t *keys = inline_keys;
+    size_t capacity = INLINE_KEYS;
+    size_t length = 0;
+
+    if (lua_type(L, index) != LUA_TTABLE || !lua_checkstack(L, 3))
+        return false;
+
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        lua_pop(L, 1); // Discard value, we don't need it.
+        // -1: key; base + 1 ... base + length: keys so far
+
+        int type = lua_type(L, -1);
+        if (type != LUA_TNUMBER && type != LUA_TSTRING)
+            goto fallback;
+        if (!lua_checkstack(L, 3))
+            goto fallback;
+
+        if (length == capacity) {
+            yl_lua_key_t *resized = malloc(sizeof(yl_lua_key_t) * capacity * 2);
+            if (resized == NULL)
+                goto fallback;
+            memcpy(resized, keys, sizeof(yl_lua_key_t) * length);
+            if (keys != inline_keys)
+                free(keys);
+            keys = resized;
+            capacity *= 2;
+        }
+
+        // Keep the key where it is, so strings stay referenced, and iterate with a copy.
+        yl_lua_key_t *key = &keys[length++];
+        key->index = lua_gettop(L);
+        key->is_string = type == LUA_TSTRING;
+        if (key->is_string) {
+            key->string = lua_tolstring(L, -1, &key->length);
+        } else {
+            key->is_integer = lua_isinteger(L, -1);
+            if (key->is_integer)
+                key->integer = lua_tointeger(L, -1);
+            else
+                key->number = lua_tonumber(L, -1);
+        }
+        lua_pushvalue(L, -1);
+    }
+
+    qsort(keys, length, sizeof(yl_lua_key_t), compare_keys);
+
+    // Move each key to its sorted position, following the cycles of the
+    // permutation with one spare stack slot.
+    for (size_t start = 0; start < length; ++start) {
+        if (keys[start].index == 0)
+            continue;
+
+        int first = base + 1 + (int)start;
+        lua_pushvalue(L, first);
+        size_t position = start;
+        for (;;) {
+            int source = keys[position].index;
+            keys[position].index = 0; // Done.
+            if (source == first) {
+                lua_copy(L, -1, base + 1 + (int)position);
+                break;
+            }
+            lua_copy(L, source, base + 1 + (int)position);
+            position = source - base - 1;
+        }
+        lua_pop(L, 1);
+    }
+
+    if (keys != inline_keys)
+        free(keys);
+    *count = (int)length;
+    return true;
+
+fallback:
+    if (keys != inline_keys)
+        free(keys);
+    lua_settop(L, base);
+    return false;
+}
+
+/*
+ * Tables built from YAML (or passed through the sequence() and mapping() helpers)
+ * remember what kind of collection they are, in a weak-keyed registry table, so
+ * Lua code can use them like any other table. The value for a table is:
+ *
+ *  - an integer, for a sequence of that length;
+ *  - a list of keys in insertion order, for an ordered mapping;
+ *  - false, for any other mapping.
+ */
+static const char yl_kinds_key = 0;
+
+static void push_kinds(lua_State *L)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &yl_kinds_key) == LUA_TTABLE)
+        return;
+
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_createtable(L, 0, 1);
+    lua_pushstring(L, "k");
+    lua_setfield(L, -2, "__mode");
+    lua_setmetatable(L, -2);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &yl_kinds_key);
+}
+
+/**
+ * Set the kind of the table at @p index to the value on the top of the stack,
+ * which is popped.
+ */
+static void set_kind(lua_State *L, int index)
+{
+    yl_state(L)->marked_kinds = true;
+    index = lua_absindex(L, index);
+    push_kinds(L);
+    lua_pushvalue(L, index);
+    lua_pushvalue(L, -3);
+    lua_rawset(L, -3);
+    lua_pop(L, 2); // Pop the kinds and the kind.
+}
+
+bool yl_lua_push_ordered_keys(lua_State *L, int index, int *count)
+{
+    // Without --preserve-order, no table has a key order to look up.
+    if (!yl_state(L)->ordered_keys)
+        return false;
+
+    index = lua_absindex(L, index);
+    int base = lua_gettop(L);
+
+    if (!lua_checkstack(L, 5))
+        return false;
+
+    push_kinds(L);
+    lua_pushvalue(L, index);
+    if (lua_rawget(L, -2) != LUA_TTABLE) {
+        lua_settop(L, base);
+        return false;
+    }
+    lua_remove(L, -2); // Remove the kinds.
+    int list = base + 1;
+
+    int length = (int)lua_rawlen(L, list);
+    if (!lua_checkstack(L, length + 5)) {
+        lua_settop(L, base);
+        return false;
+    }
+
+    // Keys deleted since the table was built are skipped.
+    int listed = 0;
+    for (int i = 1; i <= length; ++i) {
+        lua_rawgeti(L, list, i);
+        lua_pushvalue(L, -1);
+        if (lua_rawget(L, index) == LUA_TNIL) {
+            lua_pop(L, 2);
+            continue;
+        }
+        lua_pop(L, 1);
+        ++listed;
+    }
+
+    // Keys added since the table was built go after the listed ones, sorted.
+    int total = 0;
+    lua_pushnil(L);
+    while (lua_next(L, index) != 0) {
+        lua_pop(L, 1);
+        ++total;
+    }
+
+    if (total > listed) {
+        lua_createtable(L, 0, listed); // Listed keys.
+        for (int i = 1; i <= listed; ++i) {
+            lua_pushvalue(L, list + i);
+            lua_pushboolean(L, true);
+            lua_rawset(L, -3);
+        }
+        lua_createtable(L, 0, total - listed); // Added keys.
+        lua_pushnil(L);
+        while (lua_next(L, index) != 0) {
+            lua_pop(L, 1);
+            lua_pushvalue(L, -1);
+            if (lua_rawget(L, -4) == LUA_TNIL) {
+                lua_pushvalue(L, -2);
+                lua_pushboolean(L, true);
+                lua_rawset(L, -5);
+            }
+            lua_pop(L, 1);
+        }
+        // -1: added keys; -2: listed keys
+        lua_remove(L, -2);
+
+        int added = list + listed + 1;
+        int extra;
+        if (!yl_lua_push_sorted_keys(L, added, &extra)) {
+            if (yl_lua_sort_keys(L, added) != YL_NO_ERROR) {
+                lua_settop(L, base);
+                return false;
+            }
+            extra = (int)lua_rawlen(L, -1);
+            if (!lua_checkstack(L, extra + 5)) {
+                lua_settop(L, base);
+                return false;
+            }
+            int sorted = lua_gettop(L);
+            for (int i = 1; i <= extra; ++i)
+                lua_rawgeti(L, sorted, i);
+            lua_remove(L, sorted);
+        }
+        lua_remove(L, added);
+        listed += extra;
+    }
+
+    lua_remove(L, list);
+    *count = listed;
+    return true;
+}
+
 yl_error_type_t yl_lua_sort_array(lua_State *L, int index)
 {
     index = lua_absindex(L, index);
@@ -107,6 +439,65 @@ yl_error_type_t yl_lua_sort_array(lua_State *L, int index)
     return YL_NO_ERROR;
 }
 
+/**
+ * If the table at @p index is marked with its kind, push its length (or nil, for
+ * a mapping) and return true. A sequence whose length changed since it was marked
+ * (its last element is gone, or there is one past the end) is treated as unmarked.
+ */
+static bool push_marked_length(lua_State *L, int index)
+{
+    // Until a table builder or sequence() or mapping() marks a table, none is.
+    if (!yl_state(L)->marked_kinds)
+        return false;
+
+    push_kinds(L);
+    lua_pushvalue(L, index);
+    int kind = lua_rawget(L, -2);
+    lua_remove(L, -2); // Remove the kinds.
+
+    if (kind == LUA_TBOOLEAN || kind == LUA_TTABLE) {
+        lua_pop(L, 1);
+        lua_pushnil(L); // A mapping.
+        return true;
+    }
+
+    if (kind == LUA_TNUMBER) {
+        lua_Integer length = lua_tointeger(L, -1);
+        bool last = length == 0 || lua_rawgeti(L, index, length) != LUA_TNIL;
+        bool past_end = lua_rawgeti(L, index, length + 1) != LUA_TNIL;
+        lua_pop(L, length == 0 ? 1 : 2);
+        if (last && !past_end)
+            return true; // Leave the length.
+    }
+
+    lua_pop(L, 1);
+    return false;
+}
+
+int yl_lua_sequence(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    lua_pushinteger(L, (lua_Integer)lua_rawlen(L, 1));
+    set_kind(L, 1);
+    return 1;
+}
+
+int yl_lua_mapping(lua_State *L)
+{
+    luaL_checktype(L, 1, LUA_TTABLE);
+    lua_settop(L, 1);
+    push_kinds(L);
+    lua_pushvalue(L, 1);
+    if (lua_rawget(L, -2) != LUA_TTABLE) {
+        // Keep the key order of an ordered mapping.
+        lua_pushboolean(L, false);
+        set_kind(L, 1);
+    }
+    lua_settop(L, 1);
+    return 1;
+}
+
 yl_error_type_t yl_lua_get_length(lua_State *L, int index)
 {
     index = lua_absindex(L, index);
@@ -134,6 +525,8 @@ yl_error_type_t yl_lua_get_length(lua_State *L, int index)
 
         lua_pushnil(L); // No length, this is a mapping.
         return YL_NO_ERROR;
+    } else if (push_marked_length(L, index)) {
+        return YL_NO_ERROR;
     } else {
         // If there's no metatable, get the "n" field if it exists,
         // or use the raw length operator.
@@ -166,16 +559,19 @@ yl_error_type_t yl_lua_get_length(lua_State *L, int index)
     return YL_NO_ERROR;
 }
 
+void yl_lua_register_chunk(lua_State *L, const char *source)
+{
+    yl_chunk_cache_insert(L, source, true);
+}
+
 int yl_lua_execute_lua(lua_State *L, const char *buf)
 {
     int base = lua_gettop(L);
     lua_pushcfunction(L, yl_lua_error_handler);
 
-    const char *retline = lua_pushfstring(L, "return %s;", buf);
-    int status = luaL_loadbufferx(L, retline, strlen(retline), buf, "t");
-    lua_remove(L, base + 2); // Remove retline.
+    int status = yl_chunk_cache_load(L, buf);
     if (status == LUA_OK)
-        status = lua_pcall(L, 0, 1, base + 1);
+        status = yl_profile_pcall(L, 0, 1, base + 1);
 
     lua_remove(L, base + 1); // Remove the error_handler.
     return status;
@@ -183,21 +579,25 @@ int yl_lua_execute_lua(lua_State *L, const char *buf)
 
 int yl_lua_execute_lua_function(lua_State *L, const char *fnname, int nargs)
 {
-    int base = lua_gettop(L) - nargs;
-    int status = LUA_OK;
-
     // First, try to get the value as a global variable.
     int type = lua_getglobal(L, fnname);
 
     if (type == LUA_TNIL) {
         lua_pop(L, 1);
 
-        status = yl_lua_execute_lua(L, fnname);
+        int status = yl_lua_execute_lua(L, fnname);
         if (status != LUA_OK)
             return status;
     }
 
-    type = lua_type(L, -1);
+    return yl_lua_call_function(L, fnname, nargs);
+}
+
+int yl_lua_call_function(lua_State *L, const char *fnname, int nargs)
+{
+    int base = lua_gettop(L) - nargs - 1;
+
+    int type = lua_type(L, -1);
 
     if (type != LUA_TFUNCTION) {
         // Clear the stack and return an error message.
@@ -212,27 +612,45 @@ int yl_lua_execute_lua_function(lua_State *L, const char *fnname, int nargs)
     lua_pushcfunction(L, yl_lua_error_handler);
     lua_insert(L, base + 1); // Move the error handler to the bottom.
 
-    status = lua_pcall(L, nargs, 1, base + 1);
+    int status = yl_profile_pcall(L, nargs, 1, base + 1);
 
     lua_remove(L, base + 1); // Remove the error_handler.
     return status;
 }
 
-static int new_tested_table_builder(yl_lua_table_builder_t *table_builder, yaml_event_t *event, yl_error_t *err)
+static yl_lua_table_frame_t *table_frame(yl_lua_table_builder_t *table_builder, size_t depth)
 {
-    yl_lua_table_builder_t *parent = malloc(sizeof(yl_lua_table_builder_t));
-    if (parent == NULL) {
-        err->type = YL_MEMORY_ERROR;
-        err->line = event->start_mark.line;
-        err->column = event->start_mark.column;
-        err->context = "While constructing a Lua table, got memory error";
-        err->message = "unable to malloc new table builder";
-        goto error;
+    if (depth < YL_TABLE_BUILDER_INLINE_DEPTH)
+        return &table_builder->frames[depth];
+    return &table_builder->spilled[depth - YL_TABLE_BUILDER_INLINE_DEPTH];
+}
+
+static int push_table_frame(yl_lua_table_builder_t *table_builder, yaml_event_t *event, yl_error_t *err)
+{
+    size_t spilled = table_builder->depth + 1 > YL_TABLE_BUILDER_INLINE_DEPTH
+                         ? table_builder->depth + 1 - YL_TABLE_BUILDER_INLINE_DEPTH
+                         : 0;
+    if (spilled > table_builder->spilled_capacity) {
+        size_t new_capacity = table_builder->spilled_capacity ? table_builder->spilled_capacity << 1 : YL_TABLE_BUILDER_INLINE_DEPTH;
+        yl_lua_table_frame_t *frames = realloc(table_builder->spilled, new_capacity * sizeof(yl_lua_table_frame_t));
+        if (frames == NULL) {
+            err->type = YL_MEMORY_ERROR;
+            err->line = event->start_mark.line;
+            err->column = event->start_mark.column;
+            err->context = "While constructing a Lua table, got memory error";
+            err->message = "unable to realloc table builder frames";
+            goto error;
+        }
+        table_builder->spilled = frames;
+        table_builder->spilled_capacity = new_capacity;
     }
-    *parent = *table_builder;
+
+    yl_lua_table_frame_t *frame = table_frame(table_builder, table_builder->depth++);
+    frame->table_index = table_builder->table_index;
+    frame->is_mapping = table_builder->is_mapping;
+    frame->sequence_index = table_builder->sequence_index;
     table_builder->table_index = 0;
     table_builder->sequence_index = 0;
-    table_builder->parent = parent;
 
     return 1;
 
@@ -240,6 +658,66 @@ error:
     return 0;
 }
 
+/**
+ * Give the table at @p index a key order, and push its (empty) list of keys.
+ */
+static void push_key_order(lua_State *L, int index)
+{
+    yl_state(L)->ordered_keys = true;
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    set_kind(L, index);
+}
+
+/**
+ * Mark a finished table from a table builder with its kind.
+ *
+ * Mappings that look like sequences to yl_lua_get_length() (they have a first
+ * element, or an integer "n") are left unmarked, so they keep rendering as
+ * sequences.
+ */
+static void mark_table(yl_lua_table_builder_t *table_builder)
+{
+    lua_State *L = table_builder->L;
+    int index = table_builder->table_index;
+
+    if (!table_builder->is_mapping) {
+        lua_pushinteger(L, table_builder->sequence_index);
+    } else {
+        int first = lua_rawgeti(L, index, 1);
+        lua_pushstring(L, "n");
+        lua_rawget(L, index);
+        bool looks_like_sequence = first != LUA_TNIL || lua_isinteger(L, -1);
+        lua_pop(L, 2);
+
+        if (looks_like_sequence)
+            lua_pushnil(L);
+        else if (table_builder->preserve_order)
+            return; // Already marked with its key order.
+        else
+            lua_pushboolean(L, false);
+    }
+    set_kind(L, index);
+}
+
+/**
+ * Append the key about to be set to the list of keys at @p index + 1, unless the
+ * table already has it or the value is nil.
+ */
+static void record_key(lua_State *L, int index)
+{
+    // -1: value; -2: key
+    if (lua_isnil(L, -1))
+        return;
+
+    lua_pushvalue(L, -2);
+    if (lua_rawget(L, index) == LUA_TNIL) {
+        lua_pushvalue(L, -3);
+        lua_rawseti(L, index + 1, lua_rawlen(L, index + 1) + 1);
+    }
+    lua_pop(L, 1);
+}
+
 int yl_lua_table_builder(yl_lua_table_builder_t *table_builder, yaml_event_t *event, lua_State *L, yl_error_t *err)
 {
     switch (event->type) {
@@ -247,28 +725,32 @@ int yl_lua_table_builder(yl_lua_table_builder_t *table_builder, yaml_event_t *ev
     case YAML_SEQUENCE_START_EVENT:
         L = table_builder->L;
 
-        // If we're already in a table, create a nested table builder.
+        // If we're already in a table, save its state to come back to.
         if (table_builder->table_index != 0)
-            if (!new_tested_table_builder(table_builder, event, err))
+            if (!push_table_frame(table_builder, event, err))
                 goto error;
 
         lua_newtable(L);
         table_builder->is_mapping = event->type == YAML_MAPPING_START_EVENT;
         table_builder->table_index = lua_gettop(L);
+        if (table_builder->is_mapping && table_builder->preserve_order)
+            push_key_order(L, table_builder->table_index);
         break;
     case YAML_MAPPING_END_EVENT: // Fall through.
     case YAML_SEQUENCE_END_EVENT:
         // Place the newly constructed table at the top of the stack.
         L = table_builder->L;
         lua_settop(L, table_builder->table_index);
+        mark_table(table_builder);
 
-        if (table_builder->parent != NULL) {
-            // If this was a nested table, back out to the parent table builder
+        if (table_builder->depth > 0) {
+            // If this was a nested table, back out to the parent table
             // and add this table as a member of the parent by falling through
             // to the "scalar" case.
-            yl_lua_table_builder_t *parent = table_builder->parent;
-            *table_builder = *parent;
-            free(parent);
+            yl_lua_table_frame_t *frame = table_frame(table_builder, --table_builder->depth);
+            table_builder->table_index = frame->table_index;
+            table_builder->is_mapping = frame->is_mapping;
+            table_builder->sequence_index = frame->sequence_index;
         } else {
             // If it's not a nested table, we're done.
             break;
@@ -284,6 +766,8 @@ int yl_lua_table_builder(yl_lua_table_builder_t *table_builder, yaml_event_t *ev
         if (table_builder->is_mapping) {
             if ((table_builder->sequence_index & 1) == 0) {
                 // -1: value; -2: key; table_index: table
+                if (table_builder->preserve_order)
+                    record_key(L, table_builder->table_index);
                 lua_settable(L, table_builder->table_index);
             }
         } else {
@@ -304,6 +788,14 @@ error:
     return 0;
 }
 
+void yl_lua_table_builder_delete(yl_lua_table_builder_t *table_builder)
+{
+    free(table_builder->spilled);
+    table_builder->spilled = NULL;
+    table_builder->spilled_capacity = 0;
+    table_builder->depth = 0;
+}
+
 void yl_lua_value_from_scalar(lua_State *L, yaml_scalar_style_t style, size_t length, char *value)
 {
     if (style == YAML_PLAIN_SCALAR_STYLE) {
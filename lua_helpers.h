@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdbool.h>
+
 #include "lua.h"
 
 #include "error.h"
@@ -16,6 +18,41 @@
  */
 yl_error_type_t yl_lua_sort_keys(lua_State *L, int index);
 
+/**
+ * Push the keys of a table onto the stack, in the same order as yl_lua_sort_keys(),
+ * sorting them in C instead of building and sorting a Lua list.
+ *
+ * This only handles tables whose keys are all numbers and strings, which compare
+ * the same way in C as they do in Lua.
+ *
+ * @param[in,out]   L           A pointer to the Lua state.
+ * @param[in]       index       The stack index of the table.
+ * @param[out]      count       The number of keys pushed.
+ *
+ * @returns If the keys were pushed, true. If the table has other keys, or too
+ * many keys to fit on the stack, returns false and leaves the stack unchanged;
+ * use yl_lua_sort_keys() instead.
+ */
+bool yl_lua_push_sorted_keys(lua_State *L, int index, int *count);
+
+/**
+ * Push the keys of an ordered mapping onto the stack: first the keys it was built
+ * with, in source order, then any keys added since, sorted as yl_lua_sort_keys()
+ * would. Keys removed since are skipped.
+ *
+ * Tables get a key order when a table builder with @c preserve_order builds them.
+ * Until one has, on a state created by yl_allocator_new_state(), this returns
+ * false without looking the table up.
+ *
+ * @param[in,out]   L           A pointer to the Lua state.
+ * @param[in]       index       The stack index of the table.
+ * @param[out]      count       The number of keys pushed.
+ *
+ * @returns If the keys were pushed, true. If the table has no key order (or its
+ * keys don't fit on the stack), returns false and leaves the stack unchanged.
+ */
+bool yl_lua_push_ordered_keys(lua_State *L, int index, int *count);
+
 /**
  * Given an array at a given index, sort it in-place.
  *
@@ -30,6 +67,10 @@ yl_error_type_t yl_lua_sort_array(lua_State *L, int index);
 /**
  * Get the length of the table at the top of the stack without removing it.
  *
+ * Tables marked with their kind (by a table builder, or the sequence() and mapping()
+ * helpers) are answered directly. Otherwise a table is a sequence if its metatable
+ * has a length operator, it has an integer "n", it has a first element, or it is empty.
+ *
  * @param[in,out]   L           A pointer to the Lua state.
  * @param[in]       index       The stack index of the table.
  *
@@ -40,7 +81,20 @@ yl_error_type_t yl_lua_sort_array(lua_State *L, int index);
 yl_error_type_t yl_lua_get_length(lua_State *L, int index);
 
 /**
- * Execute a buffer in the Lua interpreter.
+ * Lua function sequence(t): mark @c t as a sequence of its current length, so it
+ * renders as a sequence even if empty. Returns @c t.
+ */
+int yl_lua_sequence(lua_State *L);
+
+/**
+ * Lua function mapping(t): mark @c t as a mapping, so it renders as a mapping even
+ * if empty or if its keys are 1..n. Returns @c t.
+ */
+int yl_lua_mapping(lua_State *L);
+
+/**
+ * Execute a buffer in the Lua interpreter. The compiled chunk is kept in the
+ * chunk cache, so repeated expressions are only compiled once.
  *
  * @param[in,out]   L           A pointer to the Lua state.
  * @param[in]       buf         Lua code to execute.
@@ -64,12 +118,52 @@ int yl_lua_execute_lua(lua_State *L, const char *buf);
  */
 int yl_lua_execute_lua_function(lua_State *L, const char *fnname, int nargs);
 
+/**
+ * Call the value on the top of the stack with the @p nargs arguments below it,
+ * as yl_lua_execute_lua_function() does once it has found the function.
+ *
+ * @param[in,out]   L           A pointer to the Lua state.
+ * @param[in]       fnname      The "name" of the function, for error messages.
+ * @param[in]       nargs       The number of arguments on the stack to pass.
+ *
+ * @returns One of LUA_OK, LUA_ERRRUN, LUA_ERRMEM, or LUA_ERRERR. On return,
+ * leaves one return value or error message on the Lua stack.
+ */
+int yl_lua_call_function(lua_State *L, const char *fnname, int nargs);
+
+/**
+ * Register a precompiled chunk, so that yl_lua_execute_lua() and
+ * yl_lua_execute_lua_function() call it instead of compiling @p source.
+ * Registered chunks are pinned in the chunk cache and never evicted.
+ *
+ * @param[in,out]   L           A pointer to the Lua state, with the compiled
+ *                              function on the top of the stack. It is popped.
+ * @param[in]       source      The code the function was compiled from, exactly
+ *                              as it will be passed to the execute functions.
+ */
+void yl_lua_register_chunk(lua_State *L, const char *source);
+
+// Nesting depth a table builder tracks without allocating.
+#define YL_TABLE_BUILDER_INLINE_DEPTH 16
+
+typedef struct _yl_lua_table_frame_s {
+    int table_index;
+    bool is_mapping;
+    long int sequence_index; // Also used to track alternating keys/values in mappings.
+} yl_lua_table_frame_t;
+
 typedef struct _yl_lua_table_builder_s {
     lua_State *L;
+    bool preserve_order; // Give mappings a key order, see yl_lua_push_ordered_keys().
     int table_index;
     bool is_mapping;
     long int sequence_index; // Also used to track alternating keys/values in mappings.
-    struct _yl_lua_table_builder_s *parent;
+
+    // The tables enclosing the current one, innermost last.
+    size_t depth;
+    yl_lua_table_frame_t frames[YL_TABLE_BUILDER_INLINE_DEPTH];
+    yl_lua_table_frame_t *spilled; // Frames beyond the inline ones.
+    size_t spilled_capacity;
 } yl_lua_table_builder_t;
 
 /**
@@ -77,6 +171,11 @@ typedef struct _yl_lua_table_builder_s {
  */
 int yl_lua_table_builder(yl_lua_table_builder_t *table_builder, yaml_event_t *event, lua_State *L, yl_error_t *err);
 
+/**
+ * Free any frames a table builder allocated for deeply nested tables.
+ */
+void yl_lua_table_builder_delete(yl_lua_table_builder_t *table_builder);
+
 /**
  * Convert a plain scalar to a Lua value.
  */
@@ -1,21 +1,61 @@
 #include <argp.h>
 #include <stdbool.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "lauxlib.h"
 #include "lua.h"
 #include "yaml.h"
 
+#include "allocator.h"
+#include "batch.h"
+#include "budget.h"
+#include "cache.h"
+#include "chunk_cache.h"
+#include "compiler.h"
+#include "daemon.h"
+#include "emitter.h"
 #include "environment.h"
 #include "executor.h"
+#include "json.h"
+#include "parallel.h"
 #include "parser.h"
+#include "profile.h"
 #include "render.h"
 #include "test.h"
+#include "timing.h"
+#include "watch.h"
+#include "writer.h"
 
 const char *argp_program_version = "yl 0.0.0";
 const char *argp_program_bug_address = "https://github.com/Sibilance/ffffff/issues";
 static char doc[] = "Render a YL template.";
 static char args_doc[] = "[FILENAME]...";
+
+// Keys for options without a short form.
+enum {
+    OPT_NO_MMAP = 256,
+    OPT_PARALLEL_DOCUMENTS,
+    OPT_CACHE_DIR,
+    OPT_CHUNK_CACHE_SIZE,
+    OPT_COMPILE,
+    OPT_PRESERVE_ORDER,
+    OPT_NATIVE_WRITER,
+    OPT_FORMAT,
+    OPT_MEMORY_STATS,
+    OPT_MAX_INSTRUCTIONS,
+    OPT_MAX_TIME,
+    OPT_MAX_MEMORY,
+    OPT_VERBATIM,
+    OPT_WATCH,
+    OPT_DAEMON,
+    OPT_CLIENT,
+    OPT_DAEMON_STATS,
+    OPT_PROFILE,
+    OPT_PROFILE_FOLDED,
+};
+
 static struct argp_option options[] = {
     {"in", 'i', "FILE", 0, "Input file to read from.", 0},
     {"out", 'o', "FILE", 0, "Output file to write to.", 0},
@@ -25,7 +65,59 @@ static struct argp_option options[] = {
                         "with a document containing a sequence of mappings annotated with !testcases. "
                         "Keys from these mappings are set as global variables in each test case. The "
                         "number of expected output documents must equal the length of the !testcases "
-                        "sequence.",
+                        "sequence. Given several FILENAMEs, runs them concurrently and prints one status "
+                        "line per file.",
+     0},
+    {"timing", 'T', 0, 0, "Report the time spent reading and parsing the input, and with --test that of each case, on stderr.", 0},
+    {"memory-stats", OPT_MEMORY_STATS, 0, 0, "Report the peak and total bytes Lua allocated for each document on stderr.", 0},
+    {"profile", OPT_PROFILE, 0, 0, "Report the calls, self and total time, and bytes Lua allocated of the expressions at each "
+                                   "template line and column on stderr, those with the most self time first.",
+     0},
+    {"profile-folded", OPT_PROFILE_FOLDED, "FILE", 0, "Write the self time of the expressions, in microseconds, to FILE as "
+                                                      "folded stacks of the template nodes enclosing them, for flame graph tools.",
+     0},
+    {"no-mmap", OPT_NO_MMAP, 0, 0, "Read the input through stdio even if it could be memory-mapped.", 0},
+    {"cache-dir", OPT_CACHE_DIR, "DIR", 0, "Keep compiled templates (parsed events and Lua bytecode) in DIR, keyed by the SHA-256 "
+                                           "of the template, and use them instead of parsing and compiling unchanged templates. "
+                                           "The bytecode isn't verified, so DIR must belong to you and be writable by nobody else.",
+     0},
+    {"chunk-cache-size", OPT_CHUNK_CACHE_SIZE, "N", 0, "Keep the compiled functions of up to N distinct expressions, evicting the least "
+                                                       "recently used (default: 1024, 0 to disable).",
+     0},
+    {"compile", OPT_COMPILE, 0, 0, "Read and compile the whole stream before rendering anything. Every syntax error is "
+                                   "reported up front, and expressions that read no variables are evaluated only once.",
+     0},
+    {"preserve-order", OPT_PRESERVE_ORDER, 0, 0, "Render mappings built by tagged nodes in the order of the template, instead of "
+                                                 "sorting their keys. Keys added by Lua code are rendered after them, sorted.",
+     0},
+    {"native-writer", OPT_NATIVE_WRITER, 0, 0, "Write YAML with the built-in writer instead of the libyaml emitter. The output is "
+                                               "the same, without copying every event and scalar on the way out: the "
+                                               "emitter costs about one malloc per rendered scalar, the built-in writer "
+                                               "next to none.",
+     0},
+    {"verbatim", OPT_VERBATIM, 0, 0, "Copy block collections with no ! tags in them straight from the input, with their comments "
+                                     "and formatting, instead of rendering them. Implies --native-writer; the input must be a "
+                                     "regular file.",
+     0},
+    {"format", OPT_FORMAT, "FORMAT", 0, "Output format: yaml (the default), or json. JSON is written one document per line, "
+                                        "keeping null, booleans and numbers as JSON types.",
+     0},
+    {"max-instructions", OPT_MAX_INSTRUCTIONS, "N", 0, "Fail any expression that runs more than N Lua instructions.", 0},
+    {"max-time", OPT_MAX_TIME, "SECONDS", 0, "Fail any expression that runs for longer than SECONDS.", 0},
+    {"max-memory", OPT_MAX_MEMORY, "BYTES", 0, "Fail any expression that grows the memory Lua uses by more than BYTES.", 0},
+    {"watch", OPT_WATCH, 0, 0, "Keep running, and render FILENAME into the -o file again every time it changes. Only the "
+                               "documents that changed are executed again; the output of the others is reused.",
+     0},
+    {"daemon", OPT_DAEMON, "SOCKET", 0, "Serve render requests on the Unix socket SOCKET until interrupted, keeping a warm Lua "
+                                        "state on each of the --jobs workers.",
+     0},
+    {"client", OPT_CLIENT, "SOCKET", 0, "Render on the daemon listening on SOCKET instead of in this process.", 0},
+    {"daemon-stats", OPT_DAEMON_STATS, 0, 0, "With --client, print the daemon's request latency percentiles instead of rendering.", 0},
+    {"output-dir", 'O', "DIR", 0, "Render each FILENAME into a file of the same name in DIR, concurrently.", 0},
+    {"jobs", 'j', "N", 0, "Number of worker threads when rendering several files or documents (default: one per processor).", 0},
+    {"parallel-documents", OPT_PARALLEL_DOCUMENTS, 0, 0, "Render the documents of the stream concurrently, on one Lua state per "
+                                                         "worker. Documents never see each other's globals either way. Output keeps the "
+                                                         "original document order.",
      0},
     {0}};
 
@@ -33,6 +125,29 @@ struct arguments {
     FILE *input, *output;
     bool debug;
     bool test;
+    bool timing;
+    bool memory_stats;
+    bool profile;
+    bool no_mmap;
+    bool parallel_documents;
+    bool compile;
+    bool preserve_order;
+    bool native_writer;
+    bool verbatim;
+    bool watch;
+    bool daemon_stats;
+    bool json;
+    yl_budget_t budget;
+    const char *cache_dir;
+    long chunk_cache_size;
+    const char *output_dir;
+    const char *output_path;
+    const char *daemon_socket;
+    const char *client_socket;
+    const char *profile_folded;
+    size_t jobs;
+    char **files;
+    size_t nfiles;
 };
 
 static error_t parse_opt(int key, char *arg, struct argp_state *state)
@@ -47,6 +162,7 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 'o':
         if (strcmp(arg, "-") != 0) {
             arguments->output = fopen(arg, "wb");
+            arguments->output_path = arg;
         }
         break;
     case 'd':
@@ -55,6 +171,92 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state)
     case 't':
         arguments->test = true;
         break;
+    case 'T':
+        arguments->timing = true;
+        break;
+    case OPT_MEMORY_STATS:
+        arguments->memory_stats = true;
+        break;
+    case OPT_PROFILE:
+        arguments->profile = true;
+        break;
+    case OPT_PROFILE_FOLDED:
+        arguments->profile_folded = arg;
+        break;
+    case OPT_NO_MMAP:
+        arguments->no_mmap = true;
+        break;
+    case OPT_PARALLEL_DOCUMENTS:
+        arguments->parallel_documents = true;
+        break;
+    case OPT_COMPILE:
+        arguments->compile = true;
+        break;
+    case OPT_PRESERVE_ORDER:
+        arguments->preserve_order = true;
+        break;
+    case OPT_NATIVE_WRITER:
+        arguments->native_writer = true;
+        break;
+    case OPT_VERBATIM:
+        arguments->verbatim = true;
+        arguments->native_writer = true;
+        break;
+    case OPT_WATCH:
+        arguments->watch = true;
+        break;
+    case OPT_DAEMON:
+        arguments->daemon_socket = arg;
+        break;
+    case OPT_CLIENT:
+        arguments->client_socket = arg;
+        break;
+    case OPT_DAEMON_STATS:
+        arguments->daemon_stats = true;
+        break;
+    case OPT_FORMAT:
+        if (strcmp(arg, "json") == 0)
+            arguments->json = true;
+        else if (strcmp(arg, "yaml") == 0)
+            arguments->json = false;
+        else
+            argp_error(state, "--format must be yaml or json");
+        break;
+    case OPT_MAX_INSTRUCTIONS:
+        arguments->budget.max_instructions = strtoll(arg, NULL, 10);
+        if (arguments->budget.max_instructions <= 0)
+            argp_error(state, "--max-instructions must be a positive number");
+        break;
+    case OPT_MAX_TIME:
+        arguments->budget.max_seconds = strtod(arg, NULL);
+        if (!(arguments->budget.max_seconds > 0))
+            argp_error(state, "--max-time must be a positive number");
+        break;
+    case OPT_MAX_MEMORY:
+        arguments->budget.max_memory = strtoull(arg, NULL, 10);
+        if (arguments->budget.max_memory == 0)
+            argp_error(state, "--max-memory must be a positive number");
+        break;
+    case OPT_CACHE_DIR:
+        arguments->cache_dir = arg;
+        break;
+    case OPT_CHUNK_CACHE_SIZE:
+        arguments->chunk_cache_size = strtol(arg, NULL, 10);
+        if (arguments->chunk_cache_size < 0)
+            argp_error(state, "--chunk-cache-size can't be negative");
+        break;
+    case 'O':
+        arguments->output_dir = arg;
+        break;
+    case 'j':
+        arguments->jobs = strtoul(arg, NULL, 10);
+        if (arguments->jobs == 0)
+            argp_error(state, "--jobs must be a positive number");
+        break;
+    case ARGP_KEY_ARGS:
+        arguments->files = state->argv + state->next;
+        arguments->nfiles = state->argc - state->next;
+        break;
     default:
         return ARGP_ERR_UNKNOWN;
     }
@@ -117,28 +319,6 @@ int debug_handler(lua_State *L, yaml_event_t *event, lua_State *L2, yl_error_t *
     return 1;
 }
 
-int emitter_handler(yaml_emitter_t *emitter, yaml_event_t *event, lua_State *L, yl_error_t *err)
-{
-    (void)L;
-
-    if (!yaml_emitter_emit(emitter, event))
-        goto error;
-
-    // Mark the event as consumed to prevent double free.
-    *event = (yaml_event_t){0};
-    return 1;
-
-error:
-    // Mark the event as consumed to prevent double free.
-    *event = (yaml_event_t){0};
-    err->type = (yl_error_type_t)emitter->error;
-    err->line = emitter->line;
-    err->column = emitter->column;
-    err->context = "While emitting YAML, encountered error";
-    err->message = emitter->problem;
-    return 0;
-}
-
 int main(int argc, char *argv[])
 {
     struct arguments args = {
@@ -146,12 +326,149 @@ int main(int argc, char *argv[])
         stdout,
         false,
         false,
+        false,
+        false,
+        false,
+        false,
+        false,
+        false,
+        false,
+        false,
+        false,
+        false,
+        false,
+        false,
+        {0, 0, 0},
+        NULL,
+        YL_CHUNK_CACHE_DEFAULT_CAPACITY,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        NULL,
+        0,
+        NULL,
+        0,
     };
 
     if (argp_parse(&argp, argc, argv, 0, 0, &args)) {
         return 1;
     }
 
+    if (args.parallel_documents && args.test) {
+        fprintf(stderr, "Error: --parallel-documents can't be combined with --test!\n");
+        return 1;
+    }
+
+    if (args.memory_stats && (args.parallel_documents || args.output_dir)) {
+        fprintf(stderr, "Error: --memory-stats can't be combined with --parallel-documents or --output-dir!\n");
+        return 1;
+    }
+
+    if ((args.profile || args.profile_folded) &&
+        (args.parallel_documents || args.output_dir || args.watch || args.daemon_socket || args.client_socket ||
+         (args.test && args.nfiles > 1))) {
+        fprintf(stderr, "Error: --profile and --profile-folded can only be combined with rendering or testing a single stream!\n");
+        return 1;
+    }
+
+    if (args.verbatim && (args.debug || args.test || args.json || args.compile || args.parallel_documents || args.output_dir)) {
+        fprintf(stderr, "Error: --verbatim can only be combined with YAML output of a single stream!\n");
+        return 1;
+    }
+
+    if (args.compile && args.test) {
+        fprintf(stderr, "Error: --compile can't be combined with --test!\n");
+        return 1;
+    }
+
+    if (args.daemon_stats && !args.client_socket) {
+        fprintf(stderr, "Error: --daemon-stats requires --client!\n");
+        return 1;
+    }
+
+    if (args.daemon_socket || args.client_socket) {
+        if (args.daemon_socket && args.client_socket) {
+            fprintf(stderr, "Error: --daemon and --client can't be combined!\n");
+            return 1;
+        }
+        if (args.debug || args.test || args.timing || args.memory_stats || args.compile || args.parallel_documents ||
+            args.verbatim || args.watch || args.cache_dir || args.output_dir) {
+            fprintf(stderr, "Error: --daemon and --client can only be combined with output format options!\n");
+            return 1;
+        }
+        if (args.client_socket && (args.budget.max_instructions || args.budget.max_seconds || args.budget.max_memory)) {
+            fprintf(stderr, "Error: budgets are set when starting the --daemon, not by the --client!\n");
+            return 1;
+        }
+    }
+
+    if (args.daemon_socket) {
+        yl_daemon_options_t daemon_options = {args.daemon_socket, args.jobs, args.chunk_cache_size, args.budget, stderr};
+        return yl_daemon_serve(&daemon_options);
+    }
+
+    if (args.watch) {
+        if (args.nfiles != 1 || strcmp(args.files[0], "-") == 0 || !args.output_path) {
+            fprintf(stderr, "Error: --watch requires a FILENAME and an -o file!\n");
+            return 1;
+        }
+        if (args.debug || args.test || args.compile || args.parallel_documents || args.output_dir || args.verbatim || args.memory_stats) {
+            fprintf(stderr, "Error: --watch can only be combined with output format and budget options!\n");
+            return 1;
+        }
+        if (args.output)
+            fclose(args.output);
+        yl_watch_options_t watch_options = {
+            args.files[0],
+            args.output_path,
+            args.preserve_order,
+            args.native_writer,
+            args.json,
+            args.chunk_cache_size,
+            args.budget,
+            stderr,
+        };
+        return yl_watch(&watch_options);
+    }
+
+    if (args.output_dir) {
+        if (args.debug || args.test) {
+            fprintf(stderr, "Error: --debug and --test can't be combined with --output-dir!\n");
+            return 1;
+        }
+        yl_batch_options_t batch_options = {
+            args.output_dir,
+            args.jobs,
+            !args.no_mmap,
+            args.preserve_order,
+            args.native_writer,
+            args.json,
+            args.budget,
+        };
+        return yl_batch_render(args.files, args.nfiles, &batch_options) ? 1 : 0;
+    }
+
+    if (args.test && args.nfiles > 1) {
+        if (args.debug || args.compile || args.cache_dir) {
+            fprintf(stderr, "Error: --debug, --compile and --cache-dir can't be combined with several --test files!\n");
+            return 1;
+        }
+        yl_test_options_t test_options = {args.jobs, !args.no_mmap, args.preserve_order, args.timing, args.budget,
+                                          args.chunk_cache_size};
+        return yl_test_files(args.files, args.nfiles, &test_options) ? 1 : 0;
+    }
+
+    if (args.nfiles > 1) {
+        fprintf(stderr, "Error: rendering several files requires --output-dir!\n");
+        return 1;
+    }
+    if (args.nfiles == 1 && strcmp(args.files[0], "-") != 0) {
+        if (args.input && args.input != stdin)
+            fclose(args.input);
+        args.input = fopen(args.files[0], "rb");
+    }
+
     if (!args.input) {
         fprintf(stderr, "Error opening input file!\n");
         return 1;
@@ -161,15 +478,46 @@ int main(int argc, char *argv[])
         return 1;
     }
 
+    if (args.client_socket) {
+        uint32_t flags = (args.json ? YL_DAEMON_JSON : 0) |
+                         (args.native_writer ? YL_DAEMON_NATIVE_WRITER : 0) |
+                         (args.preserve_order ? YL_DAEMON_PRESERVE_ORDER : 0) |
+                         (args.daemon_stats ? YL_DAEMON_STATS : 0);
+        int status = yl_daemon_request(args.client_socket, flags, args.input, args.output, stderr);
+        if (args.input != stdin)
+            fclose(args.input);
+        if (args.output != stdout)
+            fclose(args.output);
+        return status;
+    }
+
     yl_execution_context_t ctx = {0};
+    ctx.preserve_order = args.preserve_order;
     yaml_parser_t parser = {0};
+    yl_parser_input_t input = {0};
+    yl_timed_producer_t timed_producer = {0};
+    yl_cache_builder_t cache_builder = {0};
+    yl_cache_artifact_t cache_artifact = {0};
+    yl_event_record_t compiled = {0};
+    char *cache_path = NULL;
+    yl_cache_key_t cache_key = {0};
     yaml_emitter_t emitter = {0};
+    yl_writer_t writer = {0};
+    yl_json_writer_t json_writer = {0};
+    yl_memory_reporter_t memory_reporter = {0};
+    yl_profile_t profile = {0};
 
     if (!yaml_parser_initialize(&parser)) {
         fprintf(stderr, "Error initializing parser!\n");
         goto error;
     }
-    yaml_parser_set_input_file(&parser, args.input);
+
+    double setup_start = yl_time_now();
+    if (!yl_parser_set_input(&parser, &input, args.input, !args.no_mmap && args.input != stdin, &ctx.err)) {
+        fprintf(stderr, "Error reading input file: %s\n", ctx.err.message);
+        goto error;
+    }
+    timed_producer.seconds = yl_time_now() - setup_start;
 
     ctx.producer.callback = (yl_event_producer_callback_t *)yl_parser_parse;
     ctx.producer.data = &parser;
@@ -182,35 +530,136 @@ int main(int argc, char *argv[])
     yaml_emitter_set_encoding(&emitter, YAML_UTF8_ENCODING);
     yaml_emitter_set_output_file(&emitter, args.output);
 
-    ctx.lua = luaL_newstate();
+    if (args.native_writer && !yl_writer_initialize(&writer, args.output)) {
+        fprintf(stderr, "Error initializing writer!\n");
+        goto error;
+    }
+    if (args.json && !yl_json_writer_initialize(&json_writer, args.output)) {
+        fprintf(stderr, "Error initializing JSON writer!\n");
+        goto error;
+    }
+
+    ctx.lua = yl_allocator_new_state();
     if (ctx.lua == NULL) {
         fprintf(stderr, "Error initializing lua!\n");
         goto error;
     }
 
     yl_load_safe_libraries(ctx.lua);
+    yl_budget_set(ctx.lua, &args.budget);
+    yl_chunk_cache_set_capacity(ctx.lua, args.chunk_cache_size);
+    if (args.profile || args.profile_folded)
+        yl_profile_attach(ctx.lua, &profile);
+
+    if (args.cache_dir) {
+        const char *problem = NULL;
+        if (input.data == NULL) {
+            fprintf(stderr, "Warning: only regular input files can be cached, rendering without the cache.\n");
+        } else if ((problem = yl_cache_dir_problem(args.cache_dir)) != NULL) {
+            fprintf(stderr, "Warning: can't trust cache directory %s (%s), rendering without the cache.\n",
+                    args.cache_dir, problem);
+        } else {
+            setup_start = yl_time_now();
+            cache_key = yl_cache_key(input.data, input.length);
+            if ((cache_path = yl_cache_path(args.cache_dir, &cache_key)) == NULL) {
+                fprintf(stderr, "Error allocating cache path!\n");
+                goto error;
+            }
+            if (yl_cache_artifact_load(&cache_artifact, cache_path, &cache_key) &&
+                !yl_cache_artifact_register_chunks(&cache_artifact, ctx.lua, &ctx.err)) {
+                // Built by another Lua, say; parse the template, and replace the artifact.
+                fprintf(stderr, "Warning: could not load compiled template %s (%s), parsing the template instead.\n",
+                        cache_path, ctx.err.message);
+                lua_settop(ctx.lua, 0);
+                yl_cache_artifact_delete(&cache_artifact);
+            }
+            if (cache_artifact.data != NULL) {
+                ctx.producer.callback = (yl_event_producer_callback_t *)yl_cache_artifact_replay;
+                ctx.producer.data = &cache_artifact;
+                // Only the executor itself takes lent events.
+                if (!args.compile && !args.test && !args.parallel_documents) {
+                    ctx.producer.callback = (yl_event_producer_callback_t *)yl_cache_artifact_lend;
+                    ctx.producer.lends = true;
+                }
+            } else {
+                cache_builder.producer = ctx.producer;
+                ctx.producer.callback = (yl_event_producer_callback_t *)yl_cache_builder_record;
+                ctx.producer.data = &cache_builder;
+            }
+            timed_producer.seconds += yl_time_now() - setup_start;
+        }
+    }
+
+    if (args.timing) {
+        timed_producer.producer = ctx.producer;
+        ctx.producer.callback = (yl_event_producer_callback_t *)yl_timed_producer;
+        ctx.producer.data = &timed_producer;
+    }
+
+    if (args.compile) {
+        if (!yl_compile_stream(&ctx, &compiled, stderr)) {
+            fprintf(stderr, "Error compiling stream!\n");
+            fprintf(stderr, "%zu:%zu: %s: %s: %s\n",
+                    ctx.err.line + 1,
+                    ctx.err.column + 1,
+                    yl_error_name(ctx.err.type),
+                    ctx.err.context,
+                    ctx.err.message);
+            goto error;
+        }
+        ctx.producer.callback = (yl_event_producer_callback_t *)yl_replay_event;
+        ctx.producer.data = &compiled;
+    }
 
     ctx.consumer.callback = (yl_event_consumer_callback_t *)yl_render_event;
     if (args.debug) {
         ctx.consumer.callback = (yl_event_consumer_callback_t *)debug_handler;
         ctx.consumer.data = ctx.lua;
+    } else if (args.json) {
+        ctx.consumer.callback = (yl_event_consumer_callback_t *)yl_json_writer_write;
+        ctx.consumer.data = &json_writer;
+        ctx.consumer.borrows = true;
+    } else if (args.native_writer) {
+        ctx.consumer.callback = (yl_event_consumer_callback_t *)yl_writer_write;
+        ctx.consumer.data = &writer;
+        ctx.consumer.borrows = true;
     } else {
-        ctx.consumer.callback = (yl_event_consumer_callback_t *)emitter_handler;
+        ctx.consumer.callback = (yl_event_consumer_callback_t *)yl_emitter_emit;
         ctx.consumer.data = &emitter;
     }
 
+    if (args.verbatim) {
+        if (input.data == NULL) {
+            fprintf(stderr, "Warning: only regular input files can be copied verbatim, rendering everything.\n");
+        } else {
+            ctx.verbatim.callback = (yl_verbatim_callback_t *)yl_writer_write_verbatim;
+            ctx.verbatim.data = &writer;
+            ctx.verbatim.input = &input;
+        }
+    }
+
+    if (args.memory_stats) {
+        memory_reporter.consumer = ctx.consumer;
+        memory_reporter.lua = ctx.lua;
+        memory_reporter.report = stderr;
+        ctx.consumer.callback = (yl_event_consumer_callback_t *)yl_memory_reporter;
+        ctx.consumer.data = &memory_reporter;
+    }
+
     if (args.test) {
-        if (!yl_test_stream(&ctx)) {
+        yl_test_timing_t test_timing = {args.timing ? stderr : NULL, 0};
+        if (!yl_test_stream(&ctx, NULL, &test_timing)) {
             fprintf(stderr, "Error testing stream!\n");
-            fprintf(stderr, "%zu:%zu: %s: %s: %s\n",
+            fprintf(stderr, "%zu:%zu: %s: %s: %s (failing case: %.3f ms)\n",
                     ctx.err.line + 1,
                     ctx.err.column + 1,
                     yl_error_name(ctx.err.type),
                     ctx.err.context,
-                    ctx.err.message);
+                    ctx.err.message,
+                    test_timing.seconds * 1e3);
             goto error;
         }
-    } else if (!yl_execute_stream(&ctx)) {
+    } else if (args.parallel_documents ? !yl_execute_stream_parallel(&ctx, args.jobs) : !yl_execute_stream(&ctx)) {
         fprintf(stderr, "Error executing stream!\n");
         fprintf(stderr, "%zu:%zu: %s: %s: %s\n",
                 ctx.err.line + 1,
@@ -221,17 +670,67 @@ int main(int argc, char *argv[])
         goto error;
     }
 
+    if (cache_builder.producer.callback != NULL &&
+        !yl_cache_builder_write(&cache_builder, ctx.lua, cache_path, &cache_key, &ctx.err))
+        fprintf(stderr, "Warning: could not write compiled template %s: %s\n", cache_path, ctx.err.message);
+
+    if (args.timing)
+        fprintf(stderr, "read (%s): %.3f ms, %zu events\n",
+                cache_artifact.data ? "cache" : input.mapped ? "mmap" : "stdio",
+                timed_producer.seconds * 1e3,
+                timed_producer.events);
+
+    if (args.timing) {
+        yl_chunk_cache_stats_t stats = yl_chunk_cache_stats(ctx.lua);
+        fprintf(stderr, "chunk cache: %zu hits, %zu misses, %zu evictions, %zu/%zu entries, %zu pinned\n",
+                stats.hits,
+                stats.misses,
+                stats.evictions,
+                stats.size,
+                stats.capacity,
+                stats.pinned);
+    }
+
+    if (args.profile)
+        yl_profile_report(&profile, stderr);
+
+    if (args.profile_folded) {
+        FILE *folded = fopen(args.profile_folded, "w");
+        if (folded == NULL) {
+            fprintf(stderr, "Error opening profile file %s!\n", args.profile_folded);
+            goto error;
+        }
+        yl_profile_write_folded(&profile, folded);
+        fclose(folded);
+    }
+
     yaml_parser_delete(&parser);
+    yl_parser_input_delete(&input);
+    yl_cache_builder_delete(&cache_builder);
+    yl_cache_artifact_delete(&cache_artifact);
+    yl_event_record_delete(&compiled);
+    free(cache_path);
     yaml_emitter_delete(&emitter);
-    lua_close(ctx.lua);
+    yl_writer_delete(&writer);
+    yl_json_writer_delete(&json_writer);
+    yl_allocator_close_state(ctx.lua);
+    yl_profile_delete(&profile);
 
     return 0;
 
 error:
     yaml_parser_delete(&parser);
+    yl_parser_input_delete(&input);
+    yl_cache_builder_delete(&cache_builder);
+    yl_cache_artifact_delete(&cache_artifact);
+    yl_event_record_delete(&compiled);
+    free(cache_path);
     yaml_emitter_delete(&emitter);
+    yl_writer_delete(&writer);
+    yl_json_writer_delete(&json_writer);
     if (ctx.lua)
-        lua_close(ctx.lua);
+        yl_allocator_close_state(ctx.lua);
+    yl_profile_delete(&profile);
 
     return 1;
 }
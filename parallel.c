@@ -0,0 +1,274 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "lua.h"
+
+#include "allocator.h"
+#include "budget.h"
+#include "environment.h"
+#include "parallel.h"
+#include "pool.h"
+
+typedef struct _yl_parallel_document_s {
+    yl_event_record_t input;
+    yl_event_record_t output;
+
+    struct _yl_parallel_stream_s *stream;
+    bool done;
+    bool failed;
+    yl_error_t err;
+    char message[1024]; // Copied out of the worker's Lua state before its next document.
+} yl_parallel_document_t;
+
+typedef struct _yl_parallel_stream_s {
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+
+    // A ring of in-flight documents, oldest at head.
+    yl_parallel_document_t *documents;
+    size_t capacity;
+    size_t head, length;
+
+    bool preserve_order;
+    yl_budget_t budget;
+    lua_State **states; // One per worker, created on its first document.
+} yl_parallel_stream_t;
+
+static void execute_document(yl_parallel_document_t *document, size_t worker)
+{
+    yl_execution_context_t ctx = {0};
+    yaml_event_t event = {0};
+
+    ctx.producer.callback = (yl_event_producer_callback_t *)yl_replay_event;
+    ctx.producer.data = &document->input;
+    ctx.consumer.callback = (yl_event_consumer_callback_t *)yl_record_event;
+    ctx.consumer.data = &document->output;
+    ctx.preserve_order = document->stream->preserve_order;
+
+    // Each document runs on the globals of the frozen base environment, so the
+    // worker's state can be reused for every document it's given.
+    lua_State **state = &document->stream->states[worker];
+    if (*state == NULL) {
+        if ((*state = yl_allocator_new_state()) == NULL) {
+            ctx.err.type = YL_MEMORY_ERROR;
+            ctx.err.context = "While executing a document in parallel, got error";
+            ctx.err.message = "could not initialize lua";
+            goto error;
+        }
+        yl_load_safe_libraries(*state);
+        yl_budget_set(*state, &document->stream->budget);
+    }
+    ctx.lua = *state;
+
+    if (!yl_replay_event(&document->input, &event, &ctx.err))
+        goto error;
+    if (!yl_execute_document(&ctx, &event))
+        goto error;
+
+    yaml_event_delete(&event);
+    goto done;
+
+error:
+    yaml_event_delete(&event);
+    document->failed = true;
+    document->err = ctx.err;
+    if (ctx.err.message != NULL) {
+        snprintf(document->message, sizeof(document->message), "%s", ctx.err.message);
+        document->err.message = document->message;
+    }
+
+done:
+    if (ctx.lua)
+        lua_settop(ctx.lua, 0);
+    // The input is no longer needed; free it now rather than in order.
+    yl_event_record_delete(&document->input);
+
+    pthread_mutex_lock(&document->stream->lock);
+    document->done = true;
+    pthread_cond_broadcast(&document->stream->done);
+    pthread_mutex_unlock(&document->stream->lock);
+}
+
+/**
+ * Wait for the oldest in-flight document, then pass its rendered events on.
+ */
+static int flush_document(yl_execution_context_t *ctx, yl_parallel_stream_t *stream)
+{
+    yl_parallel_document_t *document = &stream->documents[stream->head];
+
+    pthread_mutex_lock(&stream->lock);
+    while (!document->done)
+        pthread_cond_wait(&stream->done, &stream->lock);
+    pthread_mutex_unlock(&stream->lock);
+
+    stream->head = (stream->head + 1) % stream->capacity;
+    --stream->length;
+
+    if (document->failed) {
+        ctx->err = document->err;
+        if (document->err.message == document->message) {
+            // Keep the message alive on the caller's Lua stack, like any other error.
+            ctx->err.message = lua_pushstring(ctx->lua, document->message);
+        }
+        goto error;
+    }
+
+    if (!yl_replay_record(&document->output, &ctx->consumer, &ctx->err))
+        goto error;
+
+    yl_event_record_delete(&document->output);
+    return 1;
+
+error:
+    yl_event_record_delete(&document->output);
+    return 0;
+}
+
+static int record_document(yl_execution_context_t *ctx, yaml_event_t *event, yl_event_record_t *record)
+{
+    bool done = false;
+    while (!done) {
+        done = event->type == YAML_DOCUMENT_END_EVENT;
+
+        if (!yl_record_event(record, event, NULL, &ctx->err))
+            return 0;
+
+        if (!done && !ctx->producer.callback(ctx->producer.data, event, &ctx->err))
+            return 0;
+    }
+
+    return 1;
+}
+
+static void close_states(yl_parallel_stream_t *stream, size_t jobs)
+{
+    if (stream->states == NULL)
+        return;
+    for (size_t i = 0; i < jobs; ++i)
+        if (stream->states[i] != NULL)
+            yl_allocator_close_state(stream->states[i]);
+    free(stream->states);
+}
+
+int yl_execute_stream_parallel(yl_execution_context_t *ctx, size_t jobs)
+{
+    yaml_event_t next_event = {0};
+    yl_pool_t pool = {0};
+    yl_parallel_stream_t stream = {0};
+    bool pool_started = false;
+
+    if (jobs == 0)
+        jobs = yl_pool_default_size();
+
+    // Bound the documents held in memory while still keeping every worker busy.
+    stream.capacity = jobs * 4;
+    stream.preserve_order = ctx->preserve_order;
+    stream.budget = yl_budget_get(ctx->lua);
+    stream.states = calloc(jobs, sizeof(lua_State *));
+    stream.documents = stream.states ? calloc(stream.capacity, sizeof(yl_parallel_document_t)) : NULL;
+    if (stream.documents == NULL) {
+        ctx->err.type = YL_MEMORY_ERROR;
+        ctx->err.line = 0;
+        ctx->err.column = 0;
+        ctx->err.context = "While executing a stream in parallel, got memory error";
+        ctx->err.message = "unable to allocate reorder buffer";
+        goto error;
+    }
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.done, NULL);
+
+    if (!yl_pool_initialize(&pool, jobs)) {
+        ctx->err.type = YL_EXECUTION_ERROR;
+        ctx->err.line = 0;
+        ctx->err.column = 0;
+        ctx->err.context = "While executing a stream in parallel, got error";
+        ctx->err.message = "unable to start worker threads";
+        goto error;
+    }
+    pool_started = true;
+
+    bool done = false;
+    while (!done) {
+        if (!ctx->producer.callback(ctx->producer.data, &next_event, &ctx->err))
+            goto error;
+
+        switch (next_event.type) {
+        case YAML_STREAM_START_EVENT:
+            if (!ctx->consumer.callback(ctx->consumer.data, &next_event, NULL, &ctx->err))
+                goto error;
+            break;
+        case YAML_DOCUMENT_START_EVENT: {
+            if (stream.length == stream.capacity)
+                if (!flush_document(ctx, &stream))
+                    goto error;
+
+            size_t index = (stream.head + stream.length) % stream.capacity;
+            yl_parallel_document_t *document = &stream.documents[index];
+            *document = (yl_parallel_document_t){0};
+            document->stream = &stream;
+            ++stream.length;
+
+            if (!record_document(ctx, &next_event, &document->input)) {
+                document->done = true;
+                yl_event_record_delete(&document->input);
+                goto error;
+            }
+
+            if (!yl_pool_submit(&pool, (yl_pool_task_callback_t *)execute_document, document)) {
+                document->done = true;
+                yl_event_record_delete(&document->input);
+                ctx->err.type = YL_MEMORY_ERROR;
+                ctx->err.line = next_event.start_mark.line;
+                ctx->err.column = next_event.start_mark.column;
+                ctx->err.context = "While executing a stream in parallel, got memory error";
+                ctx->err.message = "unable to queue document";
+                goto error;
+            }
+        } break;
+        case YAML_STREAM_END_EVENT:
+            while (stream.length > 0)
+                if (!flush_document(ctx, &stream))
+                    goto error;
+
+            if (!ctx->consumer.callback(ctx->consumer.data, &next_event, NULL, &ctx->err))
+                goto error;
+            done = true;
+            break;
+        default:
+            ctx->err.type = YL_EXECUTION_ERROR;
+            ctx->err.line = next_event.start_mark.line;
+            ctx->err.column = next_event.start_mark.column;
+            ctx->err.context = "While executing a stream, got unexpected event";
+            ctx->err.message = yl_event_name(next_event.type);
+            goto error;
+        }
+
+        yaml_event_delete(&next_event);
+    }
+
+    yl_pool_delete(&pool);
+    close_states(&stream, jobs);
+    pthread_mutex_destroy(&stream.lock);
+    pthread_cond_destroy(&stream.done);
+    free(stream.documents);
+    return 1;
+
+error:
+    yaml_event_delete(&next_event);
+    if (pool_started)
+        yl_pool_delete(&pool); // Let in-flight documents finish before freeing them.
+    if (stream.documents != NULL) {
+        for (size_t i = 0; i < stream.length; ++i) {
+            yl_parallel_document_t *document = &stream.documents[(stream.head + i) % stream.capacity];
+            yl_event_record_delete(&document->input);
+            yl_event_record_delete(&document->output);
+        }
+        pthread_mutex_destroy(&stream.lock);
+        pthread_cond_destroy(&stream.done);
+    }
+    free(stream.documents);
+    close_states(&stream, jobs);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "executor.h"
+
+/**
+ * Execute a stream whose documents are independent of each other, rendering
+ * several documents at once.
+ *
+ * Each document is recorded from the producer and handed to a worker thread,
+ * which executes it on that worker's Lua state and records the rendered events.
+ * A reorder buffer passes the rendered documents to the consumer in their
+ * original order. Since each document starts from the frozen base environment,
+ * globals set in one document are never visible in another.
+ *
+ * @param[in,out]   ctx         The execution context. Its Lua state only holds
+ *                              error messages and the budget documents run
+ *                              with; documents never run on it.
+ * @param[in]       jobs        Worker threads; 0 for one per processor.
+ *
+ * @returns On success, returns @c 1. On failure, returns @c 0 with the error of
+ * the first failing document in @c ctx->err.
+ */
+int yl_execute_stream_parallel(yl_execution_context_t *ctx, size_t jobs);
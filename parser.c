@@ -1,5 +1,87 @@
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "parser.h"
 
+int yl_parser_set_input(yaml_parser_t *parser, yl_parser_input_t *input, FILE *file, bool allow_mmap, yl_error_t *err)
+{
+    struct stat st;
+
+    *input = (yl_parser_input_t){0};
+
+    // Pipes, terminals and the like can't be mapped; read them through stdio.
+    if (!allow_mmap || fstat(fileno(file), &st) != 0 || !S_ISREG(st.st_mode)) {
+        yaml_parser_set_input_file(parser, file);
+        return 1;
+    }
+
+    if (st.st_size == 0) {
+        // mmap() rejects empty mappings, and libyaml wants a non-NULL string.
+        input->data = (const unsigned char *)"";
+        yaml_parser_set_input_string(parser, input->data, 0);
+        return 1;
+    }
+
+    void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fileno(file), 0);
+    if (data == MAP_FAILED) {
+        err->type = YL_READER_ERROR;
+        err->line = 0;
+        err->column = 0;
+        err->context = "While mapping the input file, got error";
+        err->message = strerror(errno);
+        return 0;
+    }
+    // The scanner only moves forward, so let the kernel read ahead aggressively.
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+
+    input->data = data;
+    input->length = st.st_size;
+    input->mapped = true;
+    yaml_parser_set_input_string(parser, input->data, input->length);
+
+    return 1;
+}
+
+void yl_parser_input_delete(yl_parser_input_t *input)
+{
+    if (input->mapped)
+        munmap((void *)input->data, input->length);
+
+    *input = (yl_parser_input_t){0};
+}
+
+int yl_parser_input_offset(yl_parser_input_t *input, size_t index, size_t *offset)
+{
+    const unsigned char *data = input->data;
+    size_t length = input->length;
+
+    if (length >= 2 && ((data[0] == 0xFE && data[1] == 0xFF) || (data[0] == 0xFF && data[1] == 0xFE)))
+        return 0; // UTF-16.
+
+    if (index < input->cursor_index || input->cursor_offset == 0) {
+        // The parser skips a byte order mark without counting it.
+        input->cursor_index = 0;
+        input->cursor_offset = length >= 3 && memcmp(data, "\xEF\xBB\xBF", 3) == 0 ? 3 : 0;
+    }
+
+    size_t i = input->cursor_index, o = input->cursor_offset;
+    while (i < index) {
+        if (o == length)
+            return 0;
+        // Skip the continuation bytes of the character.
+        for (++o; o < length && (data[o] & 0xC0) == 0x80; ++o)
+            ;
+        ++i;
+    }
+
+    input->cursor_index = i;
+    input->cursor_offset = o;
+    *offset = o;
+    return 1;
+}
+
 int yl_parser_parse(yaml_parser_t *parser, yaml_event_t *event, yl_error_t *err)
 {
     *event = (yaml_event_t){0};
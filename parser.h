@@ -8,4 +8,51 @@
 
 #include "error.h"
 
+/**
+ * The source bytes backing a parser.
+ *
+ * When the input is a regular file it is memory-mapped and handed to libyaml as a
+ * string, so the scanner reads straight from the page cache. Otherwise @c data is
+ * @c NULL and libyaml reads the @c FILE through stdio.
+ */
+typedef struct _yl_parser_input_s {
+    const unsigned char *data;
+    size_t length;
+    bool mapped;
+
+    // A character index and its byte offset, to resume yl_parser_input_offset() from.
+    size_t cursor_index, cursor_offset;
+} yl_parser_input_t;
+
+/**
+ * Attach a file to the parser, memory-mapping it when possible.
+ *
+ * @param[in,out]   parser      An initialized parser.
+ * @param[out]      input       Receives the mapping, which must outlive the parser.
+ * @param[in]       file        The file to read from.
+ * @param[in]       allow_mmap  If false, always read through stdio.
+ * @param[out]      err         Error details.
+ *
+ * @returns On success, returns @c 1. If the file could not be mapped, returns @c 0.
+ */
+int yl_parser_set_input(yaml_parser_t *parser, yl_parser_input_t *input, FILE *file, bool allow_mmap, yl_error_t *err);
+
+/**
+ * Unmap the input set by yl_parser_set_input(), if it was mapped.
+ */
+void yl_parser_input_delete(yl_parser_input_t *input);
+
+/**
+ * Find the byte offset of a character index of a mark, as the parser counts them.
+ * Converting marks in increasing order takes time linear in the input.
+ *
+ * @param[in,out]   input       The input set by yl_parser_set_input(), with @c data.
+ * @param[in]       index       The character index.
+ * @param[out]      offset      The byte offset.
+ *
+ * @returns On success, returns @c 1. If the input isn't UTF-8, or @p index is
+ * past its end, returns @c 0.
+ */
+int yl_parser_input_offset(yl_parser_input_t *input, size_t index, size_t *offset);
+
 int yl_parser_parse(yaml_parser_t *parser, yaml_event_t *event, yl_error_t *err);
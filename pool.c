@@ -0,0 +1,220 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "pool.h"
+
+typedef struct _yl_pool_worker_s {
+    yl_pool_t *pool;
+    size_t index;
+} yl_pool_worker_t;
+
+static int deque_push(yl_pool_deque_t *deque, yl_pool_task_t task)
+{
+    pthread_mutex_lock(&deque->lock);
+
+    if (deque->tail == deque->capacity && deque->head > 0) {
+        // Reclaim the space freed by steals before growing.
+        memmove(deque->tasks, &deque->tasks[deque->head], sizeof(yl_pool_task_t) * (deque->tail - deque->head));
+        deque->tail -= deque->head;
+        deque->head = 0;
+    }
+
+    if (deque->tail == deque->capacity) {
+        size_t new_capacity = deque->capacity << 1;
+        if (new_capacity == 0)
+            new_capacity = 16;
+
+        yl_pool_task_t *resized_tasks = realloc(deque->tasks, sizeof(yl_pool_task_t) * new_capacity);
+        if (resized_tasks == NULL) {
+            pthread_mutex_unlock(&deque->lock);
+            return 0;
+        }
+
+        deque->tasks = resized_tasks;
+        deque->capacity = new_capacity;
+    }
+
+    deque->tasks[deque->tail++] = task;
+
+    pthread_mutex_unlock(&deque->lock);
+    return 1;
+}
+
+static int deque_pop(yl_pool_deque_t *deque, yl_pool_task_t *task)
+{
+    int found = 0;
+
+    pthread_mutex_lock(&deque->lock);
+    if (deque->head < deque->tail) {
+        *task = deque->tasks[deque->head++];
+        found = 1;
+    }
+    if (deque->head == deque->tail)
+        deque->head = deque->tail = 0;
+    pthread_mutex_unlock(&deque->lock);
+
+    return found;
+}
+
+static int take_task(yl_pool_t *pool, size_t index, yl_pool_task_t *task)
+{
+    int found = deque_pop(&pool->deques[index], task);
+
+    for (size_t i = 1; !found && i < pool->nworkers; ++i)
+        found = deque_pop(&pool->deques[(index + i) % pool->nworkers], task);
+
+    if (found) {
+        pthread_mutex_lock(&pool->lock);
+        --pool->queued;
+        pthread_mutex_unlock(&pool->lock);
+    }
+
+    return found;
+}
+
+static void *worker_main(void *arg)
+{
+    yl_pool_worker_t *worker = arg;
+    yl_pool_t *pool = worker->pool;
+    size_t index = worker->index;
+    free(worker);
+
+    yl_pool_task_t task;
+    while (true) {
+        if (take_task(pool, index, &task)) {
+            task.callback(task.data, index);
+
+            pthread_mutex_lock(&pool->lock);
+            if (--pool->outstanding == 0)
+                pthread_cond_broadcast(&pool->idle);
+            pthread_mutex_unlock(&pool->lock);
+            continue;
+        }
+
+        pthread_mutex_lock(&pool->lock);
+        // A task counted in queued may still be being pushed, or mid-steal by
+        // another worker; retry rather than sleep so it is never stranded.
+        while (pool->queued == 0 && !pool->stopping)
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        bool done = pool->stopping && pool->queued == 0;
+        pthread_mutex_unlock(&pool->lock);
+
+        if (done)
+            break;
+    }
+
+    return NULL;
+}
+
+static void stop_workers(yl_pool_t *pool, size_t started)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = true;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (size_t i = 0; i < started; ++i)
+        pthread_join(pool->threads[i], NULL);
+
+    for (size_t i = 0; i < pool->nworkers; ++i) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->idle);
+    free(pool->threads);
+    free(pool->deques);
+
+    *pool = (yl_pool_t){0};
+}
+
+int yl_pool_initialize(yl_pool_t *pool, size_t nworkers)
+{
+    *pool = (yl_pool_t){0};
+
+    if (nworkers == 0)
+        nworkers = 1;
+
+    pool->threads = calloc(nworkers, sizeof(pthread_t));
+    pool->deques = calloc(nworkers, sizeof(yl_pool_deque_t));
+    if (pool->threads == NULL || pool->deques == NULL) {
+        free(pool->threads);
+        free(pool->deques);
+        *pool = (yl_pool_t){0};
+        return 0;
+    }
+
+    pool->nworkers = nworkers;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    for (size_t i = 0; i < nworkers; ++i)
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+
+    for (size_t i = 0; i < nworkers; ++i) {
+        yl_pool_worker_t *worker = malloc(sizeof(yl_pool_worker_t));
+        if (worker == NULL) {
+            stop_workers(pool, i);
+            return 0;
+        }
+        *worker = (yl_pool_worker_t){pool, i};
+
+        if (pthread_create(&pool->threads[i], NULL, worker_main, worker) != 0) {
+            free(worker);
+            stop_workers(pool, i);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int yl_pool_submit(yl_pool_t *pool, yl_pool_task_callback_t *callback, void *data)
+{
+    // Count the task before a worker can take it, so queued never drops below
+    // zero. Until it's pushed, a worker that sees it counted just retries.
+    pthread_mutex_lock(&pool->lock);
+    size_t index = pool->next_deque++ % pool->nworkers;
+    ++pool->outstanding;
+    ++pool->queued;
+    pthread_mutex_unlock(&pool->lock);
+
+    int pushed = deque_push(&pool->deques[index], (yl_pool_task_t){callback, data});
+
+    pthread_mutex_lock(&pool->lock);
+    if (pushed) {
+        pthread_cond_signal(&pool->wake);
+    } else {
+        --pool->queued;
+        if (--pool->outstanding == 0)
+            pthread_cond_broadcast(&pool->idle);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return pushed;
+}
+
+void yl_pool_wait(yl_pool_t *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    while (pool->outstanding > 0)
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void yl_pool_delete(yl_pool_t *pool)
+{
+    if (pool->threads == NULL)
+        return;
+
+    yl_pool_wait(pool);
+    stop_workers(pool, pool->nworkers);
+}
+
+size_t yl_pool_default_size(void)
+{
+    long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+    return nprocs > 0 ? (size_t)nprocs : 1;
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+/**
+ * The prototype of a pool task.
+ *
+ * @param[in,out]   data        A pointer to application data.
+ * @param[in]       worker      The index of the worker running the task, in
+ *                              @c [0, nworkers), for indexing per-worker state.
+ */
+typedef void yl_pool_task_callback_t(void *data, size_t worker);
+
+typedef struct _yl_pool_task_s {
+    yl_pool_task_callback_t *callback;
+    void *data;
+} yl_pool_task_t;
+
+/**
+ * A worker's queue of tasks. The owner and idle workers stealing from it both
+ * take from the head, so tasks start in the order they were submitted: when
+ * submitted largest first, the biggest start first and the tail of the run is
+ * small tasks.
+ */
+typedef struct _yl_pool_deque_s {
+    pthread_mutex_t lock;
+    size_t head, tail, capacity;
+    yl_pool_task_t *tasks;
+} yl_pool_deque_t;
+
+typedef struct _yl_pool_s {
+    size_t nworkers;
+    pthread_t *threads;
+    yl_pool_deque_t *deques;
+    size_t next_deque;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake; // Signalled when a task is queued or the pool stops.
+    pthread_cond_t idle; // Signalled when the last outstanding task finishes.
+    size_t queued;       // Tasks sitting in a deque, or being pushed to one.
+    size_t outstanding;  // Tasks submitted but not yet finished.
+    bool stopping;
+} yl_pool_t;
+
+/**
+ * Start a pool of worker threads.
+ *
+ * @returns On success, returns @c 1. On failure, returns @c 0 and leaves the pool
+ * zeroed.
+ */
+int yl_pool_initialize(yl_pool_t *pool, size_t nworkers);
+
+/**
+ * Queue a task on one of the workers' deques.
+ *
+ * @returns On success, returns @c 1. If the deque could not grow, returns @c 0.
+ */
+int yl_pool_submit(yl_pool_t *pool, yl_pool_task_callback_t *callback, void *data);
+
+/**
+ * Block until every submitted task has finished.
+ */
+void yl_pool_wait(yl_pool_t *pool);
+
+/**
+ * Wait for outstanding tasks, then stop and join the workers.
+ */
+void yl_pool_delete(yl_pool_t *pool);
+
+/**
+ * The number of online processors, as a default pool size.
+ */
+size_t yl_pool_default_size(void);
@@ -0,0 +1,229 @@
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "budget.h"
+#include "profile.h"
+#include "state.h"
+#include "timing.h"
+
+void yl_profile_attach(lua_State *L, yl_profile_t *profile)
+{
+    yl_state(L)->profile = profile;
+}
+
+yl_profile_t *yl_profile(lua_State *L)
+{
+    return yl_state(L)->profile;
+}
+
+void yl_profile_enter(yl_profile_t *profile, const yaml_mark_t *mark)
+{
+    // Past what fits, only the depth is counted, so leaving stays balanced.
+    if (profile->depth == profile->capacity) {
+        size_t capacity = profile->capacity ? profile->capacity * 2 : 16;
+        size_t *marks = realloc(profile->marks, capacity * 2 * sizeof(size_t));
+        if (marks == NULL) {
+            profile->incomplete = true;
+            ++profile->depth;
+            return;
+        }
+        profile->marks = marks;
+        profile->capacity = capacity;
+    }
+    if (profile->depth < profile->capacity) {
+        profile->marks[2 * profile->depth] = mark->line;
+        profile->marks[2 * profile->depth + 1] = mark->column;
+    }
+    ++profile->depth;
+}
+
+void yl_profile_leave(yl_profile_t *profile)
+{
+    if (profile->depth > 0)
+        --profile->depth;
+}
+
+void yl_profile_unwind(yl_profile_t *profile)
+{
+    profile->depth = 0;
+}
+
+static uint64_t hash_marks(const size_t *marks, size_t depth)
+{
+    // FNV-1a over the numbers.
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (size_t i = 0; i < 2 * depth; ++i) {
+        hash ^= marks[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+static yl_profile_entry_t *probe(yl_profile_entry_t *entries, size_t capacity, const size_t *marks, size_t depth)
+{
+    size_t i = hash_marks(marks, depth) & (capacity - 1);
+    while (entries[i].marks != NULL &&
+           (entries[i].depth != depth || memcmp(entries[i].marks, marks, 2 * depth * sizeof(size_t)) != 0))
+        i = (i + 1) & (capacity - 1);
+    return &entries[i];
+}
+
+/**
+ * The entry for the marks, added if it's new.
+ *
+ * @returns The entry, or @c NULL if memory ran out.
+ */
+static yl_profile_entry_t *find_entry(yl_profile_table_t *table, const size_t *marks, size_t depth)
+{
+    // Keep at most half the slots in use, so probes stay short.
+    if (2 * (table->size + 1) > table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 256;
+        yl_profile_entry_t *entries = calloc(capacity, sizeof(yl_profile_entry_t));
+        if (entries == NULL)
+            return NULL;
+        for (size_t i = 0; i < table->capacity; ++i) {
+            if (table->entries[i].marks != NULL)
+                *probe(entries, capacity, table->entries[i].marks, table->entries[i].depth) = table->entries[i];
+        }
+        free(table->entries);
+        table->entries = entries;
+        table->capacity = capacity;
+    }
+
+    yl_profile_entry_t *entry = probe(table->entries, table->capacity, marks, depth);
+    if (entry->marks == NULL) {
+        size_t *copy = malloc(2 * depth * sizeof(size_t));
+        if (copy == NULL)
+            return NULL;
+        memcpy(copy, marks, 2 * depth * sizeof(size_t));
+        *entry = (yl_profile_entry_t){0};
+        entry->marks = copy;
+        entry->depth = depth;
+        ++table->size;
+    }
+    return entry;
+}
+
+static void record(yl_profile_t *profile, double total, double self, size_t bytes)
+{
+    yl_profile_entry_t *entries[2] = {
+        find_entry(&profile->sites, profile->marks + 2 * (profile->depth - 1), 1),
+        find_entry(&profile->stacks, profile->marks, profile->depth),
+    };
+    for (int i = 0; i < 2; ++i) {
+        if (entries[i] == NULL) {
+            profile->incomplete = true;
+            continue;
+        }
+        ++entries[i]->calls;
+        entries[i]->total += total;
+        entries[i]->self += self;
+        entries[i]->bytes += bytes;
+    }
+}
+
+int yl_profile_pcall(lua_State *L, int nargs, int nresults, int msgh)
+{
+    yl_profile_t *profile = yl_state(L)->profile;
+    if (profile == NULL || profile->depth == 0)
+        return yl_budget_pcall(L, nargs, nresults, msgh);
+
+    double children = profile->children;
+    profile->children = 0;
+    size_t allocated = yl_allocator_stats(L).total;
+    double start = yl_time_now();
+
+    int status = yl_budget_pcall(L, nargs, nresults, msgh);
+
+    double elapsed = yl_time_now() - start;
+    // The statistics may have been reset in between, e.g. by a nested document.
+    size_t total = yl_allocator_stats(L).total;
+    size_t bytes = total >= allocated ? total - allocated : 0;
+    double self = elapsed - profile->children;
+    profile->children = children + elapsed;
+
+    if (profile->depth <= profile->capacity)
+        record(profile, elapsed, self, bytes);
+    else
+        profile->incomplete = true;
+    return status;
+}
+
+static int compare_self(const void *a, const void *b)
+{
+    const yl_profile_entry_t *x = *(const yl_profile_entry_t *const *)a;
+    const yl_profile_entry_t *y = *(const yl_profile_entry_t *const *)b;
+    if (x->self != y->self)
+        return x->self < y->self ? 1 : -1;
+    if (x->marks[0] != y->marks[0])
+        return x->marks[0] < y->marks[0] ? -1 : 1;
+    return (x->marks[1] > y->marks[1]) - (x->marks[1] < y->marks[1]);
+}
+
+void yl_profile_report(const yl_profile_t *profile, FILE *report)
+{
+    const yl_profile_table_t *sites = &profile->sites;
+    const yl_profile_entry_t **sorted = malloc((sites->size ? sites->size : 1) * sizeof(*sorted));
+    if (sorted == NULL) {
+        fprintf(report, "profile: out of memory\n");
+        return;
+    }
+
+    size_t n = 0, calls = 0;
+    double self = 0;
+    for (size_t i = 0; i < sites->capacity; ++i) {
+        if (sites->entries[i].marks != NULL) {
+            sorted[n++] = &sites->entries[i];
+            calls += sites->entries[i].calls;
+            self += sites->entries[i].self;
+        }
+    }
+    qsort(sorted, n, sizeof(*sorted), compare_self);
+
+    fprintf(report, "profile: %zu locations, %zu calls, %.3f ms%s\n", n, calls, self * 1e3,
+            profile->incomplete ? " (incomplete: out of memory)" : "");
+    fprintf(report, "%12s %12s %10s %14s  %s\n", "self ms", "total ms", "calls", "bytes", "location");
+    for (size_t i = 0; i < n; ++i)
+        fprintf(report, "%12.3f %12.3f %10zu %14zu  %zu:%zu\n",
+                sorted[i]->self * 1e3,
+                sorted[i]->total * 1e3,
+                sorted[i]->calls,
+                sorted[i]->bytes,
+                sorted[i]->marks[0] + 1,
+                sorted[i]->marks[1] + 1);
+    free(sorted);
+}
+
+void yl_profile_write_folded(const yl_profile_t *profile, FILE *output)
+{
+    const yl_profile_table_t *stacks = &profile->stacks;
+    for (size_t i = 0; i < stacks->capacity; ++i) {
+        const yl_profile_entry_t *entry = &stacks->entries[i];
+        long long microseconds = entry->marks != NULL ? llround(entry->self * 1e6) : 0;
+        // Flame graphs have nothing to draw for an empty stack.
+        if (microseconds <= 0)
+            continue;
+        for (size_t j = 0; j < entry->depth; ++j)
+            fprintf(output, "%s%zu:%zu", j ? ";" : "", entry->marks[2 * j] + 1, entry->marks[2 * j + 1] + 1);
+        fprintf(output, " %lld\n", microseconds);
+    }
+}
+
+static void table_delete(yl_profile_table_t *table)
+{
+    for (size_t i = 0; i < table->capacity; ++i)
+        free(table->entries[i].marks);
+    free(table->entries);
+    *table = (yl_profile_table_t){0};
+}
+
+void yl_profile_delete(yl_profile_t *profile)
+{
+    free(profile->marks);
+    table_delete(&profile->sites);
+    table_delete(&profile->stacks);
+    *profile = (yl_profile_t){0};
+}
@@ -0,0 +1,94 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "lua.h"
+#include "yaml.h"
+
+/**
+ * What the profile accumulates for a template location, or for a stack of them.
+ */
+typedef struct _yl_profile_entry_s {
+    size_t *marks; // Line and column pairs, outermost first; NULL for a free slot.
+    size_t depth;  // Number of pairs.
+    size_t calls;
+    double total; // Seconds, including profiled calls nested in these.
+    double self;  // Seconds, excluding them.
+    size_t bytes; // Lua bytes allocated, including nested calls.
+} yl_profile_entry_t;
+
+/**
+ * Entries by their marks, in an open-addressed hash table.
+ */
+typedef struct _yl_profile_table_s {
+    yl_profile_entry_t *entries;
+    size_t size, capacity;
+} yl_profile_table_t;
+
+/**
+ * A profile of the expressions a template runs, keyed by the start mark of the
+ * tagged scalar, sequence or mapping each belongs to.
+ *
+ * Not thread-safe: attach a profile to one Lua state only.
+ */
+typedef struct _yl_profile_s {
+    // The start marks of the nodes being executed, as line and column pairs.
+    size_t *marks;
+    size_t depth, capacity;
+    double children; // Time spent in calls nested in the current one.
+    bool incomplete; // Memory ran out, so some calls weren't recorded.
+    yl_profile_table_t sites;  // By innermost mark.
+    yl_profile_table_t stacks; // By all the marks, for folded stacks.
+} yl_profile_t;
+
+/**
+ * Profile the expressions later run on a state created by
+ * yl_allocator_new_state(), or stop profiling them if @p profile is @c NULL.
+ */
+void yl_profile_attach(lua_State *L, yl_profile_t *profile);
+
+/**
+ * The profile attached to a state created by yl_allocator_new_state(), or
+ * @c NULL.
+ */
+yl_profile_t *yl_profile(lua_State *L);
+
+/**
+ * Enter a node: expressions run until the matching yl_profile_leave() are
+ * accounted to its start mark, nested in the nodes entered before it.
+ */
+void yl_profile_enter(yl_profile_t *profile, const yaml_mark_t *mark);
+
+/**
+ * Leave the node entered last.
+ */
+void yl_profile_leave(yl_profile_t *profile);
+
+/**
+ * Leave every node, e.g. at the start of a document after an error.
+ */
+void yl_profile_unwind(yl_profile_t *profile);
+
+/**
+ * Call yl_budget_pcall(), accounting its time and allocations to the innermost
+ * node entered, if a profile is attached to the state and a node was entered.
+ *
+ * @returns As yl_budget_pcall().
+ */
+int yl_profile_pcall(lua_State *L, int nargs, int nresults, int msgh);
+
+/**
+ * Write a table of the profiled locations, those with the most self time first.
+ */
+void yl_profile_report(const yl_profile_t *profile, FILE *report);
+
+/**
+ * Write the profiled stacks in the folded format of flame graph tools: one line
+ * per stack of marks, separated by semicolons, followed by its self time in
+ * microseconds.
+ */
+void yl_profile_write_folded(const yl_profile_t *profile, FILE *output);
+
+void yl_profile_delete(yl_profile_t *profile);
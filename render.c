@@ -11,6 +11,46 @@
 // Also plenty for 17 digit precision floats.
 #define NUMBUFSIZE 32
 
+/**
+ * Check that a string is valid UTF-8, as yaml_scalar_event_initialize() would.
+ */
+static bool is_utf8(const unsigned char *string, size_t length)
+{
+    const unsigned char *end = string + length;
+
+    while (string < end) {
+        unsigned char octet = *string;
+        size_t width = (octet & 0x80) == 0x00   ? 1
+                       : (octet & 0xE0) == 0xC0 ? 2
+                       : (octet & 0xF0) == 0xE0 ? 3
+                       : (octet & 0xF8) == 0xF0 ? 4
+                                                : 0;
+        unsigned int value = (octet & 0x80) == 0x00   ? octet & 0x7F
+                             : (octet & 0xE0) == 0xC0 ? octet & 0x1F
+                             : (octet & 0xF0) == 0xE0 ? octet & 0x0F
+                             : (octet & 0xF8) == 0xF0 ? octet & 0x07
+                                                      : 0;
+        if (!width || string + width > end)
+            return false;
+        for (size_t k = 1; k < width; ++k) {
+            octet = string[k];
+            if ((octet & 0xC0) != 0x80)
+                return false;
+            value = (value << 6) + (octet & 0x3F);
+        }
+        if (!((width == 1) ||
+              (width == 2 && value >= 0x80) ||
+              (width == 3 && value >= 0x800) ||
+              (width == 4 && value >= 0x10000)))
+            return false;
+        string += width;
+    }
+
+    return true;
+}
+
+static int render_sequence(yl_event_consumer_t *consumer, yaml_event_t *event, lua_State *L, long int length, yl_error_t *err);
+
 int yl_render_event(yl_event_consumer_t *consumer, yaml_event_t *event, lua_State *L, yl_error_t *err)
 {
     size_t line = event->start_mark.line;
@@ -29,11 +69,12 @@ int yl_render_event(yl_event_consumer_t *consumer, yaml_event_t *event, lua_Stat
                 goto error;
             }
 
-            int isnum = lua_isinteger(L, -1);
+            int isnum;
+            long int length = lua_tointegerx(L, -1, &isnum);
             lua_pop(L, 1); // Pop the length.
 
             if (isnum) {
-                if (!yl_render_sequence(consumer, event, L, err))
+                if (!render_sequence(consumer, event, L, length, err))
                     goto error;
             } else {
                 if (!yl_render_mapping(consumer, event, L, err))
@@ -59,11 +100,11 @@ int yl_render_scalar(yl_event_consumer_t *consumer, yaml_event_t *event, lua_Sta
 {
     size_t line = event->start_mark.line;
     size_t column = event->start_mark.column;
-    char *anchor = yl_copy_anchor(event);
+    yaml_char_t *anchor = yl_take_anchor(event);
 
     yaml_event_delete(event);
 
-    char *buf = NULL;
+    char buf[NUMBUFSIZE];
 
     const char *value = NULL;
     size_t length = 0;
@@ -72,7 +113,6 @@ int yl_render_scalar(yl_event_consumer_t *consumer, yaml_event_t *event, lua_Sta
     int type = lua_type(L, -1);
     switch (type) {
     case LUA_TNUMBER: {
-        buf = malloc(NUMBUFSIZE);
         int len;
         if (lua_isinteger(L, -1)) {
             len = snprintf(buf, NUMBUFSIZE, "%lld", lua_tointeger(L, -1));
@@ -84,7 +124,6 @@ int yl_render_scalar(yl_event_consumer_t *consumer, yaml_event_t *event, lua_Sta
             }
         }
         if (len < 0) {
-            free(buf);
             err->type = YL_RUNTIME_ERROR;
             err->line = line;
             err->column = column;
@@ -132,13 +171,7 @@ int yl_render_scalar(yl_event_consumer_t *consumer, yaml_event_t *event, lua_Sta
         goto error;
     }
 
-    if (!yaml_scalar_event_initialize(event,
-                                      (yaml_char_t *)anchor,
-                                      NULL,
-                                      (yaml_char_t *)value,
-                                      length,
-                                      1, 1,
-                                      style)) {
+    if (type == LUA_TSTRING && !is_utf8((const unsigned char *)value, length)) {
         err->type = YL_RENDER_ERROR;
         err->line = line;
         err->column = column;
@@ -147,20 +180,109 @@ int yl_render_scalar(yl_event_consumer_t *consumer, yaml_event_t *event, lua_Sta
         goto error;
     }
 
-    if (!consumer->callback(consumer->data, event, NULL, err))
+    // A borrowing consumer is handed the Lua string (or buffer) itself. Otherwise,
+    // the event owns its value, so it's copied exactly once, straight into the event.
+    yaml_char_t *event_value = (yaml_char_t *)value;
+    if (!consumer->borrows) {
+        event_value = malloc(length + 1);
+        if (event_value == NULL) {
+            err->type = YL_MEMORY_ERROR;
+            err->line = line;
+            err->column = column;
+            err->context = "While rendering a scalar, got memory error";
+            err->message = "unable to malloc scalar value";
+            goto error;
+        }
+        memcpy(event_value, value, length);
+        event_value[length] = '\0';
+    }
+
+    *event = (yaml_event_t){0};
+    event->type = YAML_SCALAR_EVENT;
+    event->data.scalar.anchor = anchor;
+    event->data.scalar.value = event_value;
+    event->data.scalar.length = length;
+    event->data.scalar.plain_implicit = 1;
+    event->data.scalar.quoted_implicit = 1;
+    event->data.scalar.style = style;
+    anchor = NULL; // Owned by the event now.
+
+    int consumed = consumer->callback(consumer->data, event, NULL, err);
+    if (consumer->borrows)
+        event->data.scalar.value = NULL; // Not ours to free.
+    if (!consumed)
         goto error;
+    yaml_event_delete(event); // In case the consumer didn't take it.
+
+    lua_pop(L, 1); // Remove the argument from the stack.
+
+    return 1;
 
-    if (buf != NULL)
-        free(buf);
+error:
     if (anchor != NULL)
         free(anchor);
+    yaml_event_delete(event);
+    lua_pop(L, 1); // Remove the argument from the stack.
+
+    return 0;
+}
+
+/**
+ * Render the table at the top of the stack as a sequence of @p length elements,
+ * and pop it.
+ */
+static int render_sequence(yl_event_consumer_t *consumer, yaml_event_t *event, lua_State *L, long int length, yl_error_t *err)
+{
+    size_t line = event->start_mark.line;
+    size_t column = event->start_mark.column;
+    yaml_char_t *anchor = yl_take_anchor(event);
+
+    yaml_event_delete(event);
+
+    if (!lua_checkstack(L, 10)) {
+        err->type = YL_MEMORY_ERROR;
+        err->line = line;
+        err->column = column;
+        err->context = "While rendering a sequence, got memory error";
+        err->message = "could not expand Lua stack";
+        goto error;
+    }
+
+    *event = (yaml_event_t){0};
+    event->type = YAML_SEQUENCE_START_EVENT;
+    event->data.sequence_start.anchor = anchor;
+    event->data.sequence_start.implicit = 1;
+    event->data.sequence_start.style = YAML_ANY_SEQUENCE_STYLE;
+    anchor = NULL; // Owned by the event now.
+
+    if (!consumer->callback(consumer->data, event, NULL, err))
+        goto error;
+    yaml_event_delete(event);
+
+    for (long int i = 1; i <= length; ++i) {
+        lua_geti(L, -1, i);
+        if (!yl_render_event(consumer, event, L, err))
+            goto error;
+    }
+
+    if (!yaml_sequence_end_event_initialize(event)) {
+        err->type = YL_RENDER_ERROR;
+        err->line = line;
+        err->column = column;
+        err->context = "While rendering a sequence, got unexpected error";
+        err->message = "could not initialize sequence end event";
+        goto error;
+    }
+
+    if (!consumer->callback(consumer->data, event, NULL, err))
+        goto error;
+    yaml_event_delete(event);
+
     lua_pop(L, 1); // Remove the argument from the stack.
 
     return 1;
 
 error:
-    if (buf != NULL)
-        free(buf);
     if (anchor != NULL)
         free(anchor);
     yaml_event_delete(event);
@@ -173,9 +295,6 @@ int yl_render_sequence(yl_event_consumer_t *consumer, yaml_event_t *event, lua_S
 {
     size_t line = event->start_mark.line;
     size_t column = event->start_mark.column;
-    char *anchor = yl_copy_anchor(event);
-
-    yaml_event_delete(event);
 
     int type = lua_type(L, -1);
     if (type != LUA_TTABLE) {
@@ -218,45 +337,9 @@ int yl_render_sequence(yl_event_consumer_t *consumer, yaml_event_t *event, lua_S
     }
     lua_pop(L, 1);
 
-    if (!yaml_sequence_start_event_initialize(event, (yaml_char_t *)anchor, NULL, 1, YAML_ANY_SEQUENCE_STYLE)) {
-        err->type = YL_RENDER_ERROR;
-        err->line = line;
-        err->column = column;
-        err->context = "While rendering a sequence, got unexpected error";
-        err->message = "could not initialize sequence start event";
-        goto error;
-    }
-
-    if (!consumer->callback(consumer->data, event, NULL, err))
-        goto error;
-
-    for (long int i = 1; i <= length; ++i) {
-        lua_geti(L, -1, i);
-        if (!yl_render_event(consumer, event, L, err))
-            goto error;
-    }
-
-    if (!yaml_sequence_end_event_initialize(event)) {
-        err->type = YL_RENDER_ERROR;
-        err->line = line;
-        err->column = column;
-        err->context = "While rendering a sequence, got unexpected error";
-        err->message = "could not initialize sequence end event";
-        goto error;
-    }
-
-    if (!consumer->callback(consumer->data, event, NULL, err))
-        goto error;
-
-    if (anchor != NULL)
-        free(anchor);
-    lua_pop(L, 1); // Remove the argument from the stack.
-
-    return 1;
+    return render_sequence(consumer, event, L, length, err);
 
 error:
-    if (anchor != NULL)
-        free(anchor);
     yaml_event_delete(event);
     lua_pop(L, 1); // Remove the argument from the stack.
 
@@ -267,7 +350,7 @@ int yl_render_mapping(yl_event_consumer_t *consumer, yaml_event_t *event, lua_St
 {
     size_t line = event->start_mark.line;
     size_t column = event->start_mark.column;
-    char *anchor = yl_copy_anchor(event);
+    yaml_char_t *anchor = yl_take_anchor(event);
 
     yaml_event_delete(event);
 
@@ -290,45 +373,55 @@ int yl_render_mapping(yl_event_consumer_t *consumer, yaml_event_t *event, lua_St
         goto error;
     }
 
-    if (!yaml_mapping_start_event_initialize(event, (yaml_char_t *)anchor, NULL, 1, YAML_ANY_MAPPING_STYLE)) {
-        err->type = YL_RENDER_ERROR;
-        err->line = line;
-        err->column = column;
-        err->context = "While rendering a mapping, got unexpected error";
-        err->message = "could not initialize mapping start event";
-        goto error;
-    }
+    *event = (yaml_event_t){0};
+    event->type = YAML_MAPPING_START_EVENT;
+    event->data.mapping_start.anchor = anchor;
+    event->data.mapping_start.implicit = 1;
+    event->data.mapping_start.style = YAML_ANY_MAPPING_STYLE;
+    anchor = NULL; // Owned by the event now.
 
     if (!consumer->callback(consumer->data, event, NULL, err))
         goto error;
+    yaml_event_delete(event);
 
-    yl_error_type_t err_type = yl_lua_sort_keys(L, -1);
-    if (err_type != YL_NO_ERROR) {
-        err->type = err_type;
-        err->line = line;
-        err->column = column;
-        err->context = "While rendering a mapping, got error sorting keys";
-        err->message = lua_tostring(L, -1);
-        goto error;
+    int table = lua_gettop(L);
+    int length;
+    // Ordered mappings keep their key order. Otherwise, keys are sorted in C when
+    // they're all numbers and strings, and through Lua otherwise.
+    bool on_stack = yl_lua_push_ordered_keys(L, table, &length) ||
+                    yl_lua_push_sorted_keys(L, table, &length);
+    if (!on_stack) {
+        yl_error_type_t err_type = yl_lua_sort_keys(L, table);
+        if (err_type != YL_NO_ERROR) {
+            err->type = err_type;
+            err->line = line;
+            err->column = column;
+            err->context = "While rendering a mapping, got error sorting keys";
+            err->message = lua_tostring(L, -1);
+            goto error;
+        }
+        length = lua_rawlen(L, -1);
     }
-    // -1: list of keys (sorted); -2: table
+    // table + 1 ... table + length: keys (sorted), or table + 1: list of keys (sorted)
 
-    long int length = lua_rawlen(L, -1);
-    for (long int i = 1; i <= length; ++i) {
-        lua_rawgeti(L, -1, i);
+    for (int i = 1; i <= length; ++i) {
+        if (on_stack)
+            lua_pushvalue(L, table + i);
+        else
+            lua_rawgeti(L, table + 1, i);
         lua_pushvalue(L, -1); // Duplicate key, it gets consumed by yl_render_event().
         if (!yl_render_event(consumer, event, L, err)) {
-            lua_pop(L, 2); // Pop the key and list of keys.
+            lua_settop(L, table); // Pop the key and the sorted keys.
             goto error;
         }
-        // -1: key; -2 list of keys (sorted); -3: table
-        lua_gettable(L, -3); // Consumes key.
+        // -1: key; table: table
+        lua_gettable(L, table); // Consumes key.
         if (!yl_render_event(consumer, event, L, err)) {
-            lua_pop(L, 2); // Pop the value and list of keys.
+            lua_settop(L, table); // Pop the sorted keys.
             goto error;
         }
     }
-    lua_pop(L, 1); // Pop the list of keys.
+    lua_settop(L, table); // Pop the sorted keys.
 
     if (!yaml_mapping_end_event_initialize(event)) {
         err->type = YL_RENDER_ERROR;
@@ -341,9 +434,8 @@ int yl_render_mapping(yl_event_consumer_t *consumer, yaml_event_t *event, lua_St
 
     if (!consumer->callback(consumer->data, event, NULL, err))
         goto error;
+    yaml_event_delete(event);
 
-    if (anchor != NULL)
-        free(anchor);
     lua_pop(L, 1); // Remove the argument from the stack.
 
     return 1;
@@ -0,0 +1,11 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define YL_SHA256_SIZE 32
+
+/**
+ * SHA-256 (FIPS 180-4) of a buffer, for naming content that must not collide.
+ */
+void yl_sha256(const unsigned char *data, size_t length, uint8_t digest[YL_SHA256_SIZE]);
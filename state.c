@@ -0,0 +1,30 @@
+#include "state.h"
+
+static const char yl_state_key = 0;
+
+static int state_gc(lua_State *L)
+{
+    yl_state_t *state = lua_touserdata(L, 1);
+    yl_tag_table_delete(&state->tags);
+    return 0;
+}
+
+yl_state_t *yl_state(lua_State *L)
+{
+    yl_state_t *state;
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &yl_state_key) == LUA_TUSERDATA) {
+        state = lua_touserdata(L, -1);
+        lua_pop(L, 1);
+        return state;
+    }
+
+    lua_pop(L, 1);
+    state = lua_newuserdatauv(L, sizeof(yl_state_t), 0);
+    *state = (yl_state_t){0};
+    lua_createtable(L, 0, 1);
+    lua_pushcfunction(L, state_gc);
+    lua_setfield(L, -2, "__gc");
+    lua_setmetatable(L, -2);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &yl_state_key);
+    return state;
+}
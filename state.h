@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdbool.h>
+
+#include "lua.h"
+
+#include "budget.h"
+#include "profile.h"
+#include "tags.h"
+
+/**
+ * What the helpers keep about a Lua state, whichever way it was created.
+ */
+typedef struct _yl_state_s {
+    yl_budget_state_t budget;
+    yl_profile_t *profile; // If set, where expressions are profiled.
+    bool ordered_keys;     // Whether a mapping was ever given a key order.
+    bool marked_kinds;     // Whether a table was ever marked with its kind.
+    // Bumped whenever a template sets a global or a library field, so what was
+    // found in the frozen base stays valid until it changes. See environment.c.
+    unsigned long generation;
+    yl_tag_table_t tags;
+} yl_state_t;
+
+/**
+ * The helpers' data for a state. It lives in a userdata in the registry, created
+ * zeroed on first use, so it stays valid until the state closes, which frees it.
+ */
+yl_state_t *yl_state(lua_State *L);
@@ -0,0 +1,302 @@
+#include <ctype.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "environment.h"
+#include "lua_helpers.h"
+#include "state.h"
+#include "tags.h"
+
+/*
+ * Besides the C table in the state, interned tags have an entry table in the
+ * registry, by ID, for what must live in Lua:
+ *
+ *   [1..n]     The fields of a dotted name, as strings.
+ *   [n+1..2n]  The values found through each field, the last being the function.
+ *              [2n] is only set while the rest describe a valid resolution.
+ */
+static const char yl_tags_key = 0;
+
+static void push_tags(lua_State *L)
+{
+    if (lua_rawgetp(L, LUA_REGISTRYINDEX, &yl_tags_key) == LUA_TTABLE)
+        return;
+
+    lua_pop(L, 1);
+    lua_newtable(L);
+    lua_pushvalue(L, -1);
+    lua_rawsetp(L, LUA_REGISTRYINDEX, &yl_tags_key);
+}
+
+static uint32_t name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u; // FNV-1a.
+    for (const unsigned char *c = (const unsigned char *)name; *c != '\0'; ++c)
+        hash = (hash ^ *c) * 16777619u;
+    return hash;
+}
+
+/**
+ * Find the slot of a name, or the free slot it would go in.
+ */
+static size_t find_slot(const yl_tag_table_t *table, const char *name, uint32_t hash)
+{
+    size_t mask = table->nslots - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        int id = table->slots[i];
+        if (id == 0)
+            return i;
+        const yl_tag_t *tag = &table->tags[id - 1];
+        if (tag->hash == hash && strcmp(tag->name, name) == 0)
+            return i;
+    }
+}
+
+/**
+ * Make room for one more tag.
+ */
+static bool reserve(yl_tag_table_t *table)
+{
+    if (table->size == table->capacity) {
+        size_t capacity = table->capacity ? table->capacity * 2 : 16;
+        yl_tag_t *tags = realloc(table->tags, capacity * sizeof(*tags));
+        if (tags == NULL)
+            return false;
+        table->tags = tags;
+        table->capacity = capacity;
+    }
+
+    if (2 * (table->size + 1) >= table->nslots) {
+        size_t nslots = table->nslots ? table->nslots * 2 : 64;
+        int *slots = calloc(nslots, sizeof(*slots));
+        if (slots == NULL)
+            return false;
+        int *old = table->slots;
+        size_t nold = table->nslots;
+        table->slots = slots;
+        table->nslots = nslots;
+        for (size_t i = 0; i < nold; ++i) {
+            if (old[i] != 0) {
+                const yl_tag_t *tag = &table->tags[old[i] - 1];
+                table->slots[find_slot(table, tag->name, tag->hash)] = old[i];
+            }
+        }
+        free(old);
+    }
+    return true;
+}
+
+void yl_tag_table_delete(yl_tag_table_t *table)
+{
+    for (size_t i = 0; i < table->size; ++i)
+        free(table->tags[i].name);
+    free(table->tags);
+    free(table->slots);
+    *table = (yl_tag_table_t){0};
+}
+
+/**
+ * Push each field of a dotted name like `string.reverse`.
+ *
+ * @returns The number of fields pushed, or 0 (with nothing pushed) if the name
+ * isn't made of identifiers.
+ */
+static int push_fields(lua_State *L, const char *name)
+{
+    int n = 0;
+    const char *start = name;
+
+    for (const char *c = name;; ++c) {
+        if (*c == '.' || *c == '\0') {
+            if (c == start || isdigit((unsigned char)*start)) {
+                lua_pop(L, n);
+                return 0;
+            }
+            lua_pushlstring(L, start, c - start);
+            ++n;
+            if (*c == '\0')
+                return n;
+            start = c + 1;
+        } else if (!isalnum((unsigned char)*c) && *c != '_') {
+            lua_pop(L, n);
+            return 0;
+        }
+    }
+}
+
+int yl_tag_intern(lua_State *L, const char *tag)
+{
+    if (tag == NULL || tag[0] != '!' || tag[1] == '!')
+        return YL_TAG_NONE;
+    if (tag[1] == '\0')
+        return YL_TAG_IDENTITY;
+
+    const char *name = tag + 1;
+    uint32_t hash = name_hash(name);
+    yl_tag_table_t *table = &yl_state(L)->tags;
+    if (table->nslots > 0) {
+        int id = table->slots[find_slot(table, name, hash)];
+        if (id != 0)
+            return id;
+    }
+
+    char *copy = strdup(name);
+    if (copy == NULL || !reserve(table)) {
+        free(copy);
+        return YL_TAG_ERROR;
+    }
+    int id = (int)table->size + 1;
+
+    push_tags(L);
+    int tags = lua_gettop(L);
+    lua_newtable(L);
+    int n = push_fields(L, name);
+    for (int i = n; i > 0; --i)
+        lua_rawseti(L, tags + 1, i);
+    lua_rawseti(L, tags, id);
+    lua_settop(L, tags - 1);
+
+    table->tags[table->size++] = (yl_tag_t){copy, hash, n, false, 0};
+    table->slots[find_slot(table, name, hash)] = id;
+    return id;
+}
+
+/**
+ * Look up a field of the table on the top of the stack through its view, and
+ * replace the table with the value. Clears @p fixed if the field is one the
+ * table has of its own, rather than one of the frozen base.
+ */
+static void walk_field(lua_State *L, int entry, int i, bool *fixed)
+{
+    lua_rawgeti(L, entry, i);
+    lua_pushvalue(L, -1);
+    if (lua_rawget(L, -3) != LUA_TNIL)
+        *fixed = false;
+    lua_pop(L, 1);
+    yl_environment_rawget(L, -2);
+    lua_remove(L, -2); // Remove the table the field was found in.
+}
+
+/**
+ * Check that walking the fields of a dotted name through raw lookups still finds
+ * the cached values, so the cached function is what a fresh lookup would give.
+ *
+ * @returns If the cache is valid, true, with the function pushed, and @p fixed
+ * set to whether every field was found in the frozen base; otherwise false, with
+ * nothing pushed.
+ */
+static bool push_cached(lua_State *L, int entry, const yl_tag_t *tag, bool *fixed)
+{
+    int base = lua_gettop(L);
+    int n = tag->n;
+    *fixed = true;
+
+    if (lua_rawgeti(L, entry, 2 * n) == LUA_TNIL)
+        goto invalid;
+    lua_pop(L, 1);
+
+    // Templates can't change the metatable of the globals, and the one it has
+    // only falls back on the frozen base, which the raw lookups see through.
+    lua_pushglobaltable(L);
+
+    // A global with the whole dotted name takes priority over the fields.
+    if (n > 1) {
+        lua_pushstring(L, tag->name);
+        if (yl_environment_rawget(L, -2) != LUA_TNIL)
+            goto invalid;
+        lua_pop(L, 1);
+    }
+
+    for (int i = 1; i <= n; ++i) {
+        if (i > 1 && lua_type(L, -1) != LUA_TTABLE)
+            goto invalid;
+        walk_field(L, entry, i, fixed);
+        lua_rawgeti(L, entry, n + i);
+        if (!lua_rawequal(L, -1, -2))
+            goto invalid;
+        lua_pop(L, 1);
+    }
+
+    return true;
+
+invalid:
+    lua_settop(L, base);
+    return false;
+}
+
+/**
+ * Cache the function on the top of the stack for a dotted name, if walking its
+ * fields through raw lookups finds that same function.
+ *
+ * @returns Whether it was cached, and every field was found in the frozen base.
+ */
+static bool remember(lua_State *L, int entry, int n)
+{
+    int base = lua_gettop(L);
+    bool fixed = true;
+
+    lua_pushnil(L);
+    lua_rawseti(L, entry, 2 * n);
+
+    lua_pushglobaltable(L);
+    for (int i = 1; i <= n; ++i) {
+        if (lua_type(L, -1) != LUA_TTABLE) {
+            fixed = false;
+            goto done;
+        }
+        walk_field(L, entry, i, &fixed);
+        if (i < n) {
+            lua_pushvalue(L, -1);
+            lua_rawseti(L, entry, n + i);
+        }
+    }
+
+    if (lua_rawequal(L, -1, base))
+        lua_rawseti(L, entry, 2 * n);
+    else
+        fixed = false;
+
+done:
+    lua_settop(L, base);
+    return fixed;
+}
+
+int yl_tag_call(lua_State *L, int tag, int nargs)
+{
+    yl_state_t *state = yl_state(L);
+    yl_tag_t *interned = &state->tags.tags[tag - 1];
+    // Names are never freed before the state, even when the table grows.
+    const char *name = interned->name;
+    int n = interned->n;
+
+    push_tags(L);
+    lua_rawgeti(L, -1, tag);
+    lua_remove(L, -2);
+    int entry = lua_gettop(L);
+
+    bool fixed = false;
+    if (n > 0 && interned->fixed && interned->generation == state->generation) {
+        lua_rawgeti(L, entry, 2 * n);
+        fixed = true;
+    } else if (n == 0 || !push_cached(L, entry, interned, &fixed)) {
+        // Resolve it the same way as yl_lua_execute_lua_function().
+        if (lua_getglobal(L, name) == LUA_TNIL) {
+            lua_pop(L, 1);
+
+            int status = yl_lua_execute_lua(L, name);
+            if (status != LUA_OK) {
+                lua_remove(L, entry);
+                return status;
+            }
+        }
+
+        if (n > 0 && lua_type(L, -1) == LUA_TFUNCTION)
+            fixed = remember(L, entry, n);
+    }
+    interned->fixed = fixed;
+    interned->generation = state->generation;
+
+    lua_remove(L, entry);
+    return yl_lua_call_function(L, name, nargs);
+}
@@ -0,0 +1,74 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "lua.h"
+
+// The node has no tag, or a tag that isn't executed (such as `!!str`).
+#define YL_TAG_NONE 0
+// The bare `!` tag: expressions for scalars, and plain tables for collections.
+#define YL_TAG_IDENTITY (-1)
+// The tag could not be interned for lack of memory.
+#define YL_TAG_ERROR (-2)
+
+/**
+ * A function tag interned on a state.
+ */
+typedef struct _yl_tag_s {
+    char *name; // Without the leading `!`.
+    uint32_t hash;
+    int n; // The number of fields of a dotted name, or 0 if it isn't one.
+    // Whether the cached function was found through fields of the frozen base
+    // and library views alone, as of the environment generation. Until a global
+    // or library field is set, it can't have changed.
+    bool fixed;
+    unsigned long generation;
+} yl_tag_t;
+
+/**
+ * The function tags interned on a state, found by name without calling Lua.
+ */
+typedef struct _yl_tag_table_s {
+    yl_tag_t *tags; // By ID, starting at 1.
+    size_t size, capacity;
+    int *slots;    // Open-addressed by hash: IDs, or 0 for a free slot.
+    size_t nslots; // A power of two, more than twice the size.
+} yl_tag_table_t;
+
+void yl_tag_table_delete(yl_tag_table_t *table);
+
+/**
+ * Intern a tag, so it can be executed without keeping the tag string around.
+ *
+ * Each distinct function tag gets a positive ID, which stays valid for the life
+ * of the Lua state. Dotted names made of identifiers, such as `!math.cos`, are
+ * split into their fields the first time they're seen. After that, interning the
+ * same tag is a lookup in a table kept in C.
+ *
+ * @param[in,out]   L           A pointer to the Lua state.
+ * @param[in]       tag         The tag of a node, or NULL.
+ *
+ * @returns YL_TAG_NONE, YL_TAG_IDENTITY, the ID of a function tag, or
+ * YL_TAG_ERROR if memory could not be allocated.
+ */
+int yl_tag_intern(lua_State *L, const char *tag);
+
+/**
+ * Execute the function named by an interned tag, like yl_lua_execute_lua_function().
+ *
+ * The resolved function is cached with the tables it was found through. If it
+ * was found in the frozen base environment, it's used as is until a template
+ * sets a global or a library field (see yl_load_safe_libraries()). Otherwise,
+ * the fields are looked up again on each call, and it's resolved again once one
+ * of them (or the global itself) has changed.
+ *
+ * @param[in,out]   L           A pointer to the Lua state.
+ * @param[in]       tag         A function tag ID from yl_tag_intern().
+ * @param[in]       nargs       The number of arguments on the stack to pass.
+ *
+ * @returns One of LUA_OK, LUA_ERRSYNTAX, LUA_ERRRUN, LUA_ERRMEM, or LUA_ERRERR.
+ * On return, leaves one return value or error message on the Lua stack.
+ */
+int yl_tag_call(lua_State *L, int tag, int nargs);
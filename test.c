@@ -1,21 +1,439 @@
+#include <errno.h>
 #include <stdbool.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "lauxlib.h"
 #include "lua.h"
 #include "yaml.h"
 
+#include "allocator.h"
+#include "budget.h"
+#include "chunk_cache.h"
+#include "environment.h"
 #include "event.h"
+#include "pool.h"
 #include "render.h"
 #include "test.h"
+#include "timing.h"
+
+// How deeply nested the tables passed from a !testcases row to its case may be.
+#define YL_TEST_MAX_ROW_DEPTH 64
+
+/*
+ * A Lua state can only be used by one thread at a time, so the globals of a row
+ * are encoded on the caller's thread and decoded into a worker's state. Each
+ * value is a tag followed by its data: 'n' for nil, 'f' and 't' for booleans,
+ * 'i' and 'd' for a lua_Integer and a lua_Number, 's' for a size_t length and
+ * the bytes of a string, and '{' for key and value pairs up to a '}'.
+ */
+typedef struct _yl_test_buffer_s {
+    char *data;
+    size_t size, capacity;
+} yl_test_buffer_t;
+
+/**
+ * What every row of a !testcases sequence shares.
+ */
+typedef struct _yl_test_rows_s {
+    bool preserve_order;
+    yl_budget_t budget;
+    size_t chunk_cache_size;
+    lua_State **states; // One per worker, created on its first row.
+} yl_test_rows_t;
+
+typedef struct _yl_test_row_s {
+    yl_event_record_t template; // Shares the events of the template; only the cursor is its own.
+    yl_event_record_t output;
+    yl_test_rows_t *rows;
+    yl_test_buffer_t globals; // The row's fields, encoded.
+
+    bool failed;
+    yl_error_t err;
+    char message[1024]; // Copied out of the worker's Lua state before its next row.
+    double seconds;     // Spent rendering the row.
+} yl_test_row_t;
+
+static int buffer_append(yl_test_buffer_t *buffer, const void *data, size_t size)
+{
+    if (buffer->size + size > buffer->capacity) {
+        size_t capacity = buffer->capacity ? buffer->capacity * 2 : 256;
+        while (capacity < buffer->size + size)
+            capacity *= 2;
+        char *grown = realloc(buffer->data, capacity);
+        if (grown == NULL)
+            return 0;
+        buffer->data = grown;
+        buffer->capacity = capacity;
+    }
+    memcpy(buffer->data + buffer->size, data, size);
+    buffer->size += size;
+    return 1;
+}
+
+/**
+ * Encode a value. Only nil, booleans, numbers, strings and tables of them can be
+ * encoded.
+ *
+ * @returns On success, returns @c 1. On failure, returns @c 0.
+ */
+static int encode_value(lua_State *L, int index, yl_test_buffer_t *buffer, int depth)
+{
+    index = lua_absindex(L, index);
+    if (!lua_checkstack(L, 3))
+        return 0;
+
+    switch (lua_type(L, index)) {
+    case LUA_TNIL:
+        return buffer_append(buffer, "n", 1);
+    case LUA_TBOOLEAN:
+        return buffer_append(buffer, lua_toboolean(L, index) ? "t" : "f", 1);
+    case LUA_TNUMBER:
+        if (lua_isinteger(L, index)) {
+            lua_Integer value = lua_tointeger(L, index);
+            return buffer_append(buffer, "i", 1) && buffer_append(buffer, &value, sizeof(value));
+        } else {
+            lua_Number value = lua_tonumber(L, index);
+            return buffer_append(buffer, "d", 1) && buffer_append(buffer, &value, sizeof(value));
+        }
+    case LUA_TSTRING: {
+        size_t length;
+        const char *value = lua_tolstring(L, index, &length);
+        return buffer_append(buffer, "s", 1) && buffer_append(buffer, &length, sizeof(length)) &&
+               buffer_append(buffer, value, length);
+    }
+    case LUA_TTABLE:
+        if (depth >= YL_TEST_MAX_ROW_DEPTH || !buffer_append(buffer, "{", 1))
+            return 0;
+        lua_pushnil(L);
+        while (lua_next(L, index)) {
+            if (!encode_value(L, -2, buffer, depth + 1) || !encode_value(L, -1, buffer, depth + 1)) {
+                lua_pop(L, 2);
+                return 0;
+            }
+            lua_pop(L, 1);
+        }
+        return buffer_append(buffer, "}", 1);
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Push a value encoded by encode_value(), and move the cursor past it.
+ *
+ * @returns On success, returns @c 1. If the stack can't grow, returns @c 0 with
+ * nothing pushed.
+ */
+static int decode_value(lua_State *L, const char **cursor)
+{
+    if (!lua_checkstack(L, 3))
+        return 0;
+
+    switch (*(*cursor)++) {
+    case 'n':
+        lua_pushnil(L);
+        return 1;
+    case 'f':
+        lua_pushboolean(L, false);
+        return 1;
+    case 't':
+        lua_pushboolean(L, true);
+        return 1;
+    case 'i': {
+        lua_Integer value;
+        memcpy(&value, *cursor, sizeof(value));
+        *cursor += sizeof(value);
+        lua_pushinteger(L, value);
+        return 1;
+    }
+    case 'd': {
+        lua_Number value;
+        memcpy(&value, *cursor, sizeof(value));
+        *cursor += sizeof(value);
+        lua_pushnumber(L, value);
+        return 1;
+    }
+    case 's': {
+        size_t length;
+        memcpy(&length, *cursor, sizeof(length));
+        *cursor += sizeof(length);
+        lua_pushlstring(L, *cursor, length);
+        *cursor += length;
+        return 1;
+    }
+    default: { // '{'
+        int top = lua_gettop(L);
+        lua_newtable(L);
+        while (**cursor != '}') {
+            if (!decode_value(L, cursor) || !decode_value(L, cursor)) {
+                lua_settop(L, top);
+                return 0;
+            }
+            lua_rawset(L, -3);
+        }
+        ++*cursor;
+        return 1;
+    }
+    }
+}
 
-int yl_test_stream(yl_execution_context_t *ctx)
+/**
+ * Set the fields of an encoded row as globals.
+ */
+static int set_row_globals(lua_State *L, const yl_test_buffer_t *globals)
+{
+    const char *cursor = globals->data;
+    if (!decode_value(L, &cursor))
+        return 0;
+    lua_pushnil(L);
+    while (lua_next(L, -2))
+        lua_setglobal(L, lua_tostring(L, -2));
+    lua_pop(L, 1);
+    return 1;
+}
+
+static void run_row(yl_test_row_t *row, size_t worker)
+{
+    double start = yl_time_now();
+    yl_execution_context_t ctx = {0};
+    yaml_event_t event = {0};
+
+    ctx.producer.callback = (yl_event_producer_callback_t *)yl_replay_event;
+    ctx.producer.data = &row->template;
+    ctx.consumer.callback = (yl_event_consumer_callback_t *)yl_record_event;
+    ctx.consumer.data = &row->output;
+    ctx.preserve_order = row->rows->preserve_order;
+
+    // Documents reset the environment when they end, so the worker's state is
+    // reused for every row it's given.
+    lua_State **state = &row->rows->states[worker];
+    if (*state == NULL) {
+        if ((*state = yl_allocator_new_state()) == NULL) {
+            ctx.err.type = YL_MEMORY_ERROR;
+            ctx.err.context = "While trying to run parameterized testcases, got memory error";
+            ctx.err.message = "could not initialize lua";
+            goto error;
+        }
+        yl_load_safe_libraries(*state);
+        yl_budget_set(*state, &row->rows->budget);
+        yl_chunk_cache_set_capacity(*state, row->rows->chunk_cache_size);
+    }
+    ctx.lua = *state;
+
+    if (!set_row_globals(ctx.lua, &row->globals)) {
+        yl_environment_reset(ctx.lua);
+        ctx.err.type = YL_MEMORY_ERROR;
+        ctx.err.context = "While trying to run parameterized testcases, got memory error";
+        ctx.err.message = "could not expand Lua stack space";
+        goto error;
+    }
+    if (!yl_replay_event(&row->template, &event, &ctx.err) || !yl_execute_document(&ctx, &event))
+        goto error;
+    goto done;
+
+error:
+    row->failed = true;
+    row->err = ctx.err;
+    if (ctx.err.message != NULL) {
+        snprintf(row->message, sizeof(row->message), "%s", ctx.err.message);
+        row->err.message = row->message;
+    }
+
+done:
+    if (ctx.lua != NULL)
+        lua_settop(ctx.lua, 0);
+    yaml_event_delete(&event);
+    row->seconds = yl_time_now() - start;
+}
+
+/**
+ * Record the time of a case that passed, and report it if asked to.
+ *
+ * @param[in]       row         The row of a !testcases sequence, from 1, or 0 for
+ *                              a case of its own.
+ */
+static void report_case(yl_test_timing_t *timing, size_t line, size_t column, size_t row, double seconds)
+{
+    if (timing == NULL)
+        return;
+    timing->seconds = seconds;
+    if (timing->report == NULL)
+        return;
+    if (row > 0)
+        fprintf(timing->report, "case %zu:%zu row %zu: %.3f ms\n", line + 1, column + 1, row, seconds * 1e3);
+    else
+        fprintf(timing->report, "case %zu:%zu: %.3f ms\n", line + 1, column + 1, seconds * 1e3);
+}
+
+/**
+ * Run a template once for each row of a !testcases sequence, with the row's
+ * fields as globals, and compare each result with the next expected document of
+ * the stream.
+ *
+ * Rows run concurrently, each worker reusing one Lua state for the rows it's
+ * given. The expected documents are rendered on the context's state in the
+ * meantime. Results are passed to the consumer and compared in row order.
+ *
+ * @param[in,out]   ctx         The execution context, with the rows on the top
+ *                              of its Lua stack.
+ * @param[in]       template    The recorded, unexecuted template document.
+ * @param[out]      cases       If not NULL, incremented for each row that passed.
+ * @param[in,out]   timing      If not NULL, where the time of each row goes.
+ */
+static int test_rows(yl_execution_context_t *ctx, yl_event_record_t *template, size_t *cases, yl_test_timing_t *timing)
+{
+    double start = yl_time_now();
+    lua_State *L = ctx->lua;
+    int rows = lua_gettop(L);
+    size_t nrows = lua_type(L, rows) == LUA_TTABLE ? lua_rawlen(L, rows) : 0;
+    size_t line = template->length > 0 ? template->events[0].start_mark.line : 0;
+    size_t column = template->length > 0 ? template->events[0].start_mark.column : 0;
+
+    yl_pool_t pool = {0};
+    yaml_event_t event = {0};
+    size_t nworkers = nrows < yl_pool_default_size() ? nrows : yl_pool_default_size();
+    yl_test_rows_t shared = {ctx->preserve_order, yl_budget_get(L), yl_chunk_cache_stats(L).capacity, NULL};
+    shared.states = calloc(nworkers + 1, sizeof(lua_State *));
+    yl_event_record_t *expected = calloc(nrows + 1, sizeof(yl_event_record_t));
+    yl_test_row_t *row_states = calloc(nrows + 1, sizeof(yl_test_row_t));
+    yl_test_row_t *failed_row = NULL;
+    int status = 0;
+
+    if (shared.states == NULL || expected == NULL || row_states == NULL) {
+        ctx->err.type = YL_MEMORY_ERROR;
+        ctx->err.line = line;
+        ctx->err.column = column;
+        ctx->err.context = "While trying to run parameterized testcases, got memory error";
+        ctx->err.message = "unable to allocate rows";
+        goto done;
+    }
+
+    // Rows are encoded here, since only this thread may use L.
+    for (size_t i = 0; i < nrows; ++i) {
+        yl_test_row_t *row = &row_states[i];
+        row->template = *template;
+        row->template.index = 0;
+        row->rows = &shared;
+
+        bool encoded = lua_rawgeti(L, rows, (lua_Integer)i + 1) == LUA_TTABLE;
+        lua_pushnil(L);
+        while (encoded && lua_next(L, -2)) {
+            encoded = lua_type(L, -2) == LUA_TSTRING;
+            lua_pop(L, encoded ? 1 : 2);
+        }
+        encoded = encoded && encode_value(L, -1, &row->globals, 0);
+        lua_settop(L, rows);
+        if (!encoded) {
+            ctx->err.type = YL_TYPE_ERROR;
+            ctx->err.line = line;
+            ctx->err.column = column;
+            ctx->err.context = "While trying to run parameterized testcases, got unexpected row";
+            ctx->err.message = "rows must map names to nil, booleans, numbers, strings or tables of them";
+            goto done;
+        }
+    }
+
+    if (nrows > 0 && !yl_pool_initialize(&pool, nworkers)) {
+        ctx->err.type = YL_EXECUTION_ERROR;
+        ctx->err.line = line;
+        ctx->err.column = column;
+        ctx->err.context = "While trying to run parameterized testcases, got error";
+        ctx->err.message = "unable to start worker threads";
+        goto done;
+    }
+    for (size_t i = 0; i < nrows; ++i) {
+        if (!yl_pool_submit(&pool, (yl_pool_task_callback_t *)run_row, &row_states[i])) {
+            row_states[i].failed = true;
+            row_states[i].err.type = YL_MEMORY_ERROR;
+            row_states[i].err.line = line;
+            row_states[i].err.column = column;
+            row_states[i].err.context = "While trying to run parameterized testcases, got memory error";
+            row_states[i].err.message = "unable to queue row";
+        }
+    }
+
+    for (size_t i = 0; i < nrows; ++i) {
+        if (!ctx->producer.callback(ctx->producer.data, &event, &ctx->err))
+            goto done;
+        if (event.type != YAML_DOCUMENT_START_EVENT) {
+            ctx->err.type = YL_PARSER_ERROR;
+            ctx->err.line = event.start_mark.line;
+            ctx->err.column = event.start_mark.column;
+            ctx->err.context = "While trying to read the expected document of a testcase row, got unexpected event";
+            ctx->err.message = yl_event_name(event.type);
+            goto done;
+        }
+        if (!yl_test_record_document(ctx, &event, &expected[i], true))
+            goto done;
+    }
+
+    yl_pool_delete(&pool);
+
+    for (size_t i = 0; i < nrows; ++i) {
+        yl_test_row_t *row = &row_states[i];
+        failed_row = row;
+        if (row->failed) {
+            ctx->err = row->err;
+            if (row->err.message == row->message) {
+                // Keep the message alive on the caller's Lua stack, like any other error.
+                ctx->err.message = lua_pushstring(L, row->err.message);
+            }
+            goto done;
+        }
+
+        yl_event_record_t *records[] = {&row->output, &expected[i]};
+        for (size_t j = 0; j < 2; ++j) {
+            records[j]->index = 0;
+            if (!yl_replay_record(records[j], &ctx->consumer, &ctx->err))
+                goto done;
+        }
+
+        size_t mismatch;
+        if (!yl_event_record_equal(&row->output, &expected[i], &mismatch)) {
+            const yaml_event_t *at = &expected[i].events[mismatch < expected[i].length ? mismatch : 0];
+            ctx->err.type = YL_ASSERTION_ERROR;
+            ctx->err.line = at->start_mark.line;
+            ctx->err.column = at->start_mark.column;
+            ctx->err.context = "While comparing rendered documents";
+            ctx->err.message = lua_pushfstring(L, "actual document of row %d differs from expected document", (int)i + 1);
+            goto done;
+        }
+        if (cases != NULL)
+            ++*cases;
+        report_case(timing, line, column, i + 1, row->seconds);
+    }
+    status = 1;
+
+done:
+    if (!status && timing != NULL)
+        timing->seconds = failed_row != NULL ? failed_row->seconds : yl_time_now() - start;
+    yaml_event_delete(&event);
+    yl_pool_delete(&pool); // Let running rows finish before freeing them.
+    for (size_t i = 0; row_states != NULL && i < nrows; ++i) {
+        yl_event_record_delete(&row_states[i].output);
+        free(row_states[i].globals.data);
+    }
+    for (size_t i = 0; shared.states != NULL && i < nworkers; ++i) {
+        if (shared.states[i] != NULL)
+            yl_allocator_close_state(shared.states[i]);
+    }
+    free(shared.states);
+    for (size_t i = 0; expected != NULL && i < nrows; ++i)
+        yl_event_record_delete(&expected[i]);
+    free(row_states);
+    free(expected);
+    return status;
+}
+
+int yl_test_stream(yl_execution_context_t *ctx, size_t *cases, yl_test_timing_t *timing)
 {
     yaml_event_t next_event = {0};
+    double case_start = yl_time_now();
+    bool in_rows = false; // The rows account for their own time.
 
     yl_event_record_t actual_events = {0};
     yl_event_record_t expected_events = {0};
-    char *expected_rendering = NULL, *actual_rendering = NULL;
 
     if (!ctx->producer.callback(ctx->producer.data, &next_event, &ctx->err))
         goto error;
@@ -33,6 +451,7 @@ int yl_test_stream(yl_execution_context_t *ctx)
         goto error;
 
     while (true) {
+        case_start = yl_time_now();
         if (!ctx->producer.callback(ctx->producer.data, &next_event, &ctx->err))
             goto error;
 
@@ -54,7 +473,7 @@ int yl_test_stream(yl_execution_context_t *ctx)
         lua_pushcclosure(ctx->lua, yl_test_testcase, 2);
         lua_pushvalue(ctx->lua, -1); // Duplicate the closure so it is not consumed when setting global.
         lua_setglobal(ctx->lua, "testcases");
-        // -1: yl_test_testcase closure
+        int closure = lua_gettop(ctx->lua);
 
         switch (next_event.type) {
         case YAML_DOCUMENT_START_EVENT:
@@ -93,17 +512,21 @@ int yl_test_stream(yl_execution_context_t *ctx)
 
             if (!yl_test_record_document(ctx, &next_event, &actual_events, false))
                 goto error;
-            fprintf(stderr, "IT'S PARAMETERIZED!!!\n");
-        }
 
-        actual_rendering = yl_event_record_to_string(&actual_events, &ctx->err);
-        if (actual_rendering == NULL)
-            goto error;
-        for (size_t i = 0; i < actual_events.length; ++i) {
-            if (!ctx->consumer.callback(ctx->consumer.data, &actual_events.events[i], NULL, &ctx->err))
+            lua_getupvalue(ctx->lua, closure, 2);
+            in_rows = true;
+            if (!test_rows(ctx, &actual_events, cases, timing))
                 goto error;
+            in_rows = false;
+            yl_event_record_delete(&actual_events);
+            lua_settop(ctx->lua, closure - 1);
+            continue;
         }
 
+        actual_events.index = 0;
+        if (!yl_replay_record(&actual_events, &ctx->consumer, &ctx->err))
+            goto error;
+
         if (!ctx->producer.callback(ctx->producer.data, &next_event, &ctx->err))
             goto error;
 
@@ -122,15 +545,17 @@ int yl_test_stream(yl_execution_context_t *ctx)
             goto error;
         }
 
-        expected_rendering = yl_event_record_to_string(&expected_events, &ctx->err);
-        if (expected_rendering == NULL)
+        expected_events.index = 0;
+        if (!yl_replay_record(&expected_events, &ctx->consumer, &ctx->err))
             goto error;
-        for (size_t i = 0; i < expected_events.length; ++i) {
-            if (!ctx->consumer.callback(ctx->consumer.data, &expected_events.events[i], NULL, &ctx->err))
-                goto error;
-        }
 
-        if (strcmp(actual_rendering, expected_rendering) != 0) {
+        size_t mismatch;
+        if (!yl_event_record_equal(&actual_events, &expected_events, &mismatch)) {
+            // Rendered events have no marks; point at the expected node instead.
+            if (mismatch < expected_events.length) {
+                line = expected_events.events[mismatch].start_mark.line;
+                column = expected_events.events[mismatch].start_mark.column;
+            }
             ctx->err.type = YL_ASSERTION_ERROR;
             ctx->err.line = line;
             ctx->err.column = column;
@@ -138,22 +563,20 @@ int yl_test_stream(yl_execution_context_t *ctx)
             ctx->err.message = "actual document differs from expected document";
             goto error;
         }
+        if (cases != NULL)
+            ++*cases;
+        report_case(timing, line, column, 0, yl_time_now() - case_start);
 
-        free(actual_rendering);
-        actual_rendering = NULL;
-        free(expected_rendering);
-        expected_rendering = NULL;
         yl_event_record_delete(&actual_events);
         yl_event_record_delete(&expected_events);
+        lua_settop(ctx->lua, closure - 1);
     }
 done:
     return 1;
 
 error:
-    if (actual_rendering != NULL)
-        free(actual_rendering);
-    if (expected_rendering != NULL)
-        free(expected_rendering);
+    if (timing != NULL && !in_rows)
+        timing->seconds = yl_time_now() - case_start;
     yl_event_record_delete(&actual_events);
     yl_event_record_delete(&expected_events);
     yaml_event_delete(&next_event);
@@ -166,6 +589,7 @@ int yl_test_record_document(yl_execution_context_t *ctx, yaml_event_t *next_even
 
     ctx->consumer.callback = (yl_event_consumer_callback_t *)yl_record_event;
     ctx->consumer.data = event_record;
+    ctx->consumer.borrows = false;
 
     if (execute) {
         if (!yl_execute_document(ctx, next_event))
@@ -212,7 +636,6 @@ error:
 
 int yl_test_testcase(lua_State *L)
 {
-    fprintf(stderr, "yl_test_testcase\n");
     luaL_checktype(L, lua_upvalueindex(1), LUA_TLIGHTUSERDATA);
     bool *is_parameterized = lua_touserdata(L, lua_upvalueindex(1));
 
@@ -227,3 +650,147 @@ int yl_test_testcase(lua_State *L)
     }
     return 0;
 }
+
+typedef struct _yl_test_job_s {
+    const char *path;
+    const yl_test_options_t *options;
+
+    int status; // Process-style exit status: 0 on success, 1 on failure.
+    size_t cases;
+    double seconds;
+    char report[1024]; // The error report, when status is non-zero.
+    char *timings;     // The time of each case, if the options ask for it.
+    size_t timings_size;
+} yl_test_job_t;
+
+/**
+ * Event consumer that drops every event; the runner only reports results.
+ */
+static int discard_event(void *data, yaml_event_t *event, lua_State *L, yl_error_t *err)
+{
+    (void)data;
+    (void)L;
+    (void)err;
+    yaml_event_delete(event);
+    return 1;
+}
+
+static void run_job(yl_test_job_t *job, size_t worker)
+{
+    (void)worker; // Every file gets a fresh Lua state, so no per-worker state is kept.
+
+    double start = yl_time_now();
+
+    FILE *input = NULL;
+    yl_execution_context_t ctx = {0};
+    yaml_parser_t parser = {0};
+    yl_parser_input_t parser_input = {0};
+    yl_test_timing_t timing = {0};
+    double failed_seconds = -1; // Of the failing case, if one failed.
+
+    if (job->options->timing && (timing.report = open_memstream(&job->timings, &job->timings_size)) == NULL) {
+        job->status = 1;
+        snprintf(job->report, sizeof(job->report), "error opening timing report: %s", strerror(errno));
+        goto done;
+    }
+    if ((input = fopen(job->path, "rb")) == NULL) {
+        job->status = 1;
+        snprintf(job->report, sizeof(job->report), "error opening input file: %s", strerror(errno));
+        goto done;
+    }
+    if (!yaml_parser_initialize(&parser)) {
+        job->status = 1;
+        snprintf(job->report, sizeof(job->report), "error initializing parser");
+        goto done;
+    }
+    if (!yl_parser_set_input(&parser, &parser_input, input, job->options->allow_mmap, &ctx.err))
+        goto failed;
+    ctx.producer.callback = (yl_event_producer_callback_t *)yl_parser_parse;
+    ctx.producer.data = &parser;
+    ctx.consumer.callback = discard_event;
+    ctx.preserve_order = job->options->preserve_order;
+
+    ctx.lua = yl_allocator_new_state();
+    if (ctx.lua == NULL) {
+        job->status = 1;
+        snprintf(job->report, sizeof(job->report), "error initializing lua");
+        goto done;
+    }
+    yl_load_safe_libraries(ctx.lua);
+    yl_budget_set(ctx.lua, &job->options->budget);
+    yl_chunk_cache_set_capacity(ctx.lua, job->options->chunk_cache_size);
+
+    // Format the report before closing the Lua state, which may own the message.
+    if (!yl_test_stream(&ctx, &job->cases, &timing)) {
+        failed_seconds = timing.seconds;
+        goto failed;
+    }
+    goto done;
+
+failed:
+    job->status = 1;
+    snprintf(job->report, sizeof(job->report), "%zu:%zu: %s: %s: %s",
+             ctx.err.line + 1,
+             ctx.err.column + 1,
+             yl_error_name(ctx.err.type),
+             ctx.err.context,
+             ctx.err.message);
+    if (failed_seconds >= 0) {
+        size_t length = strlen(job->report);
+        snprintf(job->report + length, sizeof(job->report) - length, " (failing case: %.3f ms)", failed_seconds * 1e3);
+    }
+
+done:
+    yaml_parser_delete(&parser);
+    yl_parser_input_delete(&parser_input);
+    if (ctx.lua)
+        yl_allocator_close_state(ctx.lua);
+    if (input)
+        fclose(input);
+    if (timing.report)
+        fclose(timing.report);
+
+    job->seconds = yl_time_now() - start;
+}
+
+size_t yl_test_files(char **paths, size_t count, const yl_test_options_t *options)
+{
+    yl_pool_t pool = {0};
+    yl_test_job_t *jobs = calloc(count, sizeof(yl_test_job_t));
+    if (jobs == NULL) {
+        fprintf(stderr, "Error allocating test jobs!\n");
+        return count;
+    }
+
+    if (!yl_pool_initialize(&pool, options->jobs ? options->jobs : yl_pool_default_size())) {
+        fprintf(stderr, "Error starting worker threads!\n");
+        free(jobs);
+        return count;
+    }
+    for (size_t i = 0; i < count; ++i) {
+        jobs[i].path = paths[i];
+        jobs[i].options = options;
+        if (!yl_pool_submit(&pool, (yl_pool_task_callback_t *)run_job, &jobs[i])) {
+            jobs[i].status = 1;
+            snprintf(jobs[i].report, sizeof(jobs[i].report), "error queueing job");
+        }
+    }
+    yl_pool_delete(&pool);
+
+    size_t failures = 0;
+    for (size_t i = 0; i < count; ++i) {
+        if (jobs[i].status == 0) {
+            fprintf(stderr, "%s: ok, %zu cases (%.3f ms)\n", jobs[i].path, jobs[i].cases, jobs[i].seconds * 1e3);
+        } else {
+            fprintf(stderr, "%s: exit %d after %zu cases: %s\n", jobs[i].path, jobs[i].status, jobs[i].cases, jobs[i].report);
+            ++failures;
+        }
+        if (jobs[i].timings != NULL) {
+            fwrite(jobs[i].timings, 1, jobs[i].timings_size, stderr);
+            free(jobs[i].timings);
+        }
+    }
+
+    free(jobs);
+    return failures;
+}
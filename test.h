@@ -1,9 +1,53 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#include "budget.h"
 #include "executor.h"
 #include "parser.h"
 
-int yl_test_stream(yl_execution_context_t *ctx);
+typedef struct _yl_test_options_s {
+    size_t jobs; // Worker threads; 0 for one per processor.
+    bool allow_mmap;
+    bool preserve_order;
+    bool timing; // Report the time each case took, not only the failing one.
+    yl_budget_t budget; // Of each expression.
+    long chunk_cache_size;
+} yl_test_options_t;
+
+/**
+ * How long the cases of a stream took.
+ */
+typedef struct _yl_test_timing_s {
+    FILE *report;   // If set, a line per case that passed, with its location and time.
+    double seconds; // Of the last case run, so of the failing one after a failure.
+} yl_test_timing_t;
+
+/**
+ * Run the testcases of a stream: each document is rendered, then compared with
+ * the rendering of the document after it with yl_event_record_equal().
+ *
+ * @param[in,out]   ctx         The execution context. Both documents of each
+ *                              case are passed to its consumer.
+ * @param[out]      cases       If not NULL, incremented for each case that passed.
+ * @param[in,out]   timing      If not NULL, where the time of each case goes. A
+ *                              row of a !testcases sequence counts as a case.
+ *
+ * @returns On success, returns @c 1. On the first failing case, returns @c 0.
+ */
+int yl_test_stream(yl_execution_context_t *ctx, size_t *cases, yl_test_timing_t *timing);
+
+/**
+ * Run many testcase files concurrently, each on its own Lua state, on a pool of
+ * workers. A status line with the number of cases and the time taken is printed
+ * to stderr for each file, in argument order, once all have finished, followed
+ * by the time of each case if the options ask for it.
+ *
+ * @returns The number of files that failed.
+ */
+size_t yl_test_files(char **paths, size_t count, const yl_test_options_t *options);
 
 int yl_test_record_document(yl_execution_context_t *ctx, yaml_event_t *next_event, yl_event_record_t *event_record, bool execute);
 
@@ -1,9 +1,30 @@
 #!/usr/bin/env bash
 set -euo pipefail
 
-build/main.out -i testcases/call.yaml -t
+build/main.out -t testcases/call.yaml testcases/formatting.yaml testcases/identity.yaml testcases/environment.yaml testcases/parameterized.yaml
 # build/main.out -i testcases/eval.yaml -t
 # build/main.out -i testcases/for.yaml -t
-build/main.out -i testcases/formatting.yaml -t
-build/main.out -i testcases/identity.yaml -t
+build/main.out -i testcases/order.yaml -t --preserve-order
+build/main.out -t --native-writer testcases/call.yaml testcases/parameterized.yaml
+(build/main.out -t --timing testcases/call.yaml testcases/parameterized.yaml 2>&1 >/dev/null) | grep -q '^case 7:1 row 4: '
+(printf 'a: ! 1\n---\na: 2\n' | build/main.out -t 2>&1 >/dev/null || true) | grep -q '(failing case: [0-9.]* ms)$'
 # build/main.out -i testcases/if.yaml -t
+diff <(build/main.out -i testcases/formatting.yaml) <(build/main.out -i testcases/formatting.yaml --native-writer)
+diff <(build/main.out -i testcases/identity.yaml) <(build/main.out -i testcases/identity.yaml --native-writer)
+(echo '! (function() while true do end end)()' | build/main.out --max-instructions 100000 || true) 2>&1 >/dev/null | grep -q BUDGET_ERROR
+(echo 'a: ! pcall(function() while true do end end)' | build/main.out --max-instructions 100000 || true) 2>&1 >/dev/null | grep -q BUDGET_ERROR
+(echo '! string.rep("x", 100000000)' | build/main.out --max-memory 1000000 || true) 2>&1 >/dev/null | grep -q BUDGET_ERROR
+(echo 'a: ! ("x"):rep(400000000):len()' | build/main.out --compile --max-memory 1000000 || true) 2>&1 >/dev/null | grep -q BUDGET_ERROR
+printf '%.0s[' {1..100000} | cat - <(printf '%.0s]' {1..100000}) | build/main.out >/dev/null
+build/main.out -i testcases/verbatim.yaml --verbatim | grep -q '# comment kept'
+diff <(build/main.out -i testcases/verbatim.yaml) <(build/main.out -i testcases/verbatim.yaml --verbatim | build/main.out)
+(d=$(mktemp -d) && cp testcases/identity.yaml $d/t.yaml && { timeout 2 build/main.out --watch $d/t.yaml -o $d/out.yaml 2>$d/log & } && sleep 0.5 && cp testcases/formatting.yaml $d/t.yaml && sleep 0.5 && diff $d/out.yaml <(build/main.out -i testcases/formatting.yaml) && grep -q '^cycle 2:' $d/log && rm -r $d)
+(d=$(mktemp -d); build/main.out --daemon $d/sock -j 2 2>/dev/null & pid=$!; trap 'kill -INT $pid; wait $pid; rm -r $d' EXIT; sleep 0.5 && diff <(build/main.out --client $d/sock < testcases/formatting.yaml) <(build/main.out -i testcases/formatting.yaml) && build/main.out --client $d/sock --daemon-stats | grep -q '^requests: 1,')
+(printf 'a:\n  b: !string.upper abc\n' | build/main.out --profile 2>&1 >/dev/null) | grep -q ' 2:6$'
+make -s bench BENCH_CORPUS='--documents 10' | grep -q '"events_per_second"'
+diff <(printf 'a: ~\nb: null\nc: true\nd: false\ne: 0x1F\nf: 017\ng: !!str 5\nh: "6"\n---\n- ! 1 + 1\n- ! ({x = 1, y = "2"})\n' | build/main.out --format json) <(printf '{"a":null,"b":null,"c":true,"d":false,"e":31,"f":15,"g":"5","h":"6"}\n[2,{"x":1,"y":"2"}]\n')
+(d=$(mktemp -d) && build/main.out -O $d -j 2 testcases/formatting.yaml testcases/identity.yaml testcases/verbatim.yaml && for f in formatting identity verbatim; do diff $d/$f.yaml <(build/main.out -i testcases/$f.yaml) || exit 1; done && rm -r $d)
+(printf 'a: ! string.rep("x", 1000)\n---\nb: 1\n' | build/main.out --memory-stats 2>&1 >/dev/null) | awk '/^document 1: .* [0-9]+ bytes allocated/ { one = $6 >= 1000 } /^document 2: .* 0 allocations$/ { two = 1 } END { exit !(one && two) }'
+(d=$(mktemp -d) && cp testcases/formatting.yaml $d/t.yaml && build/main.out -i $d/t.yaml --cache-dir $d >$d/1 && ls $d/*.ylc >/dev/null && (build/main.out -i $d/t.yaml --cache-dir $d --timing 2>&1 >$d/2) | grep '^read (cache)' >/dev/null && diff $d/1 $d/2 && diff $d/1 <(build/main.out -i $d/t.yaml) && chmod o+w $d && (build/main.out -i $d/t.yaml --cache-dir $d 2>&1 >/dev/null) | grep -q "can't trust" && rm -r $d)
+(d=$(mktemp -d) && printf 'a: ! 1 + 1\nb: !string.upper abc\n' >$d/t.yaml && build/main.out -i $d/t.yaml --cache-dir $d >$d/1 && sed -i 's/\x1bLua/\x1bLux/' $d/*.ylc && (build/main.out -i $d/t.yaml --cache-dir $d 2>&1 >$d/2) | grep -q '^Warning: could not load compiled template' && diff $d/1 $d/2 && (build/main.out -i $d/t.yaml --cache-dir $d --timing 2>&1 >$d/3) | grep '^read (cache)' >/dev/null && diff $d/1 $d/3 && rm -r $d)
+(d=$(mktemp -d) && printf '%%YAML 1.1\n%%TAG !e! tag:example.com,2000:\n---\na: &x 1\nb: !e!foo 2\nc: ! 1 + 1\nd: !\n  x: [1, "2"]\n---\n- plain\n' >$d/t.yaml && for o in --native-writer '--format json' '--native-writer --verbatim'; do build/main.out -i $d/t.yaml $o >$d/1 && build/main.out -i $d/t.yaml --cache-dir $d $o >/dev/null && build/main.out -i $d/t.yaml --cache-dir $d $o >$d/2 && diff $d/1 $d/2 || exit 1; done && rm -r $d)
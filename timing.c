@@ -0,0 +1,22 @@
+#include <time.h>
+
+#include "timing.h"
+
+double yl_time_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int yl_timed_producer(yl_timed_producer_t *timed_producer, yaml_event_t *event, yl_error_t *err)
+{
+    double start = yl_time_now();
+    int status = timed_producer->producer.callback(timed_producer->producer.data, event, err);
+    timed_producer->seconds += yl_time_now() - start;
+
+    if (status)
+        ++timed_producer->events;
+
+    return status;
+}
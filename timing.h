@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "executor.h"
+
+/**
+ * Seconds elapsed on a monotonic clock, for measuring intervals.
+ */
+double yl_time_now(void);
+
+typedef struct _yl_timed_producer_s {
+    yl_event_producer_t producer;
+    double seconds;
+    size_t events;
+} yl_timed_producer_t;
+
+/**
+ * Event producer that forwards to a wrapped producer, accumulating the time spent
+ * in it and the number of events it produced.
+ */
+int yl_timed_producer(yl_timed_producer_t *timed_producer, yaml_event_t *event, yl_error_t *err);
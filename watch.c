@@ -0,0 +1,464 @@
+#include <errno.h>
+#include <libgen.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "budget.h"
+#include "cache.h"
+#include "chunk_cache.h"
+#include "emitter.h"
+#include "environment.h"
+#include "executor.h"
+#include "json.h"
+#include "parser.h"
+#include "timing.h"
+#include "watch.h"
+#include "writer.h"
+
+// How long to wait for more writes to the input before rendering it.
+#define YL_WATCH_SETTLE_MS 20
+
+typedef struct _yl_watch_s {
+    const yl_watch_options_t *options;
+    lua_State *lua;
+
+    // The documents of the last successful cycle, and a permutation sorted by hash.
+    yl_watch_document_t *documents;
+    size_t ndocuments;
+    size_t *by_hash;
+
+    size_t cycles;
+} yl_watch_t;
+
+static void documents_delete(yl_watch_document_t *documents, size_t ndocuments)
+{
+    for (size_t i = 0; i < ndocuments; ++i) {
+        free(documents[i].source);
+        yl_event_record_delete(&documents[i].output);
+    }
+    free(documents);
+}
+
+static const yl_watch_document_t *sort_documents;
+
+static int compare_by_hash(const void *left, const void *right)
+{
+    uint64_t l = sort_documents[*(const size_t *)left].hash, r = sort_documents[*(const size_t *)right].hash;
+    return (l > r) - (l < r);
+}
+
+/**
+ * Find a document of the previous cycle with the same source whose output hasn't
+ * been claimed yet, and claim it. The hash only narrows down the candidates.
+ */
+static size_t claim_previous(yl_watch_t *watch, const yl_watch_document_t *document, bool *claimed)
+{
+    uint64_t hash = document->hash;
+    size_t low = 0, high = watch->ndocuments;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (watch->documents[watch->by_hash[middle]].hash < hash)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    for (; low < watch->ndocuments && watch->documents[watch->by_hash[low]].hash == hash; ++low) {
+        size_t index = watch->by_hash[low];
+        const yl_watch_document_t *previous = &watch->documents[index];
+        if (!claimed[index] && previous->length == document->length &&
+            memcmp(previous->source, document->source, document->length) == 0) {
+            claimed[index] = true;
+            return index;
+        }
+    }
+    return SIZE_MAX;
+}
+
+static int append_document(yl_watch_document_t **documents, size_t *ndocuments, size_t *capacity)
+{
+    if (*ndocuments == *capacity) {
+        size_t new_capacity = *capacity ? *capacity * 2 : 16;
+        yl_watch_document_t *grown = realloc(*documents, new_capacity * sizeof(yl_watch_document_t));
+        if (grown == NULL)
+            return 0;
+        *documents = grown;
+        *capacity = new_capacity;
+    }
+    (*documents)[(*ndocuments)++] = (yl_watch_document_t){0, NULL, 0, {0}, SIZE_MAX};
+    return 1;
+}
+
+/**
+ * Execute one recorded document on the warm Lua state, recording its output.
+ */
+static int execute_document(yl_watch_t *watch, yl_event_record_t *input, yl_event_record_t *output, yl_error_t *err)
+{
+    yl_execution_context_t ctx = {0};
+    yaml_event_t event = {0};
+
+    ctx.producer.callback = (yl_event_producer_callback_t *)yl_replay_event;
+    ctx.producer.data = input;
+    ctx.consumer.callback = (yl_event_consumer_callback_t *)yl_record_event;
+    ctx.consumer.data = output;
+    ctx.lua = watch->lua;
+    ctx.preserve_order = watch->options->preserve_order;
+
+    int status = yl_replay_event(input, &event, &ctx.err) && yl_execute_document(&ctx, &event);
+    yaml_event_delete(&event);
+    *err = ctx.err;
+    return status;
+}
+
+/**
+ * Pass a whole stream of rendered documents to a consumer.
+ */
+static int write_documents(yl_event_consumer_t *consumer, yl_watch_document_t *documents, size_t ndocuments, yl_error_t *err)
+{
+    yaml_event_t event = {0};
+
+    yaml_stream_start_event_initialize(&event, YAML_UTF8_ENCODING);
+    if (!consumer->callback(consumer->data, &event, NULL, err))
+        goto error;
+    yaml_event_delete(&event);
+
+    for (size_t i = 0; i < ndocuments; ++i) {
+        yl_event_record_t *output = &documents[i].output;
+        output->index = 0;
+        if (!yl_replay_record(output, consumer, err))
+            goto error;
+    }
+
+    yaml_stream_end_event_initialize(&event);
+    if (!consumer->callback(consumer->data, &event, NULL, err))
+        goto error;
+    yaml_event_delete(&event);
+
+    return 1;
+
+error:
+    yaml_event_delete(&event);
+    return 0;
+}
+
+/**
+ * Write the output to a temporary file next to it, then move it into place.
+ */
+static int write_output(yl_watch_t *watch, yl_watch_document_t *documents, size_t ndocuments, yl_error_t *err)
+{
+    const yl_watch_options_t *options = watch->options;
+    yaml_emitter_t emitter = {0};
+    yl_writer_t writer = {0};
+    yl_json_writer_t json_writer = {0};
+    yl_event_consumer_t consumer = {0};
+    int status = 0;
+
+    size_t length = strlen(options->output_path) + sizeof(".tmp");
+    char *path = malloc(length);
+    FILE *file = NULL;
+    if (path == NULL) {
+        err->type = YL_MEMORY_ERROR;
+        err->message = "could not allocate the output path";
+        goto done;
+    }
+    snprintf(path, length, "%s.tmp", options->output_path);
+    if ((file = fopen(path, "wb")) == NULL) {
+        err->type = YL_WRITER_ERROR;
+        err->message = strerror(errno);
+        goto done;
+    }
+
+    if (options->json) {
+        if (!yl_json_writer_initialize(&json_writer, file))
+            goto memory_error;
+        consumer = (yl_event_consumer_t){(yl_event_consumer_callback_t *)yl_json_writer_write, &json_writer, true};
+    } else if (options->native_writer) {
+        if (!yl_writer_initialize(&writer, file))
+            goto memory_error;
+        consumer = (yl_event_consumer_t){(yl_event_consumer_callback_t *)yl_writer_write, &writer, true};
+    } else {
+        if (!yaml_emitter_initialize(&emitter))
+            goto memory_error;
+        yaml_emitter_set_unicode(&emitter, true);
+        yaml_emitter_set_encoding(&emitter, YAML_UTF8_ENCODING);
+        yaml_emitter_set_output_file(&emitter, file);
+        consumer = (yl_event_consumer_t){(yl_event_consumer_callback_t *)yl_emitter_emit, &emitter, false};
+    }
+
+    if (!write_documents(&consumer, documents, ndocuments, err))
+        goto done;
+
+    FILE *written = file;
+    file = NULL;
+    if (fclose(written) != 0 || rename(path, options->output_path) != 0) {
+        err->type = YL_WRITER_ERROR;
+        err->message = strerror(errno);
+        goto done;
+    }
+    status = 1;
+    goto done;
+
+memory_error:
+    err->type = YL_MEMORY_ERROR;
+    err->message = "could not initialize the output";
+    goto done;
+
+done:
+    yaml_emitter_delete(&emitter);
+    yl_writer_delete(&writer);
+    yl_json_writer_delete(&json_writer);
+    if (file != NULL)
+        fclose(file);
+    if (!status && path != NULL)
+        remove(path);
+    free(path);
+    return status;
+}
+
+/**
+ * Render the input once, reusing the output of unchanged documents.
+ */
+static int run_cycle(yl_watch_t *watch)
+{
+    const yl_watch_options_t *options = watch->options;
+    double start = yl_time_now();
+
+    yaml_parser_t parser = {0};
+    yl_parser_input_t input = {0};
+    yl_event_record_t record = {0};
+    yaml_event_t event = {0};
+    yl_error_t err = {0};
+    yl_watch_document_t *documents = NULL;
+    size_t ndocuments = 0, capacity = 0, rendered = 0;
+    bool *claimed = calloc(watch->ndocuments + 1, sizeof(bool));
+    int status = 0;
+
+    FILE *file = fopen(options->input_path, "rb");
+    if (file == NULL) {
+        err.type = YL_READER_ERROR;
+        err.context = "While opening the input, got error";
+        err.message = strerror(errno);
+        goto done;
+    }
+    if (claimed == NULL || !yaml_parser_initialize(&parser)) {
+        err.type = YL_MEMORY_ERROR;
+        err.context = "While starting a cycle, got error";
+        err.message = "could not initialize the parser";
+        goto done;
+    }
+    if (!yl_parser_set_input(&parser, &input, file, true, &err))
+        goto done;
+    if (input.data == NULL) {
+        err.type = YL_READER_ERROR;
+        err.context = "While opening the input, got error";
+        err.message = "only regular files can be watched";
+        goto done;
+    }
+
+    bool finished = false;
+    while (!finished) {
+        if (!yl_parser_parse(&parser, &event, &err))
+            goto done;
+
+        switch (event.type) {
+        case YAML_DOCUMENT_START_EVENT: {
+            size_t from, to;
+            if (!yl_parser_input_offset(&input, event.start_mark.index, &from))
+                goto offset_error;
+
+            yl_event_record_delete(&record);
+            while (event.type != YAML_DOCUMENT_END_EVENT) {
+                if (!yl_record_event(&record, &event, NULL, &err) ||
+                    !yl_parser_parse(&parser, &event, &err))
+                    goto done;
+            }
+            if (!yl_parser_input_offset(&input, event.end_mark.index, &to))
+                goto offset_error;
+            if (!yl_record_event(&record, &event, NULL, &err))
+                goto done;
+
+            if (!append_document(&documents, &ndocuments, &capacity)) {
+                err.type = YL_MEMORY_ERROR;
+                err.context = "While starting a cycle, got error";
+                err.message = "could not grow the document list";
+                goto done;
+            }
+            yl_watch_document_t *document = &documents[ndocuments - 1];
+            document->length = to - from;
+            if ((document->source = malloc(document->length + 1)) == NULL) {
+                err.type = YL_MEMORY_ERROR;
+                err.context = "While starting a cycle, got error";
+                err.message = "could not copy the document source";
+                goto done;
+            }
+            memcpy(document->source, input.data + from, document->length);
+            document->hash = yl_cache_hash(input.data + from, to - from);
+            document->reuse = claim_previous(watch, document, claimed);
+            if (document->reuse == SIZE_MAX) {
+                if (!execute_document(watch, &record, &document->output, &err))
+                    goto done;
+                ++rendered;
+            }
+        } break;
+        case YAML_STREAM_END_EVENT:
+            finished = true;
+            break;
+        default:
+            break;
+        }
+        yaml_event_delete(&event);
+    }
+
+    // Only now that every document has rendered, take over the reused output.
+    for (size_t i = 0; i < ndocuments; ++i) {
+        if (documents[i].reuse != SIZE_MAX) {
+            documents[i].output = watch->documents[documents[i].reuse].output;
+            watch->documents[documents[i].reuse].output = (yl_event_record_t){0};
+        }
+    }
+    documents_delete(watch->documents, watch->ndocuments);
+    free(watch->by_hash);
+    watch->documents = documents;
+    watch->ndocuments = ndocuments;
+    documents = NULL;
+    ndocuments = 0;
+
+    if ((watch->by_hash = malloc((watch->ndocuments + 1) * sizeof(size_t))) == NULL) {
+        // Without the index, the next cycle renders everything.
+        documents_delete(watch->documents, watch->ndocuments);
+        watch->documents = NULL;
+        watch->ndocuments = 0;
+    } else {
+        for (size_t i = 0; i < watch->ndocuments; ++i)
+            watch->by_hash[i] = i;
+        sort_documents = watch->documents;
+        qsort(watch->by_hash, watch->ndocuments, sizeof(size_t), compare_by_hash);
+    }
+
+    if (!write_output(watch, watch->documents, watch->ndocuments, &err)) {
+        err.context = "While writing the output, got error";
+        goto done;
+    }
+
+    status = 1;
+    fprintf(options->report, "cycle %zu: %zu documents, %zu rendered, %zu reused, %.3f ms\n",
+            ++watch->cycles,
+            watch->ndocuments,
+            rendered,
+            watch->ndocuments - rendered,
+            (yl_time_now() - start) * 1e3);
+    goto done;
+
+offset_error:
+    err.type = YL_READER_ERROR;
+    err.line = event.start_mark.line;
+    err.column = event.start_mark.column;
+    err.context = "While hashing a document, got error";
+    err.message = "the input must be UTF-8";
+    goto done;
+
+done:
+    if (!status) {
+        fprintf(options->report, "cycle %zu failed: %zu:%zu: %s: %s: %s\n",
+                ++watch->cycles,
+                err.line + 1,
+                err.column + 1,
+                yl_error_name(err.type),
+                err.context,
+                err.message);
+    }
+    // The Lua stack may hold an error message; nothing on it outlives the cycle.
+    lua_settop(watch->lua, 0);
+    documents_delete(documents, ndocuments);
+    free(claimed);
+    yaml_event_delete(&event);
+    yl_event_record_delete(&record);
+    yaml_parser_delete(&parser);
+    yl_parser_input_delete(&input);
+    if (file != NULL)
+        fclose(file);
+    return status;
+}
+
+/**
+ * Block until the input is written or moved into place, then wait for the writes
+ * to settle.
+ */
+static int wait_for_change(int fd, const char *name)
+{
+    char buffer[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+    bool changed = false;
+
+    while (!changed) {
+        ssize_t length = read(fd, buffer, sizeof(buffer));
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+        for (char *p = buffer; p < buffer + length;) {
+            struct inotify_event *event = (struct inotify_event *)p;
+            if (event->len > 0 && strcmp(event->name, name) == 0)
+                changed = true;
+            p += sizeof(struct inotify_event) + event->len;
+        }
+    }
+
+    // Drain the events of the rest of a burst of writes.
+    struct pollfd pfd = {fd, POLLIN, 0};
+    while (poll(&pfd, 1, YL_WATCH_SETTLE_MS) > 0)
+        if (read(fd, buffer, sizeof(buffer)) < 0 && errno != EINTR)
+            return 0;
+
+    return 1;
+}
+
+int yl_watch(const yl_watch_options_t *options)
+{
+    yl_watch_t watch = {0};
+    watch.options = options;
+    int fd = -1;
+    char *directory_copy = strdup(options->input_path);
+    char *name_copy = strdup(options->input_path);
+
+    if (directory_copy == NULL || name_copy == NULL) {
+        fprintf(stderr, "Error allocating input path!\n");
+        goto error;
+    }
+
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0 || inotify_add_watch(fd, dirname(directory_copy), IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+        fprintf(stderr, "Error watching %s: %s\n", options->input_path, strerror(errno));
+        goto error;
+    }
+    const char *name = basename(name_copy);
+
+    watch.lua = yl_allocator_new_state();
+    if (watch.lua == NULL) {
+        fprintf(stderr, "Error initializing lua!\n");
+        goto error;
+    }
+    yl_load_safe_libraries(watch.lua);
+    yl_budget_set(watch.lua, &options->budget);
+    yl_chunk_cache_set_capacity(watch.lua, options->chunk_cache_size);
+
+    do {
+        run_cycle(&watch);
+    } while (wait_for_change(fd, name));
+
+    fprintf(stderr, "Error watching %s: %s\n", options->input_path, strerror(errno));
+
+error:
+    documents_delete(watch.documents, watch.ndocuments);
+    free(watch.by_hash);
+    if (watch.lua)
+        yl_allocator_close_state(watch.lua);
+    if (fd >= 0)
+        close(fd);
+    free(directory_copy);
+    free(name_copy);
+    return 1;
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "budget.h"
+#include "event.h"
+
+typedef struct _yl_watch_options_s {
+    const char *input_path;
+    const char *output_path;
+    bool preserve_order;
+    bool native_writer;
+    bool json;
+    long chunk_cache_size;
+    yl_budget_t budget;
+    FILE *report; // Receives errors and the latency of each cycle.
+} yl_watch_options_t;
+
+/**
+ * A rendered document, kept for as long as its source doesn't change.
+ */
+typedef struct _yl_watch_document_s {
+    uint64_t hash; // Of the document's source bytes, to find candidates by.
+    char *source;  // A copy of the source bytes, compared before reusing the output.
+    size_t length;
+    yl_event_record_t output;
+    size_t reuse; // During a cycle, the index of the previous document to take the output of, or SIZE_MAX.
+} yl_watch_document_t;
+
+/**
+ * Render a template, then render it again every time it's written, until the
+ * process is stopped.
+ *
+ * The input's directory is watched with inotify, so editors that replace the file
+ * are noticed too. Every cycle parses the whole stream, but only executes the
+ * documents whose source bytes changed since the previous cycle; the rendered
+ * events of the others are reused. The output is then rewritten in one go, by
+ * renaming a temporary file over it. If a cycle fails, the error is reported and
+ * the previous output is left in place.
+ *
+ * One Lua state is kept across cycles, so compiled expressions stay cached.
+ * Documents never see each other's globals, so an unchanged document renders the
+ * same whatever changed around it.
+ *
+ * @param[in]       options     The input and output paths and render settings.
+ *
+ * @returns Only if watching can't be set up, returns @c 1.
+ */
+int yl_watch(const yl_watch_options_t *options);
@@ -0,0 +1,1543 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "writer.h"
+
+#define BEST_INDENT 2
+#define BEST_WIDTH 80
+#define MAX_SIMPLE_KEY_LENGTH 128
+
+static const yaml_tag_directive_t default_tag_directives[] = {
+    {(yaml_char_t *)"!", (yaml_char_t *)"!"},
+    {(yaml_char_t *)"!!", (yaml_char_t *)"tag:yaml.org,2002:"},
+};
+
+/*
+ * Character classes, as libyaml defines them. Strings are valid UTF-8 and
+ * NUL-terminated, so looking at the bytes after a lead byte is safe.
+ */
+
+static inline size_t char_width(const yaml_char_t *p)
+{
+    return (p[0] & 0x80) == 0x00   ? 1
+           : (p[0] & 0xE0) == 0xC0 ? 2
+           : (p[0] & 0xF0) == 0xE0 ? 3
+           : (p[0] & 0xF8) == 0xF0 ? 4
+                                   : 1;
+}
+
+static inline bool is_alpha(const yaml_char_t *p)
+{
+    return (p[0] >= '0' && p[0] <= '9') || (p[0] >= 'A' && p[0] <= 'Z') ||
+           (p[0] >= 'a' && p[0] <= 'z') || p[0] == '_' || p[0] == '-';
+}
+
+static inline bool is_printable(const yaml_char_t *p)
+{
+    return p[0] == 0x0A ||
+           (p[0] >= 0x20 && p[0] <= 0x7E) ||
+           (p[0] == 0xC2 && p[1] >= 0xA0) ||
+           (p[0] > 0xC2 && p[0] < 0xED) ||
+           (p[0] == 0xED && p[1] < 0xA0) ||
+           p[0] == 0xEE ||
+           (p[0] == 0xEF &&
+            !(p[1] == 0xBB && p[2] == 0xBF) &&
+            !(p[1] == 0xBF && (p[2] == 0xBE || p[2] == 0xBF)));
+}
+
+static inline bool is_bom(const yaml_char_t *p)
+{
+    return p[0] == 0xEF && p[1] == 0xBB && p[2] == 0xBF;
+}
+
+static inline bool is_break(const yaml_char_t *p)
+{
+    return p[0] == '\r' || p[0] == '\n' ||
+           (p[0] == 0xC2 && p[1] == 0x85) ||
+           (p[0] == 0xE2 && p[1] == 0x80 && (p[2] == 0xA8 || p[2] == 0xA9));
+}
+
+static inline bool is_blank(const yaml_char_t *p)
+{
+    return p[0] == ' ' || p[0] == '\t';
+}
+
+static inline bool is_blankz(const yaml_char_t *p)
+{
+    return is_blank(p) || is_break(p) || p[0] == '\0';
+}
+
+/*
+ * Output.
+ */
+
+static bool flush(yl_writer_t *writer)
+{
+    if (writer->length != 0 && fwrite(writer->buffer, 1, writer->length, writer->file) != writer->length) {
+        writer->problem = "could not write output";
+        return false;
+    }
+    writer->length = 0;
+    return true;
+}
+
+static inline bool reserve(yl_writer_t *writer, size_t length)
+{
+    return YL_WRITER_BUFFER_SIZE - writer->length >= length || flush(writer);
+}
+
+static inline bool put(yl_writer_t *writer, char c)
+{
+    if (!reserve(writer, 1))
+        return false;
+    writer->buffer[writer->length++] = c;
+    ++writer->column;
+    return true;
+}
+
+static inline bool put_break(yl_writer_t *writer)
+{
+    if (!reserve(writer, 1))
+        return false;
+    writer->buffer[writer->length++] = '\n';
+    writer->column = 0;
+    ++writer->line;
+    return true;
+}
+
+// Copy one character, advancing @p p past it.
+static inline bool write_char(yl_writer_t *writer, const yaml_char_t **p)
+{
+    size_t width = char_width(*p);
+    if (!reserve(writer, width))
+        return false;
+    memcpy(writer->buffer + writer->length, *p, width);
+    writer->length += width;
+    *p += width;
+    ++writer->column;
+    return true;
+}
+
+// Copy one line break, advancing @p p past it.
+static inline bool write_break(yl_writer_t *writer, const yaml_char_t **p)
+{
+    if (**p == '\n') {
+        ++*p;
+        return put_break(writer);
+    }
+    if (!write_char(writer, p))
+        return false;
+    writer->column = 0;
+    ++writer->line;
+    return true;
+}
+
+static bool write_indicator(yl_writer_t *writer, const char *indicator, bool need_whitespace, bool is_whitespace, bool is_indention)
+{
+    if (need_whitespace && !writer->whitespace && !put(writer, ' '))
+        return false;
+
+    for (; *indicator; ++indicator)
+        if (!put(writer, *indicator))
+            return false;
+
+    writer->whitespace = is_whitespace;
+    writer->indention = writer->indention && is_indention;
+    return true;
+}
+
+static bool write_indent(yl_writer_t *writer)
+{
+    int indent = writer->indent >= 0 ? writer->indent : 0;
+
+    if (!writer->indention || writer->column > indent || (writer->column == indent && !writer->whitespace))
+        if (!put_break(writer))
+            return false;
+
+    while (writer->column < indent)
+        if (!put(writer, ' '))
+            return false;
+
+    writer->whitespace = true;
+    writer->indention = true;
+    return true;
+}
+
+static bool write_anchor(yl_writer_t *writer, const yaml_char_t *value, size_t length)
+{
+    for (const yaml_char_t *p = value, *end = value + length; p < end;)
+        if (!write_char(writer, &p))
+            return false;
+
+    writer->whitespace = false;
+    writer->indention = false;
+    return true;
+}
+
+static bool write_tag_handle(yl_writer_t *writer, const yaml_char_t *value, size_t length)
+{
+    if (!writer->whitespace && !put(writer, ' '))
+        return false;
+
+    for (const yaml_char_t *p = value, *end = value + length; p < end;)
+        if (!write_char(writer, &p))
+            return false;
+
+    writer->whitespace = false;
+    writer->indention = false;
+    return true;
+}
+
+static bool write_tag_content(yl_writer_t *writer, const yaml_char_t *value, size_t length, bool need_whitespace)
+{
+    if (need_whitespace && !writer->whitespace && !put(writer, ' '))
+        return false;
+
+    for (const yaml_char_t *p = value, *end = value + length; p < end;) {
+        if (is_alpha(p) || strchr(";/?:@&=+$,_.~*'()[]", *p) != NULL) {
+            if (!write_char(writer, &p))
+                return false;
+        } else {
+            // Percent-encode every byte of the character.
+            for (size_t width = char_width(p); width > 0; --width, ++p) {
+                static const char digits[] = "0123456789ABCDEF";
+                if (!put(writer, '%') || !put(writer, digits[*p >> 4]) || !put(writer, digits[*p & 0x0F]))
+                    return false;
+            }
+        }
+    }
+
+    writer->whitespace = false;
+    writer->indention = false;
+    return true;
+}
+
+/*
+ * Scalars.
+ */
+
+static bool write_plain(yl_writer_t *writer, const yaml_char_t *value, size_t length, bool allow_breaks)
+{
+    bool spaces = false, breaks = false;
+
+    // Avoid trailing spaces for empty values in block mode.
+    if (!writer->whitespace && (length != 0 || writer->flow_level != 0))
+        if (!put(writer, ' '))
+            return false;
+
+    for (const yaml_char_t *p = value, *end = value + length; p < end;) {
+        if (*p == ' ') {
+            if (allow_breaks && !spaces && writer->column > BEST_WIDTH && p[1] != ' ') {
+                if (!write_indent(writer))
+                    return false;
+                ++p;
+            } else if (!write_char(writer, &p)) {
+                return false;
+            }
+            spaces = true;
+        } else if (is_break(p)) {
+            if (!breaks && *p == '\n' && !put_break(writer))
+                return false;
+            if (!write_break(writer, &p))
+                return false;
+            writer->indention = true;
+            breaks = true;
+        } else {
+            if (breaks && !write_indent(writer))
+                return false;
+            if (!write_char(writer, &p))
+                return false;
+            writer->indention = false;
+            spaces = false;
+            breaks = false;
+        }
+    }
+
+    writer->whitespace = false;
+    writer->indention = false;
+    if (writer->root_context)
+        writer->open_ended = 1;
+    return true;
+}
+
+static bool write_single_quoted(yl_writer_t *writer, const yaml_char_t *value, size_t length, bool allow_breaks)
+{
+    bool spaces = false, breaks = false;
+
+    if (!write_indicator(writer, "'", true, false, false))
+        return false;
+
+    for (const yaml_char_t *p = value, *end = value + length; p < end;) {
+        if (*p == ' ') {
+            if (allow_breaks && !spaces && writer->column > BEST_WIDTH && p != value && p != end - 1 && p[1] != ' ') {
+                if (!write_indent(writer))
+                    return false;
+                ++p;
+            } else if (!write_char(writer, &p)) {
+                return false;
+            }
+            spaces = true;
+        } else if (is_break(p)) {
+            if (!breaks && *p == '\n' && !put_break(writer))
+                return false;
+            if (!write_break(writer, &p))
+                return false;
+            writer->indention = true;
+            breaks = true;
+        } else {
+            if (breaks && !write_indent(writer))
+                return false;
+            if (*p == '\'' && !put(writer, '\''))
+                return false;
+            if (!write_char(writer, &p))
+                return false;
+            writer->indention = false;
+            spaces = false;
+            breaks = false;
+        }
+    }
+
+    if (breaks && !write_indent(writer))
+        return false;
+
+    if (!write_indicator(writer, "'", false, false, false))
+        return false;
+
+    writer->whitespace = false;
+    writer->indention = false;
+    return true;
+}
+
+static bool write_escape(yl_writer_t *writer, const yaml_char_t **p)
+{
+    static const char digits[] = "0123456789ABCDEF";
+    const yaml_char_t *s = *p;
+    size_t width = char_width(s);
+    unsigned int value = width == 1   ? s[0]
+                         : width == 2 ? s[0] & 0x1F
+                         : width == 3 ? s[0] & 0x0F
+                                      : s[0] & 0x07;
+    for (size_t k = 1; k < width; ++k)
+        value = (value << 6) + (s[k] & 0x3F);
+    *p += width;
+
+    if (!put(writer, '\\'))
+        return false;
+
+    char escape = 0;
+    switch (value) {
+    case 0x00: escape = '0'; break;
+    case 0x07: escape = 'a'; break;
+    case 0x08: escape = 'b'; break;
+    case 0x09: escape = 't'; break;
+    case 0x0A: escape = 'n'; break;
+    case 0x0B: escape = 'v'; break;
+    case 0x0C: escape = 'f'; break;
+    case 0x0D: escape = 'r'; break;
+    case 0x1B: escape = 'e'; break;
+    case 0x22: escape = '"'; break;
+    case 0x5C: escape = '\\'; break;
+    case 0x85: escape = 'N'; break;
+    case 0xA0: escape = '_'; break;
+    case 0x2028: escape = 'L'; break;
+    case 0x2029: escape = 'P'; break;
+    }
+    if (escape != 0)
+        return put(writer, escape);
+
+    int digits_length;
+    if (value <= 0xFF) {
+        escape = 'x';
+        digits_length = 2;
+    } else if (value <= 0xFFFF) {
+        escape = 'u';
+        digits_length = 4;
+    } else {
+        escape = 'U';
+        digits_length = 8;
+    }
+    if (!put(writer, escape))
+        return false;
+    for (int k = (digits_length - 1) * 4; k >= 0; k -= 4)
+        if (!put(writer, digits[(value >> k) & 0x0F]))
+            return false;
+    return true;
+}
+
+static bool write_double_quoted(yl_writer_t *writer, const yaml_char_t *value, size_t length, bool allow_breaks)
+{
+    bool spaces = false;
+
+    if (!write_indicator(writer, "\"", true, false, false))
+        return false;
+
+    for (const yaml_char_t *p = value, *end = value + length; p < end;) {
+        if (!is_printable(p) || is_bom(p) || is_break(p) || *p == '"' || *p == '\\') {
+            if (!write_escape(writer, &p))
+                return false;
+            spaces = false;
+        } else if (*p == ' ') {
+            if (allow_breaks && !spaces && writer->column > BEST_WIDTH && p != value && p != end - 1) {
+                if (!write_indent(writer))
+                    return false;
+                if (p[1] == ' ' && !put(writer, '\\'))
+                    return false;
+                ++p;
+            } else if (!write_char(writer, &p)) {
+                return false;
+            }
+            spaces = true;
+        } else {
+            if (!write_char(writer, &p))
+                return false;
+            spaces = false;
+        }
+    }
+
+    if (!write_indicator(writer, "\"", false, false, false))
+        return false;
+
+    writer->whitespace = false;
+    writer->indention = false;
+    return true;
+}
+
+static bool write_block_scalar_hints(yl_writer_t *writer, const yaml_char_t *value, size_t length)
+{
+    const char *chomp_hint = NULL;
+
+    if (length != 0 && (value[0] == ' ' || is_break(value))) {
+        char indent_hint[2] = {'0' + BEST_INDENT, '\0'};
+        if (!write_indicator(writer, indent_hint, false, false, false))
+            return false;
+    }
+
+    writer->open_ended = 0;
+
+    if (length == 0) {
+        chomp_hint = "-";
+    } else {
+        const yaml_char_t *p = value + length;
+        do
+            --p;
+        while ((*p & 0xC0) == 0x80);
+        if (!is_break(p)) {
+            chomp_hint = "-";
+        } else if (p == value) {
+            chomp_hint = "+";
+            writer->open_ended = 2;
+        } else {
+            do
+                --p;
+            while ((*p & 0xC0) == 0x80);
+            if (is_break(p)) {
+                chomp_hint = "+";
+                writer->open_ended = 2;
+            }
+        }
+    }
+
+    if (chomp_hint != NULL && !write_indicator(writer, chomp_hint, false, false, false))
+        return false;
+    return true;
+}
+
+static bool write_literal(yl_writer_t *writer, const yaml_char_t *value, size_t length)
+{
+    bool breaks = true;
+
+    if (!write_indicator(writer, "|", true, false, false))
+        return false;
+    if (!write_block_scalar_hints(writer, value, length))
+        return false;
+    if (!put_break(writer))
+        return false;
+    writer->indention = true;
+    writer->whitespace = true;
+
+    for (const yaml_char_t *p = value, *end = value + length; p < end;) {
+        if (is_break(p)) {
+            if (!write_break(writer, &p))
+                return false;
+            writer->indention = true;
+            breaks = true;
+        } else {
+            if (breaks && !write_indent(writer))
+                return false;
+            if (!write_char(writer, &p))
+                return false;
+            writer->indention = false;
+            breaks = false;
+        }
+    }
+
+    return true;
+}
+
+static bool write_folded(yl_writer_t *writer, const yaml_char_t *value, size_t length)
+{
+    bool breaks = true, leading_spaces = true;
+
+    if (!write_indicator(writer, ">", true, false, false))
+        return false;
+    if (!write_block_scalar_hints(writer, value, length))
+        return false;
+    if (!put_break(writer))
+        return false;
+    writer->indention = true;
+    writer->whitespace = true;
+
+    for (const yaml_char_t *p = value, *end = value + length; p < end;) {
+        if (is_break(p)) {
+            if (!breaks && !leading_spaces && *p == '\n') {
+                const yaml_char_t *k = p;
+                while (is_break(k))
+                    k += char_width(k);
+                if (!is_blankz(k) && !put_break(writer))
+                    return false;
+            }
+            if (!write_break(writer, &p))
+                return false;
+            writer->indention = true;
+            breaks = true;
+        } else {
+            if (breaks) {
+                if (!write_indent(writer))
+                    return false;
+                leading_spaces = is_blank(p);
+            }
+            if (!breaks && *p == ' ' && p[1] != ' ' && writer->column > BEST_WIDTH) {
+                if (!write_indent(writer))
+                    return false;
+                ++p;
+            } else if (!write_char(writer, &p)) {
+                return false;
+            }
+            writer->indention = false;
+            breaks = false;
+        }
+    }
+
+    return true;
+}
+
+/*
+ * Analysis.
+ */
+
+static bool analyze_anchor(yl_writer_t *writer, const yaml_char_t *anchor, bool alias)
+{
+    size_t length = strlen((const char *)anchor);
+
+    if (length == 0) {
+        writer->problem = alias ? "alias value must not be empty" : "anchor value must not be empty";
+        return false;
+    }
+    for (size_t i = 0; i < length; ++i) {
+        if (!is_alpha(anchor + i)) {
+            writer->problem = alias ? "alias value must contain alphanumerical characters only"
+                                    : "anchor value must contain alphanumerical characters only";
+            return false;
+        }
+    }
+
+    writer->anchor = anchor;
+    writer->anchor_length = length;
+    writer->alias = alias;
+    return true;
+}
+
+static bool match_tag_directive(yl_writer_t *writer, const yaml_tag_directive_t *directive, const yaml_char_t *tag, size_t length)
+{
+    size_t prefix_length = strlen((const char *)directive->prefix);
+    if (prefix_length >= length || strncmp((const char *)directive->prefix, (const char *)tag, prefix_length) != 0)
+        return false;
+
+    writer->handle = directive->handle;
+    writer->handle_length = strlen((const char *)directive->handle);
+    writer->suffix = tag + prefix_length;
+    writer->suffix_length = length - prefix_length;
+    return true;
+}
+
+static bool find_tag_directive(yl_writer_t *writer, const yaml_char_t *handle)
+{
+    for (size_t i = 0; i < writer->ntag_directives; ++i)
+        if (strcmp((const char *)writer->tag_directives[i].handle, (const char *)handle) == 0)
+            return true;
+    return false;
+}
+
+static bool analyze_tag(yl_writer_t *writer, const yaml_char_t *tag)
+{
+    size_t length = strlen((const char *)tag);
+
+    if (length == 0) {
+        writer->problem = "tag value must not be empty";
+        return false;
+    }
+
+    for (size_t i = 0; i < writer->ntag_directives; ++i)
+        if (match_tag_directive(writer, &writer->tag_directives[i], tag, length))
+            return true;
+    // The default directives apply unless the document redefined their handles.
+    for (size_t i = 0; i < sizeof(default_tag_directives) / sizeof(*default_tag_directives); ++i)
+        if (!find_tag_directive(writer, default_tag_directives[i].handle) &&
+            match_tag_directive(writer, &default_tag_directives[i], tag, length))
+            return true;
+
+    writer->suffix = tag;
+    writer->suffix_length = length;
+    return true;
+}
+
+static void analyze_scalar(yl_writer_t *writer, const yaml_char_t *value, size_t length)
+{
+    bool block_indicators = false, flow_indicators = false;
+    bool line_breaks = false, special_characters = false;
+    bool leading_space = false, leading_break = false;
+    bool trailing_space = false, trailing_break = false;
+    bool break_space = false, space_break = false;
+    bool previous_space = false, previous_break = false;
+
+    writer->value = value;
+    writer->value_length = length;
+
+    if (length == 0) {
+        writer->multiline = false;
+        writer->flow_plain_allowed = false;
+        writer->block_plain_allowed = true;
+        writer->single_quoted_allowed = true;
+        writer->block_allowed = false;
+        return;
+    }
+
+    if (length >= 3 && ((value[0] == '-' && value[1] == '-' && value[2] == '-') ||
+                        (value[0] == '.' && value[1] == '.' && value[2] == '.'))) {
+        block_indicators = true;
+        flow_indicators = true;
+    }
+
+    bool preceded_by_whitespace = true;
+    bool followed_by_whitespace = is_blankz(value + char_width(value));
+
+    const yaml_char_t *end = value + length;
+    for (const yaml_char_t *p = value; p != end;) {
+        size_t width = char_width(p);
+
+        if (p == value) {
+            if (strchr("#,[]{}&*!|>'\"%@`", *p) != NULL && *p != '\0') {
+                flow_indicators = true;
+                block_indicators = true;
+            }
+            if (*p == '?' || *p == ':') {
+                flow_indicators = true;
+                if (followed_by_whitespace)
+                    block_indicators = true;
+            }
+            if (*p == '-' && followed_by_whitespace) {
+                flow_indicators = true;
+                block_indicators = true;
+            }
+        } else {
+            if (strchr(",?[]{}", *p) != NULL && *p != '\0')
+                flow_indicators = true;
+            if (*p == ':') {
+                flow_indicators = true;
+                if (followed_by_whitespace)
+                    block_indicators = true;
+            }
+            if (*p == '#' && preceded_by_whitespace) {
+                flow_indicators = true;
+                block_indicators = true;
+            }
+        }
+
+        if (!is_printable(p))
+            special_characters = true;
+
+        if (is_break(p))
+            line_breaks = true;
+
+        if (*p == ' ') {
+            if (p == value)
+                leading_space = true;
+            if (p + width == end)
+                trailing_space = true;
+            if (previous_break)
+                break_space = true;
+            previous_space = true;
+            previous_break = false;
+        } else if (is_break(p)) {
+            if (p == value)
+                leading_break = true;
+            if (p + width == end)
+                trailing_break = true;
+            if (previous_space)
+                space_break = true;
+            previous_space = false;
+            previous_break = true;
+        } else {
+            previous_space = false;
+            previous_break = false;
+        }
+
+        preceded_by_whitespace = is_blankz(p);
+        p += width;
+        if (p != end)
+            followed_by_whitespace = is_blankz(p + char_width(p));
+    }
+
+    writer->multiline = line_breaks;
+    writer->flow_plain_allowed = true;
+    writer->block_plain_allowed = true;
+    writer->single_quoted_allowed = true;
+    writer->block_allowed = true;
+
+    if (leading_space || leading_break || trailing_space || trailing_break) {
+        writer->flow_plain_allowed = false;
+        writer->block_plain_allowed = false;
+    }
+    if (trailing_space)
+        writer->block_allowed = false;
+    if (break_space) {
+        writer->flow_plain_allowed = false;
+        writer->block_plain_allowed = false;
+        writer->single_quoted_allowed = false;
+    }
+    if (space_break || special_characters) {
+        writer->flow_plain_allowed = false;
+        writer->block_plain_allowed = false;
+        writer->single_quoted_allowed = false;
+        writer->block_allowed = false;
+    }
+    if (line_breaks) {
+        writer->flow_plain_allowed = false;
+        writer->block_plain_allowed = false;
+    }
+    if (flow_indicators)
+        writer->flow_plain_allowed = false;
+    if (block_indicators)
+        writer->block_plain_allowed = false;
+}
+
+static bool analyze_event(yl_writer_t *writer, const yaml_event_t *event)
+{
+    writer->anchor = NULL;
+    writer->anchor_length = 0;
+    writer->handle = NULL;
+    writer->handle_length = 0;
+    writer->suffix = NULL;
+    writer->suffix_length = 0;
+    writer->value = NULL;
+    writer->value_length = 0;
+
+    switch (event->type) {
+    case YAML_ALIAS_EVENT:
+        return analyze_anchor(writer, event->data.alias.anchor, true);
+
+    case YAML_SCALAR_EVENT:
+        if (event->data.scalar.anchor && !analyze_anchor(writer, event->data.scalar.anchor, false))
+            return false;
+        if (event->data.scalar.tag && !event->data.scalar.plain_implicit && !event->data.scalar.quoted_implicit)
+            if (!analyze_tag(writer, event->data.scalar.tag))
+                return false;
+        analyze_scalar(writer, event->data.scalar.value, event->data.scalar.length);
+        return true;
+
+    case YAML_SEQUENCE_START_EVENT:
+        if (event->data.sequence_start.anchor && !analyze_anchor(writer, event->data.sequence_start.anchor, false))
+            return false;
+        if (event->data.sequence_start.tag && !event->data.sequence_start.implicit)
+            if (!analyze_tag(writer, event->data.sequence_start.tag))
+                return false;
+        return true;
+
+    case YAML_MAPPING_START_EVENT:
+        if (event->data.mapping_start.anchor && !analyze_anchor(writer, event->data.mapping_start.anchor, false))
+            return false;
+        if (event->data.mapping_start.tag && !event->data.mapping_start.implicit)
+            if (!analyze_tag(writer, event->data.mapping_start.tag))
+                return false;
+        return true;
+
+    default:
+        return true;
+    }
+}
+
+/*
+ * Emitter states.
+ */
+
+static bool push_state(yl_writer_t *writer, yl_writer_state_t state)
+{
+    if (writer->nstates == writer->states_capacity) {
+        size_t capacity = writer->states_capacity ? writer->states_capacity * 2 : 16;
+        yl_writer_state_t *states = realloc(writer->states, capacity * sizeof(*states));
+        if (states == NULL) {
+            writer->problem = "could not grow state stack";
+            return false;
+        }
+        writer->states = states;
+        writer->states_capacity = capacity;
+    }
+    writer->states[writer->nstates++] = state;
+    return true;
+}
+
+static bool increase_indent(yl_writer_t *writer, bool flow, bool indentless)
+{
+    if (writer->nindents == writer->indents_capacity) {
+        size_t capacity = writer->indents_capacity ? writer->indents_capacity * 2 : 16;
+        int *indents = realloc(writer->indents, capacity * sizeof(*indents));
+        if (indents == NULL) {
+            writer->problem = "could not grow indent stack";
+            return false;
+        }
+        writer->indents = indents;
+        writer->indents_capacity = capacity;
+    }
+    writer->indents[writer->nindents++] = writer->indent;
+
+    if (writer->indent < 0)
+        writer->indent = flow ? BEST_INDENT : 0;
+    else if (!indentless)
+        writer->indent += BEST_INDENT;
+    return true;
+}
+
+static bool process_anchor(yl_writer_t *writer)
+{
+    if (writer->anchor == NULL)
+        return true;
+    return write_indicator(writer, writer->alias ? "*" : "&", true, false, false) &&
+           write_anchor(writer, writer->anchor, writer->anchor_length);
+}
+
+static bool process_tag(yl_writer_t *writer)
+{
+    if (writer->handle == NULL && writer->suffix == NULL)
+        return true;
+
+    if (writer->handle != NULL) {
+        if (!write_tag_handle(writer, writer->handle, writer->handle_length))
+            return false;
+        if (writer->suffix != NULL && !write_tag_content(writer, writer->suffix, writer->suffix_length, false))
+            return false;
+        return true;
+    }
+
+    return write_indicator(writer, "!<", true, false, false) &&
+           write_tag_content(writer, writer->suffix, writer->suffix_length, false) &&
+           write_indicator(writer, ">", false, false, false);
+}
+
+static bool is_empty_collection(const yaml_event_t *event, const yaml_event_t *next)
+{
+    return next != NULL &&
+           ((event->type == YAML_SEQUENCE_START_EVENT && next->type == YAML_SEQUENCE_END_EVENT) ||
+            (event->type == YAML_MAPPING_START_EVENT && next->type == YAML_MAPPING_END_EVENT));
+}
+
+static bool check_simple_key(yl_writer_t *writer, const yaml_event_t *event, const yaml_event_t *next)
+{
+    size_t length = 0;
+
+    switch (event->type) {
+    case YAML_ALIAS_EVENT:
+        length = writer->anchor_length;
+        break;
+    case YAML_SCALAR_EVENT:
+        if (writer->multiline)
+            return false;
+        length = writer->anchor_length + writer->handle_length + writer->suffix_length + writer->value_length;
+        break;
+    case YAML_SEQUENCE_START_EVENT: // Fall through.
+    case YAML_MAPPING_START_EVENT:
+        if (!is_empty_collection(event, next))
+            return false;
+        length = writer->anchor_length + writer->handle_length + writer->suffix_length;
+        break;
+    default:
+        return false;
+    }
+
+    return length <= MAX_SIMPLE_KEY_LENGTH;
+}
+
+static bool select_scalar_style(yl_writer_t *writer, const yaml_event_t *event)
+{
+    yaml_scalar_style_t style = event->data.scalar.style;
+    bool no_tag = writer->handle == NULL && writer->suffix == NULL;
+
+    if (no_tag && !event->data.scalar.plain_implicit && !event->data.scalar.quoted_implicit) {
+        writer->problem = "neither tag nor implicit flags are specified";
+        return false;
+    }
+
+    if (style == YAML_ANY_SCALAR_STYLE)
+        style = YAML_PLAIN_SCALAR_STYLE;
+
+    if (writer->simple_key_context && writer->multiline)
+        style = YAML_DOUBLE_QUOTED_SCALAR_STYLE;
+
+    if (style == YAML_PLAIN_SCALAR_STYLE) {
+        if ((writer->flow_level && !writer->flow_plain_allowed) ||
+            (!writer->flow_level && !writer->block_plain_allowed))
+            style = YAML_SINGLE_QUOTED_SCALAR_STYLE;
+        if (writer->value_length == 0 && (writer->flow_level || writer->simple_key_context))
+            style = YAML_SINGLE_QUOTED_SCALAR_STYLE;
+        if (no_tag && !event->data.scalar.plain_implicit)
+            style = YAML_SINGLE_QUOTED_SCALAR_STYLE;
+    }
+    if (style == YAML_SINGLE_QUOTED_SCALAR_STYLE && !writer->single_quoted_allowed)
+        style = YAML_DOUBLE_QUOTED_SCALAR_STYLE;
+    if (style == YAML_LITERAL_SCALAR_STYLE || style == YAML_FOLDED_SCALAR_STYLE)
+        if (!writer->block_allowed || writer->flow_level || writer->simple_key_context)
+            style = YAML_DOUBLE_QUOTED_SCALAR_STYLE;
+
+    if (no_tag && !event->data.scalar.quoted_implicit && style != YAML_PLAIN_SCALAR_STYLE) {
+        writer->handle = (const yaml_char_t *)"!";
+        writer->handle_length = 1;
+    }
+
+    writer->style = style;
+    return true;
+}
+
+static bool process_scalar(yl_writer_t *writer)
+{
+    bool allow_breaks = !writer->simple_key_context;
+
+    switch (writer->style) {
+    case YAML_PLAIN_SCALAR_STYLE:
+        return write_plain(writer, writer->value, writer->value_length, allow_breaks);
+    case YAML_SINGLE_QUOTED_SCALAR_STYLE:
+        return write_single_quoted(writer, writer->value, writer->value_length, allow_breaks);
+    case YAML_DOUBLE_QUOTED_SCALAR_STYLE:
+        return write_double_quoted(writer, writer->value, writer->value_length, allow_breaks);
+    case YAML_LITERAL_SCALAR_STYLE:
+        return write_literal(writer, writer->value, writer->value_length);
+    case YAML_FOLDED_SCALAR_STYLE:
+        return write_folded(writer, writer->value, writer->value_length);
+    default:
+        return true;
+    }
+}
+
+static bool pop_state(yl_writer_t *writer)
+{
+    writer->state = writer->states[--writer->nstates];
+    return true;
+}
+
+static bool emit_alias(yl_writer_t *writer)
+{
+    if (!process_anchor(writer))
+        return false;
+    if (writer->simple_key_context && !put(writer, ' '))
+        return false;
+    return pop_state(writer);
+}
+
+static bool emit_scalar(yl_writer_t *writer, const yaml_event_t *event)
+{
+    if (!select_scalar_style(writer, event) ||
+        !process_anchor(writer) ||
+        !process_tag(writer) ||
+        !increase_indent(writer, true, false) ||
+        !process_scalar(writer))
+        return false;
+
+    writer->indent = writer->indents[--writer->nindents];
+    return pop_state(writer);
+}
+
+static bool emit_collection_start(yl_writer_t *writer, const yaml_event_t *event, const yaml_event_t *next)
+{
+    if (!process_anchor(writer) || !process_tag(writer))
+        return false;
+
+    bool flow;
+    if (event->type == YAML_SEQUENCE_START_EVENT) {
+        flow = writer->flow_level || event->data.sequence_start.style == YAML_FLOW_SEQUENCE_STYLE || is_empty_collection(event, next);
+        writer->state = flow ? YL_WRITER_FLOW_SEQUENCE_FIRST_ITEM_STATE : YL_WRITER_BLOCK_SEQUENCE_FIRST_ITEM_STATE;
+    } else {
+        flow = writer->flow_level || event->data.mapping_start.style == YAML_FLOW_MAPPING_STYLE || is_empty_collection(event, next);
+        writer->state = flow ? YL_WRITER_FLOW_MAPPING_FIRST_KEY_STATE : YL_WRITER_BLOCK_MAPPING_FIRST_KEY_STATE;
+    }
+    return true;
+}
+
+static bool emit_node(yl_writer_t *writer, const yaml_event_t *event, const yaml_event_t *next,
+                      bool root, bool sequence, bool mapping, bool simple_key)
+{
+    writer->root_context = root;
+    writer->sequence_context = sequence;
+    writer->mapping_context = mapping;
+    writer->simple_key_context = simple_key;
+
+    switch (event->type) {
+    case YAML_ALIAS_EVENT:
+        return emit_alias(writer);
+    case YAML_SCALAR_EVENT:
+        return emit_scalar(writer, event);
+    case YAML_SEQUENCE_START_EVENT: // Fall through.
+    case YAML_MAPPING_START_EVENT:
+        return emit_collection_start(writer, event, next);
+    default:
+        writer->problem = "expected SCALAR, SEQUENCE-START, MAPPING-START, or ALIAS";
+        return false;
+    }
+}
+
+static void delete_tag_directives(yl_writer_t *writer)
+{
+    for (size_t i = 0; i < writer->ntag_directives; ++i) {
+        free(writer->tag_directives[i].handle);
+        free(writer->tag_directives[i].prefix);
+    }
+    writer->ntag_directives = 0;
+}
+
+static bool append_tag_directive(yl_writer_t *writer, const yaml_tag_directive_t *directive)
+{
+    const char *handle = (const char *)directive->handle;
+    size_t length = strlen(handle);
+
+    if (length == 0) {
+        writer->problem = "tag handle must not be empty";
+        return false;
+    }
+    if (handle[0] != '!') {
+        writer->problem = "tag handle must start with '!'";
+        return false;
+    }
+    if (handle[length - 1] != '!') {
+        writer->problem = "tag handle must end with '!'";
+        return false;
+    }
+    for (size_t i = 1; i + 1 < length; ++i) {
+        if (!is_alpha(directive->handle + i)) {
+            writer->problem = "tag handle must contain alphanumerical characters only";
+            return false;
+        }
+    }
+    if (directive->prefix[0] == '\0') {
+        writer->problem = "tag prefix must not be empty";
+        return false;
+    }
+    if (find_tag_directive(writer, directive->handle)) {
+        writer->problem = "duplicate %TAG directive";
+        return false;
+    }
+
+    if (writer->ntag_directives == writer->tag_directives_capacity) {
+        size_t capacity = writer->tag_directives_capacity ? writer->tag_directives_capacity * 2 : 4;
+        yaml_tag_directive_t *directives = realloc(writer->tag_directives, capacity * sizeof(*directives));
+        if (directives == NULL)
+            goto memory_error;
+        writer->tag_directives = directives;
+        writer->tag_directives_capacity = capacity;
+    }
+
+    yaml_tag_directive_t copy = {
+        (yaml_char_t *)strdup(handle),
+        (yaml_char_t *)strdup((const char *)directive->prefix),
+    };
+    if (copy.handle == NULL || copy.prefix == NULL) {
+        free(copy.handle);
+        free(copy.prefix);
+        goto memory_error;
+    }
+    writer->tag_directives[writer->ntag_directives++] = copy;
+    return true;
+
+memory_error:
+    writer->problem = "could not copy %TAG directive";
+    return false;
+}
+
+static bool emit_stream_start(yl_writer_t *writer, const yaml_event_t *event)
+{
+    if (event->type != YAML_STREAM_START_EVENT) {
+        writer->problem = "expected STREAM-START";
+        return false;
+    }
+
+    writer->indent = -1;
+    writer->line = 0;
+    writer->column = 0;
+    writer->whitespace = true;
+    writer->indention = true;
+    writer->state = YL_WRITER_FIRST_DOCUMENT_START_STATE;
+    return true;
+}
+
+static bool emit_document_start(yl_writer_t *writer, const yaml_event_t *event, bool first)
+{
+    if (event->type == YAML_STREAM_END_EVENT) {
+        // A block scalar with trailing empty lines at the end of the stream.
+        if (writer->open_ended == 2) {
+            if (!write_indicator(writer, "...", true, false, false))
+                return false;
+            writer->open_ended = 0;
+            if (!write_indent(writer))
+                return false;
+        }
+        if (!flush(writer))
+            return false;
+        writer->state = YL_WRITER_END_STATE;
+        return true;
+    }
+
+    if (event->type != YAML_DOCUMENT_START_EVENT) {
+        writer->problem = "expected DOCUMENT-START or STREAM-END";
+        return false;
+    }
+
+    const yaml_version_directive_t *version = event->data.document_start.version_directive;
+    if (version && (version->major != 1 || (version->minor != 1 && version->minor != 2))) {
+        writer->problem = "incompatible %YAML directive";
+        return false;
+    }
+
+    const yaml_tag_directive_t *directive = event->data.document_start.tag_directives.start;
+    const yaml_tag_directive_t *directives_end = event->data.document_start.tag_directives.end;
+    for (; directive != directives_end; ++directive)
+        if (!append_tag_directive(writer, directive))
+            return false;
+
+    bool implicit = event->data.document_start.implicit && first;
+
+    if ((version || writer->ntag_directives) && writer->open_ended) {
+        if (!write_indicator(writer, "...", true, false, false) || !write_indent(writer))
+            return false;
+    }
+    writer->open_ended = 0;
+
+    if (version) {
+        implicit = false;
+        if (!write_indicator(writer, "%YAML", true, false, false) ||
+            !write_indicator(writer, version->minor == 1 ? "1.1" : "1.2", true, false, false) ||
+            !write_indent(writer))
+            return false;
+    }
+
+    for (size_t i = 0; i < writer->ntag_directives; ++i) {
+        implicit = false;
+        const yaml_tag_directive_t *tag_directive = &writer->tag_directives[i];
+        if (!write_indicator(writer, "%TAG", true, false, false) ||
+            !write_tag_handle(writer, tag_directive->handle, strlen((const char *)tag_directive->handle)) ||
+            !write_tag_content(writer, tag_directive->prefix, strlen((const char *)tag_directive->prefix), true) ||
+            !write_indent(writer))
+            return false;
+    }
+
+    if (!implicit) {
+        if (!write_indent(writer) || !write_indicator(writer, "---", true, false, false))
+            return false;
+    }
+
+    writer->state = YL_WRITER_DOCUMENT_CONTENT_STATE;
+    writer->open_ended = 0;
+    return true;
+}
+
+static bool emit_document_end(yl_writer_t *writer, const yaml_event_t *event)
+{
+    if (event->type != YAML_DOCUMENT_END_EVENT) {
+        writer->problem = "expected DOCUMENT-END";
+        return false;
+    }
+
+    if (!write_indent(writer))
+        return false;
+    if (!event->data.document_end.implicit) {
+        if (!write_indicator(writer, "...", true, false, false))
+            return false;
+        writer->open_ended = 0;
+        if (!write_indent(writer))
+            return false;
+    } else if (!writer->open_ended) {
+        writer->open_ended = 1;
+    }
+
+    if (!flush(writer))
+        return false;
+
+    writer->state = YL_WRITER_DOCUMENT_START_STATE;
+    delete_tag_directives(writer);
+    return true;
+}
+
+static bool emit_flow_sequence_item(yl_writer_t *writer, const yaml_event_t *event, const yaml_event_t *next, bool first)
+{
+    if (first) {
+        if (!write_indicator(writer, "[", true, true, false) || !increase_indent(writer, true, false))
+            return false;
+        ++writer->flow_level;
+    }
+
+    if (event->type == YAML_SEQUENCE_END_EVENT) {
+        --writer->flow_level;
+        writer->indent = writer->indents[--writer->nindents];
+        if (!write_indicator(writer, "]", false, false, false))
+            return false;
+        return pop_state(writer);
+    }
+
+    if (!first && !write_indicator(writer, ",", false, false, false))
+        return false;
+    if (writer->column > BEST_WIDTH && !write_indent(writer))
+        return false;
+    if (!push_state(writer, YL_WRITER_FLOW_SEQUENCE_ITEM_STATE))
+        return false;
+    return emit_node(writer, event, next, false, true, false, false);
+}
+
+static bool emit_flow_mapping_key(yl_writer_t *writer, const yaml_event_t *event, const yaml_event_t *next, bool first)
+{
+    if (first) {
+        if (!write_indicator(writer, "{", true, true, false) || !increase_indent(writer, true, false))
+            return false;
+        ++writer->flow_level;
+    }
+
+    if (event->type == YAML_MAPPING_END_EVENT) {
+        --writer->flow_level;
+        writer->indent = writer->indents[--writer->nindents];
+        if (!write_indicator(writer, "}", false, false, false))
+            return false;
+        return pop_state(writer);
+    }
+
+    if (!first && !write_indicator(writer, ",", false, false, false))
+        return false;
+    if (writer->column > BEST_WIDTH && !write_indent(writer))
+        return false;
+
+    if (check_simple_key(writer, event, next)) {
+        if (!push_state(writer, YL_WRITER_FLOW_MAPPING_SIMPLE_VALUE_STATE))
+            return false;
+        return emit_node(writer, event, next, false, false, true, true);
+    }
+
+    if (!write_indicator(writer, "?", true, false, false) ||
+        !push_state(writer, YL_WRITER_FLOW_MAPPING_VALUE_STATE))
+        return false;
+    return emit_node(writer, event, next, false, false, true, false);
+}
+
+static bool emit_flow_mapping_value(yl_writer_t *writer, const yaml_event_t *event, const yaml_event_t *next, bool simple)
+{
+    if (simple) {
+        if (!write_indicator(writer, ":", false, false, false))
+            return false;
+    } else {
+        if (writer->column > BEST_WIDTH && !write_indent(writer))
+            return false;
+        if (!write_indicator(writer, ":", true, false, false))
+            return false;
+    }
+
+    if (!push_state(writer, YL_WRITER_FLOW_MAPPING_KEY_STATE))
+        return false;
+    return emit_node(writer, event, next, false, false, true, false);
+}
+
+static bool emit_block_sequence_item(yl_writer_t *writer, const yaml_event_t *event, const yaml_event_t *next, bool first)
+{
+    if (first && !increase_indent(writer, false, writer->mapping_context && !writer->indention))
+        return false;
+
+    if (event->type == YAML_SEQUENCE_END_EVENT) {
+        writer->indent = writer->indents[--writer->nindents];
+        return pop_state(writer);
+    }
+
+    if (!write_indent(writer) ||
+        !write_indicator(writer, "-", true, false, true) ||
+        !push_state(writer, YL_WRITER_BLOCK_SEQUENCE_ITEM_STATE))
+        return false;
+    return emit_node(writer, event, next, false, true, false, false);
+}
+
+static bool emit_block_mapping_key(yl_writer_t *writer, const yaml_event_t *event, const yaml_event_t *next, bool first)
+{
+    if (first && !increase_indent(writer, false, false))
+        return false;
+
+    if (event->type == YAML_MAPPING_END_EVENT) {
+        writer->indent = writer->indents[--writer->nindents];
+        return pop_state(writer);
+    }
+
+    if (!write_indent(writer))
+        return false;
+
+    if (check_simple_key(writer, event, next)) {
+        if (!push_state(writer, YL_WRITER_BLOCK_MAPPING_SIMPLE_VALUE_STATE))
+            return false;
+        return emit_node(writer, event, next, false, false, true, true);
+    }
+
+    if (!write_indicator(writer, "?", true, false, true) ||
+        !push_state(writer, YL_WRITER_BLOCK_MAPPING_VALUE_STATE))
+        return false;
+    return emit_node(writer, event, next, false, false, true, false);
+}
+
+static bool emit_block_mapping_value(yl_writer_t *writer, const yaml_event_t *event, const yaml_event_t *next, bool simple)
+{
+    if (simple) {
+        if (!write_indicator(writer, ":", false, false, false))
+            return false;
+    } else {
+        if (!write_indent(writer) || !write_indicator(writer, ":", true, false, true))
+            return false;
+    }
+
+    if (!push_state(writer, YL_WRITER_BLOCK_MAPPING_KEY_STATE))
+        return false;
+    return emit_node(writer, event, next, false, false, true, false);
+}
+
+/**
+ * Run the emitter state machine on one event. @p next is the event after it, if
+ * @p event starts a collection.
+ */
+static bool emit(yl_writer_t *writer, const yaml_event_t *event, const yaml_event_t *next)
+{
+    if (!analyze_event(writer, event))
+        return false;
+
+    switch (writer->state) {
+    case YL_WRITER_STREAM_START_STATE:
+        return emit_stream_start(writer, event);
+    case YL_WRITER_FIRST_DOCUMENT_START_STATE:
+        return emit_document_start(writer, event, true);
+    case YL_WRITER_DOCUMENT_START_STATE:
+        return emit_document_start(writer, event, false);
+    case YL_WRITER_DOCUMENT_CONTENT_STATE:
+        return push_state(writer, YL_WRITER_DOCUMENT_END_STATE) &&
+               emit_node(writer, event, next, true, false, false, false);
+    case YL_WRITER_DOCUMENT_END_STATE:
+        return emit_document_end(writer, event);
+    case YL_WRITER_FLOW_SEQUENCE_FIRST_ITEM_STATE:
+        return emit_flow_sequence_item(writer, event, next, true);
+    case YL_WRITER_FLOW_SEQUENCE_ITEM_STATE:
+        return emit_flow_sequence_item(writer, event, next, false);
+    case YL_WRITER_FLOW_MAPPING_FIRST_KEY_STATE:
+        return emit_flow_mapping_key(writer, event, next, true);
+    case YL_WRITER_FLOW_MAPPING_KEY_STATE:
+        return emit_flow_mapping_key(writer, event, next, false);
+    case YL_WRITER_FLOW_MAPPING_SIMPLE_VALUE_STATE:
+        return emit_flow_mapping_value(writer, event, next, true);
+    case YL_WRITER_FLOW_MAPPING_VALUE_STATE:
+        return emit_flow_mapping_value(writer, event, next, false);
+    case YL_WRITER_BLOCK_SEQUENCE_FIRST_ITEM_STATE:
+        return emit_block_sequence_item(writer, event, next, true);
+    case YL_WRITER_BLOCK_SEQUENCE_ITEM_STATE:
+        return emit_block_sequence_item(writer, event, next, false);
+    case YL_WRITER_BLOCK_MAPPING_FIRST_KEY_STATE:
+        return emit_block_mapping_key(writer, event, next, true);
+    case YL_WRITER_BLOCK_MAPPING_KEY_STATE:
+        return emit_block_mapping_key(writer, event, next, false);
+    case YL_WRITER_BLOCK_MAPPING_SIMPLE_VALUE_STATE:
+        return emit_block_mapping_value(writer, event, next, true);
+    case YL_WRITER_BLOCK_MAPPING_VALUE_STATE:
+        return emit_block_mapping_value(writer, event, next, false);
+    case YL_WRITER_END_STATE:
+    default:
+        writer->problem = "expected nothing";
+        return false;
+    }
+}
+
+static bool copy_string(yaml_char_t **copy, size_t *capacity, const yaml_char_t *string)
+{
+    if (string == NULL) {
+        return true;
+    }
+
+    size_t size = strlen((const char *)string) + 1;
+    if (size > *capacity) {
+        yaml_char_t *grown = realloc(*copy, size);
+        if (grown == NULL)
+            return false;
+        *copy = grown;
+        *capacity = size;
+    }
+    memcpy(*copy, string, size);
+    return true;
+}
+
+/**
+ * Hold back a collection start until the next event, using the writer's own
+ * copies of its anchor and tag.
+ */
+static bool defer(yl_writer_t *writer, const yaml_event_t *event)
+{
+    writer->pending = *event;
+
+    yaml_char_t **anchor, **tag;
+    if (event->type == YAML_SEQUENCE_START_EVENT) {
+        anchor = &writer->pending.data.sequence_start.anchor;
+        tag = &writer->pending.data.sequence_start.tag;
+    } else {
+        anchor = &writer->pending.data.mapping_start.anchor;
+        tag = &writer->pending.data.mapping_start.tag;
+    }
+
+    if (!copy_string(&writer->pending_anchor, &writer->pending_anchor_capacity, *anchor) ||
+        !copy_string(&writer->pending_tag, &writer->pending_tag_capacity, *tag)) {
+        writer->problem = "could not copy collection start";
+        return false;
+    }
+    if (*anchor)
+        *anchor = writer->pending_anchor;
+    if (*tag)
+        *tag = writer->pending_tag;
+
+    writer->has_pending = true;
+    return true;
+}
+
+int yl_writer_initialize(yl_writer_t *writer, FILE *file)
+{
+    *writer = (yl_writer_t){0};
+    writer->file = file;
+    writer->buffer = malloc(YL_WRITER_BUFFER_SIZE);
+    return writer->buffer != NULL;
+}
+
+void yl_writer_delete(yl_writer_t *writer)
+{
+    delete_tag_directives(writer);
+    free(writer->tag_directives);
+    free(writer->buffer);
+    free(writer->states);
+    free(writer->indents);
+    free(writer->pending_anchor);
+    free(writer->pending_tag);
+    *writer = (yl_writer_t){0};
+}
+
+/**
+ * Copy the source of a block collection, which starts at @p column, shifting
+ * every line after the first by the difference to the current indent.
+ */
+static bool write_source(yl_writer_t *writer, const char *source, size_t length, size_t column)
+{
+    const char *p = source, *end = source + length;
+    long shift = (long)writer->indent - (long)column;
+
+    while (p < end) {
+        const char *eol = memchr(p, '\n', end - p);
+        const char *stop = eol ? eol + 1 : end;
+
+        for (const char *q = p; q < stop;) {
+            if (writer->length == YL_WRITER_BUFFER_SIZE && !flush(writer))
+                return false;
+            size_t chunk = YL_WRITER_BUFFER_SIZE - writer->length;
+            if (chunk > (size_t)(stop - q))
+                chunk = stop - q;
+            memcpy(writer->buffer + writer->length, q, chunk);
+            writer->length += chunk;
+            q += chunk;
+        }
+        if (eol == NULL) {
+            for (; p < end; ++p)
+                writer->column += ((unsigned char)*p & 0xC0) != 0x80;
+            break;
+        }
+        writer->column = 0;
+        ++writer->line;
+
+        p = stop;
+        long spaces = 0;
+        while (p + spaces < end && p[spaces] == ' ')
+            ++spaces;
+        p += spaces;
+        for (spaces += shift; spaces > 0; --spaces)
+            if (!put(writer, ' '))
+                return false;
+    }
+
+    writer->whitespace = false;
+    writer->indention = false;
+    return true;
+}
+
+int yl_writer_write_verbatim(yl_writer_t *writer, yaml_event_t *start, yaml_event_t *end,
+                             const char *source, size_t length, size_t column, yl_error_t *err)
+{
+    yaml_event_t *event = start;
+
+    if (writer->has_pending) {
+        writer->has_pending = false;
+        if (!emit(writer, &writer->pending, start))
+            goto error;
+    }
+
+    // Any event but its end tells the emitter that the collection isn't empty.
+    if (!emit(writer, start, start))
+        goto error;
+
+    bool first_item = writer->state == YL_WRITER_BLOCK_SEQUENCE_FIRST_ITEM_STATE;
+    if (!first_item && writer->state != YL_WRITER_BLOCK_MAPPING_FIRST_KEY_STATE) {
+        writer->problem = "expected a block collection to copy";
+        goto error;
+    }
+
+    // Start the first item as the emitter would, then copy the rest as it is.
+    if (!increase_indent(writer, false, first_item && writer->mapping_context && !writer->indention) ||
+        !write_indent(writer) ||
+        !write_source(writer, source, length, column))
+        goto error;
+    writer->state = first_item ? YL_WRITER_BLOCK_SEQUENCE_ITEM_STATE : YL_WRITER_BLOCK_MAPPING_KEY_STATE;
+
+    event = end;
+    if (!emit(writer, end, NULL))
+        goto error;
+
+    return 1;
+
+error:
+    err->type = YL_EMITTER_ERROR;
+    err->line = event->start_mark.line;
+    err->column = event->start_mark.column;
+    err->context = "While writing YAML, encountered error";
+    err->message = writer->problem;
+    return 0;
+}
+
+int yl_writer_write(yl_writer_t *writer, yaml_event_t *event, lua_State *L, yl_error_t *err)
+{
+    (void)L;
+
+    if (writer->has_pending) {
+        writer->has_pending = false;
+        if (!emit(writer, &writer->pending, event))
+            goto error;
+    }
+
+    if (event->type == YAML_SEQUENCE_START_EVENT || event->type == YAML_MAPPING_START_EVENT) {
+        if (!defer(writer, event))
+            goto error;
+    } else if (!emit(writer, event, NULL)) {
+        goto error;
+    }
+
+    return 1;
+
+error:
+    err->type = YL_EMITTER_ERROR;
+    err->line = event->start_mark.line;
+    err->column = event->start_mark.column;
+    err->context = "While writing YAML, encountered error";
+    err->message = writer->problem;
+    return 0;
+}
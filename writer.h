@@ -0,0 +1,127 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "lua.h"
+#include "yaml.h"
+
+#include "error.h"
+
+// Size of the buffer output is collected in before it's written to the file.
+#define YL_WRITER_BUFFER_SIZE (64 * 1024)
+
+typedef enum _yl_writer_state_e {
+    YL_WRITER_STREAM_START_STATE,
+    YL_WRITER_FIRST_DOCUMENT_START_STATE,
+    YL_WRITER_DOCUMENT_START_STATE,
+    YL_WRITER_DOCUMENT_CONTENT_STATE,
+    YL_WRITER_DOCUMENT_END_STATE,
+    YL_WRITER_FLOW_SEQUENCE_FIRST_ITEM_STATE,
+    YL_WRITER_FLOW_SEQUENCE_ITEM_STATE,
+    YL_WRITER_FLOW_MAPPING_FIRST_KEY_STATE,
+    YL_WRITER_FLOW_MAPPING_KEY_STATE,
+    YL_WRITER_FLOW_MAPPING_SIMPLE_VALUE_STATE,
+    YL_WRITER_FLOW_MAPPING_VALUE_STATE,
+    YL_WRITER_BLOCK_SEQUENCE_FIRST_ITEM_STATE,
+    YL_WRITER_BLOCK_SEQUENCE_ITEM_STATE,
+    YL_WRITER_BLOCK_MAPPING_FIRST_KEY_STATE,
+    YL_WRITER_BLOCK_MAPPING_KEY_STATE,
+    YL_WRITER_BLOCK_MAPPING_SIMPLE_VALUE_STATE,
+    YL_WRITER_BLOCK_MAPPING_VALUE_STATE,
+    YL_WRITER_END_STATE,
+} yl_writer_state_t;
+
+/**
+ * A YAML writer that formats events exactly as the libyaml emitter (configured
+ * for UTF-8 with unicode output) does, without copying events or queueing them.
+ *
+ * Events are only read during the call, so their strings can be borrowed; see
+ * yl_event_consumer_t. The only lookahead the emitter needs, whether a collection
+ * is empty, is handled by holding back each collection start until the next event.
+ */
+typedef struct _yl_writer_s {
+    FILE *file;
+    char *buffer;
+    size_t length;
+    const char *problem;
+
+    yl_writer_state_t state;
+    yl_writer_state_t *states;
+    size_t nstates, states_capacity;
+    int *indents;
+    size_t nindents, indents_capacity;
+    yaml_tag_directive_t *tag_directives; // The current document's, owned.
+    size_t ntag_directives, tag_directives_capacity;
+
+    int indent;
+    int flow_level;
+    bool root_context, sequence_context, mapping_context, simple_key_context;
+    int line, column;
+    bool whitespace, indention;
+    int open_ended;
+
+    // A collection start, with copies of its anchor and tag, held until the next event.
+    bool has_pending;
+    yaml_event_t pending;
+    yaml_char_t *pending_anchor, *pending_tag;
+    size_t pending_anchor_capacity, pending_tag_capacity;
+
+    // Analysis of the node being written.
+    const yaml_char_t *anchor;
+    size_t anchor_length;
+    bool alias;
+    const yaml_char_t *handle, *suffix;
+    size_t handle_length, suffix_length;
+    const yaml_char_t *value;
+    size_t value_length;
+    bool multiline, flow_plain_allowed, block_plain_allowed, single_quoted_allowed, block_allowed;
+    yaml_scalar_style_t style;
+} yl_writer_t;
+
+/**
+ * Initialize a writer.
+ *
+ * @param[out]      writer      The writer to initialize.
+ * @param[in]       file        The file to write to.
+ *
+ * @returns On success, returns @c 1. If the output buffer can't be allocated,
+ * returns @c 0.
+ */
+int yl_writer_initialize(yl_writer_t *writer, FILE *file);
+
+/**
+ * Free everything a writer allocated. Output that hasn't been flushed is lost.
+ */
+void yl_writer_delete(yl_writer_t *writer);
+
+/**
+ * Event consumer that writes events as YAML. Output is flushed to the file at the
+ * end of each document.
+ *
+ * The event isn't consumed; the caller still owns it.
+ */
+int yl_writer_write(yl_writer_t *writer, yaml_event_t *event, lua_State *L, yl_error_t *err);
+
+/**
+ * Write a block collection by copying its source, in place of its events.
+ *
+ * The collection is started and ended as its events would be, so it's placed and
+ * indented like any other node; in between, its source is copied, with every line
+ * after the first shifted by the difference between its column in the source and
+ * its indent in the output. Comments and formatting inside it are kept.
+ *
+ * @param[in,out]   writer      The writer.
+ * @param[in]       start       The collection's start event. It must have block
+ *                              style, and no anchor or tag.
+ * @param[in]       end         The collection's end event.
+ * @param[in]       source      The source, from the start of the first item up to
+ *                              the end of the last, without trailing whitespace.
+ * @param[in]       length      The length of the source in bytes.
+ * @param[in]       column      The column the source starts at.
+ * @param[out]      err         Error details.
+ *
+ * @returns On success, returns @c 1. On failure, returns @c 0.
+ */
+int yl_writer_write_verbatim(yl_writer_t *writer, yaml_event_t *start, yaml_event_t *end,
+                             const char *source, size_t length, size_t column, yl_error_t *err);